@@ -68,7 +68,7 @@ Options :
                              pour tous les traitements, de plus en plus avancées selon le niveau choisi :
                                  0 : Utiliser les implémentations de base en awk et C (AVL)
                                  1 : Utiliser les implémentations expérimentales en C (tables de hachage)
-                                 2 : Utiliser les implémentations très expérimentales en C (SSE/AVX)
+                                 2 : Identique au niveau 1 (les instructions SSE/AVX sont choisies automatiquement)
                              Un changement de niveau peut nécessiter une recompilation du programme.
   -E, --exceed-speed-limits, Équivalent à --quick 2.
       --excès-de-vitesse     ${ORANGE}${UL_ON}Attention${UL_OFF} : Cette option ajoute des propulseurs surpuissants à votre camion
@@ -189,7 +189,6 @@ fi
 # Use the "10#" prefix to force the number to be interpreted as a decimal, in case
 # the user puts a zero in front of the number (I actually did by the way).
 QL1=$(( 10#$QUICK_LEVEL >= 1 ))
-QL2=$(( 10#$QUICK_LEVEL >= 2 ))
 
 # ----------------------------------------------
 # Phase 2: Make compilation and folder setup
@@ -235,8 +234,6 @@ export OPTIMIZE_NATIVE=${OPTIMIZE_NATIVE:-1}
 export CLEAN=${CLEAN:-0}
 # Enable experimental algorithms for QUICK_LEVEL >= 1.
 export EXPERIMENTAL_ALGO=${EXPERIMENTAL_ALGO:-$QL1}
-# Enable experimental AVX stuff for QUICK_LEVEL >= 2.
-export EXPERIMENTAL_ALGO_AVX=${EXPERIMENTAL_ALGO_AVX:-$QL2}
 # Disable the profiler by default.
 export ENABLE_PROFILER=${ENABLE_PROFILER:-0}
 
@@ -325,37 +322,36 @@ fi
 
 # Computations D1, D2 and L are done with awk. T and S are done with the PermisC executable.
 # Computation D1, D2 and L can be done with the experimental implementation in PermisC.
+# All computations done by PermisC are run at once, so the file is only read once.
 # The 141 exit code should be ignored later as it means the sort command was interrupted by a SIGPIPE,
 # which we arguably don't care. (Sorry to break sort's feelings...)
 
-comp_d1() {
-  if [ $QL1 -eq 1 ]; then
-    "$PERMISC_EXEC" -d1 "$CSV_FILE"
+NATIVE_COMPUTATIONS=()
+AWK_COMPUTATIONS=()
+for comp in "${COMPUTATIONS[@]}"; do
+  if [ $QL1 -eq 1 ] || [ "$comp" = "t" ] || [ "$comp" = "s" ]; then
+    NATIVE_COMPUTATIONS+=("$comp")
   else
-    LC_ALL=C $AWK -F ';' -f "$AWK_COMP_DIR/d1.awk" "$CSV_FILE" | LC_ALL=C sort -t ';' -k2nr -S 50% | head -n 10
+    AWK_COMPUTATIONS+=("$comp")
   fi
+done
+
+comp_d1() {
+  LC_ALL=C $AWK -F ';' -f "$AWK_COMP_DIR/d1.awk" "$CSV_FILE" | LC_ALL=C sort -t ';' -k2nr -S 50% | head -n 10
   return $?
 }
 
 comp_d2() {
-  if [ $QL1 -eq 1 ]; then
-    "$PERMISC_EXEC" -d2 "$CSV_FILE"
-  else
-    LC_ALL=C $AWK -F ';' -f "$AWK_COMP_DIR/d2.awk" "$CSV_FILE" | LC_ALL=C sort -t ';' -k2 -nr | head -n 10
-  fi
+  LC_ALL=C $AWK -F ';' -f "$AWK_COMP_DIR/d2.awk" "$CSV_FILE" | LC_ALL=C sort -t ';' -k2 -nr | head -n 10
   return $?
 }
 
 comp_l() {
-  if [ $QL1 -eq 1 ]; then
-    "$PERMISC_EXEC" -l "$CSV_FILE"
-  else
-    LC_ALL=C $AWK -F ';' -f "$AWK_COMP_DIR/l.awk" "$CSV_FILE" | LC_ALL=C sort -t ';' -k2nr | head -n 10 | sort -t ';' -k1,1n
-  fi
+  LC_ALL=C $AWK -F ';' -f "$AWK_COMP_DIR/l.awk" "$CSV_FILE" | LC_ALL=C sort -t ';' -k2nr | head -n 10 | sort -t ';' -k1,1n
   return $?
 }
 
-# Calls the adequate function for a computation. Also this is a separate function
+# Calls the adequate awk function for a computation. Also this is a separate function
 # so errors are handled in an easier way.
 comp_dispatch() {
   local comp="$1"
@@ -371,12 +367,6 @@ comp_dispatch() {
     l)
       comp_l > "$out_file" 2> "$err_file"
       ;;
-    t)
-      "$PERMISC_EXEC" -t "$CSV_FILE" > "$out_file" 2> "$err_file"
-      ;;
-    s)
-      "$PERMISC_EXEC" -s "$CSV_FILE" > "$out_file" 2> "$err_file"
-      ;;
   esac
   RET=$?
   # Mark SIGPIPE return values as a success, it just means that the sort command was interrupted by head.
@@ -393,9 +383,56 @@ comp_dispatch() {
   return $RET
 }
 
-# Iterate through all the computations, and run them one by one.
+# Runs all the native computations with PermisC, which writes the results
+# in the temp folder, with the same file names as comp_out_file.
+native_dispatch() {
+  local -r err_file="$1"
+  local args=()
+  for comp in "${NATIVE_COMPUTATIONS[@]}"; do
+    args+=("-$comp")
+  done
+
+  "$PERMISC_EXEC" "$CSV_FILE" "${args[@]}" --out-dir "$TEMP_DIR" 2> "$err_file"
+  RET=$?
+
+  if [ $RET -ne 0 ]; then
+    echo "[ Fin | Code d'erreur : $RET ]" >> "$err_file"
+  else
+    rm -f "$err_file"
+  fi
+  return $RET
+}
+
+# Run all the native computations at once, and measure the time it takes.
+if [ "${#NATIVE_COMPUTATIONS[@]}" -ne 0 ]; then
+  COMP_NAMES=""
+  for comp in "${NATIVE_COMPUTATIONS[@]}"; do
+    COMP_NAMES="$COMP_NAMES${COMP_NAMES:+, }$(comp_name "$comp")"
+  done
+  if [ "${#NATIVE_COMPUTATIONS[@]}" -eq 1 ]; then
+    TITLE="Traitement $COMP_NAMES en cours..."
+  else
+    TITLE="Traitements $COMP_NAMES en cours..."
+  fi
+  echo -n "⚙️  | ⏳ $TITLE"
+
+  ERR_FILE="$TEMP_DIR/result_native.err"
+  TIME_START="$(measure_time)"
+  if ! native_dispatch "$ERR_FILE"; then
+    TIME_END="$(measure_time)"
+    ELAPSED_MS=$(( (TIME_END - TIME_START)/1000000 ))
+    echo -e "\r⚙️  | ❌ $TITLE Échec ! (en $ELAPSED_MS ms)"
+    echo "Erreur lors des traitements $COMP_NAMES. Lisez le fichier $(simple_path "$ERR_FILE") pour plus de détails." >&2
+    exit 3
+  fi
+  TIME_END="$(measure_time)"
+  ELAPSED_MS=$(( (TIME_END - TIME_START)/1000000 ))
+  echo -e "\r⚙️  | ✅ $TITLE Terminé en $ELAPSED_MS ms !"
+fi
+
+# Iterate through all the awk computations, and run them one by one.
 # Also measure the time it takes to run each computation.
-for comp in "${COMPUTATIONS[@]}"; do
+for comp in "${AWK_COMPUTATIONS[@]+"${AWK_COMPUTATIONS[@]}"}"; do
   COMP_NAME=$(comp_name "$comp") # Uppercase the computation name
   TITLE="Traitement $COMP_NAME en cours..."
   echo -n "⚙️  | ⏳ $TITLE"
@@ -0,0 +1,79 @@
+#!/usr/bin/env bash
+
+set -u
+
+# Runs a computation on a CSV file with every way of reading it (mmap, stdin, gzip, threads, io_uring,
+# --state, --out-dir, .pcb, --follow, and the basic algorithms), and checks they all print the exact same thing.
+# Usage: same_output.sh <file.csv> [computation, -s by default]
+# The build variables are given to the Makefile, like run.sh. The basic algorithms are built in build-make-basic.
+# Numbers must be the same to the last digit: results shouldn't depend on how the file was read.
+
+if [ "$#" -lt 1 ]; then
+  echo "Wrong usage: same_output.sh <file.csv> [-d1|-d2|-l|-t|-s]" >&2
+  exit 2
+fi
+
+PROGC_DIR="$(dirname "$0")"
+CSV="$1"
+COMP="${2:--s}"
+NAME="${COMP#-}"
+
+if ! make -C "$PROGC_DIR" --no-print-directory -j build EXPERIMENTAL_ALGO=1 >/dev/null \
+  || ! make -C "$PROGC_DIR" --no-print-directory -j build EXPERIMENTAL_ALGO=0 OUT=build-make-basic >/dev/null; then
+  exit 1
+fi
+
+PROG="$PROGC_DIR/build-make/PermisC"
+BASIC="$PROGC_DIR/build-make-basic/PermisC"
+TMP="$(mktemp -d)"
+trap 'rm -rf "$TMP"' EXIT
+
+"$PROG" "$CSV" "$COMP" > "$TMP/mapped.out" 2>/dev/null
+"$PROG" - "$COMP" < "$CSV" > "$TMP/stdin.out" 2>/dev/null
+"$PROG" "$CSV" "$COMP" --threads 3 > "$TMP/threads.out" 2>/dev/null
+"$PROG" "$CSV" "$COMP" --io-uring > "$TMP/io_uring.out" 2>/dev/null
+"$PROG" "$CSV" "$COMP" --max-memory 16 > "$TMP/max_memory.out" 2>/dev/null
+if grep -q '^ZLIB=1' "$PROGC_DIR/build-make/build_vars" 2>/dev/null; then
+  gzip -c "$CSV" > "$TMP/file.csv.gz"
+  "$PROG" "$TMP/file.csv.gz" "$COMP" > "$TMP/gzip.out" 2>/dev/null
+fi
+
+# Read the first half, then the rest from the saved state.
+mkdir "$TMP/state"
+LINES=$(wc -l < "$CSV")
+head -n $((LINES / 2)) "$CSV" > "$TMP/half.csv"
+"$PROG" "$TMP/half.csv" "$COMP" --state "$TMP/state" > /dev/null 2>&1
+cp "$CSV" "$TMP/half.csv"
+"$PROG" "$TMP/half.csv" "$COMP" --state "$TMP/state" > "$TMP/state.out" 2>/dev/null
+
+mkdir "$TMP/dir"
+# Along with another computation, reading the file only once.
+OTHER=-t
+if [ "$COMP" = -t ]; then
+  OTHER=-d1
+fi
+"$PROG" "$CSV" "$COMP" "$OTHER" --out-dir "$TMP/dir" > /dev/null 2>&1
+cp "$TMP/dir/result_$NAME.out" "$TMP/out_dir.out"
+
+"$PROG" convert "$CSV" "$TMP/file.pcb" > /dev/null 2>&1 \
+  && "$PROG" "$TMP/file.pcb" "$COMP" > "$TMP/pcb.out" 2>/dev/null
+
+# The first results are followed by an empty line.
+timeout 5 "$PROG" "$CSV" "$COMP" --follow 2>/dev/null | sed '/^$/q' | sed '/^$/d' > "$TMP/follow.out"
+
+# Only T and S have a basic version in C.
+if [ "$COMP" = -t ] || [ "$COMP" = -s ]; then
+  "$BASIC" "$CSV" "$COMP" > "$TMP/basic.out" 2>/dev/null
+fi
+
+FAILED=0
+for out in "$TMP"/*.out; do
+  if cmp -s "$out" "$TMP/mapped.out"; then
+    echo "OK   $(basename "$out" .out)"
+  else
+    echo "DIFF $(basename "$out" .out)"
+    FAILED=1
+  fi
+done
+
+exit $FAILED
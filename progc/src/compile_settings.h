@@ -12,8 +12,9 @@
 #define EXPERIMENTAL_ALGO 0
 #endif
 
-#ifndef EXPERIMENTAL_ALGO_AVX
-#define EXPERIMENTAL_ALGO_AVX 0
+// The engine of the maps used by experimental algorithms (see map.h): 1 for swiss tables, 0 for linear probing.
+#ifndef MAP_SWISS
+#define MAP_SWISS 1
 #endif
 
 #ifndef ENABLE_PROFILER
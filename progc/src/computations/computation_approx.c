@@ -0,0 +1,585 @@
+#include "computations.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "hash.h"
+#include "route.h"
+#include "portable.h"
+#include "profile.h"
+#include "sketch.h"
+#include "state.h"
+
+// Approximate computations D1, D2 and T (--approx)
+// ------------------------
+// The exact computations keep every driver, town and route in memory, which grows with the file.
+// These ones only keep a TopK (see sketch.h) of a fixed size, so they use the same amount of memory
+// no matter how big the file is... at the cost of counts that can be a bit too high.
+// Each result comes with its error: the real count is between count - error and count.
+//
+// Strings are copied in the TopK instead of getting an id from the stream (no STRING_IDS),
+// since the ids would keep every string of the file in memory.
+//
+// D1 and T count a name only once per route. The names of the route being read (a "run" of consecutive lines)
+// are all remembered, so a name is never counted twice in the same run. But a route can come back later in the file,
+// or be cut in two by the end of a part: we can't remember the names of every route, so the names of these
+// other runs might have been counted already. They're still counted, but their error goes up by one as well.
+// A bit per route id, shared by all workers, tells which routes have already started a run.
+// On a file grouped by route, that's only the routes cut by the end of a part, so the counts stay (almost) exact.
+// On a shuffled file, the errors get big, but the real count is still between count - error and count.
+//
+// Big enough to make the top 10 meaningless, actually: a name is counted once per run, not once per route,
+// and the counts of all names go up so much that the TopK can't tell them apart anymore.
+// So once too many runs are repeated (see routesScattered), a warning is printed, and each name also gets
+// a tiny HyperLogLog of its routes, which doesn't care how many times a route comes back (see addDistinct).
+// The names of a repeated run are then only counted by how much they make the estimate go up: nothing for
+// a route already seen, about 1 for a new one. The counts become estimates of the distinct routes: the error
+// still gets all of it, so count - error stays a lower bound, but count isn't an upper bound anymore.
+// The routes read before that aren't in the sketches, so they can still be counted twice.
+
+// The number of (route, name) pairs remembered to skip the names seen again in another run. (See RecentPairs.)
+// A miss isn't a problem: the name is counted with an error, see above.
+#define RECENT_PAIRS 4096
+
+// The number of names remembered in the current run. Past that, the other names of the run are counted
+// with an error, like the ones of another run.
+#define RUN_NAMES 128
+
+// The bits of the routes already seen, a fixed amount of memory: 2 MB.
+// Route ids further than that share the bit of another one, which only makes the errors bigger.
+#define ROUTE_BITS (1u << 24)
+
+// The distinct sketches of the names, shared by all workers like the route bits: 2^14 HyperLogLogs of 128 bytes,
+// so 2 MB, for an error of about 9%. A name takes the sketch given by the highest bits of its hash.
+// They don't live in the TopK: a name that leaves it would forget its routes, and count them again when it's back.
+// With lots of names, a few of them share a sketch, which makes the estimates noisier (but not too high).
+// The memory is only touched once the routes are scattered.
+#define DISTINCT_SKETCH_BITS 14
+#define DISTINCT_PRECISION 7
+#define DISTINCT_WORDS ((1u << DISTINCT_PRECISION) / 8)
+
+static uint32_t approxCapacity = 1024;
+static bool approxCountMin = false;
+
+void approxConfigure(uint32_t capacity, bool countMin)
+{
+    assert(capacity > 0);
+
+    approxCapacity = capacity;
+    approxCountMin = countMin;
+}
+
+// The bits of the routes seen by all the workers of a computation (see ROUTE_BITS), and the distinct sketches
+// of the names (see DISTINCT_SKETCH_BITS), kept in 64-bit words so they can be changed atomically.
+// Created with the first worker, and freed with the last one.
+typedef struct SeenRoutes
+{
+    uint64_t* bits;
+    uint64_t* distinct;
+    uint32_t numWorkers;
+} SeenRoutes;
+
+// One for each computation counting routes: D1 and T can run at the same time.
+static SeenRoutes* seenRoutesD1 = NULL;
+static SeenRoutes* seenRoutesT = NULL;
+
+typedef struct ApproxWorker
+{
+    TopK topk;
+    RecentPairs recent;
+
+    // NULL for D2, which doesn't count routes.
+    SeenRoutes** seen;
+    // The route being read, with the hashes of its names seen so far.
+    bool inRun;
+    uint32_t runRoute;
+    // Whether the route already had a run before this one: its names might have been counted already.
+    bool runRepeated;
+    uint64_t runNames[RUN_NAMES];
+    uint32_t numRunNames;
+    // The hash of the route for the distinct sketches.
+    uint64_t runHash;
+
+    // How many runs have been read, and how many of them were for a route already seen.
+    uint64_t numRuns;
+    uint64_t numRepeatedRuns;
+} ApproxWorker;
+
+static void* createWorker(SeenRoutes** seen)
+{
+    ApproxWorker* worker = malloc(sizeof(ApproxWorker));
+    assert(worker);
+
+    topkInit(&worker->topk, approxCapacity, approxCountMin);
+    recentPairsInit(&worker->recent, RECENT_PAIRS);
+
+    worker->seen = seen;
+    worker->inRun = false;
+    worker->numRuns = 0;
+    worker->numRepeatedRuns = 0;
+    if (seen != NULL)
+    {
+        if (*seen == NULL)
+        {
+            *seen = malloc(sizeof(SeenRoutes));
+            assert(*seen);
+            (*seen)->bits = calloc(ROUTE_BITS / 64, sizeof(uint64_t));
+            assert((*seen)->bits);
+            (*seen)->distinct = calloc((size_t) DISTINCT_WORDS << DISTINCT_SKETCH_BITS, sizeof(uint64_t));
+            assert((*seen)->distinct);
+            (*seen)->numWorkers = 0;
+        }
+        (*seen)->numWorkers++;
+    }
+
+    return worker;
+}
+
+static void* createWorkerD1()
+{
+    return createWorker(&seenRoutesD1);
+}
+
+static void* createWorkerD2()
+{
+    return createWorker(NULL);
+}
+
+static void* createWorkerT()
+{
+    return createWorker(&seenRoutesT);
+}
+
+static void freeWorker(ApproxWorker* worker)
+{
+    topkFree(&worker->topk);
+    recentPairsFree(&worker->recent);
+    if (worker->seen != NULL && --(*worker->seen)->numWorkers == 0)
+    {
+        free((*worker->seen)->bits);
+        free((*worker->seen)->distinct);
+        free(*worker->seen);
+        *worker->seen = NULL;
+    }
+    free(worker);
+}
+
+typedef enum PairKind
+{
+    // The name has already been counted for this route.
+    PAIR_DUPLICATE,
+    // The name has never been counted for this route.
+    PAIR_NEW,
+    // The name might have been counted for this route, in another run.
+    PAIR_MAYBE_NEW
+} PairKind;
+
+// Whether routes come back too often for the counts to mean anything. A file grouped by route only repeats
+// the routes cut by the end of a part (or of a previous read), which is nowhere near 1% of them on real files.
+static bool routesScattered(uint64_t numRuns, uint64_t numRepeatedRuns)
+{
+    return numRepeatedRuns > 100 && numRepeatedRuns * 100 > numRuns;
+}
+
+// Tells whether the name (given by its hash) has already been counted for the route of the step.
+static PairKind checkPair(ApproxWorker* worker, uint32_t routeId, uint64_t hash)
+{
+    if (!worker->inRun || worker->runRoute != routeId)
+    {
+        // A new run: only the first one of the route, among all workers, can be sure its names are new.
+        uint32_t bit = routeId & (ROUTE_BITS - 1);
+        uint64_t mask = 1ull << (bit % 64);
+        uint64_t old = ATOMIC_FETCH_OR(&(*worker->seen)->bits[bit / 64], mask, ATOMIC_RELAXED);
+
+        worker->inRun = true;
+        worker->runRoute = routeId;
+        worker->runRepeated = (old & mask) != 0;
+        worker->numRunNames = 0;
+        worker->runHash = hllHashU32(routeId);
+
+        worker->numRuns++;
+        worker->numRepeatedRuns += worker->runRepeated;
+    }
+
+    for (uint32_t i = 0; i < worker->numRunNames; ++i)
+    {
+        if (worker->runNames[i] == hash)
+        {
+            return PAIR_DUPLICATE;
+        }
+    }
+
+    bool remembered = worker->numRunNames < RUN_NAMES;
+    if (remembered)
+    {
+        worker->runNames[worker->numRunNames++] = hash;
+    }
+
+    // Seen in another run of this worker, not long ago.
+    if (recentPairsSeen(&worker->recent, routeId, hash))
+    {
+        return PAIR_DUPLICATE;
+    }
+
+    return worker->runRepeated || !remembered ? PAIR_MAYBE_NEW : PAIR_NEW;
+}
+
+// The highest of each of the 8 registers (bytes) of a and b.
+static uint64_t registersMax(uint64_t a, uint64_t b)
+{
+    uint64_t result = 0;
+    for (uint32_t shift = 0; shift < 64; shift += 8)
+    {
+        uint64_t registerA = (a >> shift) & 0xFF, registerB = (b >> shift) & 0xFF;
+        result |= (registerA > registerB ? registerA : registerB) << shift;
+    }
+    return result;
+}
+
+// Adds the route of the run to the distinct sketch of the name (given by its hash), and tells how much
+// it made its estimate go up: 0 when the name has already been seen on the route (most likely), about 1 otherwise.
+static uint64_t addDistinct(ApproxWorker* worker, uint64_t hash)
+{
+    uint64_t* sketch = (*worker->seen)->distinct + (hash >> (64 - DISTINCT_SKETCH_BITS)) * DISTINCT_WORDS;
+
+    // Work on a copy, other workers might be changing the sketch at the same time.
+    uint64_t before[DISTINCT_WORDS], after[DISTINCT_WORDS];
+    for (uint32_t i = 0; i < DISTINCT_WORDS; ++i)
+    {
+        before[i] = after[i] = ATOMIC_LOAD(&sketch[i], ATOMIC_RELAXED);
+    }
+    // The names sharing the sketch must not share their routes: the pair is hashed, not just the route.
+    if (!hllAdd((uint8_t*) after, DISTINCT_PRECISION, hashMix64(worker->runHash ^ hash)))
+    {
+        return 0;
+    }
+
+    // Put back the word that changed, without lowering a register another worker has just raised.
+    for (uint32_t i = 0; i < DISTINCT_WORDS; ++i)
+    {
+        if (after[i] != before[i])
+        {
+            uint64_t current = before[i];
+            uint64_t wanted = registersMax(current, after[i]);
+            while (wanted != current && !ATOMIC_CAS(&sketch[i], &current, wanted))
+            {
+                wanted = registersMax(current, after[i]);
+            }
+            break;
+        }
+    }
+
+    // Rounded so that the weights add up to the rounded estimate.
+    double estimateBefore = hllEstimate((const uint8_t*) before, DISTINCT_PRECISION);
+    double estimateAfter = hllEstimate((const uint8_t*) after, DISTINCT_PRECISION);
+    uint64_t roundedBefore = (uint64_t) (estimateBefore + 0.5), roundedAfter = (uint64_t) (estimateAfter + 0.5);
+    return roundedAfter > roundedBefore ? roundedAfter - roundedBefore : 0;
+}
+
+// Counts the route for the name, unless it already has been. Returns the item of the name, NULL when not counted.
+static TopKItem* addPair(ApproxWorker* worker, uint32_t routeId, const char* name, uint32_t len, uint64_t hash)
+{
+    PairKind kind = checkPair(worker, routeId, hash);
+    if (kind == PAIR_DUPLICATE)
+    {
+        return NULL;
+    }
+
+    // Once the routes are scattered, the sketches decide whether the route is new for the name (see above).
+    uint64_t weight = 1;
+    if (routesScattered(worker->numRuns, worker->numRepeatedRuns))
+    {
+        uint64_t added = addDistinct(worker, hash);
+        if (kind == PAIR_MAYBE_NEW)
+        {
+            weight = added;
+            if (weight == 0)
+            {
+                return NULL;
+            }
+        }
+    }
+
+    TopKItem* item = topkAdd(&worker->topk, name, len, hash, weight);
+    if (kind == PAIR_MAYBE_NEW)
+    {
+        item->error += weight;
+    }
+    return item;
+}
+
+/*
+ * Steps
+ */
+
+// D1: one more route for the driver, unless the driver has already been seen on this route.
+static void processStepD1(void* w, const RouteStep* step)
+{
+    ApproxWorker* worker = w;
+
+    uint64_t hash = sketchHash(step->driverName, step->driverNameLen);
+    addPair(worker, step->routeId, step->driverName, step->driverNameLen, hash);
+}
+
+// D2: the distance goes to the driver, in thousandths so the sum doesn't depend on the order.
+static void processStepD2(void* w, const RouteStep* step)
+{
+    ApproxWorker* worker = w;
+
+    uint64_t hash = sketchHash(step->driverName, step->driverNameLen);
+    topkAdd(&worker->topk, step->driverName, step->driverNameLen, hash, step->distanceThousandths);
+}
+
+// T: one more route for both towns, unless they've already been seen on this route.
+// The number of routes starting in a town is counted in the extra counter of its item.
+static void processStepT(void* w, const RouteStep* step)
+{
+    ApproxWorker* worker = w;
+
+    uint64_t hashA = sketchHash(step->townA, step->townALen);
+    TopKItem* townA = addPair(worker, step->routeId, step->townA, step->townALen, hashA);
+    if (townA == NULL && step->stepId == 1)
+    {
+        townA = topkFind(&worker->topk, step->townA, step->townALen, hashA);
+    }
+
+    if (step->stepId == 1 && townA != NULL)
+    {
+        townA->extra++;
+    }
+
+    uint64_t hashB = sketchHash(step->townB, step->townBLen);
+    addPair(worker, step->routeId, step->townB, step->townBLen, hashB);
+}
+
+#define D1_APPROX_FIELDS (ROUTE_ID | DRIVER_NAME)
+#define D2_APPROX_FIELDS (DRIVER_NAME | DISTANCE_FIXED)
+#define T_APPROX_FIELDS (ROUTE_ID | STEP_ID | TOWN_A | TOWN_B)
+
+static void processD1(void* worker, RouteStream* stream)
+{
+    RouteStep step;
+    while (rsRead(stream, &step, D1_APPROX_FIELDS))
+    {
+        processStepD1(worker, &step);
+    }
+}
+
+static void processD2(void* worker, RouteStream* stream)
+{
+    RouteStep step;
+    while (rsRead(stream, &step, D2_APPROX_FIELDS))
+    {
+        processStepD2(worker, &step);
+    }
+}
+
+static void processT(void* worker, RouteStream* stream)
+{
+    RouteStep step;
+    while (rsRead(stream, &step, T_APPROX_FIELDS))
+    {
+        processStepT(worker, &step);
+    }
+}
+
+/*
+ * State (see --state)
+ */
+
+// The TopK, the recent pairs of the last part of the file, so a route cut in two by the end of the file
+// doesn't get its names counted twice in the next run, and the routes already seen with the number of runs
+// and the distinct sketches (not for D2).
+static void saveState(const ApproxWorker* merged, const ApproxWorker* last, FILE* stateOut)
+{
+    topkWriteState(stateOut, &merged->topk);
+    fwrite(last->recent.pairs, sizeof(uint64_t), RECENT_PAIRS, stateOut);
+    if (merged->seen != NULL)
+    {
+        fwrite((*merged->seen)->bits, sizeof(uint64_t), ROUTE_BITS / 64, stateOut);
+        fwrite((*merged->seen)->distinct, sizeof(uint64_t), DISTINCT_WORDS << DISTINCT_SKETCH_BITS, stateOut);
+        stateWriteU64(stateOut, merged->numRuns);
+        stateWriteU64(stateOut, merged->numRepeatedRuns);
+    }
+}
+
+static void* loadState(FILE* in, SeenRoutes** seen)
+{
+    ApproxWorker* worker = createWorker(seen);
+
+    TopK topk;
+    if (!topkReadState(in, &topk))
+    {
+        freeWorker(worker);
+        return NULL;
+    }
+    topkFree(&worker->topk);
+    worker->topk = topk;
+
+    // A state saved with another size can't be used: the memory used would no longer be the one asked for.
+    bool ok = worker->topk.capacity == approxCapacity && (worker->topk.countMin != NULL) == approxCountMin
+              && fread(worker->recent.pairs, sizeof(uint64_t), RECENT_PAIRS, in) == RECENT_PAIRS
+              && (seen == NULL
+                  || (fread((*seen)->bits, sizeof(uint64_t), ROUTE_BITS / 64, in) == ROUTE_BITS / 64
+                      && fread((*seen)->distinct, sizeof(uint64_t), DISTINCT_WORDS << DISTINCT_SKETCH_BITS, in)
+                         == DISTINCT_WORDS << DISTINCT_SKETCH_BITS
+                      && stateReadU64(in, &worker->numRuns) && stateReadU64(in, &worker->numRepeatedRuns)));
+    if (!ok)
+    {
+        freeWorker(worker);
+        return NULL;
+    }
+    return worker;
+}
+
+static void* loadStateD1(FILE* in, RouteStream* stream)
+{
+    return loadState(in, &seenRoutesD1);
+}
+
+static void* loadStateD2(FILE* in, RouteStream* stream)
+{
+    return loadState(in, NULL);
+}
+
+static void* loadStateT(FILE* in, RouteStream* stream)
+{
+    return loadState(in, &seenRoutesT);
+}
+
+/*
+ * Results
+ */
+
+// Highest counts first, then the same order as the exact computations for ties.
+static int compareItems(const void* a, const void* b)
+{
+    const TopKItem* itemA = *(const TopKItem* const*) a;
+    const TopKItem* itemB = *(const TopKItem* const*) b;
+    if (itemA->count != itemB->count)
+    {
+        return itemA->count < itemB->count ? 1 : -1;
+    }
+    return compareNames(itemB->name, itemB->length, itemA->name, itemA->length);
+}
+
+static int compareItemNames(const void* a, const void* b)
+{
+    const TopKItem* itemA = *(const TopKItem* const*) a;
+    const TopKItem* itemB = *(const TopKItem* const*) b;
+    return compareNames(itemA->name, itemA->length, itemB->name, itemB->length);
+}
+
+// Merges all workers into the first one, saves the state, and gives the top 10 items.
+// Returns the number of items in top, which can be less than 10 for tiny files.
+static uint32_t mergeAndGetTop10(void** workers, uint32_t numWorkers, FILE* stateOut, const TopKItem* top[10])
+{
+    ApproxWorker* merged = workers[0];
+    {
+        PROFILER_START("Merge the TopK of all workers");
+        for (uint32_t w = 1; w < numWorkers; ++w)
+        {
+            ApproxWorker* worker = workers[w];
+            topkMerge(&merged->topk, &worker->topk);
+            merged->numRuns += worker->numRuns;
+            merged->numRepeatedRuns += worker->numRepeatedRuns;
+        }
+        PROFILER_END();
+    }
+
+    if (stateOut != NULL)
+    {
+        saveState(merged, workers[numWorkers - 1], stateOut);
+    }
+
+    // Only once: with --follow, the results are given again and again.
+    static bool warned = false;
+    if (merged->seen != NULL && routesScattered(merged->numRuns, merged->numRepeatedRuns) && !warned)
+    {
+        warned = true;
+        fprintf(stderr, "Attention : les lignes des trajets ne se suivent pas dans le fichier (%llu morceaux de trajet "
+                        "sur %llu reprennent un trajet déjà vu), les résultats ne sont que des estimations\n",
+                (unsigned long long) merged->numRepeatedRuns, (unsigned long long) merged->numRuns);
+    }
+
+    // The TopK is just a heap, sort it to find the top 10.
+    const TopKItem** sorted = malloc((merged->topk.size > 0 ? merged->topk.size : 1) * sizeof(TopKItem*));
+    assert(sorted);
+    for (uint32_t i = 0; i < merged->topk.size; ++i)
+    {
+        sorted[i] = &merged->topk.items[i];
+    }
+    qsort(sorted, merged->topk.size, sizeof(TopKItem*), compareItems);
+
+    uint32_t n = merged->topk.size < 10 ? merged->topk.size : 10;
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        top[i] = sorted[i];
+    }
+    free(sorted);
+    return n;
+}
+
+static void freeWorkers(void** workers, uint32_t numWorkers)
+{
+    for (uint32_t w = 0; w < numWorkers; ++w)
+    {
+        freeWorker(workers[w]);
+    }
+}
+
+// Prints "name;routes;error" for the 10 drivers with the most routes.
+static void finishD1(void** workers, uint32_t numWorkers, const RouteStream* stream, FILE* out, FILE* stateOut)
+{
+    const TopKItem* top[10];
+    uint32_t n = mergeAndGetTop10(workers, numWorkers, stateOut, top);
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        fprintf(out, "%.*s;%llu;%llu\n", (int) top[i]->length, top[i]->name,
+                (unsigned long long) top[i]->count, (unsigned long long) top[i]->error);
+    }
+
+    freeWorkers(workers, numWorkers);
+}
+
+// Prints "name;distance;error" for the 10 drivers with the longest distance.
+static void finishD2(void** workers, uint32_t numWorkers, const RouteStream* stream, FILE* out, FILE* stateOut)
+{
+    const TopKItem* top[10];
+    uint32_t n = mergeAndGetTop10(workers, numWorkers, stateOut, top);
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        fprintf(out, "%.*s;%f;%f\n", (int) top[i]->length, top[i]->name,
+                top[i]->count / 1000.0, top[i]->error / 1000.0);
+    }
+
+    freeWorkers(workers, numWorkers);
+}
+
+// Prints "name;routes;firstTown;error" for the 10 most visited towns, sorted by name like the exact computation.
+// The number of routes starting in the town is only counted while the town is in the TopK,
+// so it can be a bit too low (it's never too high).
+static void finishT(void** workers, uint32_t numWorkers, const RouteStream* stream, FILE* out, FILE* stateOut)
+{
+    const TopKItem* top[10];
+    uint32_t n = mergeAndGetTop10(workers, numWorkers, stateOut, top);
+    qsort(top, n, sizeof(TopKItem*), compareItemNames);
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        fprintf(out, "%.*s;%llu;%llu;%llu\n", (int) top[i]->length, top[i]->name,
+                (unsigned long long) top[i]->count, (unsigned long long) top[i]->extra,
+                (unsigned long long) top[i]->error);
+    }
+
+    freeWorkers(workers, numWorkers);
+}
+
+const Computation computationD1Approx = {"Computation D1 (approx)", D1_APPROX_FIELDS, createWorkerD1, processD1,
+                                         processStepD1, finishD1, loadStateD1};
+
+const Computation computationD2Approx = {"Computation D2 (approx)", D2_APPROX_FIELDS, createWorkerD2, processD2,
+                                         processStepD2, finishD2, loadStateD2};
+
+const Computation computationTApprox = {"Computation T (approx)", T_APPROX_FIELDS, createWorkerT, processT,
+                                        processStepT, finishT, loadStateT};
@@ -11,15 +11,17 @@
 #include "route.h"
 #include "profile.h"
 #include "map.h"
+#include "hash.h"
 #include "mem_alloc.h"
 #include "partition.h"
+#include "grouped.h"
 #include "avl.h"
+#include "state.h"
+#include "parallel.h"
 
 #define NUM_PARTITIONS 64
 
-static MemArena driverStringListMem;
 static MemArena driverSortAVLMem;
-static MemArena driverStringsMem;
 
 // Computation D1
 // ------------------------
@@ -28,27 +30,29 @@ static MemArena driverStringsMem;
 
 /*
  * ------------
- * LINKED LIST OF STRINGS
+ * LINKED LIST OF DRIVER IDS
  * ------------
  */
 
-// A linked list of strings.
-// The list is considered empty when its value is NULL.
-typedef struct LLStr
-{
-    // The string contained in this linked list node.
-    // When NULL, it indicates that this node is the head of the list, with zero elements.
-    char* value;
-    // The next element in the list, allocated using malloc.
-    struct LLStr* next;
-} LLStr;
+#define LL_EMPTY UINT32_MAX
 
-// Adds a string to the end of the list. The list pointer must not be NULL.
-static void llStrAdd(LLStr* list, char* value)
+// A linked list of driver ids.
+// The list is considered empty when its value is LL_EMPTY.
+typedef struct LLDriver
+{
+    // The driver id contained in this linked list node.
+    // When LL_EMPTY, it indicates that this node is the head of the list, with zero elements.
+    uint32_t value;
+    // The next element in the list, allocated in the memory arena of the thread.
+    struct LLDriver* next;
+} LLDriver;
+
+// Adds a driver id to the end of the list, with new nodes allocated in the arena. The list pointer must not be NULL.
+static void llDriverAdd(LLDriver* list, uint32_t value, MemArena* arena)
 {
     assert(list);
 
-    if (list->value == NULL)
+    if (list->value == LL_EMPTY)
     {
         list->value = value;
     }
@@ -57,7 +61,7 @@ static void llStrAdd(LLStr* list, char* value)
         // Go to the end of the list.
         while (list->next != NULL) { list = list->next; }
 
-        LLStr* newNode = memAlloc(&driverStringListMem, sizeof(LLStr));
+        LLDriver* newNode = memAlloc(arena, sizeof(LLDriver));
         assert(newNode);
 
         newNode->value = value;
@@ -78,7 +82,7 @@ typedef struct RouteMapEntry
 {
     bool occupied;
     uint32_t key;
-    LLStr drivers;
+    LLDriver drivers;
 } RouteMapEntry;
 
 // This route map works using open addressing.
@@ -91,13 +95,10 @@ typedef struct
 
 static inline uint32_t MAP_HASH_FUNC(const void* key, uint32_t capacityExponent)
 {
-    uint32_t a = *(uint32_t*) key;
-    // We're reading partitioned routes that are distributed according to a modulo hash function.
-    // Dividing by the number of partitions preserves a unique number for each route, which leads
-    // to a better distribution. (and honestly i'm not entirely sure why it's so inefficient without...)
-    a /= NUM_PARTITIONS;
-    a *= 2654435769U;
-    return a >> (32 - capacityExponent);
+    // We're reading partitioned routes: all routes of a partition have the same lowest bits
+    // (see partinitionerAdd), so their ids are spaced by NUM_PARTITIONS.
+    // Dividing by the number of partitions gives back dense ids, which is what Fibonacci hashing likes best.
+    return hashTopBits(hashFibonacci(*(uint32_t*) key / NUM_PARTITIONS), capacityExponent);
 }
 
 static inline bool MAP_KEY_EQUAL_FUNC(const RouteMapEntry* entry, const uint32_t* key)
@@ -126,72 +127,17 @@ MAP_DECLARE_FUNCTIONS_STATIC(routeMap, RouteMapEntry, uint32_t, true)
 #undef CURRENT_MAP_TYPE
 
 /*
- * DRIVER MAP
+ * DRIVERS
  */
 
-typedef struct
-{
-    char* str;
-    uint32_t length;
-} MeasuredString;
-
+// A driver, found using its id given by the stream (see STRING_IDS).
 typedef struct DriverEntry
 {
-    char* name; // NULL if empty.
+    const char* name; // NULL if the driver hasn't been seen.
     uint32_t length;
     uint32_t routeCount;
 } DriverEntry;
 
-typedef struct DriverMap
-{
-    MAP_HEADER(DriverEntry)
-} DriverMap;
-
-#define CURRENT_MAP_TYPE() DriverMap
-
-static inline uint32_t MAP_HASH_FUNC(const MeasuredString* key, uint32_t capacityExponent)
-{
-    uint32_t a = 0;
-    for (uint32_t i = 0; i < key->length; i++)
-    {
-        a *= 31;
-        a += key->str[i];
-    }
-    return a;
-}
-
-static inline bool MAP_KEY_EQUAL_FUNC(const DriverEntry* entry, const MeasuredString* key)
-{
-    return entry->length == key->length && memcmp(entry->name, key->str, key->length) == 0;
-}
-
-static inline bool MAP_GET_OCCUPIED_FUNC(const DriverEntry* entry)
-{
-    return entry->name != NULL;
-}
-
-static inline void MAP_MARK_OCCUPIED_FUNC(DriverEntry* entry, MeasuredString* key)
-{
-    char* copy = memAlloc(&driverStringsMem, key->length + 1);
-    memcpy(copy, key->str, key->length + 1);
-
-    entry->name = copy;
-    entry->length = key->length;
-}
-
-static inline MeasuredString* MAP_GET_KEY_PTR_FUNC(DriverEntry* entry, MapKeyScratch scratch)
-{
-    MeasuredString* scratchStr = (MeasuredString*) scratch;
-
-    scratchStr->str = entry->name;
-    scratchStr->length = entry->length;
-    return scratchStr;
-}
-
-MAP_DECLARE_FUNCTIONS_STATIC(driverMap, DriverEntry, MeasuredString, true)
-
-#undef CURRENT_MAP_TYPE
-
 /*
  * ------------
  * DRIVER SORT AVL
@@ -216,15 +162,17 @@ typedef struct DriverSortAVL
     int routesTaken;
 
     // The name of the driver, the second criteria for sorting.
-    // In our computation, it is allocated in the drivers AVL.
-    char* driverName;
+    // In our computation, it's the string kept by the stream.
+    const char* driverName;
+    uint32_t driverNameLen;
 } DriverSortAVL;
 
 // The struct containing all the data needed to insert a new DriverSortAVL node.
 typedef struct
 {
     int routesTaken;
-    char* driverName;
+    const char* driverName;
+    uint32_t driverNameLen;
 } DriverSortAVLData;
 
 static DriverSortAVL* driverSortAVLCreate(const DriverSortAVLData* data)
@@ -235,6 +183,7 @@ static DriverSortAVL* driverSortAVLCreate(const DriverSortAVLData* data)
     AVL_INIT(avl); // Initializes left, right and balance.
     avl->routesTaken = data->routesTaken;
     avl->driverName = data->driverName;
+    avl->driverNameLen = data->driverNameLen;
 
     return avl;
 }
@@ -249,7 +198,7 @@ static int driverSortAVLCompare(const DriverSortAVL* a, const DriverSortAVLData*
     }
     else
     {
-        return strcmp(a->driverName, data->driverName);
+        return compareNames(a->driverName, a->driverNameLen, data->driverName, data->driverNameLen);
     }
 }
 
@@ -262,130 +211,472 @@ static AVL_DECLARE_INSERT_FUNCTION(driverSortAVLInsert, DriverSortAVL, DriverSor
  * ------------
  */
 
-// Define the prototype of the functions used in computationD1 first, so we get the declarations later.
+// Define the prototype of the functions used in the computation first, so we get the declarations later.
 // It would be weird to have the functions used in the computation before the computation itself!
 
-static void sortDriversByRouteCount(DriverMap* drivers, DriverSortAVL** sortedDrivers);
+static void sortDriversByRouteCount(DriverEntry* drivers, uint32_t numDrivers, DriverSortAVL** sortedDrivers);
 
-static void printTop10Drivers(const DriverSortAVL* node, int* n);
+static void printTop10Drivers(const DriverSortAVL* node, int* n, FILE* out);
 
-void computationD1(RouteStream* stream)
+// A step copied into the partitioner, with the id of the driver.
+typedef struct StepPart
 {
-    memInit(&driverStringListMem, 256 * 1024);
-    memInit(&driverSortAVLMem, 256 * 1024);
-    memInitEx(&driverStringsMem, 256 * 1024, 1);
-
-    // The map containing all drivers by their name, with the number of routes they have taken.
-    //
-    // It's really just a function:
-    //    f(driverName) -> routeCount
-    DriverMap drivers;
-    driverMapInit(&drivers, 4096, 0.75f);
-
-    // The map containing all routes, for lookup.
-    // Each route in this map holds a list of all drivers who have already drove this route.
-    //
-    // It's really just a function:
-    //     f(routeId) -> [driverName1, driverName2, ...]
-    RouteMap routes;
-    routeMapInit(&routes, 8192, 0.75f); // Use 8192 as we do partitioning
+    uint32_t routeId;
+    uint32_t driverId;
+} StepPart;
 
+// Each worker reads a part of the file, route by route when the file is grouped (see grouped.h),
+// or with its own partitioner otherwise.
+typedef struct D1Worker
+{
+    // When reading route by route: the number of routes of each driver, by their id.
+    uint32_t* routeCounts;
+    // The number of the last route counted for each driver, so drivers are counted once per route.
+    uint32_t* lastRun;
+    uint32_t runNumber;
+    uint32_t capacity; // Of both arrays
+    GroupedReader grouped;
     // Splits all the route steps into multiple buckets for better
     // cache locality.
+    // Only created when the file isn't grouped by route (partitions is NULL until then).
     Partitioner partitioner;
-    partitionerInit(&partitioner, NUM_PARTITIONS, 66536);
+} D1Worker;
 
-    struct StepPart
+static void growDrivers(D1Worker* worker, uint32_t id)
+{
+    uint32_t newCapacity = worker->capacity;
+    while (newCapacity <= id)
+    {
+        newCapacity *= 2;
+    }
+
+    worker->routeCounts = realloc(worker->routeCounts, sizeof(uint32_t) * newCapacity);
+    worker->lastRun = realloc(worker->lastRun, sizeof(uint32_t) * newCapacity);
+    assert(worker->routeCounts && worker->lastRun);
+    memset(worker->routeCounts + worker->capacity, 0, sizeof(uint32_t) * (newCapacity - worker->capacity));
+    memset(worker->lastRun + worker->capacity, 0, sizeof(uint32_t) * (newCapacity - worker->capacity));
+    worker->capacity = newCapacity;
+}
+
+// Counts the route for all of its drivers, once each.
+// Given by the grouped reader, once all the steps of the route have been read.
+static void countRun(void* w, uint32_t routeId, const void* items, uint32_t numItems)
+{
+    D1Worker* worker = w;
+    const StepPart* steps = items;
+
+    uint32_t run = ++worker->runNumber;
+    for (uint32_t i = 0; i < numItems; ++i)
+    {
+        uint32_t driverId = steps[i].driverId;
+        if (worker->lastRun[driverId] != run)
+        {
+            worker->lastRun[driverId] = run;
+            worker->routeCounts[driverId]++;
+        }
+    }
+}
+
+static void* createWorker()
+{
+    D1Worker* worker = malloc(sizeof(D1Worker));
+    assert(worker);
+
+    worker->capacity = 1024;
+    worker->routeCounts = calloc(worker->capacity, sizeof(uint32_t));
+    worker->lastRun = calloc(worker->capacity, sizeof(uint32_t));
+    assert(worker->routeCounts && worker->lastRun);
+    worker->runNumber = 0;
+    groupedInit(&worker->grouped, sizeof(StepPart), countRun, worker);
+    worker->partitioner.partitions = NULL;
+
+    return worker;
+}
+
+static void freeWorker(D1Worker* worker)
+{
+    partitionerFree(&worker->partitioner);
+    groupedFree(&worker->grouped);
+    free(worker->routeCounts);
+    free(worker->lastRun);
+    free(worker);
+}
+
+// From now on, steps are written in the partitioner.
+static void usePartitioner(D1Worker* worker)
+{
+    worker->grouped.mode = GROUPED_PARTITIONED;
+    if (worker->partitioner.partitions == NULL)
+    {
+        partitionerInit(&worker->partitioner, NUM_PARTITIONS, 66536);
+    }
+}
+
+// Step 1: Write all steps to partitions
+// ------------------------------------------
+// For better performance, we'll copy every step to partitions with similar route ids.
+// The stream already gives an id to every driver, so we can later compare them very fast.
+// That is, unless the file is grouped by route: then we can count the routes right away, route by route.
+#define D1_FIELDS (ROUTE_ID | DRIVER_NAME | STRING_IDS)
+
+static inline void processStep(void* w, const RouteStep* step)
+{
+    D1Worker* worker = w;
+
+    // Steps given one by one can't be read again, so they always go to the partitioner.
+    if (worker->partitioner.partitions == NULL)
+    {
+        usePartitioner(worker);
+    }
+
+    StepPart part = {step->routeId, step->driverId};
+    partinitionerAddS(&worker->partitioner, step->routeId, part);
+}
+
+static void readPartitioned(D1Worker* worker, RouteStream* stream)
+{
+    usePartitioner(worker);
+
+    RouteStep step;
+    while (rsRead(stream, &step, D1_FIELDS))
+    {
+        processStep(worker, &step);
+    }
+}
+
+// Reads the part route by route. Returns false when the file isn't grouped by route.
+static bool readGrouped(D1Worker* worker, RouteStream* stream)
+{
+    RouteStep step;
+    while (rsRead(stream, &step, D1_FIELDS))
+    {
+        if (step.driverId >= worker->capacity)
+        {
+            growDrivers(worker, step.driverId);
+        }
+
+        StepPart part = {step.routeId, step.driverId};
+        if (!groupedAdd(&worker->grouped, step.routeId, &part))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Forgets the routes counted so far, and reads the part again with the partitioner.
+static void readAgainPartitioned(D1Worker* worker)
+{
+    memset(worker->routeCounts, 0, sizeof(uint32_t) * worker->capacity);
+    RouteStream* part = worker->grouped.part;
+    groupedRewind(&worker->grouped);
+    readPartitioned(worker, part);
+}
+
+static void process(void* w, RouteStream* stream)
+{
+    D1Worker* worker = w;
+
+    if (!groupedStart(&worker->grouped, stream))
+    {
+        readPartitioned(worker, stream);
+    }
+    else if (!readGrouped(worker, stream))
+    {
+        readAgainPartitioned(worker);
+    }
+}
+
+// When some parts can't be read route by route, all of them are read with the partitioner.
+static void readPartAgain(uint32_t index, void* data)
+{
+    D1Worker* worker = ((void**) data)[index];
+    if (worker->grouped.mode == GROUPED_STREAMING)
+    {
+        readAgainPartitioned(worker);
+    }
+    else
+    {
+        usePartitioner(worker);
+    }
+}
+
+// The state is just the list of drivers of every route: that's all we need to know
+// whether a driver of a new step has already been counted for the route.
+// Each route is written with its number of drivers first, and a count of 0 ends the list.
+static void saveRouteDrivers(RouteMap* routes, FILE* stateOut)
+{
+    for (uint32_t i = 0; i < routes->capacity; ++i)
+    {
+        RouteMapEntry* entry = &routes->entries[i];
+        if (!entry->occupied)
+        {
+            continue;
+        }
+
+        uint32_t count = 0;
+        for (LLDriver* it = &entry->drivers; it && it->value != LL_EMPTY; it = it->next)
+        {
+            count++;
+        }
+
+        stateWriteU32(stateOut, count);
+        stateWriteU32(stateOut, entry->key);
+        for (LLDriver* it = &entry->drivers; it && it->value != LL_EMPTY; it = it->next)
+        {
+            stateWriteU32(stateOut, it->value);
+        }
+    }
+}
+
+// The saved drivers are added to a new worker as if they were steps.
+static void* loadState(FILE* in, RouteStream* stream)
+{
+    uint32_t numIds;
+    uint32_t* newIds = stateReadStrings(in, stream, &numIds);
+    if (newIds == NULL)
+    {
+        return NULL;
+    }
+
+    D1Worker* worker = createWorker();
+    usePartitioner(worker);
+
+    uint32_t count;
+    bool ok = stateReadU32(in, &count);
+    while (ok && count > 0)
     {
         uint32_t routeId;
-        uint32_t driverLen;
-        char* driverName;
-    };
+        ok = stateReadU32(in, &routeId);
+        for (uint32_t i = 0; i < count && ok; ++i)
+        {
+            uint32_t driverId;
+            ok = stateReadU32(in, &driverId) && driverId < numIds;
+            if (ok)
+            {
+                StepPart part = {routeId, newIds[driverId]};
+                partinitionerAddS(&worker->partitioner, routeId, part);
+            }
+        }
+        ok = ok && stateReadU32(in, &count);
+    }
 
-    // Step 1: Write all steps to partitions, and register drivers
-    // ------------------------------------------
-    // For better performance, we'll copy every step to partitions with similar route ids.
-    // During this phase, we are also going to register all drivers into the map first,
-    // so we can later compare strings very fast.
+    free(newIds);
+    if (!ok)
     {
-        PROFILER_START("Write to partitions and register drivers");
+        freeWorker(worker);
+        return NULL;
+    }
+    return worker;
+}
 
-        RouteStep step;
-        while (rsRead(stream, &step, ROUTE_ID | DRIVER_NAME))
+// Phase 2 is run by multiple threads, each one taking the next partition to read.
+// Partitions have different route ids, so each thread can have its own route map,
+// and count the routes of each driver on its own.
+typedef struct D1Thread
+{
+    // The map containing the routes of the partition, for lookup.
+    // Each route in this map holds a list of all drivers who have already drove this route.
+    //
+    // It's really just a function:
+    //     f(routeId) -> [driverId1, driverId2, ...]
+    RouteMap routes;
+    // The number of routes of each driver, by their id, in the partitions read by this thread.
+    uint32_t* routeCounts;
+    // Used to allocate the nodes of the driver lists.
+    MemArena driverListMem;
+} D1Thread;
+
+typedef struct D1Phase2
+{
+    void** workers;
+    uint32_t numWorkers;
+    D1Thread* threads;
+    // The partitions to read, biggest first.
+    uint32_t order[NUM_PARTITIONS];
+    // The state is written by all threads, one partition at a time.
+    FILE* stateOut;
+    ParallelLock stateLock;
+} D1Phase2;
+
+static void countPartition(uint32_t threadIndex, uint32_t item, void* data)
+{
+    D1Phase2* task = data;
+    D1Thread* thread = &task->threads[threadIndex];
+    uint32_t i = task->order[item];
+
+    // Routes can be spread over multiple workers, so we read the same partition of all workers at once.
+    for (uint32_t w = 0; w < task->numWorkers; ++w)
+    {
+        Partitioner* partitioner = &((D1Worker*) task->workers[w])->partitioner;
+        // Partitions spilled to disk are read back one at a time (see partition.h).
+        partitionLoad(partitioner, &partitioner->partitions[i]);
+        PARTITION_ITERATE(partitioner, &partitioner->partitions[i], StepPart, p)
         {
-            MeasuredString str = (MeasuredString){step.driverName, step.driverNameLen};
-            DriverEntry* entry = driverMapLookup(&drivers, str);
+            RouteMapEntry* entry = routeMapLookup(&thread->routes, p->routeId);
             if (!entry)
             {
-                entry = driverMapInsert(&drivers, str);
+                entry = routeMapInsert(&thread->routes, p->routeId);
+                entry->drivers = (LLDriver){.value = LL_EMPTY, .next = NULL};
             }
 
-            struct StepPart part = {step.routeId, step.driverNameLen, entry->name};
-            partinitionerAddS(&partitioner, step.routeId, part);
+            // Has the driver already been seen on this route?
+            bool driverAlreadySeen = false;
+            LLDriver* it = &entry->drivers;
+            // Traverse the linked list of drivers already assigned to this route.
+            while (it && it->value != LL_EMPTY)
+            {
+                // Same id, same driver!
+                if (it->value == p->driverId)
+                {
+                    driverAlreadySeen = true;
+                    break;
+                }
+                it = it->next;
+            }
+
+            if (!driverAlreadySeen)
+            {
+                // Increment its route count, and add it to the list of drivers involved in this route.
+                thread->routeCounts[p->driverId]++;
+                llDriverAdd(&entry->drivers, p->driverId, &thread->driverListMem);
+            }
+        }
+        partitionRelease(partitioner, &partitioner->partitions[i]);
+    }
+
+    if (task->stateOut != NULL)
+    {
+        parallelLock(&task->stateLock);
+        saveRouteDrivers(&thread->routes, task->stateOut);
+        parallelUnlock(&task->stateLock);
+    }
+
+    routeMapClear(&thread->routes, -1);
+    memReset(&thread->driverListMem);
+}
+
+static void finish(void** workers, uint32_t numWorkers, const RouteStream* stream, FILE* out, FILE* stateOut)
+{
+    memInitOrReset(&driverSortAVLMem, 256 * 1024);
+
+    // All drivers, by their id.
+    //
+    // It's really just a function:
+    //    f(driverId) -> routeCount
+    uint32_t numDrivers = rsNumStrings(stream);
+    DriverEntry* drivers = calloc(numDrivers > 0 ? numDrivers : 1, sizeof(DriverEntry));
+    assert(drivers);
+
+    // Has every part been read route by route? Then the routes cut by the end of a part are the only ones
+    // left to count (by the first worker). If not, every part is read again with the partitioner.
+    bool grouped;
+    {
+        PROFILER_START("Check the routes read by each part");
+
+        D1Worker* firstWorker = workers[0];
+        if (numDrivers > firstWorker->capacity)
+        {
+            growDrivers(firstWorker, numDrivers - 1);
+        }
+
+        GroupedReader* readers[MAX_THREADS];
+        for (uint32_t w = 0; w < numWorkers; ++w)
+        {
+            readers[w] = &((D1Worker*) workers[w])->grouped;
+        }
+        grouped = groupedFinish(readers, numWorkers, countRun, firstWorker);
+        if (!grouped)
+        {
+            parallelRun(numWorkers, readPartAgain, workers);
         }
 
         PROFILER_END();
     }
 
+    if (stateOut != NULL)
+    {
+        stateWriteStrings(stateOut, stream);
+    }
+
     // Phase 2: Read all the route steps
     // ------------------------------------------
-    // Let's read all the route steps and fill our two intermediate AVLs with data.
-    // The routes AVL will be used to filter out drivers we've already seen on a particular route.
+    // Let's read all the route steps and count the routes of every driver.
+    // The route map is used to filter out drivers we've already seen on a particular route.
+    // The file has been read by numWorkers threads, so let's use as many to read the partitions.
+    // (Unless the routes have already been counted while reading the file!)
+    if (grouped)
     {
-        PROFILER_START("Read partitions and count routes per driver");
+        PROFILER_START("Add up the routes of all parts");
 
-        for (Partition* partition = partitioner.partitions;
-             partition != (partitioner.partitions + partitioner.numPartitions);
-             ++partition)
+        for (uint32_t w = 0; w < numWorkers; ++w)
         {
-            PARTITION_ITERATE(&partitioner, partition, struct StepPart, p)
+            D1Worker* worker = workers[w];
+            uint32_t count = worker->capacity < numDrivers ? worker->capacity : numDrivers;
+            for (uint32_t i = 0; i < count; ++i)
             {
-                RouteMapEntry* entry = routeMapLookup(&routes, p->routeId);
-                if (!entry)
-                {
-                    entry = routeMapInsert(&routes, p->routeId);
-                    entry->drivers = (LLStr){.value = NULL, .next = NULL};
-                }
+                drivers[i].routeCount += worker->routeCounts[i];
+            }
+        }
 
-                // Has the driver already been seen on this route?
-                bool driverAlreadySeen = false;
-                LLStr* it = &entry->drivers;
-                // Traverse the linked list of drivers already assigned to this route.
-                while (it && it->value != NULL)
-                {
-                    // Here we can use pointer comparison, as both strings refer to the ones
-                    // used in the map.
-                    if (it->value == p->driverName)
-                    {
-                        driverAlreadySeen = true;
-                        break;
-                    }
-                    it = it->next;
-                }
+        PROFILER_END();
+    }
+    else
+    {
+        PROFILER_START("Read partitions and count routes per driver");
 
-                if (!driverAlreadySeen)
-                {
-                    // Find the driver in the map, we've already added it earlier.
-                    MeasuredString drivStr = {p->driverName, p->driverLen};
-                    DriverEntry* driverNode = driverMapLookup(&drivers, drivStr);
-
-                    // Increment its routeCount value.
-                    driverNode->routeCount++;
-
-                    // Add it to the list of drivers involved in this route.
-                    // Use the string located in the map (precisely in the strings memory arena)
-                    // since it is valid through the entire computation.
-                    char* storedName = driverNode->name;
-                    llStrAdd(&entry->drivers, storedName);
-                }
+        D1Phase2 task = {workers, numWorkers, calloc(numWorkers, sizeof(D1Thread)), .stateOut = stateOut};
+        assert(task.threads);
+        for (uint32_t t = 0; t < numWorkers; ++t)
+        {
+            routeMapInit(&task.threads[t].routes, 8192, MAP_LOAD_FACTOR); // Use 8192 as we do partitioning
+            task.threads[t].routeCounts = calloc(numDrivers > 0 ? numDrivers : 1, sizeof(uint32_t));
+            assert(task.threads[t].routeCounts);
+            memInit(&task.threads[t].driverListMem, 256 * 1024);
+        }
+
+        Partitioner* partitioners[MAX_THREADS];
+        for (uint32_t w = 0; w < numWorkers; ++w)
+        {
+            partitioners[w] = &((D1Worker*) workers[w])->partitioner;
+        }
+        partitionOrderBySize(partitioners, numWorkers, task.order);
+
+        parallelFor(numWorkers, NUM_PARTITIONS, countPartition, &task);
+
+        // Sum up the counts of all threads (always in the same order, not that it matters with integers).
+        for (uint32_t t = 0; t < numWorkers; ++t)
+        {
+            D1Thread* thread = &task.threads[t];
+            for (uint32_t i = 0; i < numDrivers; ++i)
+            {
+                drivers[i].routeCount += thread->routeCounts[i];
             }
 
-            routeMapClear(&routes, -1);
+            routeMapFree(&thread->routes);
+            free(thread->routeCounts);
+            memFree(&thread->driverListMem);
         }
+        free(task.threads);
 
         PROFILER_END();
     }
 
+    if (stateOut != NULL)
+    {
+        // The end of the routes. (None are saved when every part has been read route by route,
+        // which only happens without states, or when there's nothing to read.)
+        stateWriteU32(stateOut, 0);
+    }
+
+    for (uint32_t i = 0; i < numDrivers; ++i)
+    {
+        if (drivers[i].routeCount != 0)
+        {
+            drivers[i].name = rsGetString(stream, i, &drivers[i].length);
+        }
+    }
+
     // The AVL which will contain the drivers sorted by route count.
     // We're going to extract the 10 largest elements from it.
     DriverSortAVL* bestDrivers = NULL;
@@ -399,46 +690,48 @@ void computationD1(RouteStream* stream)
     {
         PROFILER_START("Sort drivers by route count");
 
-        sortDriversByRouteCount(&drivers, &bestDrivers);
+        sortDriversByRouteCount(drivers, numDrivers, &bestDrivers);
 
         int n = 0;
-        printTop10Drivers(bestDrivers, &n);
+        printTop10Drivers(bestDrivers, &n, out);
 
         PROFILER_END();
     }
 
     // Phase 4: Free everything
     // ------------------------------------------
-    // We're done, and we can just free all the AVL trees we have created.
+    // We're done, and we can just free all the AVL trees and workers we have created.
     {
-        PROFILER_START("Free stuff")
+        PROFILER_START("Free stuff");
 
-        // Free the entire hash map.
-        routeMapFree(&routes);
-        driverMapFree(&drivers);
+        for (uint32_t w = 0; w < numWorkers; ++w)
+        {
+            freeWorker(workers[w]);
+        }
+        free(drivers);
 
-        // Free all the memory arenas.
-        memFree(&driverStringListMem);
-        memFree(&driverStringsMem);
-        memFree(&driverSortAVLMem);
+        // The AVL arena keeps its blocks for the next time (with --follow), see memInitOrReset.
 
         PROFILER_END();
     }
 }
 
-// Transfer all drivers from the drivers map
-// to the sorting AVL, using a simple pre-order traversal.
-static void sortDriversByRouteCount(DriverMap* drivers, DriverSortAVL** sortedDrivers)
+const Computation computationD1 = {"Computation D1", D1_FIELDS, createWorker, process, processStep, finish,
+                                   loadState};
+
+// Transfer all drivers we've seen to the sorting AVL.
+static void sortDriversByRouteCount(DriverEntry* drivers, uint32_t numDrivers, DriverSortAVL** sortedDrivers)
 {
-    for (uint32_t i = 0; i < drivers->capacity; ++i)
+    for (uint32_t i = 0; i < numDrivers; ++i)
     {
-        DriverEntry* entry = &drivers->entries[i];
+        DriverEntry* entry = &drivers[i];
 
         if (entry->name != NULL)
         {
             DriverSortAVLData insertion = {
                 .routesTaken = entry->routeCount,
-                .driverName = entry->name
+                .driverName = entry->name,
+                .driverNameLen = entry->length
             };
             // We're using a double pointer so we can modify the root (in case *sortedDrivers is NULL for example).
             *sortedDrivers = driverSortAVLInsert(*sortedDrivers, &insertion, NULL, NULL);
@@ -448,28 +741,30 @@ static void sortDriversByRouteCount(DriverMap* drivers, DriverSortAVL** sortedDr
 
 // A simple in-order traversal to print the top 10 drivers and the number of routes taken.
 // The n parameter is used to stop the traversal once we've printed 10 drivers, it needs to be initialized with 0.
-static void printTop10Drivers(const DriverSortAVL* node, int* n)
+static void printTop10Drivers(const DriverSortAVL* node, int* n, FILE* out)
 {
     if (node == NULL || *n >= 10)
     {
         return;
     }
 
-    printTop10Drivers(node->right, n);
+    printTop10Drivers(node->right, n, out);
 
     if (*n < 10)
     {
-        printf("%s;%d\n", node->driverName, node->routesTaken);
+        fprintf(out, "%.*s;%d\n", (int) node->driverNameLen, node->driverName, node->routesTaken);
         *n += 1;
     }
 
-    printTop10Drivers(node->left, n);
+    printTop10Drivers(node->left, n, out);
 }
 
 #else
-void computationD1(struct RouteStream* s)
+static void* createWorker()
 {
     fprintf(stderr, "Cannot use computation D1 without experimental algorithms enabled!\n");
     exit(9);
 }
+
+const Computation computationD1 = {"Computation D1", ROUTE_ID | DRIVER_NAME, createWorker, NULL, NULL, NULL};
 #endif
@@ -4,84 +4,28 @@
 #include "compile_settings.h"
 
 #if EXPERIMENTAL_ALGO
+#include <assert.h>
 #include <string.h>
 
 #include "route.h"
 #include "avl.h"
 #include "profile.h"
 #include "mem_alloc.h"
-#include "map.h"
+#include "state.h"
 
 static MemArena driverSortAVLMem;
-static MemArena driverStringsMem;
 
 /*
- * Driver Map
+ * Drivers, by their id given by the stream (see STRING_IDS)
  */
 
-typedef struct
-{
-    char* str;
-    uint32_t length;
-} MeasuredString;
-
 typedef struct DriverEntry
 {
-    char* name; // NULL if empty.
+    const char* name; // NULL if the driver hasn't been seen.
     uint32_t length;
-    float dist;
+    uint64_t dist; // In thousandths
 } DriverEntry;
 
-typedef struct DriverMap
-{
-    MAP_HEADER(DriverEntry)
-} DriverMap;
-
-#define CURRENT_MAP_TYPE() DriverMap
-
-static inline uint32_t MAP_HASH_FUNC(const MeasuredString* key, uint32_t capacityExponent)
-{
-    uint32_t a = 0;
-    for (uint32_t i = 0; i < key->length; i++)
-    {
-        a *= 31;
-        a += key->str[i];
-    }
-    return a;
-}
-
-static inline bool MAP_KEY_EQUAL_FUNC(const DriverEntry* entry, const MeasuredString* key)
-{
-    return entry->length == key->length && memcmp(entry->name, key->str, key->length) == 0;
-}
-
-static inline bool MAP_GET_OCCUPIED_FUNC(const DriverEntry* entry)
-{
-    return entry->name != NULL;
-}
-
-static inline void MAP_MARK_OCCUPIED_FUNC(DriverEntry* entry, MeasuredString* key)
-{
-    char* copy = memAlloc(&driverStringsMem, key->length + 1);
-    memcpy(copy, key->str, key->length + 1);
-
-    entry->name = copy;
-    entry->length = key->length;
-}
-
-static inline MeasuredString* MAP_GET_KEY_PTR_FUNC(DriverEntry* entry, MapKeyScratch scratch)
-{
-    MeasuredString* scratchStr = (MeasuredString*) scratch;
-
-    scratchStr->str = entry->name;
-    scratchStr->length = entry->length;
-    return scratchStr;
-}
-
-MAP_DECLARE_FUNCTIONS_STATIC(driverMap, DriverEntry, MeasuredString, true)
-
-#undef CURRENT_MAP_TYPE
-
 typedef struct DriverSortAVL
 {
     AVL_HEADER(DriverSortAVL)
@@ -111,83 +55,229 @@ static int driverSortAVLCompare(DriverSortAVL* tree, DriverEntry* driver)
     }
     else
     {
-        return strcmp(tree->driver->name, driver->name);
+        return compareNames(tree->driver->name, tree->driver->length, driver->name, driver->length);
     }
 }
 
 AVL_DECLARE_FUNCTIONS_STATIC(driverSortAVL, DriverSortAVL, DriverEntry,
                              (AVLCreateFunc) &driverSortAVLCreate, (AVLCompareValueFunc) &driverSortAVLCompare)
 
-static void sortDrivers(DriverMap* drivers, DriverSortAVL** sorted)
+static void sortDrivers(DriverEntry* drivers, uint32_t numDrivers, DriverSortAVL** sorted)
 {
-    for (uint32_t i = 0; i < drivers->capacity; ++i)
+    for (uint32_t i = 0; i < numDrivers; ++i)
     {
-        if (drivers->entries[i].name != NULL)
+        if (drivers[i].name != NULL)
         {
-            *sorted = driverSortAVLInsert(*sorted, &drivers->entries[i], NULL, NULL);
+            *sorted = driverSortAVLInsert(*sorted, &drivers[i], NULL, NULL);
         }
     }
 }
 
-static void printTop10(DriverSortAVL* tree, int* n)
+static void printTop10(DriverSortAVL* tree, int* n, FILE* out)
 {
     if (tree == NULL || *n >= 10)
     {
         return;
     }
 
-    printTop10(tree->right, n);
+    printTop10(tree->right, n, out);
 
     if (*n < 10)
     {
-        printf("%s;%f\n", tree->driver->name, tree->driver->dist);
+        fprintf(out, "%.*s;%f\n", (int) tree->driver->length, tree->driver->name, tree->driver->dist / 1000.0);
         *n += 1;
     }
 
-    printTop10(tree->left, n);
+    printTop10(tree->left, n, out);
+}
+
+// Distances are summed up in fixed-point (thousandths), so the total is exact,
+// and doesn't depend on the order of the steps (or how the file is split between workers).
+typedef struct DriverDist
+{
+    uint64_t dist;
+    bool seen;
+} DriverDist;
+
+// Each worker has its own array of distances, indexed by driver id, merged at the end.
+// Ids are dense and shared by all workers, so no need for a map anymore.
+typedef struct D2Worker
+{
+    DriverDist* drivers;
+    uint32_t capacity;
+} D2Worker;
+
+static void* createWorker()
+{
+    D2Worker* worker = malloc(sizeof(D2Worker));
+    assert(worker);
+
+    worker->capacity = 4096;
+    worker->drivers = calloc(worker->capacity, sizeof(DriverDist));
+    assert(worker->drivers);
+
+    return worker;
+}
+
+static void freeWorker(D2Worker* worker)
+{
+    free(worker->drivers);
+    free(worker);
+}
+
+// Grows the array so the id fits in. Ids grow as new names appear, so this is quite rare.
+static void growDrivers(D2Worker* worker, uint32_t id)
+{
+    uint32_t newCapacity = worker->capacity;
+    while (newCapacity <= id)
+    {
+        newCapacity *= 2;
+    }
+
+    worker->drivers = realloc(worker->drivers, newCapacity * sizeof(DriverDist));
+    assert(worker->drivers);
+    memset(worker->drivers + worker->capacity, 0, (newCapacity - worker->capacity) * sizeof(DriverDist));
+    worker->capacity = newCapacity;
 }
 
-void computationD2(RouteStream* stream)
+#define D2_FIELDS (DRIVER_NAME | DISTANCE_FIXED | STRING_IDS)
+
+static inline void processStep(void* w, const RouteStep* step)
 {
-    PROFILER_START("Computation D2");
+    D2Worker* worker = w;
 
-    DriverMap drivers;
-    driverMapInit(&drivers, 4096, 0.75f);
+    if (step->driverId >= worker->capacity)
+    {
+        growDrivers(worker, step->driverId);
+    }
 
-    memInit(&driverSortAVLMem, 128 * 1024);
-    memInit(&driverStringsMem, 256 * 1024);
+    DriverDist* driver = &worker->drivers[step->driverId];
+    driver->dist += step->distanceThousandths;
+    driver->seen = true;
+}
 
+static void process(void* worker, RouteStream* stream)
+{
     RouteStep step;
-    while (rsRead(stream, &step, DRIVER_NAME | DISTANCE))
+    while (rsRead(stream, &step, D2_FIELDS))
+    {
+        processStep(worker, &step);
+    }
+}
+
+// Saves the distance of each driver, with its id.
+static void saveState(DriverEntry* drivers, uint32_t numDrivers, const RouteStream* stream, FILE* stateOut)
+{
+    stateWriteStrings(stateOut, stream);
+
+    uint32_t numSeen = 0;
+    for (uint32_t i = 0; i < numDrivers; ++i)
+    {
+        numSeen += drivers[i].name != NULL;
+    }
+
+    stateWriteU32(stateOut, numSeen);
+    for (uint32_t i = 0; i < numDrivers; ++i)
+    {
+        if (drivers[i].name != NULL)
+        {
+            stateWriteU32(stateOut, i);
+            stateWriteU64(stateOut, drivers[i].dist);
+        }
+    }
+}
+
+static void* loadState(FILE* in, RouteStream* stream)
+{
+    uint32_t numIds;
+    uint32_t* newIds = stateReadStrings(in, stream, &numIds);
+    if (newIds == NULL)
     {
-        MeasuredString drivStr = { step.driverName, step.driverNameLen };
+        return NULL;
+    }
+
+    D2Worker* worker = createWorker();
+
+    uint32_t numSeen;
+    bool ok = stateReadU32(in, &numSeen);
+    for (uint32_t i = 0; i < numSeen && ok; ++i)
+    {
+        uint32_t id;
+        uint64_t dist;
+        ok = stateReadU32(in, &id) && stateReadU64(in, &dist) && id < numIds;
+        if (ok)
+        {
+            id = newIds[id];
+            if (id >= worker->capacity)
+            {
+                growDrivers(worker, id);
+            }
+            worker->drivers[id] = (DriverDist) {dist, true};
+        }
+    }
+
+    free(newIds);
+    if (!ok)
+    {
+        freeWorker(worker);
+        return NULL;
+    }
+    return worker;
+}
 
-        DriverEntry* driver = driverMapLookup(&drivers, drivStr);
-        if (driver == NULL)
+static void finish(void** workers, uint32_t numWorkers, const RouteStream* stream, FILE* out, FILE* stateOut)
+{
+    uint32_t numDrivers = rsNumStrings(stream);
+    DriverEntry* drivers = calloc(numDrivers > 0 ? numDrivers : 1, sizeof(DriverEntry));
+    assert(drivers);
+
+    memInitOrReset(&driverSortAVLMem, 128 * 1024);
+
+    // Sum up the distances of all workers.
+    for (uint32_t w = 0; w < numWorkers; ++w)
+    {
+        D2Worker* worker = workers[w];
+        uint32_t count = worker->capacity < numDrivers ? worker->capacity : numDrivers;
+        for (uint32_t i = 0; i < count; ++i)
         {
-            driver = driverMapInsert(&drivers, drivStr);
+            if (worker->drivers[i].seen)
+            {
+                drivers[i].dist += worker->drivers[i].dist;
+                if (drivers[i].name == NULL)
+                {
+                    drivers[i].name = rsGetString(stream, i, &drivers[i].length);
+                }
+            }
         }
+    }
 
-        driver->dist += step.distance;
+    if (stateOut != NULL)
+    {
+        saveState(drivers, numDrivers, stream, stateOut);
     }
 
     DriverSortAVL* sorted = NULL;
     int n = 0;
 
-    sortDrivers(&drivers, &sorted);
-    printTop10(sorted, &n);
+    sortDrivers(drivers, numDrivers, &sorted);
+    printTop10(sorted, &n, out);
 
-    driverMapFree(&drivers);
-    memFree(&driverSortAVLMem);
-    memFree(&driverStringsMem);
-
-    PROFILER_END();
+    free(drivers);
+    for (uint32_t w = 0; w < numWorkers; ++w)
+    {
+        freeWorker(workers[w]);
+    }
 }
 
+const Computation computationD2 = {"Computation D2", D2_FIELDS, createWorker, process, processStep, finish,
+                                   loadState};
+
 #else
-void computationD2(struct RouteStream* s)
+static void* createWorker()
 {
     fprintf(stderr, "Cannot use computation D2 without experimental algorithms enabled!\n");
     exit(9);
 }
+
+const Computation computationD2 = {"Computation D2", DRIVER_NAME | DISTANCE_FIXED, createWorker, NULL, NULL, NULL};
 #endif
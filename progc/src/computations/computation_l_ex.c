@@ -7,9 +7,13 @@
 #include "route.h"
 #include "avl.h"
 #include "map.h"
+#include "hash.h"
 #include "profile.h"
 #include "mem_alloc.h"
 #include "partition.h"
+#include "grouped.h"
+#include "parallel.h"
+#include "state.h"
 
 static MemArena routeSortAVLMem;
 
@@ -17,7 +21,7 @@ typedef struct RouteDistEntry
 {
     bool occupied : 1;
     uint32_t id : 31;
-    float dist;
+    uint64_t dist; // In thousandths
 } RouteDistEntry;
 
 typedef struct
@@ -29,9 +33,7 @@ typedef struct
 
 static inline uint32_t MAP_HASH_FUNC(const int* key, uint32_t capacityExponent)
 {
-    uint32_t a = *(uint32_t*) key;
-    a *= 2654435769U;
-    return a >> (32 - capacityExponent);
+    return hashTopBits(hashFibonacci(*(uint32_t*) key), capacityExponent);
 }
 
 static inline bool MAP_KEY_EQUAL_FUNC(const RouteDistEntry* entry, const int* key)
@@ -65,7 +67,7 @@ MAP_DECLARE_FUNCTIONS_STATIC(routeDist, RouteDistEntry, int, true)
 typedef struct
 {
     int routeId;
-    float dist;
+    uint64_t dist;
 } RouteSortInfo;
 
 typedef struct RouteSortAVL
@@ -115,11 +117,11 @@ static AVL_DECLARE_INSERT_FUNCTION(routeSortAVLInsertId, RouteSortAVL, RouteSort
 
 // Find the element with the 10th highest distance value.
 // This will be used as a threshold to avoid inserting useless elements in the AVL tree
-static float findThresholdSortAVL(RouteSortAVL* tree, float top[10], int* i)
+static uint64_t findThresholdSortAVL(RouteSortAVL* tree, uint64_t top[10], int* i)
 {
     if (tree == NULL || *i >= 10)
     {
-        return 0.0f;
+        return 0;
     }
 
     findThresholdSortAVL(tree->right, top, i);
@@ -150,60 +152,301 @@ static void extractTop10(RouteSortAVL* distSorted, RouteSortAVL** top, int* n)
     extractTop10(distSorted->left, top, n);
 }
 
-static void printTop10(RouteSortAVL* top)
+static void printTop10(RouteSortAVL* top, FILE* out)
 {
     if (top == NULL)
     {
         return;
     }
 
-    printTop10(top->left);
+    printTop10(top->left, out);
 
-    printf("%d;%f\n", top->info.routeId, top->info.dist);
+    fprintf(out, "%d;%f\n", top->info.routeId, top->info.dist / 1000.0);
 
-    printTop10(top->right);
+    printTop10(top->right, out);
 }
 
+// Distances are in fixed-point (thousandths), so the sums are exact and don't depend on the order of the steps.
 typedef struct StepPart
 {
     uint32_t routeId;
-    float distance;
+    uint32_t distance;
 } StepPart;
 
-void computationL(RouteStream* stream)
+#define NUM_PARTITIONS 64
+
+// Each worker reads a part of the file route by route when the file is grouped (see grouped.h),
+// and only keeps the 10 longest routes it has read.
+// Otherwise, it writes the steps of its part in its own partitioner.
+typedef struct LWorker
 {
-    PROFILER_START("Computation L");
+    GroupedReader grouped;
+    RouteSortInfo best[10];
+    uint32_t numBest;
+    // Only created when the file isn't grouped by route (partitions is NULL until then).
+    Partitioner partitioner;
+} LWorker;
 
-    memInit(&routeSortAVLMem, 1 * 1024 * 1024);
+// Same order as routeSortAVLCompareDist.
+static inline bool isShorter(const RouteSortInfo* a, const RouteSortInfo* b)
+{
+    return a->dist < b->dist || (a->dist == b->dist && a->routeId < b->routeId);
+}
 
-    RouteDistMap map;
-    routeDistInit(&map, 1 << 16, 0.7f); // 65536 capacity
+// Adds up the distance of a route, and keeps it if it's one of the 10 longest.
+// Given by the grouped reader, once all the steps of the route have been read.
+static void keepRun(void* w, uint32_t routeId, const void* items, uint32_t numItems)
+{
+    LWorker* worker = w;
+    const StepPart* steps = items;
 
-    Partitioner partitioner;
-    partitionerInit(&partitioner, 64, 65536);
+    RouteSortInfo info = {(int) routeId, 0};
+    for (uint32_t i = 0; i < numItems; ++i)
+    {
+        info.dist += steps[i].distance;
+    }
+
+    if (worker->numBest < 10)
+    {
+        worker->best[worker->numBest++] = info;
+        return;
+    }
+
+    // Replace the shortest one, if this one's longer.
+    uint32_t shortest = 0;
+    for (uint32_t i = 1; i < 10; ++i)
+    {
+        if (isShorter(&worker->best[i], &worker->best[shortest]))
+        {
+            shortest = i;
+        }
+    }
+    if (isShorter(&worker->best[shortest], &info))
+    {
+        worker->best[shortest] = info;
+    }
+}
+
+static void* createWorker()
+{
+    LWorker* worker = malloc(sizeof(LWorker));
+    assert(worker);
+
+    groupedInit(&worker->grouped, sizeof(StepPart), keepRun, worker);
+    worker->numBest = 0;
+    worker->partitioner.partitions = NULL;
+
+    return worker;
+}
+
+static void freeWorker(LWorker* worker)
+{
+    partitionerFree(&worker->partitioner);
+    groupedFree(&worker->grouped);
+    free(worker);
+}
+
+// From now on, steps are written in the partitioner.
+static void usePartitioner(LWorker* worker)
+{
+    worker->grouped.mode = GROUPED_PARTITIONED;
+    if (worker->partitioner.partitions == NULL)
+    {
+        partitionerInit(&worker->partitioner, NUM_PARTITIONS, 65536);
+    }
+}
+
+#define L_FIELDS (ROUTE_ID | DISTANCE_FIXED)
+
+static inline void processStep(void* w, const RouteStep* step)
+{
+    LWorker* worker = w;
+
+    // Steps given one by one can't be read again, so they always go to the partitioner.
+    if (worker->partitioner.partitions == NULL)
+    {
+        usePartitioner(worker);
+    }
+
+    StepPart part = {step->routeId, step->distanceThousandths};
+    partinitionerAddS(&worker->partitioner, step->routeId, part);
+}
+
+// Read the steps by batches: way less calls, and a simple loop over the columns.
+#define BATCH_SIZE 512
+
+static void readPartitioned(LWorker* worker, RouteStream* stream)
+{
+    usePartitioner(worker);
+
+    uint32_t routeIds[BATCH_SIZE];
+    uint32_t distances[BATCH_SIZE];
+    RouteBatch batch = {.routeIds = routeIds, .distancesThousandths = distances, .capacity = BATCH_SIZE};
+
+    uint32_t n;
+    while ((n = rsReadBatch(stream, &batch, L_FIELDS)) > 0)
+    {
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            StepPart item = {routeIds[i], distances[i]};
+            partinitionerAddS(&worker->partitioner, routeIds[i], item);
+        }
+    }
+}
+
+// Reads the part route by route. Returns false when the file isn't grouped by route.
+static bool readGrouped(LWorker* worker, RouteStream* stream)
+{
+    uint32_t routeIds[BATCH_SIZE];
+    uint32_t distances[BATCH_SIZE];
+    RouteBatch batch = {.routeIds = routeIds, .distancesThousandths = distances, .capacity = BATCH_SIZE};
+
+    uint32_t n;
+    while ((n = rsReadBatch(stream, &batch, L_FIELDS)) > 0)
+    {
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            StepPart item = {routeIds[i], distances[i]};
+            if (!groupedAdd(&worker->grouped, routeIds[i], &item))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Forgets the routes kept so far, and reads the part again with the partitioner.
+static void readAgainPartitioned(LWorker* worker)
+{
+    worker->numBest = 0;
+    RouteStream* part = worker->grouped.part;
+    groupedRewind(&worker->grouped);
+    readPartitioned(worker, part);
+}
+
+static void process(void* w, RouteStream* stream)
+{
+    LWorker* worker = w;
+
+    if (!groupedStart(&worker->grouped, stream))
+    {
+        readPartitioned(worker, stream);
+    }
+    else if (!readGrouped(worker, stream))
+    {
+        readAgainPartitioned(worker);
+    }
+}
+
+// When some parts can't be read route by route, all of them are read with the partitioner.
+static void readPartAgain(uint32_t index, void* data)
+{
+    LWorker* worker = ((void**) data)[index];
+    if (worker->grouped.mode == GROUPED_STREAMING)
+    {
+        readAgainPartitioned(worker);
+    }
+    else
+    {
+        usePartitioner(worker);
+    }
+}
 
-    RouteStep step;
-    while (rsRead(stream, &step, ROUTE_ID | DISTANCE))
+// Saves the distance of each route.
+static void saveState(RouteDistMap* map, FILE* stateOut)
+{
+    stateWriteU32(stateOut, map->size);
+    for (uint32_t i = 0; i < map->capacity; ++i)
     {
-        StepPart part = {step.routeId, step.distance};
-        partinitionerAddS(&partitioner, step.routeId, part);
+        if (map->entries[i].occupied)
+        {
+            stateWriteU32(stateOut, map->entries[i].id);
+            stateWriteU64(stateOut, map->entries[i].dist);
+        }
     }
+}
+
+// The saved distances are added to a new worker as if they were steps,
+// split in several parts when they don't fit in a single one.
+static void* loadState(FILE* in, RouteStream* stream)
+{
+    LWorker* worker = createWorker();
+    usePartitioner(worker);
+    Partitioner* partitioner = &worker->partitioner;
 
-    PARTITIONER_ITERATE(&partitioner, StepPart, stepPart)
+    uint32_t numRoutes;
+    bool ok = stateReadU32(in, &numRoutes);
+    for (uint32_t i = 0; i < numRoutes && ok; ++i)
     {
-        RouteDistEntry* entry = routeDistLookup(&map, stepPart->routeId);
-        if (entry == NULL)
+        uint32_t routeId;
+        uint64_t dist;
+        ok = stateReadU32(in, &routeId) && stateReadU64(in, &dist);
+        while (ok && dist > 0)
         {
-            entry = routeDistInsert(&map, stepPart->routeId);
-            entry->dist = 0.0f;
+            StepPart part = {routeId, dist > UINT32_MAX ? UINT32_MAX : (uint32_t) dist};
+            partinitionerAddS(partitioner, routeId, part);
+            dist -= part.distance;
         }
+    }
+
+    if (!ok)
+    {
+        freeWorker(worker);
+        return NULL;
+    }
+    return worker;
+}
+
+static void finish(void** workers, uint32_t numWorkers, const RouteStream* stream, FILE* out, FILE* stateOut)
+{
+    memInitOrReset(&routeSortAVLMem, 1 * 1024 * 1024);
 
-        entry->dist += stepPart->distance;
+    RouteDistMap map;
+    routeDistInit(&map, 1 << 16, MAP_LOAD_FACTOR); // 65536 capacity
+
+    // When every part has been read route by route, the workers already have their 10 longest routes,
+    // and the first one takes the routes cut by the end of a part. Else, read everything with the partitioner.
+    GroupedReader* readers[MAX_THREADS];
+    for (uint32_t w = 0; w < numWorkers; ++w)
+    {
+        readers[w] = &((LWorker*) workers[w])->grouped;
+    }
+    bool grouped = groupedFinish(readers, numWorkers, keepRun, workers[0]);
+    if (!grouped)
+    {
+        parallelRun(numWorkers, readPartAgain, workers);
+    }
+
+    // Read the same partition of every worker, one after the other.
+    for (uint32_t i = 0; i < NUM_PARTITIONS && !grouped; ++i)
+    {
+        for (uint32_t w = 0; w < numWorkers; ++w)
+        {
+            Partitioner* partitioner = &((LWorker*) workers[w])->partitioner;
+            partitionLoad(partitioner, &partitioner->partitions[i]);
+            PARTITION_ITERATE(partitioner, &partitioner->partitions[i], StepPart, stepPart)
+            {
+                RouteDistEntry* entry = routeDistLookup(&map, stepPart->routeId);
+                if (entry == NULL)
+                {
+                    entry = routeDistInsert(&map, stepPart->routeId);
+                    entry->dist = 0;
+                }
+
+                entry->dist += stepPart->distance;
+            }
+            partitionRelease(partitioner, &partitioner->partitions[i]);
+        }
     }
 
+    if (stateOut != NULL)
+    {
+        saveState(&map, stateOut);
+    }
 
     RouteSortAVL* distSorted = NULL;
-    float threshold = 0.0f;
+    uint64_t threshold = 0;
     uint32_t num = 0;
     for (uint32_t i = 0; i < map.capacity; ++i)
     {
@@ -215,28 +458,44 @@ void computationL(RouteStream* stream)
             num++;
             if (num >= 10)
             {
-                float top[10]; int ti = 0;
+                uint64_t top[10]; int ti = 0;
                 threshold = findThresholdSortAVL(distSorted, top, &ti);
             }
         }
     }
 
+    if (grouped)
+    {
+        for (uint32_t w = 0; w < numWorkers; ++w)
+        {
+            LWorker* worker = workers[w];
+            for (uint32_t i = 0; i < worker->numBest; ++i)
+            {
+                distSorted = routeSortAVLInsertDist(distSorted, &worker->best[i], NULL, NULL);
+            }
+        }
+    }
+
     RouteSortAVL* top = NULL;
     int n = 0;
     extractTop10(distSorted, &top, &n);
-    printTop10(top);
+    printTop10(top, out);
 
     routeDistFree(&map);
-    partitionerFree(&partitioner);
-    memFree(&routeSortAVLMem);
-
-    PROFILER_END();
+    for (uint32_t w = 0; w < numWorkers; ++w)
+    {
+        freeWorker(workers[w]);
+    }
 }
 
+const Computation computationL = {"Computation L", L_FIELDS, createWorker, process, processStep, finish, loadState};
+
 #else
-void computationL(struct RouteStream* s)
+static void* createWorker()
 {
     fprintf(stderr, "Cannot use computation L without experimental algorithms enabled!\n");
     exit(9);
 }
+
+const Computation computationL = {"Computation L", ROUTE_ID | DISTANCE_FIXED, createWorker, NULL, NULL, NULL};
 #endif
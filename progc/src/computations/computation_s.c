@@ -10,17 +10,19 @@
 #include "computations.h"
 #include "route.h"
 #include "profile.h"
+#include "state.h"
 
+// All distances are in thousandths (see DISTANCE_FIXED): the sums are exact, so they're the same
+// no matter how the file is split between threads, and in which order the trees are merged.
 typedef struct Travel
 {
     uint32_t id;
-    float min;
-    float max;
-    // In the first step, where we read the file, this will be the sum of all the distances.
-    // Once we have finished this, in the calcAvg function, this will be the average distance.
-    // This approach saves some memory instead of having two different fields (sum and avg).
-    float sumOrAvg;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
     uint32_t nSteps;
+    // Only calculated once everything is read, in the calcAvg function.
+    double avg;
 } Travel;
 
 // The AVL containing all the travels, before we sort them.
@@ -66,9 +68,8 @@ static void calcAvg(TravelAVL* tree)
         return;
     }
 
-    // At this moment, avgOrSum contains the sum of all distances.
-    // Transform it into an average.
-    tree->t.sumOrAvg = tree->t.sumOrAvg / tree->t.nSteps;
+    // Back to actual kilometers.
+    tree->t.avg = (double) tree->t.sum / tree->t.nSteps / 1000.0;
 
     calcAvg(tree->left);
     calcAvg(tree->right);
@@ -87,12 +88,13 @@ static TravelSortAVL* travelSortAVLCreate(Travel* travel)
 
 static int travelSortAVLCompare(TravelSortAVL* tree, Travel* travel)
 {
-    float deltaMaxMin = (tree->t->max - tree->t->min) - (travel->max - travel->min);
-    if (deltaMaxMin < 0)
+    uint32_t deltaTree = tree->t->max - tree->t->min;
+    uint32_t deltaTravel = travel->max - travel->min;
+    if (deltaTree < deltaTravel)
     {
         return -1;
     }
-    else if (deltaMaxMin > 0)
+    else if (deltaTree > deltaTravel)
     {
         return 1;
     }
@@ -105,23 +107,23 @@ static int travelSortAVLCompare(TravelSortAVL* tree, Travel* travel)
 static AVL_DECLARE_INSERT_FUNCTION(travelSortAVLInsert, TravelSortAVL, Travel,
                                    (AVLCreateFunc) &travelSortAVLCreate, (AVLCompareValueFunc) &travelSortAVLCompare)
 
-static void printTop50(TravelSortAVL* tr, int* n)
+static void printTop50(TravelSortAVL* tr, int* n, FILE* out)
 {
     if (tr == NULL || *n >= 50)
     {
         return;
     }
 
-    printTop50(tr->right, n);
+    printTop50(tr->right, n, out);
 
     if (*n < 50)
     {
         *n += 1;
-        printf("%d;%d;%f;%f;%f;%f\n", *n,
-               tr->t->id, tr->t->min, tr->t->sumOrAvg, tr->t->max, tr->t->max - tr->t->min);
+        fprintf(out, "%d;%d;%f;%f;%f;%f\n", *n,
+               tr->t->id, tr->t->min / 1000.0, tr->t->avg, tr->t->max / 1000.0, (tr->t->max - tr->t->min) / 1000.0);
     }
 
-    printTop50(tr->left, n);
+    printTop50(tr->left, n, out);
 }
 
 static void transferToSortAVL(TravelAVL* travels, TravelSortAVL** sorted)
@@ -150,59 +152,193 @@ static void freeAVL(AVL* tree)
     free(tree);
 }
 
-void computationS(RouteStream* stream)
+// Adds all the travels of the other tree to the travels tree, merging the ones already present.
+static void mergeTravels(TravelAVL** travels, TravelAVL* other)
 {
-    PROFILER_START("Computation S");
+    if (other == NULL)
+    {
+        return;
+    }
+
+    TravelAVL* found = travelAVLLookup(*travels, &other->t);
+    if (found == NULL)
+    {
+        *travels = travelAVLInsert(*travels, &other->t, NULL, NULL);
+    }
+    else
+    {
+        if (found->t.max < other->t.max)
+        {
+            found->t.max = other->t.max;
+        }
+        if (found->t.min > other->t.min)
+        {
+            found->t.min = other->t.min;
+        }
+        found->t.sum += other->t.sum;
+        found->t.nSteps += other->t.nSteps;
+    }
+
+    mergeTravels(travels, other->left);
+    mergeTravels(travels, other->right);
+}
+
+// Each worker has its own tree of travels, merged at the end.
+typedef struct SWorker
+{
+    TravelAVL* travels;
+} SWorker;
+
+static void* createWorker()
+{
+    SWorker* worker = malloc(sizeof(SWorker));
+    assert(worker);
 
-    TravelAVL* travels = NULL;
+    worker->travels = NULL;
 
+    return worker;
+}
+
+#define S_FIELDS (ROUTE_ID | DISTANCE_FIXED)
+
+static void processStep(void* w, const RouteStep* step)
+{
+    SWorker* worker = w;
+
+    Travel tra = {.id = step->routeId};
+    TravelAVL* found = travelAVLLookup(worker->travels, &tra);
+    if (found == NULL)
+    {
+        // Register the travel for the first time, with the same distances for
+        // max, min and sum since there's only one step at the moment.
+        tra.max = step->distanceThousandths;
+        tra.min = step->distanceThousandths;
+        tra.sum = step->distanceThousandths; // Sum of all the distances.
+        tra.nSteps = 1;
+
+        worker->travels = travelAVLInsert(worker->travels, &tra, NULL, NULL);
+    }
+    else
+    {
+        // Update the values of the travel: update the max and min, and add to the sum.
+        if (found->t.max < step->distanceThousandths)
+        {
+            found->t.max = step->distanceThousandths;
+        }
+        if (found->t.min > step->distanceThousandths)
+        {
+            found->t.min = step->distanceThousandths;
+        }
+        found->t.sum += step->distanceThousandths; // Add to the sum of all distances.
+        found->t.nSteps += 1;
+    }
+}
+
+static void process(void* worker, RouteStream* stream)
+{
     RouteStep step;
-    while (rsRead(stream, &step, ROUTE_ID | DISTANCE))
+    while (rsRead(stream, &step, S_FIELDS))
     {
-        Travel tra = {.id = step.routeId};
-        TravelAVL* found = travelAVLLookup(travels, &tra);
-        if (found == NULL)
+        processStep(worker, &step);
+    }
+}
+
+static uint32_t countTravels(TravelAVL* tree)
+{
+    return tree == NULL ? 0 : 1 + countTravels(tree->left) + countTravels(tree->right);
+}
+
+static void writeTravels(TravelAVL* tree, FILE* stateOut)
+{
+    if (tree == NULL)
+    {
+        return;
+    }
+
+    stateWriteU32(stateOut, tree->t.id);
+    stateWriteU32(stateOut, tree->t.min);
+    stateWriteU32(stateOut, tree->t.max);
+    stateWriteU64(stateOut, tree->t.sum);
+    stateWriteU32(stateOut, tree->t.nSteps);
+
+    writeTravels(tree->left, stateOut);
+    writeTravels(tree->right, stateOut);
+}
+
+// The saved travels are put back in the tree of a new worker, with their sums.
+static void* loadState(FILE* in, RouteStream* stream)
+{
+    SWorker* worker = createWorker();
+
+    uint32_t numTravels;
+    bool ok = stateReadU32(in, &numTravels);
+    for (uint32_t i = 0; i < numTravels && ok; ++i)
+    {
+        Travel tra = {0};
+        ok = stateReadU32(in, &tra.id)
+             && stateReadU32(in, &tra.min) && stateReadU32(in, &tra.max)
+             && stateReadU64(in, &tra.sum) && stateReadU32(in, &tra.nSteps);
+        if (ok)
+        {
+            worker->travels = travelAVLInsert(worker->travels, &tra, NULL, NULL);
+        }
+    }
+
+    if (!ok)
+    {
+        if (worker->travels != NULL)
         {
-            // Register the travel for the first time, with the same distances for
-            // max, min and sum since there's only one step at the moment.
-            tra.max = step.distance;
-            tra.min = step.distance;
-            tra.sumOrAvg = step.distance; // Sum of all the distances.
-            tra.nSteps = 1;
-
-            travels = travelAVLInsert(travels, &tra, NULL, NULL);
+            freeAVL((AVL*) worker->travels);
         }
-        else
+        free(worker);
+        return NULL;
+    }
+    return worker;
+}
+
+static void finish(void** workers, uint32_t numWorkers, const RouteStream* stream, FILE* out, FILE* stateOut)
+{
+    TravelAVL* travels = ((SWorker*) workers[0])->travels;
+    for (uint32_t w = 1; w < numWorkers; ++w)
+    {
+        TravelAVL* other = ((SWorker*) workers[w])->travels;
+        mergeTravels(&travels, other);
+        if (other != NULL)
         {
-            // Update the values of the travel: update the max and min, and add to the sum.
-            if (found->t.max < step.distance)
-            {
-                found->t.max = step.distance;
-            }
-            if (found->t.min > step.distance)
-            {
-                found->t.min = step.distance;
-            }
-            found->t.sumOrAvg += step.distance; // Add to the sum of all distances.
-            found->t.nSteps += 1;
+            freeAVL((AVL*) other);
         }
     }
 
+    // Save the sums, the averages are calculated again each time.
+    if (stateOut != NULL)
+    {
+        stateWriteU32(stateOut, countTravels(travels));
+        writeTravels(travels, stateOut);
+    }
+
     TravelSortAVL* sorted = NULL;
     int n = 0;
 
-    // Transform the sum into an average.
+    // Calculate the averages from the sums.
     calcAvg(travels);
     // Put all the elements from the travel AVL the sorting AVL (which sorts by max-min).
     transferToSortAVL(travels, &sorted);
     // Print the 50 highest elements from the sorting AVL.
-    printTop50(sorted, &n);
+    printTop50(sorted, &n, out);
 
     // Free all the AVLs.
-    freeAVL((AVL*) sorted);
-    freeAVL((AVL*) travels);
-
-    PROFILER_END();
+    if (sorted != NULL)
+    {
+        freeAVL((AVL*) sorted);
+        freeAVL((AVL*) travels);
+    }
+    for (uint32_t w = 0; w < numWorkers; ++w)
+    {
+        free(workers[w]);
+    }
 }
 
+const Computation computationS = {"Computation S", S_FIELDS, createWorker, process, processStep, finish,
+                                  loadState};
+
 #endif
@@ -11,24 +11,40 @@
 #include "route.h"
 #include "profile.h"
 #include "map.h"
+#include "hash.h"
 #include "mem_alloc.h"
 #include "partition.h"
+#include "grouped.h"
+#include "parallel.h"
+#include "state.h"
 
 static MemArena travelSortAVLMem;
 
+// All distances are in thousandths (see DISTANCE_FIXED), like in computation_s.c: the sums are exact,
+// so they're the same no matter how the file is read (threads, partitions, grouped or not, saved state...).
 typedef struct TravelEntry
 {
     bool occupied : 1;
     uint32_t id : 31;
-    float min;
-    float max;
+    uint32_t min;
+    uint32_t max;
     // In the first step, where we read the file, this will be the sum of all the distances.
-    // Once we have finished this, in the calcAvg function, this will be the average distance.
+    // Once we have finished this, in the calcAvg function, this will be the average distance (in kilometers).
     // This approach saves some memory instead of having two different fields (sum and avg).
-    float sumOrAvg;
+    union
+    {
+        uint64_t sum;
+        double avg;
+    };
     uint32_t nSteps;
 } TravelEntry;
 
+// Back to actual kilometers, the same way as computation_s.c.
+static inline double averageDistance(uint64_t sum, uint32_t nSteps)
+{
+    return (double) sum / nSteps / 1000.0;
+}
+
 typedef struct
 {
     MAP_HEADER(TravelEntry)
@@ -38,9 +54,7 @@ typedef struct
 
 static inline uint32_t MAP_HASH_FUNC(const int* key, uint32_t capacityExponent)
 {
-    uint32_t a = *(uint32_t*) key;
-    a *= 2654435769U;
-    return a >> (32 - capacityExponent);
+    return hashTopBits(hashFibonacci(*(uint32_t*) key), capacityExponent);
 }
 
 static inline bool MAP_KEY_EQUAL_FUNC(const TravelEntry* entry, const int* key)
@@ -76,11 +90,11 @@ typedef struct TravelSortAVL
 {
     AVL_HEADER(TravelSortAVL)
 
-    float deltaMaxMin;
+    uint32_t deltaMaxMin;
     uint32_t id;
-    float min;
-    float max;
-    float avg; // Copies the travel entry from the map.
+    uint32_t min;
+    uint32_t max;
+    double avg; // Copies the travel entry from the map.
 } TravelSortAVL;
 
 static TravelSortAVL* travelSortAVLCreate(TravelEntry* travel)
@@ -91,7 +105,7 @@ static TravelSortAVL* travelSortAVLCreate(TravelEntry* travel)
     tree->id = travel->id;
     tree->min = travel->min;
     tree->max = travel->max;
-    tree->avg = travel->sumOrAvg;
+    tree->avg = travel->avg;
     tree->deltaMaxMin = travel->max - travel->min;
 
     return tree;
@@ -99,12 +113,12 @@ static TravelSortAVL* travelSortAVLCreate(TravelEntry* travel)
 
 static int travelSortAVLCompare(TravelSortAVL* tree, TravelEntry* travel)
 {
-    float deltaMaxMin = tree->deltaMaxMin - (travel->max - travel->min);
-    if (deltaMaxMin < 0)
+    uint32_t deltaTravel = travel->max - travel->min;
+    if (tree->deltaMaxMin < deltaTravel)
     {
         return -1;
     }
-    else if (deltaMaxMin > 0)
+    else if (tree->deltaMaxMin > deltaTravel)
     {
         return 1;
     }
@@ -119,11 +133,11 @@ static AVL_DECLARE_INSERT_FUNCTION(travelSortAVLInsert, TravelSortAVL, TravelEnt
 
 // Find the element with the 50th highest max-min value.
 // This will be used as a threshold to avoid inserting useless elements in the AVL tree
-static float findThresholdSortAVL(TravelSortAVL* tree, float top[50], int* i)
+static uint32_t findThresholdSortAVL(TravelSortAVL* tree, uint32_t top[50], int* i)
 {
     if (tree == NULL || *i >= 50)
     {
-        return 0.0f;
+        return 0;
     }
 
     findThresholdSortAVL(tree->right, top, i);
@@ -140,7 +154,7 @@ static float findThresholdSortAVL(TravelSortAVL* tree, float top[50], int* i)
 static void calcAvgAndSort(TravelMap* map, TravelSortAVL** sorted)
 {
     uint32_t num = 0;
-    float threshold = -1e18f;
+    uint32_t threshold = 0;
 
     for (uint32_t i = 0; i < map->capacity; ++i)
     {
@@ -150,15 +164,15 @@ static void calcAvgAndSort(TravelMap* map, TravelSortAVL** sorted)
         // so we have high chances that this condition fails first.
         if ((entry->max - entry->min) >= threshold && entry->occupied)
         {
-            // At this moment, avgOrSum contains the sum of all distances.
+            // At this moment, the entry contains the sum of all distances.
             // Transform it into an average.
-            entry->sumOrAvg = entry->sumOrAvg / entry->nSteps;
+            entry->avg = averageDistance(entry->sum, entry->nSteps);
             *sorted = travelSortAVLInsert(*sorted, entry, NULL, NULL);
 
             num++;
             if (num >= 50)
             {
-                float top[50];
+                uint32_t top[50];
                 int ti = 0;
                 threshold = findThresholdSortAVL(*sorted, top, &ti);
             }
@@ -166,87 +180,404 @@ static void calcAvgAndSort(TravelMap* map, TravelSortAVL** sorted)
     }
 }
 
-static void printTop50(TravelSortAVL* tr, int* n)
+static void printTop50(TravelSortAVL* tr, int* n, FILE* out)
 {
     if (tr == NULL || *n >= 50)
     {
         return;
     }
 
-    printTop50(tr->right, n);
+    printTop50(tr->right, n, out);
 
     if (*n < 50)
     {
         *n += 1;
-        printf("%d;%d;%f;%f;%f;%f\n", *n,
-               tr->id, tr->min, tr->avg, tr->max, tr->max - tr->min);
+        fprintf(out, "%d;%d;%f;%f;%f;%f\n", *n,
+               tr->id, tr->min / 1000.0, tr->avg, tr->max / 1000.0, tr->deltaMaxMin / 1000.0);
     }
 
-    printTop50(tr->left, n);
+    printTop50(tr->left, n, out);
 }
 
 typedef struct RoutePart
 {
     uint32_t id;
-    float dist;
+    uint32_t dist; // In thousandths
 } RoutePart;
 
-void computationS(RouteStream* stream)
-{
-    PROFILER_START("Computation S (Experimental!)");
+#define NUM_PARTITIONS 64
 
-    memInit(&travelSortAVLMem, 1 * 1024 * 1024);
-
-    TravelMap travels;
-    travelMapInit(&travels, 1024, 0.7f);
+// The number of travels printed.
+#define NUM_BEST 50
 
+// Each worker reads a part of the file route by route when the file is grouped (see grouped.h),
+// and only keeps the 50 travels with the highest max-min it has read.
+// Otherwise, it writes the steps of its part of the file in its own partitioner.
+typedef struct SWorker
+{
+    GroupedReader grouped;
+    // The travels kept when reading route by route, with their average distance (not the sum).
+    TravelEntry best[NUM_BEST];
+    uint32_t numBest;
+    // Only created when the file isn't grouped by route (partitions is NULL until then).
     Partitioner partitioner;
-    partitionerInit(&partitioner, 64, sizeof(RoutePart) * 10000);
+    // The travels saved by a previous run (see loadState), added before any step.
+    // Only the sums are saved, so they can't be turned back into steps.
+    TravelEntry* saved;
+    uint32_t numSaved;
+} SWorker;
+
+// Same order as travelSortAVLCompare.
+static inline bool isSmaller(const TravelEntry* a, const TravelEntry* b)
+{
+    uint32_t deltaA = a->max - a->min;
+    uint32_t deltaB = b->max - b->min;
+    return deltaA < deltaB || (deltaA == deltaB && a->id < b->id);
+}
+
+// Computes the stats of a travel, just like the steps read from the partitions in finish,
+// and keeps it if it's one of the 50 with the highest max-min.
+// Given by the grouped reader, once all the steps of the route have been read.
+static void keepRun(void* w, uint32_t routeId, const void* items, uint32_t numItems)
+{
+    SWorker* worker = w;
+    const RoutePart* steps = items;
+
+    TravelEntry travel = {.occupied = true, .id = routeId};
+    travel.min = steps[0].dist;
+    travel.max = steps[0].dist;
+    uint64_t sum = steps[0].dist;
+    for (uint32_t i = 1; i < numItems; ++i)
+    {
+        if (travel.max < steps[i].dist)
+        {
+            travel.max = steps[i].dist;
+        }
+        if (travel.min > steps[i].dist)
+        {
+            travel.min = steps[i].dist;
+        }
+        sum += steps[i].dist;
+    }
+    travel.nSteps = numItems;
+    travel.avg = averageDistance(sum, travel.nSteps);
 
-    RouteStep step;
-    while (rsRead(stream, &step, ROUTE_ID | DISTANCE))
+    if (worker->numBest < NUM_BEST)
     {
-        RoutePart item = {step.routeId, step.distance};
-        partinitionerAddS(&partitioner, step.routeId, item);
+        worker->best[worker->numBest++] = travel;
+        return;
     }
 
-    PARTITIONER_ITERATE(&partitioner, RoutePart, stepPart)
+    // Replace the smallest one, if this one's bigger.
+    uint32_t smallest = 0;
+    for (uint32_t i = 1; i < NUM_BEST; ++i)
     {
-        TravelEntry* travel = travelMapLookup(&travels, stepPart->id);
-        if (travel == NULL)
+        if (isSmaller(&worker->best[i], &worker->best[smallest]))
         {
-            travel = travelMapInsert(&travels, stepPart->id);
-            travel->max = stepPart->dist;
-            travel->min = stepPart->dist;
-            travel->sumOrAvg = stepPart->dist; // Sum of all the distances
-            travel->nSteps = 1;
+            smallest = i;
         }
-        else
+    }
+    if (isSmaller(&worker->best[smallest], &travel))
+    {
+        worker->best[smallest] = travel;
+    }
+}
+
+static void* createWorker()
+{
+    SWorker* worker = malloc(sizeof(SWorker));
+    assert(worker);
+
+    groupedInit(&worker->grouped, sizeof(RoutePart), keepRun, worker);
+    worker->numBest = 0;
+    worker->partitioner.partitions = NULL;
+    worker->saved = NULL;
+    worker->numSaved = 0;
+
+    return worker;
+}
+
+static void freeWorker(SWorker* worker)
+{
+    partitionerFree(&worker->partitioner);
+    groupedFree(&worker->grouped);
+    free(worker->saved);
+    free(worker);
+}
+
+// From now on, steps are written in the partitioner.
+static void usePartitioner(SWorker* worker)
+{
+    worker->grouped.mode = GROUPED_PARTITIONED;
+    if (worker->partitioner.partitions == NULL)
+    {
+        partitionerInit(&worker->partitioner, NUM_PARTITIONS, sizeof(RoutePart) * 10000);
+    }
+}
+
+#define S_FIELDS (ROUTE_ID | DISTANCE_FIXED)
+
+static inline void processStep(void* w, const RouteStep* step)
+{
+    SWorker* worker = w;
+
+    // Steps given one by one can't be read again, so they always go to the partitioner.
+    if (worker->partitioner.partitions == NULL)
+    {
+        usePartitioner(worker);
+    }
+
+    RoutePart item = {step->routeId, step->distanceThousandths};
+    partinitionerAddS(&worker->partitioner, step->routeId, item);
+}
+
+// Read the steps by batches: way less calls, and a simple loop over the columns.
+#define BATCH_SIZE 512
+
+// Reads the part route by route. Returns false when the file isn't grouped by route.
+static bool readGrouped(SWorker* worker, RouteStream* stream)
+{
+    uint32_t routeIds[BATCH_SIZE];
+    uint32_t distances[BATCH_SIZE];
+    RouteBatch batch = {.routeIds = routeIds, .distancesThousandths = distances, .capacity = BATCH_SIZE};
+
+    uint32_t n;
+    while ((n = rsReadBatch(stream, &batch, S_FIELDS)) > 0)
+    {
+        for (uint32_t i = 0; i < n; ++i)
         {
-            if (travel->max < stepPart->dist)
+            RoutePart item = {routeIds[i], distances[i]};
+            if (!groupedAdd(&worker->grouped, routeIds[i], &item))
             {
-                travel->max = stepPart->dist;
+                return false;
             }
-            if (travel->min > stepPart->dist)
+        }
+    }
+    return true;
+}
+
+static void readPartitioned(SWorker* worker, RouteStream* stream)
+{
+    usePartitioner(worker);
+
+    uint32_t routeIds[BATCH_SIZE];
+    uint32_t distances[BATCH_SIZE];
+    RouteBatch batch = {.routeIds = routeIds, .distancesThousandths = distances, .capacity = BATCH_SIZE};
+
+    uint32_t n;
+    while ((n = rsReadBatch(stream, &batch, S_FIELDS)) > 0)
+    {
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            RoutePart item = {routeIds[i], distances[i]};
+            partinitionerAddS(&worker->partitioner, routeIds[i], item);
+        }
+    }
+}
+
+// Forgets the travels kept so far, and reads the part again with the partitioner.
+static void readAgainPartitioned(SWorker* worker)
+{
+    worker->numBest = 0;
+    RouteStream* part = worker->grouped.part;
+    groupedRewind(&worker->grouped);
+    readPartitioned(worker, part);
+}
+
+static void process(void* w, RouteStream* stream)
+{
+    SWorker* worker = w;
+
+    if (!groupedStart(&worker->grouped, stream))
+    {
+        readPartitioned(worker, stream);
+    }
+    else if (!readGrouped(worker, stream))
+    {
+        readAgainPartitioned(worker);
+    }
+}
+
+// When some parts can't be read route by route, all of them are read with the partitioner.
+static void readPartAgain(uint32_t index, void* data)
+{
+    SWorker* worker = ((void**) data)[index];
+    if (worker->grouped.mode == GROUPED_STREAMING)
+    {
+        readAgainPartitioned(worker);
+    }
+    else
+    {
+        usePartitioner(worker);
+    }
+}
+
+// Saves every travel, before the sums are turned into averages.
+static void saveState(TravelMap* travels, FILE* stateOut)
+{
+    stateWriteU32(stateOut, travels->size);
+    for (uint32_t i = 0; i < travels->capacity; ++i)
+    {
+        TravelEntry* entry = &travels->entries[i];
+        if (entry->occupied)
+        {
+            stateWriteU32(stateOut, entry->id);
+            stateWriteU32(stateOut, entry->min);
+            stateWriteU32(stateOut, entry->max);
+            stateWriteU64(stateOut, entry->sum);
+            stateWriteU32(stateOut, entry->nSteps);
+        }
+    }
+}
+
+static void* loadState(FILE* in, RouteStream* stream)
+{
+    uint32_t numSaved;
+    if (!stateReadU32(in, &numSaved))
+    {
+        return NULL;
+    }
+
+    SWorker* worker = createWorker();
+    usePartitioner(worker);
+    worker->saved = malloc((numSaved > 0 ? numSaved : 1) * sizeof(TravelEntry));
+    assert(worker->saved);
+
+    bool ok = true;
+    for (uint32_t i = 0; i < numSaved && ok; ++i)
+    {
+        uint32_t id;
+        TravelEntry* entry = &worker->saved[i];
+        ok = stateReadU32(in, &id)
+             && stateReadU32(in, &entry->min) && stateReadU32(in, &entry->max)
+             && stateReadU64(in, &entry->sum) && stateReadU32(in, &entry->nSteps);
+        entry->id = id;
+    }
+    worker->numSaved = numSaved;
+
+    if (!ok)
+    {
+        freeWorker(worker);
+        return NULL;
+    }
+    return worker;
+}
+
+static void finish(void** workers, uint32_t numWorkers, const RouteStream* stream, FILE* out, FILE* stateOut)
+{
+    memInitOrReset(&travelSortAVLMem, 1 * 1024 * 1024);
+
+    // When every part has been read route by route, the workers already have their 50 best travels,
+    // and the first one takes the routes cut by the end of a part. Else, read everything with the partitioner.
+    GroupedReader* readers[MAX_THREADS];
+    for (uint32_t w = 0; w < numWorkers; ++w)
+    {
+        readers[w] = &((SWorker*) workers[w])->grouped;
+    }
+    bool grouped = groupedFinish(readers, numWorkers, keepRun, workers[0]);
+    if (!grouped)
+    {
+        parallelRun(numWorkers, readPartAgain, workers);
+    }
+
+    // Make room for all the saved travels at once: they were saved in the order of the map of the previous run,
+    // and inserting them in that order in a smaller map would pile them up in the same few places.
+    uint32_t numSaved = 0;
+    for (uint32_t w = 0; w < numWorkers; ++w)
+    {
+        numSaved += ((SWorker*) workers[w])->numSaved;
+    }
+    uint32_t capacity = 1024;
+    while ((uint32_t) (capacity * MAP_LOAD_FACTOR) <= numSaved + 1)
+    {
+        capacity *= 2;
+    }
+
+    TravelMap travels;
+    travelMapInit(&travels, capacity, MAP_LOAD_FACTOR);
+
+    // Start with the saved travels, they come before any step we've read.
+    for (uint32_t w = 0; w < numWorkers; ++w)
+    {
+        SWorker* worker = workers[w];
+        for (uint32_t i = 0; i < worker->numSaved; ++i)
+        {
+            TravelEntry* saved = &worker->saved[i];
+            TravelEntry* travel = travelMapInsert(&travels, saved->id);
+            travel->min = saved->min;
+            travel->max = saved->max;
+            travel->sum = saved->sum;
+            travel->nSteps = saved->nSteps;
+        }
+    }
+
+    // Read the same partition of every worker, one after the other: workers are in file order,
+    // so the steps are summed up in the same order as with a single worker.
+    for (uint32_t i = 0; i < NUM_PARTITIONS && !grouped; ++i)
+    {
+        for (uint32_t w = 0; w < numWorkers; ++w)
+        {
+            Partitioner* partitioner = &((SWorker*) workers[w])->partitioner;
+            partitionLoad(partitioner, &partitioner->partitions[i]);
+            PARTITION_ITERATE(partitioner, &partitioner->partitions[i], RoutePart, stepPart)
             {
-                travel->min = stepPart->dist;
+                TravelEntry* travel = travelMapLookup(&travels, stepPart->id);
+                if (travel == NULL)
+                {
+                    travel = travelMapInsert(&travels, stepPart->id);
+                    travel->max = stepPart->dist;
+                    travel->min = stepPart->dist;
+                    travel->sum = stepPart->dist; // Sum of all the distances
+                    travel->nSteps = 1;
+                }
+                else
+                {
+                    if (travel->max < stepPart->dist)
+                    {
+                        travel->max = stepPart->dist;
+                    }
+                    if (travel->min > stepPart->dist)
+                    {
+                        travel->min = stepPart->dist;
+                    }
+                    travel->sum += stepPart->dist; // Add to the sum of all distances.
+                    travel->nSteps += 1;
+                }
             }
-            travel->sumOrAvg += stepPart->dist; // Add to the sum of all distances.
-            travel->nSteps += 1;
+            partitionRelease(partitioner, &partitioner->partitions[i]);
         }
     }
 
+    if (stateOut != NULL)
+    {
+        saveState(&travels, stateOut);
+    }
+
     TravelSortAVL* sorted = NULL;
     int n = 0;
 
     calcAvgAndSort(&travels, &sorted);
-    printTop50(sorted, &n);
+    if (grouped)
+    {
+        for (uint32_t w = 0; w < numWorkers; ++w)
+        {
+            SWorker* worker = workers[w];
+            for (uint32_t i = 0; i < worker->numBest; ++i)
+            {
+                sorted = travelSortAVLInsert(sorted, &worker->best[i], NULL, NULL);
+            }
+        }
+    }
+    printTop50(sorted, &n, out);
 
     travelMapFree(&travels);
-    partitionerFree(&partitioner);
-    memFree(&travelSortAVLMem);
-
-    PROFILER_END();
+    for (uint32_t w = 0; w < numWorkers; ++w)
+    {
+        freeWorker(workers[w]);
+    }
 }
 
+const Computation computationS = {"Computation S (Experimental!)", S_FIELDS, createWorker, process, processStep,
+                                   finish, loadState};
+
 #endif
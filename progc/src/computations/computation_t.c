@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "profile.h"
+#include "state.h"
 
 // AVL with all the ids
 typedef struct IdAVL
@@ -51,16 +52,24 @@ static int idAVLCompare(IdAVL* tree, uint32_t* id)
 AVL_DECLARE_FUNCTIONS_STATIC(idAVL, IdAVL, const uint32_t,
                              (AVLCreateFunc) &idAVLCreate, (AVLCompareValueFunc) &idAVLCompare)
 
-static TownAVL* townAVLCreate(const char* townName)
+// A town name read from the file, which isn't null-terminated.
+typedef struct
 {
-    int chars = strlen(townName) + 1;
+    const char* str;
+    uint32_t length;
+} MeasuredString;
+
+static TownAVL* townAVLCreate(const MeasuredString* townName)
+{
+    int chars = townName->length + 1;
 
     // Create the tree using malloc, and alloc enough space for the name string.
     TownAVL* tree = malloc(sizeof(TownAVL) + chars);
     assert(tree);
 
     AVL_INIT(tree);
-    strcpy(tree->name, townName);
+    memcpy(tree->name, townName->str, townName->length);
+    tree->name[townName->length] = '\0';
     tree->passed = 0;
     tree->firstTown = 0;
     tree->routeIds = NULL;
@@ -68,12 +77,22 @@ static TownAVL* townAVLCreate(const char* townName)
     return tree;
 }
 
-static int townAVLCompare(TownAVL* tree, const char* townName)
+// Same as strcmp, but with a string that isn't null-terminated.
+static int townAVLCompare(TownAVL* tree, const MeasuredString* townName)
 {
-    return strcmp(tree->name, townName);
+    int cmp = strncmp(tree->name, townName->str, townName->length);
+    if (cmp != 0)
+    {
+        return cmp;
+    }
+    else
+    {
+        // Both strings share the same first characters, the longest one is the greatest.
+        return tree->name[townName->length] == '\0' ? 0 : 1;
+    }
 }
 
-AVL_DECLARE_FUNCTIONS_STATIC(townAVL, TownAVL, const char,
+AVL_DECLARE_FUNCTIONS_STATIC(townAVL, TownAVL, const MeasuredString,
                              (AVLCreateFunc) &townAVLCreate, (AVLCompareValueFunc) &townAVLCompare)
 
 static TownSortAVL* townSortAvlCreate(TownAVL* townNode)
@@ -141,19 +160,19 @@ static void createTop10(TownSortAVL* topTowns, int* n, TownSortAVL** sorted)
     createTop10(topTowns->left, n, sorted);
 }
 
-static void printTowns(TownSortAVL* t)
+static void printTowns(TownSortAVL* t, FILE* out)
 {
     if (t->left != NULL)
-        printTowns(t->left);
-    printf("%s;%d;%d\n", t->value->name, t->value->passed, t->value->firstTown);
+        printTowns(t->left, out);
+    fprintf(out, "%s;%d;%d\n", t->value->name, t->value->passed, t->value->firstTown);
     if (t->right != NULL)
-        printTowns(t->right);
+        printTowns(t->right, out);
 }
 
-static void insertTown(TownAVL** towns, const RouteStep* step, const char* townName, bool townA)
+static void insertTown(TownAVL** towns, const RouteStep* step, const MeasuredString townName, bool townA)
 {
     TownAVL* townNode;
-    *towns = townAVLInsert(*towns, townName, &townNode, NULL);
+    *towns = townAVLInsert(*towns, &townName, &townNode, NULL);
 
     bool seenId;
     townNode->routeIds = idAVLInsert(townNode->routeIds, &step->routeId, NULL, &seenId);
@@ -196,17 +215,176 @@ static void freeTownAVL(TownAVL* tree)
     free(tree);
 }
 
-void computationT(RouteStream* stream)
+// Adds all the route ids of the ids tree to the routes of the town.
+static void mergeRouteIds(TownAVL* town, IdAVL* ids)
 {
-    PROFILER_START("Computation T");
+    if (ids == NULL)
+    {
+        return;
+    }
 
-    TownAVL* towns = NULL;
+    bool seenId;
+    town->routeIds = idAVLInsert(town->routeIds, &ids->id, NULL, &seenId);
+    if (!seenId)
+    {
+        town->passed++;
+    }
+
+    mergeRouteIds(town, ids->left);
+    mergeRouteIds(town, ids->right);
+}
+
+// Adds all the towns of the other tree to the towns tree, along with their stats.
+static void mergeTowns(TownAVL** towns, TownAVL* other)
+{
+    if (other == NULL)
+    {
+        return;
+    }
 
+    MeasuredString name = {other->name, strlen(other->name)};
+    TownAVL* townNode;
+    *towns = townAVLInsert(*towns, &name, &townNode, NULL);
+
+    townNode->firstTown += other->firstTown;
+    mergeRouteIds(townNode, other->routeIds);
+
+    mergeTowns(towns, other->left);
+    mergeTowns(towns, other->right);
+}
+
+// Each worker has its own tree of towns, merged at the end.
+typedef struct TWorker
+{
+    TownAVL* towns;
+} TWorker;
+
+static void* createWorker()
+{
+    TWorker* worker = malloc(sizeof(TWorker));
+    assert(worker);
+
+    worker->towns = NULL;
+
+    return worker;
+}
+
+#define T_FIELDS (ROUTE_ID | STEP_ID | TOWN_A | TOWN_B)
+
+static void processStep(void* w, const RouteStep* step)
+{
+    TWorker* worker = w;
+
+    insertTown(&worker->towns, step, (MeasuredString){step->townA, step->townALen}, true);
+    insertTown(&worker->towns, step, (MeasuredString){step->townB, step->townBLen}, false);
+}
+
+static void process(void* worker, RouteStream* stream)
+{
     RouteStep step;
-    while (rsRead(stream, &step, ROUTE_ID | STEP_ID | TOWN_A | TOWN_B))
+    while (rsRead(stream, &step, T_FIELDS))
     {
-        insertTown(&towns, &step, step.townA, true);
-        insertTown(&towns, &step, step.townB, false);
+        processStep(worker, &step);
+    }
+}
+
+static uint32_t countNodes(AVL* tree)
+{
+    return tree == NULL ? 0 : 1 + countNodes(tree->left) + countNodes(tree->right);
+}
+
+static void writeRouteIds(IdAVL* ids, FILE* stateOut)
+{
+    if (ids == NULL)
+    {
+        return;
+    }
+
+    stateWriteU32(stateOut, ids->id);
+    writeRouteIds(ids->left, stateOut);
+    writeRouteIds(ids->right, stateOut);
+}
+
+// Saves every town with its name, the number of routes starting there, and the ids of the routes passing by.
+static void writeTowns(TownAVL* tree, FILE* stateOut)
+{
+    if (tree == NULL)
+    {
+        return;
+    }
+
+    stateWriteStr(stateOut, tree->name, strlen(tree->name));
+    stateWriteU32(stateOut, tree->firstTown);
+    stateWriteU32(stateOut, countNodes((AVL*) tree->routeIds));
+    writeRouteIds(tree->routeIds, stateOut);
+
+    writeTowns(tree->left, stateOut);
+    writeTowns(tree->right, stateOut);
+}
+
+static void* loadState(FILE* in, RouteStream* stream)
+{
+    TWorker* worker = createWorker();
+    char* name = malloc(STATE_MAX_STR);
+    assert(name);
+
+    uint32_t numTowns;
+    bool ok = stateReadU32(in, &numTowns);
+    for (uint32_t i = 0; i < numTowns && ok; ++i)
+    {
+        uint32_t nameLen, firstTown, numIds;
+        ok = stateReadStr(in, name, STATE_MAX_STR, &nameLen)
+             && stateReadU32(in, &firstTown) && stateReadU32(in, &numIds);
+        if (!ok)
+        {
+            break;
+        }
+
+        TownAVL* townNode;
+        MeasuredString townName = {name, nameLen};
+        worker->towns = townAVLInsert(worker->towns, &townName, &townNode, NULL);
+        townNode->firstTown += (int) firstTown;
+
+        for (uint32_t j = 0; j < numIds && ok; ++j)
+        {
+            uint32_t id;
+            ok = stateReadU32(in, &id);
+            if (ok)
+            {
+                bool seenId;
+                townNode->routeIds = idAVLInsert(townNode->routeIds, &id, NULL, &seenId);
+                if (!seenId)
+                {
+                    townNode->passed++;
+                }
+            }
+        }
+    }
+
+    free(name);
+    if (!ok)
+    {
+        freeTownAVL(worker->towns);
+        free(worker);
+        return NULL;
+    }
+    return worker;
+}
+
+static void finish(void** workers, uint32_t numWorkers, const RouteStream* stream, FILE* out, FILE* stateOut)
+{
+    TownAVL* towns = ((TWorker*) workers[0])->towns;
+    for (uint32_t w = 1; w < numWorkers; ++w)
+    {
+        TownAVL* other = ((TWorker*) workers[w])->towns;
+        mergeTowns(&towns, other);
+        freeTownAVL(other);
+    }
+
+    if (stateOut != NULL)
+    {
+        stateWriteU32(stateOut, countNodes((AVL*) towns));
+        writeTowns(towns, stateOut);
     }
 
     int n = 0;
@@ -215,13 +393,21 @@ void computationT(RouteStream* stream)
 
     sortTownsByPasses(towns, &sorted);
     createTop10(sorted, &n, &top10);
-    printTowns(top10);
+    if (top10 != NULL)
+    {
+        printTowns(top10, out);
+    }
 
     freeTownAVL(towns);
     freeAVLBasic((AVL*) sorted);
     freeAVLBasic((AVL*) top10);
-
-    PROFILER_END();
+    for (uint32_t w = 0; w < numWorkers; ++w)
+    {
+        free(workers[w]);
+    }
 }
 
+const Computation computationT = {"Computation T", T_FIELDS, createWorker, process, processStep, finish,
+                                  loadState};
+
 #endif
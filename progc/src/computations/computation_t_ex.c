@@ -13,15 +13,21 @@
 #include "mem_alloc.h"
 #include "profile.h"
 #include "map.h"
+#include "hash.h"
 #include "partition.h"
+#include "grouped.h"
+#include "state.h"
+#include "parallel.h"
 
 /*
  * [EXPERIMENTAL!] Computation T implementation
  * Featuring:
  * - The experimental map structure!
+ * - Town ids given by the stream!
  * - The memory arena allocator!
  * - The partitioner!
  * - Weird linked lists of arrays!
+ * - No partitioner at all when the file is grouped by route! (see grouped.h)
  */
 
 // A high number of partition is better for this comptuation, as the RouteMapEntry
@@ -29,10 +35,9 @@
 #define NUM_PARTITIONS 128
 
 // The memory arenas used for each kind of structure.
-// Currently those are global variables, should these be passed to the create functions instead?
+// The TownNodeList structures are allocated by the threads reading the partitions, so each one has its own arena,
+// given to the create functions.
 static MemArena townSortAVLMem; // Used to allocate TownSortAVL nodes.
-static MemArena townNodeListMem; // Used to allocate the TownNodeList structures (only the ones we need to allocate).
-static MemArena townStringsMem; // Used to allocate all the strings for towns.
 
 // Can be changed to uint16_t for 2x more towns stored, but limits the total amount of towns to 65536.
 typedef uint32_t TownNodeId;
@@ -53,9 +58,9 @@ static void tnListInit(TownNodeList* list)
     list->next = NULL;
 }
 
-static TownNodeList* tnListCreate()
+static TownNodeList* tnListCreate(MemArena* arena)
 {
-    TownNodeList* list = memAlloc(&townNodeListMem, sizeof(TownNodeList));
+    TownNodeList* list = memAlloc(arena, sizeof(TownNodeList));
     assert(list);
 
     tnListInit(list);
@@ -63,15 +68,15 @@ static TownNodeList* tnListCreate()
     return list;
 }
 
-static void tnListAdd(TownNodeList* list, TownNodeId id)
+static void tnListAdd(TownNodeList* list, TownNodeId id, MemArena* arena)
 {
     if (list->size == TN_LIST_NUM - 1)
     {
         if (!list->next)
         {
-            list->next = tnListCreate();
+            list->next = tnListCreate(arena);
         }
-        tnListAdd(list->next, id);
+        tnListAdd(list->next, id, arena);
     }
     else
     {
@@ -119,13 +124,10 @@ typedef struct
 
 static inline uint32_t MAP_HASH_FUNC(const int* key, uint32_t capacityExponent)
 {
-    uint32_t a = *(uint32_t*) key;
-    // We're reading partitioned routes that are distributed according to a modulo hash function.
-    // Dividing by the number of partitions preserves a unique number for each route, which leads
-    // to a better distribution. (and honestly i'm not entirely sure why it's so inefficient without...)
-    a /= NUM_PARTITIONS;
-    a *= 2654435769U;
-    return a >> (32 - capacityExponent);
+    // We're reading partitioned routes: all routes of a partition have the same lowest bits
+    // (see partinitionerAdd), so their ids are spaced by NUM_PARTITIONS.
+    // Dividing by the number of partitions gives back dense ids, which is what Fibonacci hashing likes best.
+    return hashTopBits(hashFibonacci(*(uint32_t*) key / NUM_PARTITIONS), capacityExponent);
 }
 
 static inline bool MAP_KEY_EQUAL_FUNC(const RouteEntry* entry, const int* key)
@@ -154,120 +156,18 @@ MAP_DECLARE_FUNCTIONS_STATIC(routeMap, RouteEntry, int, true)
 #undef CURRENT_MAP_TYPE
 
 /*
- * Town Map: Links each town id to its town name.
- */
-
-typedef struct
-{
-    char* str;
-    uint32_t length;
-} MeasuredString;
-
-typedef struct TownMapEntry
-{
-    TownNodeId id;
-    bool occupied;
-    uint16_t length;
-    char* name;
-} TownMapEntry;
-
-typedef struct
-{
-    MAP_HEADER(TownMapEntry)
-} TownMap;
-
-#define CURRENT_MAP_TYPE() TownMap
-
-static inline uint32_t MAP_HASH_FUNC(MeasuredString* key, uint32_t capacityExponent)
-{
-    char* str = key->str;
-
-    uint32_t hash = 0;
-    while (*str != '\0')
-    {
-        hash *= 31;
-        hash += *str;
-        str++;
-    }
-    return hash;
-}
-
-static inline bool MAP_KEY_EQUAL_FUNC(const TownMapEntry* entry, MeasuredString* key)
-{
-    if (key->length == entry->length)
-    {
-        return memcmp(key->str, entry->name, key->length) == 0;
-    }
-    else
-    {
-        return false;
-    }
-}
-
-static inline bool MAP_GET_OCCUPIED_FUNC(const TownMapEntry* entry)
-{
-    return entry->occupied;
-}
-
-static inline void MAP_MARK_OCCUPIED_FUNC(TownMapEntry* entry, MeasuredString* key)
-{
-    size_t length = key->length;
-    size_t size = length + 1;
-
-    assert(size <= UINT16_MAX);
-
-    entry->name = memAlloc(&townStringsMem, size);
-    memcpy(entry->name, key->str, size);
-
-    entry->length = (uint16_t) length;
-    entry->occupied = true;
-}
-
-static inline MeasuredString* MAP_GET_KEY_PTR_FUNC(TownMapEntry* entry, MapKeyScratch scratch)
-{
-    MeasuredString* str = (MeasuredString*) scratch;
-    str->str = entry->name;
-    str->length = entry->length;
-    return str;
-}
-
-MAP_DECLARE_FUNCTIONS_STATIC(townMap, TownMapEntry, MeasuredString, true)
-
-#undef CURRENT_MAP_TYPE
-
-/*
- * Town Stats, and its array
+ * Town Stats
  */
 
+// The stats of a town, found using its id given by the stream (see STRING_IDS).
 typedef struct TownStats
 {
-    char* name;
+    const char* name;
+    uint32_t length;
     uint32_t passed;
     uint32_t firstTown;
 } TownStats;
 
-typedef struct TownStatsArray
-{
-    TownStats* elements;
-    uint32_t capacity;
-} TownStatsArray;
-
-static void townStatsArrayInit(TownStatsArray* array)
-{
-    array->capacity = 8192;
-    array->elements = malloc(sizeof(TownStats) * array->capacity);
-}
-
-static void townStatsArrayPut(TownStatsArray* array, TownNodeId index, const TownStats stats)
-{
-    if (index >= array->capacity)
-    {
-        array->capacity *= 2;
-        array->elements = realloc(array->elements, sizeof(TownStats) * array->capacity);
-    }
-    array->elements[index] = stats;
-}
-
 /*
  * Town Sort AVL
  */
@@ -299,13 +199,13 @@ static int townSortAVLComparePassed(TownSortAVL* tree, TownStats* entry)
     }
     else
     {
-        return strcmp(tree->stats.name, entry->name);
+        return compareNames(tree->stats.name, tree->stats.length, entry->name, entry->length);
     }
 }
 
 static int townSortAVLCompareName(TownSortAVL* tree, TownStats* townNode)
 {
-    return strcmp(tree->stats.name, townNode->name);
+    return compareNames(tree->stats.name, tree->stats.length, townNode->name, townNode->length);
 }
 
 AVL_DECLARE_INSERT_FUNCTION(townSortAVLInsertPassed, TownSortAVL, TownStats,
@@ -322,42 +222,66 @@ typedef struct StepPart
     TownNodeId townB;
 } StepPart;
 
-static inline TownNodeId registerTown(const RouteStep* step, TownMap* towns, TownStatsArray* statArray,
-                                      MeasuredString townName, TownNodeId* idCounter)
+// Each worker reads a part of the file, route by route when the file is grouped (see grouped.h),
+// or with its own partitioner otherwise.
+// Town ids are given by the stream, and are the same for all workers.
+typedef struct TWorker
+{
+    // The number of routes starting in each town, indexed by town id.
+    // Grows as new ids appear.
+    uint32_t* firstTown;
+    // When reading route by route: the number of routes going through each town, indexed by town id.
+    uint32_t* passed;
+    // The number of the last route that went through each town, so towns are counted once per route.
+    uint32_t* lastRun;
+    uint32_t runNumber;
+    uint32_t capacity; // Of all three arrays
+    GroupedReader grouped;
+    // Writes all the steps into partitions, grouping them into
+    // batches of steps with the same route id.
+    // This improves performance a LOT by reducing cache misses, as the algorithm will
+    // access the same routes more frequently, instead of systematically
+    // accessing a random area in the RAM.
+    // Only created when the file isn't grouped by route (partitions is NULL until then).
+    Partitioner partitioner;
+} TWorker;
+
+static void growTowns(TWorker* worker, TownNodeId id)
 {
-    TownMapEntry* townNode = townMapLookup(towns, townName);
-    if (townNode == NULL)
+    uint32_t newCapacity = worker->capacity;
+    while (newCapacity <= id)
     {
-        townNode = townMapInsert(towns, townName);
-        townNode->id = (*idCounter)++;
-        townStatsArrayPut(statArray, townNode->id, (TownStats){townNode->name, 0, 0});
+        newCapacity *= 2;
     }
 
-    if (step->stepId == 1 && townName.str == step->townA)
+    uint32_t** arrays[] = {&worker->firstTown, &worker->passed, &worker->lastRun};
+    for (uint32_t i = 0; i < 3; ++i)
     {
-        statArray->elements[townNode->id].firstTown++;
+        *arrays[i] = realloc(*arrays[i], sizeof(uint32_t) * newCapacity);
+        assert(*arrays[i]);
+        memset(*arrays[i] + worker->capacity, 0, sizeof(uint32_t) * (newCapacity - worker->capacity));
     }
-
-    return townNode->id;
+    worker->capacity = newCapacity;
 }
 
-static inline void incrementTownPassed(RouteEntry* entry, TownStatsArray* statArray, TownNodeId townId)
+static inline void incrementTownPassed(RouteEntry* entry, uint32_t* passed, TownNodeId townId, MemArena* arena)
 {
-    TownStats* stats = &statArray->elements[townId];
-
     if (!tnListSearch(&entry->towns, townId))
     {
-        stats->passed++;
-        tnListAdd(&entry->towns, townId);
+        passed[townId]++;
+        tnListAdd(&entry->towns, townId, arena);
     }
 }
 
-static void sortTowns(TownStatsArray* stats, TownNodeId num, TownSortAVL** sorted)
+static void sortTowns(TownStats* stats, uint32_t num, TownSortAVL** sorted)
 {
     for (uint32_t i = 0; i < num; ++i)
     {
-        TownStats* stat = &stats->elements[i];
-        *sorted = townSortAVLInsertPassed(*sorted, stat, NULL, NULL);
+        // Drivers share the same ids as towns, skip them. (Every town is passed at least once.)
+        if (stats[i].passed != 0)
+        {
+            *sorted = townSortAVLInsertPassed(*sorted, &stats[i], NULL, NULL);
+        }
     }
 }
 
@@ -379,115 +303,502 @@ static void extractTop10(TownSortAVL* sorted, TownSortAVL** top, int* n)
     extractTop10(sorted->left, top, n);
 }
 
-static void printTop10(TownSortAVL* top)
+static void printTop10(TownSortAVL* top, FILE* out)
 {
     if (top == NULL)
     {
         return;
     }
 
-    printTop10(top->left);
-    printf("%s;%d;%d\n", top->stats.name, top->stats.passed, top->stats.firstTown);
-    printTop10(top->right);
+    printTop10(top->left, out);
+    fprintf(out, "%.*s;%d;%d\n", (int) top->stats.length, top->stats.name, top->stats.passed, top->stats.firstTown);
+    printTop10(top->right, out);
+}
+
+// Counts all the towns of a route, once each.
+// Given by the grouped reader, once all the steps of the route have been read.
+static void countRun(void* w, uint32_t routeId, const void* items, uint32_t numItems)
+{
+    TWorker* worker = w;
+    const StepPart* steps = items;
+
+    uint32_t run = ++worker->runNumber;
+    for (uint32_t i = 0; i < numItems; ++i)
+    {
+        TownNodeId towns[2] = {steps[i].townA, steps[i].townB};
+        for (uint32_t t = 0; t < 2; ++t)
+        {
+            if (worker->lastRun[towns[t]] != run)
+            {
+                worker->lastRun[towns[t]] = run;
+                worker->passed[towns[t]]++;
+            }
+        }
+    }
+}
+
+static void* createWorker()
+{
+    TWorker* worker = malloc(sizeof(TWorker));
+    assert(worker);
+
+    worker->capacity = 8192;
+    worker->firstTown = calloc(worker->capacity, sizeof(uint32_t));
+    worker->passed = calloc(worker->capacity, sizeof(uint32_t));
+    worker->lastRun = calloc(worker->capacity, sizeof(uint32_t));
+    assert(worker->firstTown && worker->passed && worker->lastRun);
+    worker->runNumber = 0;
+    groupedInit(&worker->grouped, sizeof(StepPart), countRun, worker);
+    worker->partitioner.partitions = NULL;
+
+    return worker;
+}
+
+static void freeWorker(TWorker* worker)
+{
+    partitionerFree(&worker->partitioner);
+    groupedFree(&worker->grouped);
+    free(worker->firstTown);
+    free(worker->passed);
+    free(worker->lastRun);
+    free(worker);
+}
+
+// From now on, steps are written in the partitioner.
+static void usePartitioner(TWorker* worker)
+{
+    worker->grouped.mode = GROUPED_PARTITIONED;
+    if (worker->partitioner.partitions == NULL)
+    {
+        // More partitions is efficent for this computation as the route map is very large.
+        partitionerInit(&worker->partitioner, NUM_PARTITIONS, 65536);
+    }
+}
+
+#define T_FIELDS (ROUTE_ID | STEP_ID | TOWN_A | TOWN_B | STRING_IDS)
+
+static inline void countFirstTown(TWorker* worker, const RouteStep* step)
+{
+    if (step->stepId == 1)
+    {
+        if (step->townAId >= worker->capacity)
+        {
+            growTowns(worker, step->townAId);
+        }
+        worker->firstTown[step->townAId]++;
+    }
+}
+
+static inline void processStep(void* w, const RouteStep* step)
+{
+    TWorker* worker = w;
+
+    // Steps given one by one can't be read again, so they always go to the partitioner.
+    if (worker->partitioner.partitions == NULL)
+    {
+        usePartitioner(worker);
+    }
+
+    countFirstTown(worker, step);
+
+    StepPart part = {step->routeId, step->townAId, step->townBId};
+    partinitionerAddS(&worker->partitioner, step->routeId, part);
+}
+
+static void readPartitioned(TWorker* worker, RouteStream* stream)
+{
+    usePartitioner(worker);
+
+    RouteStep step;
+    while (rsRead(stream, &step, T_FIELDS))
+    {
+        processStep(worker, &step);
+    }
+}
+
+// Reads the part route by route. Returns false when the file isn't grouped by route,
+// and the part must be read again with the partitioner.
+static bool readGrouped(TWorker* worker, RouteStream* stream)
+{
+    RouteStep step;
+    while (rsRead(stream, &step, T_FIELDS))
+    {
+        countFirstTown(worker, &step);
+
+        TownNodeId maxId = step.townAId > step.townBId ? step.townAId : step.townBId;
+        if (maxId >= worker->capacity)
+        {
+            growTowns(worker, maxId);
+        }
+
+        StepPart part = {step.routeId, step.townAId, step.townBId};
+        if (!groupedAdd(&worker->grouped, step.routeId, &part))
+        {
+            return false;
+        }
+    }
+    return true;
 }
 
-void computationT(RouteStream* stream)
+// Forgets everything read route by route, and reads the part again with the partitioner.
+static void readAgainPartitioned(TWorker* worker)
 {
-    PROFILER_START("Computation T (Experimental!)");
+    memset(worker->firstTown, 0, sizeof(uint32_t) * worker->capacity);
+    memset(worker->passed, 0, sizeof(uint32_t) * worker->capacity);
+    RouteStream* part = worker->grouped.part;
+    groupedRewind(&worker->grouped);
+    readPartitioned(worker, part);
+}
 
-    memInit(&townSortAVLMem, 256 * 1024);
-    memInit(&townNodeListMem, 1 * 1024 * 1024);
-    memInitEx(&townStringsMem, 512 * 1024, 1);
+static void process(void* w, RouteStream* stream)
+{
+    TWorker* worker = w;
 
-    // Stores all the towns travelled in each route.
+    if (!groupedStart(&worker->grouped, stream))
+    {
+        readPartitioned(worker, stream);
+    }
+    else if (!readGrouped(worker, stream))
+    {
+        readAgainPartitioned(worker);
+    }
+}
+
+// When some parts can't be read route by route, all of them are read with the partitioner.
+static void readPartAgain(uint32_t index, void* data)
+{
+    TWorker* worker = ((void**) data)[index];
+    if (worker->grouped.mode == GROUPED_STREAMING)
+    {
+        readAgainPartitioned(worker);
+    }
+    else
+    {
+        usePartitioner(worker);
+    }
+}
+
+/*
+ * State (see --state)
+ */
+
+// Saves the number of routes starting in each town, written as (id, count) pairs.
+static void saveFirstTowns(TownStats* stats, uint32_t numTowns, FILE* stateOut)
+{
+    uint32_t numFirst = 0;
+    for (uint32_t i = 0; i < numTowns; ++i)
+    {
+        numFirst += stats[i].firstTown != 0;
+    }
+
+    stateWriteU32(stateOut, numFirst);
+    for (uint32_t i = 0; i < numTowns; ++i)
+    {
+        if (stats[i].firstTown != 0)
+        {
+            stateWriteU32(stateOut, i);
+            stateWriteU32(stateOut, stats[i].firstTown);
+        }
+    }
+}
+
+// Saves the towns visited by every route in the map, with their number first.
+// A count of 0 ends the list.
+static void saveRouteTowns(RouteMap* routes, FILE* stateOut)
+{
+    for (uint32_t i = 0; i < routes->capacity; ++i)
+    {
+        RouteEntry* entry = &routes->entries[i];
+        if (!entry->occupied)
+        {
+            continue;
+        }
+
+        uint32_t count = 0;
+        for (TownNodeList* list = &entry->towns; list; list = list->next)
+        {
+            count += list->size;
+        }
+
+        stateWriteU32(stateOut, count);
+        stateWriteU32(stateOut, entry->id);
+        for (TownNodeList* list = &entry->towns; list; list = list->next)
+        {
+            _Static_assert(sizeof(TownNodeId) == sizeof(uint32_t), "Town ids are saved as uint32_t");
+            stateWriteU32s(stateOut, list->nodes, list->size);
+        }
+    }
+}
+
+// The saved towns are added to a new worker as steps going from the town to itself.
+static void* loadState(FILE* in, RouteStream* stream)
+{
+    uint32_t numIds;
+    uint32_t* newIds = stateReadStrings(in, stream, &numIds);
+    if (newIds == NULL)
+    {
+        return NULL;
+    }
+
+    TWorker* worker = createWorker();
+    usePartitioner(worker);
+
+    uint32_t numFirst;
+    bool ok = stateReadU32(in, &numFirst);
+    for (uint32_t i = 0; i < numFirst && ok; ++i)
+    {
+        uint32_t townId, count;
+        ok = stateReadU32(in, &townId) && stateReadU32(in, &count) && townId < numIds;
+        if (ok)
+        {
+            townId = newIds[townId];
+            if (townId >= worker->capacity)
+            {
+                growTowns(worker, townId);
+            }
+            worker->firstTown[townId] += count;
+        }
+    }
+
+    uint32_t count;
+    ok = ok && stateReadU32(in, &count);
+    while (ok && count > 0)
+    {
+        uint32_t routeId;
+        ok = stateReadU32(in, &routeId);
+        for (uint32_t i = 0; i < count && ok; ++i)
+        {
+            uint32_t townId;
+            ok = stateReadU32(in, &townId) && townId < numIds;
+            if (ok)
+            {
+                StepPart part = {routeId, newIds[townId], newIds[townId]};
+                partinitionerAddS(&worker->partitioner, routeId, part);
+            }
+        }
+        ok = ok && stateReadU32(in, &count);
+    }
+
+    free(newIds);
+    if (!ok)
+    {
+        freeWorker(worker);
+        return NULL;
+    }
+    return worker;
+}
+
+// Partitions are read by multiple threads, taking them one by one, biggest first.
+// A route is always in the same partition, so each thread has its own route map
+// and counts the routes going through each town on its own.
+typedef struct TThread
+{
+    // Stores all the towns travelled in each route of the partition.
     RouteMap routes;
-    // Stores the identifiers of the towns, and their name as strings.
-    TownMap towns;
-    // Stores the passed/first-passed stats of each town.
-    // It's an array, but it's clearly accessed like a map, because the ids are sequential.
-    TownStatsArray stats;
-    // Writes all the steps into partitions, grouping them into
-    // batches of steps with the same route id.
-    // This improves performance a LOT by reducing cache misses, as the algorithm will
-    // access the same routes more frequently, instead of systematically
-    // accessing a random area in the RAM.
-    Partitioner partitioner;
-    // Just tracks the current town id, and increments it for the next town we encounter.
-    TownNodeId idCounter = 0;
+    // The number of routes going through each town, by town id.
+    uint32_t* passed;
+    // Used to allocate the TownNodeList structures (only the ones we need to allocate).
+    MemArena townNodeListMem;
+} TThread;
+
+typedef struct TPhase2
+{
+    void** workers;
+    uint32_t numWorkers;
+    TThread* threads;
+    uint32_t order[NUM_PARTITIONS];
+    FILE* stateOut;
+    ParallelLock stateLock;
+} TPhase2;
+
+static void readPartition(uint32_t threadIndex, uint32_t item, void* data)
+{
+    TPhase2* task = data;
+    TThread* thread = &task->threads[threadIndex];
+    uint32_t i = task->order[item];
+
+    // Routes can be spread over multiple workers, so we read the same partition of all workers at once.
+    for (uint32_t w = 0; w < task->numWorkers; ++w)
+    {
+        Partitioner* partitioner = &((TWorker*) task->workers[w])->partitioner;
+        partitionLoad(partitioner, &partitioner->partitions[i]);
+        PARTITION_ITERATE(partitioner, &partitioner->partitions[i], StepPart, stepPart)
+        {
+            RouteEntry* entry = routeMapLookup(&thread->routes, stepPart->routeId);
+            if (entry == NULL)
+            {
+                entry = routeMapInsert(&thread->routes, stepPart->routeId);
+                tnListInit(&entry->towns);
+            }
+
+            incrementTownPassed(entry, thread->passed, stepPart->townA, &thread->townNodeListMem);
+            incrementTownPassed(entry, thread->passed, stepPart->townB, &thread->townNodeListMem);
+        }
+        partitionRelease(partitioner, &partitioner->partitions[i]);
+    }
+
+    if (task->stateOut != NULL)
+    {
+        parallelLock(&task->stateLock);
+        saveRouteTowns(&thread->routes, task->stateOut);
+        parallelUnlock(&task->stateLock);
+    }
+
+    // The lists of the routes aren't needed anymore: their memory can be used by the next partition.
+    routeMapClear(&thread->routes, -1);
+    memReset(&thread->townNodeListMem);
+}
 
-    // Start with a low capacity that grows as needed.
-    routeMapInit(&routes, 256, 0.75f);
-    // A lower load factor is better for this map as strings are really just stored
-    // in another memory region, and the key bottleneck is comparing strings; we must
-    // then reduce the number of collisions as much as possible.
-    townMapInit(&towns, 8192, 0.5f);
-    // More partitions is efficent for this computation as the route map is very large.
-    partitionerInit(&partitioner, NUM_PARTITIONS, 65536);
-    townStatsArrayInit(&stats);
+static void finish(void** workers, uint32_t numWorkers, const RouteStream* stream, FILE* out, FILE* stateOut)
+{
+    memInitOrReset(&townSortAVLMem, 256 * 1024);
+
+    // The stats of all towns, by their id.
+    uint32_t numTowns = rsNumStrings(stream);
 
+    // When all parts have been read route by route, we just need to count the routes cut by the end of a part.
+    // They're counted by the first worker, which needs room for all towns.
+    bool grouped;
     {
-        PROFILER_START("Write to partitions + town registering");
+        PROFILER_START("Check the routes read by each part");
+
+        TWorker* firstWorker = workers[0];
+        if (numTowns > firstWorker->capacity)
+        {
+            growTowns(firstWorker, numTowns - 1);
+        }
 
-        RouteStep step;
-        while (rsRead(stream, &step, ROUTE_ID | STEP_ID | TOWN_A | TOWN_B))
+        GroupedReader* readers[MAX_THREADS];
+        for (uint32_t w = 0; w < numWorkers; ++w)
+        {
+            readers[w] = &((TWorker*) workers[w])->grouped;
+        }
+        grouped = groupedFinish(readers, numWorkers, countRun, firstWorker);
+        if (!grouped)
         {
-            StepPart part = {step.routeId};
-            part.townA = registerTown(&step, &towns, &stats, (MeasuredString){step.townA, step.townALen}, &idCounter);
-            part.townB = registerTown(&step, &towns, &stats, (MeasuredString){step.townB, step.townBLen}, &idCounter);
-            partinitionerAddS(&partitioner, step.routeId, part);
+            parallelRun(numWorkers, readPartAgain, workers);
         }
 
         PROFILER_END();
     }
 
+    TownStats* stats = calloc(numTowns > 0 ? numTowns : 1, sizeof(TownStats));
+    assert(stats);
+
+    {
+        PROFILER_START("Merge towns");
+
+        for (uint32_t i = 0; i < numTowns; ++i)
+        {
+            stats[i].name = rsGetString(stream, i, &stats[i].length);
+        }
+
+        for (uint32_t w = 0; w < numWorkers; ++w)
+        {
+            TWorker* worker = workers[w];
+            uint32_t count = worker->capacity < numTowns ? worker->capacity : numTowns;
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                stats[i].firstTown += worker->firstTown[i];
+            }
+        }
+
+        if (stateOut != NULL)
+        {
+            stateWriteStrings(stateOut, stream);
+            saveFirstTowns(stats, numTowns, stateOut);
+        }
+
+        PROFILER_END();
+    }
+
+    if (grouped)
+    {
+        PROFILER_START("Add up the routes of all parts");
+
+        for (uint32_t w = 0; w < numWorkers; ++w)
+        {
+            TWorker* worker = workers[w];
+            uint32_t count = worker->capacity < numTowns ? worker->capacity : numTowns;
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                stats[i].passed += worker->passed[i];
+            }
+        }
+
+        PROFILER_END();
+    }
+    else
     {
         PROFILER_START("Read partitioned entries");
 
-        for (uint32_t i = 0; i < partitioner.numPartitions; ++i)
+        // The file has been read by numWorkers threads, use as many to read the partitions.
+        TPhase2 task = {workers, numWorkers, calloc(numWorkers, sizeof(TThread)), .stateOut = stateOut};
+        assert(task.threads);
+        for (uint32_t t = 0; t < numWorkers; ++t)
+        {
+            // Start with a low capacity that grows as needed.
+            routeMapInit(&task.threads[t].routes, 256, MAP_LOAD_FACTOR);
+            task.threads[t].passed = calloc(numTowns > 0 ? numTowns : 1, sizeof(uint32_t));
+            assert(task.threads[t].passed);
+            memInit(&task.threads[t].townNodeListMem, 1 * 1024 * 1024);
+        }
+
+        Partitioner* partitioners[MAX_THREADS];
+        for (uint32_t w = 0; w < numWorkers; ++w)
         {
-            Partition* partition = &partitioner.partitions[i];
+            partitioners[w] = &((TWorker*) workers[w])->partitioner;
+        }
+        partitionOrderBySize(partitioners, numWorkers, task.order);
 
-            PARTITION_ITERATE(&partitioner, partition, StepPart, stepPart)
+        parallelFor(numWorkers, NUM_PARTITIONS, readPartition, &task);
+
+        // Add up the counts of every thread.
+        for (uint32_t t = 0; t < numWorkers; ++t)
+        {
+            TThread* thread = &task.threads[t];
+            for (uint32_t i = 0; i < numTowns; ++i)
             {
-                RouteEntry* entry = routeMapLookup(&routes, stepPart->routeId);
-                if (entry == NULL)
-                {
-                    entry = routeMapInsert(&routes, stepPart->routeId);
-                    tnListInit(&entry->towns);
-                }
-
-                incrementTownPassed(entry, &stats, stepPart->townA);
-                incrementTownPassed(entry, &stats, stepPart->townB);
+                stats[i].passed += thread->passed[i];
             }
 
-            routeMapClear(&routes, -1);
+            routeMapFree(&thread->routes);
+            free(thread->passed);
+            memFree(&thread->townNodeListMem);
         }
+        free(task.threads);
 
         PROFILER_END();
     }
 
+    if (stateOut != NULL)
+    {
+        // The end of the routes. (There's none when every part has been read route by route, as that only happens
+        // without states, or with nothing read at all.)
+        stateWriteU32(stateOut, 0);
+    }
+
     TownSortAVL *sorted = NULL, *top = NULL;
     int n = 0;
 
     {
         PROFILER_START("Sort towns");
 
-        sortTowns(&stats, idCounter, &sorted);
+        sortTowns(stats, numTowns, &sorted);
         extractTop10(sorted, &top, &n);
 
         PROFILER_END();
     }
-    printTop10(top);
-
-    routeMapFree(&routes);
-    townMapFree(&towns);
-    partitionerFree(&partitioner);
-    free(stats.elements);
-    memFree(&townSortAVLMem);
-    memFree(&townNodeListMem);
-    memFree(&townStringsMem);
+    printTop10(top, out);
 
-    PROFILER_END();
+    for (uint32_t w = 0; w < numWorkers; ++w)
+    {
+        freeWorker(workers[w]);
+    }
+    free(stats);
 }
 
+const Computation computationT = {"Computation T (Experimental!)", T_FIELDS, createWorker, process, processStep,
+                                   finish, loadState};
+
 #endif
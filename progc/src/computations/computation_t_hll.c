@@ -0,0 +1,317 @@
+#include "computations.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "route.h"
+#include "profile.h"
+#include "sketch.h"
+#include "state.h"
+
+// Computation T with HyperLogLog (--hll)
+// ------------------------
+// The exact computations remember every route going through every town (or every town of every route),
+// just to count each route once per town. Here, each town only has a HyperLogLog (see sketch.h) of the route ids
+// going through it: a few KB per town, no matter how big the file is.
+// Adding the same route twice doesn't change anything, so we don't even need to know where routes begin and end.
+// The number of routes starting in each town is still exact.
+
+static uint32_t hllPrecision = 10;
+
+void tHllConfigure(uint32_t precision)
+{
+    assert(precision >= HLL_MIN_PRECISION && precision <= HLL_MAX_PRECISION);
+
+    hllPrecision = precision;
+}
+
+// The towns of a worker, by their id given by the stream (see STRING_IDS).
+typedef struct THllWorker
+{
+    // The registers of each town, one after the other: 2^precision bytes per town.
+    uint8_t* registers;
+    // The number of routes starting in each town.
+    uint32_t* firstTown;
+    uint32_t capacity; // In towns
+    uint32_t precision;
+} THllWorker;
+
+static THllWorker* createWorkerWith(uint32_t precision)
+{
+    THllWorker* worker = malloc(sizeof(THllWorker));
+    assert(worker);
+
+    worker->precision = precision;
+    worker->capacity = 1024;
+    worker->registers = calloc((size_t) worker->capacity << precision, 1);
+    worker->firstTown = calloc(worker->capacity, sizeof(uint32_t));
+    assert(worker->registers && worker->firstTown);
+
+    return worker;
+}
+
+static void* createWorker()
+{
+    return createWorkerWith(hllPrecision);
+}
+
+static void freeWorker(THllWorker* worker)
+{
+    free(worker->registers);
+    free(worker->firstTown);
+    free(worker);
+}
+
+static void growTowns(THllWorker* worker, uint32_t id)
+{
+    uint32_t newCapacity = worker->capacity;
+    while (newCapacity <= id)
+    {
+        newCapacity *= 2;
+    }
+
+    size_t oldBytes = (size_t) worker->capacity << worker->precision;
+    size_t newBytes = (size_t) newCapacity << worker->precision;
+    worker->registers = realloc(worker->registers, newBytes);
+    worker->firstTown = realloc(worker->firstTown, sizeof(uint32_t) * newCapacity);
+    assert(worker->registers && worker->firstTown);
+
+    memset(worker->registers + oldBytes, 0, newBytes - oldBytes);
+    memset(worker->firstTown + worker->capacity, 0, sizeof(uint32_t) * (newCapacity - worker->capacity));
+    worker->capacity = newCapacity;
+}
+
+static inline uint8_t* townRegisters(THllWorker* worker, uint32_t id)
+{
+    return worker->registers + ((size_t) id << worker->precision);
+}
+
+#define T_HLL_FIELDS (ROUTE_ID | STEP_ID | TOWN_A | TOWN_B | STRING_IDS)
+
+static void processStep(void* w, const RouteStep* step)
+{
+    THllWorker* worker = w;
+
+    uint32_t maxId = step->townAId > step->townBId ? step->townAId : step->townBId;
+    if (maxId >= worker->capacity)
+    {
+        growTowns(worker, maxId);
+    }
+
+    uint64_t hash = hllHashU32(step->routeId);
+    hllAdd(townRegisters(worker, step->townAId), worker->precision, hash);
+    hllAdd(townRegisters(worker, step->townBId), worker->precision, hash);
+
+    if (step->stepId == 1)
+    {
+        worker->firstTown[step->townAId]++;
+    }
+}
+
+static void process(void* worker, RouteStream* stream)
+{
+    RouteStep step;
+    while (rsRead(stream, &step, T_HLL_FIELDS))
+    {
+        processStep(worker, &step);
+    }
+}
+
+/*
+ * State (see --state)
+ */
+
+// A town always has a non-empty register: it's been added at least once.
+static bool isEmpty(const uint8_t* registers, size_t numRegisters)
+{
+    for (size_t i = 0; i < numRegisters; ++i)
+    {
+        if (registers[i] != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Only towns that have been seen are saved, with their id, their number of first towns and their registers.
+// (Drivers share the same ids, and have nothing to save.)
+static void saveState(THllWorker* merged, uint32_t numTowns, const RouteStream* stream, FILE* stateOut)
+{
+    stateWriteStrings(stateOut, stream);
+    stateWriteU32(stateOut, merged->precision);
+
+    uint32_t count = numTowns < merged->capacity ? numTowns : merged->capacity;
+    size_t numRegisters = (size_t) 1 << merged->precision;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        const uint8_t* registers = townRegisters(merged, i);
+        if (isEmpty(registers, numRegisters))
+        {
+            continue;
+        }
+
+        stateWriteU32(stateOut, i);
+        stateWriteU32(stateOut, merged->firstTown[i]);
+        fwrite(registers, 1, numRegisters, stateOut);
+    }
+    stateWriteU32(stateOut, UINT32_MAX); // The end of the list
+}
+
+static void* loadState(FILE* in, RouteStream* stream)
+{
+    uint32_t numIds;
+    uint32_t* newIds = stateReadStrings(in, stream, &numIds);
+    if (newIds == NULL)
+    {
+        return NULL;
+    }
+
+    // A state with another precision can't be merged with the new registers.
+    uint32_t precision;
+    if (!stateReadU32(in, &precision) || precision != hllPrecision)
+    {
+        free(newIds);
+        return NULL;
+    }
+
+    THllWorker* worker = createWorkerWith(precision);
+    size_t numRegisters = (size_t) 1 << precision;
+
+    uint32_t id;
+    bool ok = stateReadU32(in, &id);
+    while (ok && id != UINT32_MAX)
+    {
+        uint32_t firstTown;
+        ok = id < numIds && stateReadU32(in, &firstTown);
+        if (ok)
+        {
+            id = newIds[id];
+            if (id >= worker->capacity)
+            {
+                growTowns(worker, id);
+            }
+            worker->firstTown[id] = firstTown;
+            ok = fread(townRegisters(worker, id), 1, numRegisters, in) == numRegisters;
+        }
+        ok = ok && stateReadU32(in, &id);
+    }
+
+    free(newIds);
+    if (!ok)
+    {
+        freeWorker(worker);
+        return NULL;
+    }
+    return worker;
+}
+
+/*
+ * Results
+ */
+
+typedef struct TownEstimate
+{
+    const char* name;
+    uint32_t length;
+    uint32_t passed;
+    uint32_t firstTown;
+} TownEstimate;
+
+// Most routes first, then the same order as the exact computation for ties.
+static int compareByPassed(const void* a, const void* b)
+{
+    const TownEstimate* townA = a;
+    const TownEstimate* townB = b;
+    if (townA->passed != townB->passed)
+    {
+        return townA->passed < townB->passed ? 1 : -1;
+    }
+    return compareNames(townB->name, townB->length, townA->name, townA->length);
+}
+
+static int compareByName(const void* a, const void* b)
+{
+    const TownEstimate* townA = a;
+    const TownEstimate* townB = b;
+    return compareNames(townA->name, townA->length, townB->name, townB->length);
+}
+
+static void finish(void** workers, uint32_t numWorkers, const RouteStream* stream, FILE* out, FILE* stateOut)
+{
+    THllWorker* merged = workers[0];
+    uint32_t numTowns = rsNumStrings(stream);
+    if (numTowns > merged->capacity)
+    {
+        growTowns(merged, numTowns - 1);
+    }
+
+    {
+        PROFILER_START("Merge registers");
+
+        size_t numRegisters = (size_t) 1 << merged->precision;
+        for (uint32_t w = 1; w < numWorkers; ++w)
+        {
+            THllWorker* worker = workers[w];
+            uint32_t count = worker->capacity < numTowns ? worker->capacity : numTowns;
+            // Registers of all towns are next to each other, so they can all be merged at once.
+            for (size_t r = 0; r < (size_t) count * numRegisters; r += numRegisters)
+            {
+                hllMerge(merged->registers + r, worker->registers + r, merged->precision);
+            }
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                merged->firstTown[i] += worker->firstTown[i];
+            }
+        }
+
+        PROFILER_END();
+    }
+
+    if (stateOut != NULL)
+    {
+        saveState(merged, numTowns, stream, stateOut);
+    }
+
+    TownEstimate* towns = malloc((numTowns > 0 ? numTowns : 1) * sizeof(TownEstimate));
+    assert(towns);
+    uint32_t n = 0;
+    {
+        PROFILER_START("Estimate and sort towns");
+
+        for (uint32_t i = 0; i < numTowns; ++i)
+        {
+            double estimate = hllEstimate(townRegisters(merged, i), merged->precision);
+            // Drivers share the same ids as towns, skip them. (Every town is passed at least once.)
+            if (estimate > 0)
+            {
+                towns[n].name = rsGetString(stream, i, &towns[n].length);
+                towns[n].passed = (uint32_t) (estimate + 0.5);
+                towns[n].firstTown = merged->firstTown[i];
+                n++;
+            }
+        }
+
+        qsort(towns, n, sizeof(TownEstimate), compareByPassed);
+        n = n < 10 ? n : 10;
+        qsort(towns, n, sizeof(TownEstimate), compareByName);
+
+        PROFILER_END();
+    }
+
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        fprintf(out, "%.*s;%u;%u\n", (int) towns[i].length, towns[i].name, towns[i].passed, towns[i].firstTown);
+    }
+
+    free(towns);
+    for (uint32_t w = 0; w < numWorkers; ++w)
+    {
+        freeWorker(workers[w]);
+    }
+}
+
+const Computation computationTHll = {"Computation T (HyperLogLog)", T_HLL_FIELDS, createWorker, process,
+                                     processStep, finish, loadState};
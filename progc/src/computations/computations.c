@@ -0,0 +1,334 @@
+#include "computations.h"
+
+#include <assert.h>
+
+#include "compile_settings.h"
+#include "route.h"
+#include "profile.h"
+#include "state.h"
+#if EXPERIMENTAL_ALGO
+#include "grouped.h"
+#endif
+
+typedef struct ReadTask
+{
+    const Computation* const* computations;
+    uint32_t numComputations;
+    RouteFields fields; // The fields needed by all computations.
+    RouteStream* const* parts;
+    // The workers of each computation, for each part, part i going to worker firstWorker + i.
+    void* (*workers)[MAX_THREADS];
+    uint32_t firstWorker;
+} ReadTask;
+
+static void readPart(uint32_t index, void* data)
+{
+    ReadTask* task = data;
+    uint32_t worker = task->firstWorker + index;
+
+    if (task->numComputations == 1)
+    {
+        // Use the specialized reading function, which is quicker than calling processStep for each step.
+        task->computations[0]->process(task->workers[0][worker], task->parts[index]);
+    }
+    else
+    {
+        RouteStep step;
+        while (rsRead(task->parts[index], &step, task->fields))
+        {
+            for (uint32_t c = 0; c < task->numComputations; ++c)
+            {
+                task->computations[c]->processStep(task->workers[c][worker], &step);
+            }
+        }
+    }
+}
+
+// Adds up the lines and characters read by all parts so far, for the profiler.
+static void countRead(RouteStream* const* parts, uint32_t numParts, uint64_t* outRows, uint64_t* outBytes)
+{
+    *outRows = 0;
+    *outBytes = 0;
+    for (uint32_t i = 0; i < numParts; ++i)
+    {
+        *outRows += parts[i]->rowsRead;
+        *outBytes += parts[i]->bytesRead;
+    }
+}
+
+#if ENABLE_PROFILER && !defined(NDEBUG)
+// Makes sure the profiler has counted each line read by the part exactly once, even the ones read again
+// after a rsRewind. Only for parts in memory, where we can count the lines ourselves.
+static void checkReadCounts(const RouteStream* part, RsMark begin)
+{
+    RsMark end;
+    if (!rsMark(part, &end))
+    {
+        return;
+    }
+
+    uint64_t lines = 0;
+    if (part->mode == RS_COLUMNAR)
+    {
+        lines = end.position - begin.position;
+    }
+    else
+    {
+        assert(end.bytesRead - begin.bytesRead == end.position - begin.position);
+        const char* cursor = part->readBuf + begin.position;
+        const char* limit = part->readBuf + end.position;
+        while ((cursor = memchr(cursor, '\n', limit - cursor)) != NULL)
+        {
+            lines++;
+            cursor++;
+        }
+    }
+    assert(end.rowsRead - begin.rowsRead == lines);
+}
+#endif
+
+// Loads the states of all computations, and moves the stream right after the lines they've already read.
+// Gives false in outLoaded when the states can't be used (missing, or made with another file):
+// then the file has to be read from the beginning.
+// Returns false when a state file is there, but broken.
+static bool loadStates(RouteStream* stream, const Computation* const* computations, FILE* const* statesIn,
+                       uint32_t numComputations, void** outWorkers, bool* outLoaded, char errMsg[ERR_MAX])
+{
+    *outLoaded = false;
+
+    uint64_t offset = 0;
+    bool usable = true;
+
+    // First, check that all states have been saved at the same place of this very file.
+    for (uint32_t c = 0; c < numComputations && usable; ++c)
+    {
+        StateHeader header;
+        uint64_t checksum;
+        usable = statesIn[c] != NULL
+                 && computations[c]->loadState != NULL
+                 && stateReadHeader(statesIn[c], &header)
+                 && strcmp(header.computation, computations[c]->name) == 0
+                 && (c == 0 || header.offset == offset)
+                 && rsChecksum(stream, header.offset, &checksum) && checksum == header.checksum;
+        offset = header.offset;
+    }
+
+    bool ok = true;
+    if (usable)
+    {
+        usable = rsSeek(stream, offset);
+    }
+    if (usable)
+    {
+        for (uint32_t c = 0; c < numComputations && ok; ++c)
+        {
+            outWorkers[c] = computations[c]->loadState(statesIn[c], stream);
+            if (outWorkers[c] == NULL)
+            {
+                snprintf(errMsg, ERR_MAX, "l'état de « %s » est invalide, supprimez-le pour tout relire",
+                         computations[c]->name);
+                ok = false;
+            }
+        }
+        *outLoaded = ok;
+    }
+
+    return ok;
+}
+
+// Splits the rest of the stream in up to numThreads parts, or gives the stream itself when it can't be split.
+static uint32_t splitStream(RouteStream* stream, uint32_t numThreads, RouteStream* partStreams,
+                            RouteStream** outParts)
+{
+    uint32_t numParts = numThreads > 1 ? rsSplit(stream, numThreads, partStreams) : 0;
+    if (numParts == 0)
+    {
+        outParts[0] = stream;
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < numParts; ++i)
+    {
+        outParts[i] = &partStreams[i];
+    }
+    return numParts;
+}
+
+// Creates numWorkers workers for each computation. The loaded states (when not NULL) become the first ones,
+// which just carry on from where they stopped.
+static void createWorkers(ComputationRun* run, const Computation* const* computations, uint32_t numComputations,
+                          void* const* loaded, uint32_t numWorkers)
+{
+    run->computations = computations;
+    run->numComputations = numComputations;
+    run->numWorkers = numWorkers;
+    run->fields = 0;
+    for (uint32_t c = 0; c < numComputations; ++c)
+    {
+        run->fields |= computations[c]->fields;
+        for (uint32_t i = 0; i < numWorkers; ++i)
+        {
+            run->workers[c][i] = loaded != NULL && i == 0 ? loaded[c] : computations[c]->createWorker();
+        }
+    }
+}
+
+// Reads the parts of the run, the first one with the worker firstWorker, the next ones with the next workers.
+static void readParts(ComputationRun* run, uint32_t firstWorker)
+{
+    PROFILER_START("Read the file");
+
+    uint64_t rowsBefore, bytesBefore, rowsAfter, bytesAfter;
+    countRead(run->parts, run->numParts, &rowsBefore, &bytesBefore);
+#if ENABLE_PROFILER && !defined(NDEBUG)
+    RsMark begins[MAX_THREADS];
+    bool marked[MAX_THREADS];
+    for (uint32_t i = 0; i < run->numParts; ++i)
+    {
+        marked[i] = rsMark(run->parts[i], &begins[i]);
+    }
+#endif
+
+    ReadTask task = {run->computations, run->numComputations, run->fields, run->parts, run->workers, firstWorker};
+    parallelRun(run->numParts, readPart, &task);
+
+    countRead(run->parts, run->numParts, &rowsAfter, &bytesAfter);
+#if ENABLE_PROFILER && !defined(NDEBUG)
+    for (uint32_t i = 0; i < run->numParts; ++i)
+    {
+        if (marked[i])
+        {
+            checkReadCounts(run->parts[i], begins[i]);
+        }
+    }
+#endif
+    PROFILER_COUNT(PROFILE_ROWS, rowsAfter - rowsBefore);
+    PROFILER_COUNT(PROFILE_BYTES, bytesAfter - bytesBefore);
+
+    PROFILER_END();
+}
+
+bool computationsStart(ComputationRun* run, RouteStream* stream, const Computation* const* computations,
+                       FILE* const* statesIn, uint32_t numComputations, uint32_t numThreads, char errMsg[ERR_MAX])
+{
+    assert(run && stream && computations);
+    assert(numComputations > 0 && numComputations <= MAX_COMPUTATIONS);
+    assert(numThreads > 0 && numThreads <= MAX_THREADS);
+
+    void* loaded[MAX_COMPUTATIONS];
+    bool stateLoaded = false;
+    if (statesIn != NULL
+        && !loadStates(stream, computations, statesIn, numComputations, loaded, &stateLoaded, errMsg))
+    {
+        return false;
+    }
+
+#if EXPERIMENTAL_ALGO
+    // A worker reads a different part of the file each time: the routes can't be read one by one.
+    groupedInputAllowed = false;
+#endif
+
+    createWorkers(run, computations, numComputations, stateLoaded ? loaded : NULL, numThreads);
+    run->numParts = 0;
+    return true;
+}
+
+void computationsRead(ComputationRun* run, RouteStream* stream)
+{
+    assert(run && stream && run->numWorkers > 0);
+
+    // The first read is split between all workers. The next ones all go to the last worker: that way,
+    // the workers are still in the order of the file, which finish relies on to sum things up in the same order.
+    // And it's only the few lines added since the previous read anyway.
+    if (run->numParts == 0)
+    {
+        run->numParts = splitStream(stream, run->numWorkers, run->partStreams, run->parts);
+        readParts(run, 0);
+    }
+    else
+    {
+        run->numParts = 1;
+        run->parts[0] = stream;
+        readParts(run, run->numWorkers - 1);
+    }
+}
+
+void computationsFinish(ComputationRun* run, const RouteStream* stream, FILE* const* outputs,
+                        FILE* const* statesOut)
+{
+    assert(run && stream && outputs);
+
+    // Everything has been read: save the states along with the position of the end of the file.
+    StateHeader header = {.offset = 0};
+    if (statesOut != NULL)
+    {
+        header.offset = rsTell(stream);
+        // Can't fail, we've just read all of it.
+        bool checked = rsChecksum(stream, header.offset, &header.checksum);
+        assert(checked);
+        (void) checked;
+    }
+
+    for (uint32_t c = 0; c < run->numComputations; ++c)
+    {
+        PROFILER_START(run->computations[c]->name);
+
+        FILE* stateOut = statesOut != NULL ? statesOut[c] : NULL;
+        if (stateOut != NULL)
+        {
+            snprintf(header.computation, sizeof(header.computation), "%s", run->computations[c]->name);
+            stateWriteHeader(stateOut, &header);
+        }
+
+        run->computations[c]->finish(run->workers[c], run->numWorkers, stream, outputs[c], stateOut);
+
+        PROFILER_END();
+    }
+
+    run->numWorkers = 0;
+}
+
+bool runComputations(RouteStream* stream, const Computation* const* computations, FILE* const* outputs,
+                     FILE* const* statesIn, FILE* const* statesOut, uint32_t numComputations,
+                     uint32_t numThreads, char errMsg[ERR_MAX])
+{
+    assert(stream && computations && outputs);
+    assert(numComputations > 0 && numComputations <= MAX_COMPUTATIONS);
+    assert(numThreads > 0 && numThreads <= MAX_THREADS);
+
+    PROFILER_START("Computations");
+
+    // With saved states, we only need to read the lines after the ones read by the previous run.
+    void* loaded[MAX_COMPUTATIONS];
+    bool stateLoaded = false;
+    if (statesIn != NULL || statesOut != NULL)
+    {
+        // States are saved at the end of a line, leave the unfinished one for the next time.
+        rsIgnoreUnfinishedLine(stream);
+    }
+    if (statesIn != NULL
+        && !loadStates(stream, computations, statesIn, numComputations, loaded, &stateLoaded, errMsg))
+    {
+        PROFILER_END();
+        return false;
+    }
+
+    // Split the file in multiple parts, one for each thread.
+    // If we can't, then the stream itself is the only part.
+    static ComputationRun run;
+    run.numParts = splitStream(stream, numThreads, run.partStreams, run.parts);
+
+#if EXPERIMENTAL_ALGO
+    // Saved states need every route, which reading the file route by route doesn't keep.
+    groupedInputAllowed = statesOut == NULL;
+#endif
+
+    // The saved state becomes the worker of the first part, which just carries on from where it stopped.
+    createWorkers(&run, computations, numComputations, stateLoaded ? loaded : NULL, run.numParts);
+    readParts(&run, 0);
+    computationsFinish(&run, stream, outputs, statesOut);
+
+    PROFILER_END();
+
+    return true;
+}
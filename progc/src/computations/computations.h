@@ -1,27 +1,147 @@
 #ifndef COMPUTATIONS_H
 #define COMPUTATIONS_H
 
-struct RouteStream;
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "route.h"
+#include "parallel.h"
+
+// A computation, split in two phases so the file can be read by multiple threads:
+//  1. Each worker reads a part of the file, and aggregates the steps in its own state. (process)
+//  2. The states of all workers are merged, in order, and the results are printed. (finish)
+// With a single worker, it's just the good old read-then-print computation.
+typedef struct Computation
+{
+    // The name shown by the profiler.
+    const char* name;
+    // The fields of the steps needed by the computation.
+    RouteFields fields;
+    // Creates the state of a worker, with all the data it needs to aggregate steps.
+    void* (*createWorker)();
+    // Reads all the steps of a part of the file, and aggregates them in the worker state.
+    // Run concurrently by multiple threads, so it must only touch the given worker state.
+    void (*process)(void* worker, struct RouteStream* part);
+    // Aggregates a single step in the worker state, just like process does for each step.
+    // Used when multiple computations share the same read of the file.
+    void (*processStep)(void* worker, const RouteStep* step);
+    // Merges all the worker states, prints the results to the output file, and frees the workers.
+    // The workers are given in the same order as the parts of the file.
+    // The stream is given to get the strings of the ids read with STRING_IDS (see rsGetString).
+    // When stateOut isn't NULL, the merged state is also written there, to be read by loadState in the next run.
+    void (*finish)(void** workers, uint32_t numWorkers, const struct RouteStream* stream, FILE* out,
+                   FILE* stateOut);
+    // Creates a worker containing the state written by finish in a previous run (see state.h).
+    // It's used as the worker of the first part of the file, as if it had read the beginning of it.
+    // Strings saved by the previous run get new ids using rsInternString.
+    // Returns NULL when the state file isn't valid.
+    void* (*loadState)(FILE* in, struct RouteStream* stream);
+} Computation;
+
+// Compares two strings that aren't null-terminated, giving the same order as strcmp.
+static inline int compareNames(const char* a, uint32_t aLen, const char* b, uint32_t bLen)
+{
+    int cmp = memcmp(a, b, aLen < bLen ? aLen : bLen);
+    if (cmp != 0)
+    {
+        return cmp;
+    }
+    return aLen < bLen ? -1 : aLen > bLen;
+}
 
 // Computation D1: the top 10 drivers based on the number of routes taken.
 // EXPERIMENTAL! The awk computation works reliably, but this one is much faster.
 //               Only available in EXPERIMENTAL_ALGO mode.
-void computationD1(struct RouteStream* stream);
+extern const Computation computationD1;
 
 // Computation D2: the top 10 drivers based on the distance traveled
 // EXPERIMENTAL! The awk computation works reliably, but this one is much faster.
 //               Only available in EXPERIMENTAL_ALGO mode.
-void computationD2(struct RouteStream* stream);
+extern const Computation computationD2;
 
 // Computation L: the top 10 routes with the highest total distance.
 // EXPERIMENTAL! Uses a map, and the awk implementation already exists.
 //               Only available in EXPERIMENTAL_ALGO mode.
-void computationL(struct RouteStream* stream);
+extern const Computation computationL;
 
 // Computation T: the top 10 visited towns.
-void computationT(struct RouteStream* stream);
+extern const Computation computationT;
 
 // Computation S: Stats for steps
-void computationS(struct RouteStream* stream);
+extern const Computation computationS;
+
+// Approximate versions of D1, D2 and T (--approx), using a fixed amount of memory, see sketch.h.
+// Available in all builds. The results are followed by their error: the real count is between count - error and count.
+// D1 prints "name;routes;error", D2 "name;distance;error" and T "name;routes;firstTown;error".
+extern const Computation computationD1Approx;
+extern const Computation computationD2Approx;
+extern const Computation computationTApprox;
+
+// Sets the number of names kept by the approximate computations (1024 by default), and whether they're
+// backed by a Count-Min sketch. Must be called before running them.
+void approxConfigure(uint32_t capacity, bool countMin);
+
+// Computation T counting routes with a HyperLogLog per town (--hll), see sketch.h.
+// Available in all builds. The number of routes of each town is an estimate, with the same output as T.
+extern const Computation computationTHll;
+
+// Sets the precision of the HyperLogLog of each town: 2^precision bytes per town (10 by default).
+// Must be called before running computationTHll.
+void tHllConfigure(uint32_t precision);
+
+// Limits the memory used by the partitioners of the experimental computations (--max-memory), in bytes.
+// Past that, partitions are written to temporary files and read back one at a time (see partition.h).
+// 0 for no limit (the default). Does nothing without EXPERIMENTAL_ALGO.
+void computationsSetMemoryBudget(uint64_t bytes);
+
+// The maximum number of computations that can be run at once.
+#define MAX_COMPUTATIONS 5
+
+// Runs multiple computations on the file, using up to numThreads threads.
+// The file is read only once: each step is given to all computations.
+// The results of each computation are printed in their own output file.
+// Multiple threads can only be used when the stream can be split (see rsSplit).
+//
+// States (see state.h) let a run only read the lines added since the previous one.
+// The stream must then be in RS_MAPPED mode.
+// When statesIn isn't NULL, each computation starts from the state read from its file, and the lines before
+// it are skipped. If any of them is NULL, or doesn't match the file, the entire file is read again.
+// When statesOut isn't NULL, each computation writes its state in its file. Check for errors with ferror.
+// Returns false when a state is there but can't be read, with an error message.
+bool runComputations(struct RouteStream* stream, const Computation* const* computations, FILE* const* outputs,
+                     FILE* const* statesIn, FILE* const* statesOut, uint32_t numComputations,
+                     uint32_t numThreads, char errMsg[ERR_MAX]);
+
+// Computations whose workers are kept between two reads of the file, so each read only gives them the lines
+// added since the previous one (see follow.h). runComputations does it all in one go instead.
+typedef struct ComputationRun
+{
+    const Computation* const* computations;
+    uint32_t numComputations;
+    RouteFields fields; // The fields needed by all computations.
+    // The workers of each computation: numWorkers of them.
+    void* workers[MAX_COMPUTATIONS][MAX_THREADS];
+    uint32_t numWorkers;
+    // The parts of the last read, 0 before the first one.
+    struct RouteStream partStreams[MAX_THREADS];
+    struct RouteStream* parts[MAX_THREADS];
+    uint32_t numParts;
+} ComputationRun;
+
+// Creates numThreads workers for each computation. Like runComputations, when statesIn isn't NULL, the first
+// workers start from the states when they match the file, and the stream is moved after the lines they've read.
+// Returns false when a state is there but can't be read, with an error message. No worker is created then.
+bool computationsStart(ComputationRun* run, struct RouteStream* stream, const Computation* const* computations,
+                       FILE* const* statesIn, uint32_t numComputations, uint32_t numThreads, char errMsg[ERR_MAX]);
+
+// Gives all the lines of the stream, from where it is until its end, to the workers.
+// Only the first read uses multiple threads, the next ones are given to the last worker.
+void computationsRead(ComputationRun* run, struct RouteStream* stream);
+
+// Merges the workers, prints the results, and frees the workers (see Computation.finish).
+// When statesOut isn't NULL, the states are also saved for the lines read so far.
+void computationsFinish(ComputationRun* run, const struct RouteStream* stream, FILE* const* outputs,
+                        FILE* const* statesOut);
 
 #endif //COMPUTATIONS_H
@@ -0,0 +1,287 @@
+#include "decompress.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// The size of the buffer holding compressed data, read from the file.
+// Same as the one used by zstd (ZSTD_DStreamInSize), zlib doesn't really care.
+#define DECOMP_INPUT_SIZE (128 * 1024)
+
+struct Decompressor
+{
+    Compression compression;
+    FILE* file;
+
+    // The compressed data read from the file, and the part of it that hasn't been decompressed yet.
+    unsigned char* input;
+    size_t inputPos;
+    size_t inputSize;
+    // True when there's nothing left to read from the file.
+    bool inputEnded;
+
+    // True when we're right between two frames (or at the very start): if the file ends here, it's complete.
+    bool betweenFrames;
+    // True when there's nothing left to decompress (or when something went wrong).
+    bool finished;
+
+#if HAVE_ZLIB
+    z_stream zlib;
+#endif
+#if HAVE_ZSTD
+    ZSTD_DStream* zstd;
+#endif
+};
+
+Compression compressionDetect(const unsigned char* bytes, size_t len)
+{
+    if (len < COMPRESSION_MAGIC_SIZE)
+    {
+        return COMPRESSION_NONE;
+    }
+
+    if (bytes[0] == 0x1F && bytes[1] == 0x8B)
+    {
+        return COMPRESSION_GZIP;
+    }
+    // Stored in little-endian: 0xFD2FB528
+    if (bytes[0] == 0x28 && bytes[1] == 0xB5 && bytes[2] == 0x2F && bytes[3] == 0xFD)
+    {
+        return COMPRESSION_ZSTD;
+    }
+    return COMPRESSION_NONE;
+}
+
+bool compressionSupported(Compression compression)
+{
+    switch (compression)
+    {
+        case COMPRESSION_NONE:
+            return true;
+        case COMPRESSION_GZIP:
+            return HAVE_ZLIB;
+        case COMPRESSION_ZSTD:
+            return HAVE_ZSTD;
+        default:
+            return false;
+    }
+}
+
+const char* compressionName(Compression compression)
+{
+    switch (compression)
+    {
+        case COMPRESSION_GZIP:
+            return "gzip";
+        case COMPRESSION_ZSTD:
+            return "zstd";
+        default:
+            return "none";
+    }
+}
+
+const char* compressionLibrary(Compression compression)
+{
+    switch (compression)
+    {
+        case COMPRESSION_GZIP:
+            return "zlib";
+        case COMPRESSION_ZSTD:
+            return "libzstd";
+        default:
+            return "none";
+    }
+}
+
+Decompressor* decompOpen(Compression compression, FILE* file,
+                         const unsigned char* prefix, size_t prefixLen, int* outError)
+{
+    assert(prefixLen <= DECOMP_INPUT_SIZE);
+
+    if (!compressionSupported(compression) || compression == COMPRESSION_NONE)
+    {
+        *outError = ENOTSUP;
+        return NULL;
+    }
+
+    Decompressor* d = calloc(1, sizeof(Decompressor));
+    if (d)
+    {
+        d->input = malloc(DECOMP_INPUT_SIZE);
+    }
+    if (!d || !d->input)
+    {
+        free(d);
+        *outError = ENOMEM;
+        return NULL;
+    }
+
+    d->compression = compression;
+    d->file = file;
+    memcpy(d->input, prefix, prefixLen);
+    d->inputSize = prefixLen;
+    d->betweenFrames = true;
+
+    bool ok = false;
+#if HAVE_ZLIB
+    if (compression == COMPRESSION_GZIP)
+    {
+        // 16 + MAX_WBITS: only accept gzip data (with its header), not raw zlib data.
+        ok = inflateInit2(&d->zlib, 16 + MAX_WBITS) == Z_OK;
+    }
+#endif
+#if HAVE_ZSTD
+    if (compression == COMPRESSION_ZSTD)
+    {
+        d->zstd = ZSTD_createDStream();
+        ok = d->zstd != NULL && !ZSTD_isError(ZSTD_initDStream(d->zstd));
+    }
+#endif
+
+    if (!ok)
+    {
+        decompFree(d);
+        *outError = ENOMEM;
+        return NULL;
+    }
+
+    return d;
+}
+
+// Decompresses as much as possible from the input to out[*produced...size], and adds the number of
+// bytes written to produced. Returns false when the data is corrupted.
+static bool decompStep(Decompressor* d, char* out, size_t size, size_t* produced)
+{
+#if HAVE_ZLIB
+    if (d->compression == COMPRESSION_GZIP)
+    {
+        z_stream* z = &d->zlib;
+        z->next_in = d->input + d->inputPos;
+        z->avail_in = (uInt) (d->inputSize - d->inputPos);
+        z->next_out = (unsigned char*) out + *produced;
+        z->avail_out = (uInt) (size - *produced);
+
+        int ret = inflate(z, Z_NO_FLUSH);
+
+        d->inputPos = d->inputSize - z->avail_in;
+        *produced = size - z->avail_out;
+
+        if (ret == Z_STREAM_END)
+        {
+            // There might be another member right after this one, get ready for it.
+            inflateReset(z);
+            d->betweenFrames = true;
+        }
+        else if (ret == Z_OK)
+        {
+            d->betweenFrames = false;
+        }
+        // Z_BUF_ERROR just means nothing could be done: we need more input.
+        else if (ret != Z_BUF_ERROR)
+        {
+            return false;
+        }
+        return true;
+    }
+#endif
+#if HAVE_ZSTD
+    if (d->compression == COMPRESSION_ZSTD)
+    {
+        ZSTD_inBuffer in = {d->input, d->inputSize, d->inputPos};
+        ZSTD_outBuffer o = {out, size, *produced};
+
+        size_t ret = ZSTD_decompressStream(d->zstd, &o, &in);
+        if (ZSTD_isError(ret))
+        {
+            return false;
+        }
+
+        // When nothing moved, ret is just a hint about the next frame, don't trust it.
+        if (in.pos != d->inputPos || o.pos != *produced)
+        {
+            // 0 means the frame is complete, and entirely flushed.
+            d->betweenFrames = ret == 0;
+        }
+        d->inputPos = in.pos;
+        *produced = o.pos;
+        return true;
+    }
+#endif
+    return false;
+}
+
+size_t decompRead(Decompressor* d, char* out, size_t size, int* outError)
+{
+    size_t produced = 0;
+    while (produced < size && !d->finished)
+    {
+        // Read some more compressed data when we've used it all.
+        if (d->inputPos == d->inputSize && !d->inputEnded)
+        {
+            d->inputPos = 0;
+            d->inputSize = fread(d->input, 1, DECOMP_INPUT_SIZE, d->file);
+            if (d->inputSize < DECOMP_INPUT_SIZE)
+            {
+                d->inputEnded = true;
+                if (ferror(d->file))
+                {
+                    *outError = errno != 0 ? errno : EIO;
+                    d->finished = true;
+                    break;
+                }
+            }
+        }
+
+        size_t before = produced;
+        if (!decompStep(d, out, size, &produced))
+        {
+            *outError = EILSEQ;
+            d->finished = true;
+            break;
+        }
+
+        if (produced == before && d->inputPos == d->inputSize && d->inputEnded)
+        {
+            // Nothing comes in, nothing comes out: we're done.
+            // If we stopped in the middle of a frame, the file has been cut short.
+            if (!d->betweenFrames)
+            {
+                *outError = EILSEQ;
+            }
+            d->finished = true;
+        }
+    }
+
+    return produced;
+}
+
+void decompFree(Decompressor* d)
+{
+    if (!d)
+    {
+        return;
+    }
+
+#if HAVE_ZLIB
+    if (d->compression == COMPRESSION_GZIP)
+    {
+        inflateEnd(&d->zlib);
+    }
+#endif
+#if HAVE_ZSTD
+    if (d->zstd)
+    {
+        ZSTD_freeDStream(d->zstd);
+    }
+#endif
+    free(d->input);
+    free(d);
+}
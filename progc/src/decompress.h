@@ -0,0 +1,65 @@
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+/*
+ * decompress.h
+ * ---------------
+ * Reads compressed files (gzip or zstd) as if they weren't, a bit like fread.
+ * Used by the prefetch thread in route.c, so the file is decompressed while the previous chunk is being parsed.
+ *
+ * Both libraries are optional: gzip needs zlib (HAVE_ZLIB), and zstd needs libzstd (HAVE_ZSTD).
+ * Files made of several frames (or members for gzip), like ones made with "cat a.gz b.gz" or pigz,
+ * are read just fine.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef HAVE_ZLIB
+#define HAVE_ZLIB 0
+#endif
+
+#ifndef HAVE_ZSTD
+#define HAVE_ZSTD 0
+#endif
+
+// The number of bytes needed by compressionDetect to recognize any format.
+#define COMPRESSION_MAGIC_SIZE 4
+
+typedef enum
+{
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+    COMPRESSION_ZSTD
+} Compression;
+
+typedef struct Decompressor Decompressor;
+
+// Finds the compression of a file using its first bytes (the "magic number").
+// Gives COMPRESSION_NONE when there are less than COMPRESSION_MAGIC_SIZE bytes.
+Compression compressionDetect(const unsigned char* bytes, size_t len);
+
+// Returns true when the program has been compiled with the library needed to decompress it.
+bool compressionSupported(Compression compression);
+
+// The name of the format ("gzip", "zstd"), and the name of the library needed to read it ("zlib", "libzstd").
+const char* compressionName(Compression compression);
+const char* compressionLibrary(Compression compression);
+
+// Starts decompressing the file. The first prefixLen bytes of the file have already been read (to detect
+// the compression), and are given in prefix.
+// Returns NULL on failure, with the error number in outError.
+Decompressor* decompOpen(Compression compression, FILE* file,
+                         const unsigned char* prefix, size_t prefixLen, int* outError);
+
+// Decompresses up to size bytes into out, and returns the number of bytes written.
+// Returns less than size only at the end of the file, or when something went wrong:
+// in that case, outError is set to the error number (EILSEQ when the file is corrupted or truncated).
+size_t decompRead(Decompressor* d, char* out, size_t size, int* outError);
+
+// Frees the decompressor. The file is NOT closed.
+void decompFree(Decompressor* d);
+
+#endif //DECOMPRESS_H
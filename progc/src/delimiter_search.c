@@ -0,0 +1,284 @@
+#include "delimiter_search.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+// The implementations using masks need always_inline, and target attributes for SSE/AVX.
+#if defined(__GNUC__)
+#define DELIM_MASK_SUPPORTED 1
+#define DELIM_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define DELIM_MASK_SUPPORTED 0
+#endif
+
+// SWAR needs the first character in the lowest byte.
+#if DELIM_MASK_SUPPORTED && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define DELIM_SWAR_SUPPORTED 1
+#else
+#define DELIM_SWAR_SUPPORTED 0
+#endif
+
+// SSE and AVX are only there on x86 CPUs. Functions using them are compiled with a target attribute,
+// so they're available even without -mavx2, and only called when the CPU supports them.
+#if DELIM_MASK_SUPPORTED && (defined(__x86_64__) || defined(__i386__))
+#define DELIM_X86_SUPPORTED 1
+#include <immintrin.h>
+#else
+#define DELIM_X86_SUPPORTED 0
+#endif
+
+/*
+ * Scalar version, one character at a time.
+ */
+
+static void buildIndexScalar(const char* a, uint32_t numBlocks, uint64_t* outBits)
+{
+    for (uint32_t i = 0; i < numBlocks; ++i)
+    {
+        uint64_t mask = 0;
+        for (uint32_t n = 0; n < 64; ++n)
+        {
+            char c = a[i * 64 + n];
+            mask |= (uint64_t) (c == ';' || c == '\n') << n;
+        }
+        outBits[i] = mask;
+    }
+}
+
+#if DELIM_MASK_SUPPORTED
+/*
+ * Versions using masks: the 64 next characters are turned into a 64-bit mask, where the n-th bit is 1
+ * if the n-th character is a delimiter (; or \n), using vector instructions.
+ *
+ * All of them share the same loop, only the function making the mask changes.
+ */
+
+typedef uint64_t (*MakeMaskFunc)(const char* a);
+
+// Always inlined, so makeMask64 gets inlined too, and the loop is compiled with the right instructions.
+static DELIM_ALWAYS_INLINE void buildIndexWithMask(const char* a, uint32_t numBlocks, uint64_t* outBits,
+                                                   MakeMaskFunc makeMask64)
+{
+    for (uint32_t i = 0; i < numBlocks; ++i)
+    {
+        outBits[i] = makeMask64(a + i * 64);
+    }
+}
+#endif
+
+#if DELIM_SWAR_SUPPORTED
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_LOW7 0x7F7F7F7F7F7F7F7FULL
+
+// Gives 0x80 in every byte of x that is zero, and 0 in all the others.
+// (The usual (x - 1) & ~x trick is faster, but can give false positives after the first zero byte.)
+static inline uint64_t swarZeroBytes(uint64_t x)
+{
+    return ~(((x & SWAR_LOW7) + SWAR_LOW7) | x | SWAR_LOW7);
+}
+
+static uint64_t makeMaskSwar(const char* a)
+{
+    uint64_t mask = 0;
+    for (int i = 0; i < 8; ++i)
+    {
+        uint64_t chunk;
+        memcpy(&chunk, a + i * 8, sizeof(chunk));
+
+        uint64_t found = swarZeroBytes(chunk ^ (SWAR_ONES * ';')) | swarZeroBytes(chunk ^ (SWAR_ONES * '\n'));
+        // Gather the 8 high bits into a single byte: bit n of the byte is the high bit of the n-th byte.
+        uint64_t bits = ((found >> 7) * 0x0102040810204080ULL) >> 56;
+
+        mask |= bits << (i * 8);
+    }
+    return mask;
+}
+
+static void buildIndexSwar(const char* a, uint32_t numBlocks, uint64_t* outBits)
+{
+    buildIndexWithMask(a, numBlocks, outBits, makeMaskSwar);
+}
+#endif
+
+#if DELIM_X86_SUPPORTED
+__attribute__((target("sse2")))
+static inline uint64_t makeMaskSse2(const char* a)
+{
+    __m128i semiColon = _mm_set1_epi8(';');
+    __m128i newLine = _mm_set1_epi8('\n');
+
+    uint64_t mask = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        __m128i aVec = _mm_loadu_si128((const __m128i*) (a + i * 16));
+        __m128i anyFound = _mm_or_si128(_mm_cmpeq_epi8(aVec, semiColon), _mm_cmpeq_epi8(aVec, newLine));
+        mask |= (uint64_t) (uint16_t) _mm_movemask_epi8(anyFound) << (i * 16);
+    }
+    return mask;
+}
+
+__attribute__((target("sse2")))
+static void buildIndexSse2(const char* a, uint32_t numBlocks, uint64_t* outBits)
+{
+    buildIndexWithMask(a, numBlocks, outBits, makeMaskSse2);
+}
+
+__attribute__((target("sse4.2")))
+static inline uint64_t makeMaskSse42(const char* a)
+{
+    // The set of characters to look for, null-terminated.
+    __m128i delims = _mm_setr_epi8(';', '\n', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+    uint64_t mask = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        __m128i aVec = _mm_loadu_si128((const __m128i*) (a + i * 16));
+        // Gives a bit mask of all the characters equal to any character of the set.
+        // It stops at the first null character, which is fine: there's none in a valid line.
+        __m128i found = _mm_cmpistrm(delims, aVec, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK);
+        mask |= (uint64_t) (uint16_t) _mm_cvtsi128_si32(found) << (i * 16);
+    }
+    return mask;
+}
+
+__attribute__((target("sse4.2")))
+static void buildIndexSse42(const char* a, uint32_t numBlocks, uint64_t* outBits)
+{
+    buildIndexWithMask(a, numBlocks, outBits, makeMaskSse42);
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t makeMaskAvx2Half(const char* a, __m256i semiColon, __m256i newLine)
+{
+    // Load the 32 characters of the string a into a vector.
+    __m256i aVec = _mm256_loadu_si256((const __m256i*) a);
+
+    // Compare the string vector to one filled with ';' or '\n' characters to locate delimiters
+    // semiColonFound[n] = a[n] == ';' ? 0xFF : 0x00
+    __m256i semiColonFound = _mm256_cmpeq_epi8(aVec, semiColon);
+    // newLineFound[n] = a[n] == '\n' ? 0xFF : 0x00
+    __m256i newLineFound = _mm256_cmpeq_epi8(aVec, newLine);
+
+    // Combine both vectors using the bitwise OR.
+    // anyFound[n] = semiColonFound[n] | newLineFound[n]
+    __m256i anyFound = _mm256_or_si256(semiColonFound, newLineFound);
+
+    // Convert the 'anyFound' vector to a mask where the n-th bit is 1 if the n-th char is equal to ';' or '\n'
+    // bit(n) = a[n] == ';' || a[n] == '\n'
+    return (uint32_t) _mm256_movemask_epi8(anyFound);
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t makeMaskAvx2(const char* a)
+{
+    __m256i semiColon = _mm256_set1_epi8(';');
+    __m256i newLine = _mm256_set1_epi8('\n');
+
+    uint32_t lo = makeMaskAvx2Half(a, semiColon, newLine);
+    uint32_t hi = makeMaskAvx2Half(a + 32, semiColon, newLine);
+
+    return (uint64_t) hi << 32 | lo;
+}
+
+__attribute__((target("avx2")))
+static void buildIndexAvx2(const char* a, uint32_t numBlocks, uint64_t* outBits)
+{
+    buildIndexWithMask(a, numBlocks, outBits, makeMaskAvx2);
+}
+#endif
+
+/*
+ * Choosing the implementation
+ */
+
+DelimIndexFunc delimIndexImpl = buildIndexScalar;
+static SimdLevel currentLevel = SIMD_SCALAR;
+
+// Returns the implementation for the level, or NULL if it's not supported.
+static DelimIndexFunc findImpl(SimdLevel level)
+{
+#if DELIM_X86_SUPPORTED
+    __builtin_cpu_init();
+#endif
+
+    switch (level)
+    {
+        case SIMD_SCALAR:
+            return buildIndexScalar;
+#if DELIM_SWAR_SUPPORTED
+        case SIMD_SWAR:
+            return buildIndexSwar;
+#endif
+#if DELIM_X86_SUPPORTED
+        case SIMD_SSE2:
+            return __builtin_cpu_supports("sse2") ? buildIndexSse2 : NULL;
+        case SIMD_SSE42:
+            return __builtin_cpu_supports("sse4.2") ? buildIndexSse42 : NULL;
+        case SIMD_AVX2:
+            return __builtin_cpu_supports("avx2") ? buildIndexAvx2 : NULL;
+#endif
+        default:
+            return NULL;
+    }
+}
+
+bool delimSearchInit(SimdLevel level)
+{
+    if (level == SIMD_AUTO)
+    {
+        // SSE4.2 isn't there: its string instructions aren't any faster than the plain SSE2 comparisons.
+        // It's only useful for benchmarking.
+        static const SimdLevel preferred[] = {SIMD_AVX2, SIMD_SSE2, SIMD_SWAR, SIMD_SCALAR};
+        for (uint32_t i = 0; i < sizeof(preferred) / sizeof(preferred[0]); ++i)
+        {
+            if (delimSearchInit(preferred[i]))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    DelimIndexFunc impl = findImpl(level);
+    if (impl == NULL)
+    {
+        return false;
+    }
+
+    delimIndexImpl = impl;
+    currentLevel = level;
+    return true;
+}
+
+SimdLevel delimSearchLevel()
+{
+    return currentLevel;
+}
+
+static const char* const levelNames[] = {
+        [SIMD_AUTO] = "auto",
+        [SIMD_SCALAR] = "scalar",
+        [SIMD_SWAR] = "swar",
+        [SIMD_SSE2] = "sse2",
+        [SIMD_SSE42] = "sse4.2",
+        [SIMD_AVX2] = "avx2"
+};
+
+bool simdLevelParse(const char* name, SimdLevel* outLevel)
+{
+    for (uint32_t i = 0; i < sizeof(levelNames) / sizeof(levelNames[0]); ++i)
+    {
+        if (strcmp(name, levelNames[i]) == 0)
+        {
+            *outLevel = (SimdLevel) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* simdLevelName(SimdLevel level)
+{
+    return levelNames[level];
+}
@@ -0,0 +1,393 @@
+#include "follow.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+#include "state.h"
+#include "profile.h"
+
+typedef struct Follower
+{
+    const Computation* const* computations;
+    const char* const* outPaths;
+    const char* const* statePaths;
+    uint32_t numComputations;
+    uint32_t numThreads;
+
+    // The workers, which keep everything read so far from one round to the next.
+    ComputationRun* run;
+    // The position of the first line that hasn't been read yet, and the checksum of the file until there
+    // (see rsChecksum): when it changes, the file has been replaced.
+    uint64_t offset;
+    uint64_t checksum;
+    // The results as they were last written, so they're only written again when they change.
+    char* results[MAX_COMPUTATIONS];
+    size_t resultLens[MAX_COMPUTATIONS];
+} Follower;
+
+static void sleepMs(uint32_t ms)
+{
+#ifdef WIN32
+    Sleep(ms);
+#else
+    struct timespec duration = {ms / 1000, (long) (ms % 1000) * 1000000L};
+    nanosleep(&duration, NULL);
+#endif
+}
+
+// Reads the entire file into a new buffer, to be freed with free. Returns NULL on failure.
+static char* readAll(FILE* file, size_t* outLen)
+{
+    if (fseek(file, 0, SEEK_END) != 0)
+    {
+        return NULL;
+    }
+    long len = ftell(file);
+    if (len < 0)
+    {
+        return NULL;
+    }
+    rewind(file);
+
+    char* text = malloc(len > 0 ? len : 1);
+    if (text != NULL && fread(text, 1, len, file) != (size_t) len)
+    {
+        free(text);
+        return NULL;
+    }
+
+    *outLen = (size_t) len;
+    return text;
+}
+
+// Writes the results of a computation, in its file or to stdout when path is NULL.
+// The file is written under another name and then renamed, so whoever reads it never sees half of it.
+static bool writeResults(const char* path, const char* text, size_t len, char errMsg[ERR_MAX])
+{
+    if (path == NULL)
+    {
+        fwrite(text, 1, len, stdout);
+        fputc('\n', stdout);
+        fflush(stdout);
+        return true;
+    }
+
+    char tempPath[4096];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+
+    FILE* file = fopen(tempPath, "wb");
+    if (file == NULL)
+    {
+        snprintf(errMsg, ERR_MAX, "Impossible de créer le fichier « %s.tmp » : %s", path, strerror(errno));
+        return false;
+    }
+
+    bool written = fwrite(text, 1, len, file) == len;
+    written = fclose(file) == 0 && written;
+    if (!written || rename(tempPath, path) != 0)
+    {
+        snprintf(errMsg, ERR_MAX, "Impossible d'écrire le fichier « %s » : %s", path, strerror(errno));
+        remove(tempPath);
+        return false;
+    }
+    return true;
+}
+
+static FILE* createTempFile(char errMsg[ERR_MAX])
+{
+    FILE* file = tmpfile();
+    if (file == NULL)
+    {
+        snprintf(errMsg, ERR_MAX, "Impossible de créer un fichier temporaire : %s", strerror(errno));
+    }
+    return file;
+}
+
+// Runs finish on a copy of the workers: finish merges them and frees them, but ours must carry on with the
+// next lines. The copy is made by fork, so it's (almost) free: only the memory changed by the merge is copied.
+// The child process writes the results and the states in the given files, which the parent reads afterwards.
+static bool finishCopy(Follower* f, const RouteStream* stream, FILE* const* results, FILE* const* statesOut,
+                       char errMsg[ERR_MAX])
+{
+#ifdef WIN32
+    // Files can't be mapped on Windows, so --follow is refused long before getting here.
+    snprintf(errMsg, ERR_MAX, "impossible de suivre un fichier sous Windows");
+    return false;
+#else
+    // Whatever is still in the buffers of the files would be written by both processes otherwise.
+    fflush(NULL);
+
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        snprintf(errMsg, ERR_MAX, "Impossible de créer le processus des résultats : %s", strerror(errno));
+        return false;
+    }
+
+    if (pid == 0)
+    {
+        computationsFinish(f->run, stream, results, statesOut);
+
+        bool written = true;
+        for (uint32_t c = 0; c < f->numComputations; ++c)
+        {
+            written = fflush(results[c]) == 0 && !ferror(results[c]) && written;
+            if (statesOut != NULL)
+            {
+                written = fflush(statesOut[c]) == 0 && !ferror(statesOut[c]) && written;
+            }
+        }
+        // Leave right away, without closing anything: everything else belongs to the parent.
+        _exit(written ? 0 : 1);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1)
+    {
+        if (errno != EINTR)
+        {
+            snprintf(errMsg, ERR_MAX, "Impossible d'attendre le processus des résultats : %s", strerror(errno));
+            return false;
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        snprintf(errMsg, ERR_MAX, "Le processus des résultats a échoué");
+        return false;
+    }
+    return true;
+#endif
+}
+
+// Writes the results of everything read so far, when they're not the same as last time.
+// With a state folder, the states are saved as well.
+static bool publish(Follower* f, const RouteStream* stream, char errMsg[ERR_MAX])
+{
+    FILE* results[MAX_COMPUTATIONS] = {NULL};
+    FILE* statesOut[MAX_COMPUTATIONS] = {NULL};
+
+    bool ok = true;
+    for (uint32_t c = 0; c < f->numComputations && ok; ++c)
+    {
+        results[c] = createTempFile(errMsg);
+        ok = results[c] != NULL;
+        if (ok && f->statePaths != NULL)
+        {
+            statesOut[c] = stateCreate(f->statePaths[c], errMsg);
+            ok = statesOut[c] != NULL;
+        }
+    }
+
+    ok = ok && finishCopy(f, stream, results, f->statePaths != NULL ? statesOut : NULL, errMsg);
+
+    for (uint32_t c = 0; c < f->numComputations; ++c)
+    {
+        if (statesOut[c] != NULL && !stateCommit(statesOut[c], f->statePaths[c], ok, errMsg))
+        {
+            ok = false;
+        }
+    }
+
+    for (uint32_t c = 0; c < f->numComputations; ++c)
+    {
+        if (results[c] == NULL)
+        {
+            continue;
+        }
+
+        size_t len;
+        char* text = ok ? readAll(results[c], &len) : NULL;
+        if (ok && text == NULL)
+        {
+            snprintf(errMsg, ERR_MAX, "Impossible de relire les résultats de « %s »", f->computations[c]->name);
+            ok = false;
+        }
+
+        if (text != NULL)
+        {
+            bool changed = f->results[c] == NULL || len != f->resultLens[c]
+                           || memcmp(text, f->results[c], len) != 0;
+            if (changed)
+            {
+                ok = writeResults(f->outPaths != NULL ? f->outPaths[c] : NULL, text, len, errMsg);
+            }
+
+            free(f->results[c]);
+            f->results[c] = text;
+            f->resultLens[c] = len;
+        }
+
+        fclose(results[c]);
+    }
+
+    return ok;
+}
+
+// Gives the lines of the stream that haven't been read yet to the workers, and writes the new results.
+static bool readRound(Follower* f, RouteStream* stream, char errMsg[ERR_MAX])
+{
+    PROFILER_START("Computations");
+
+    computationsRead(f->run, stream);
+    bool ok = rsCheck(stream, errMsg);
+
+    f->offset = rsTell(stream);
+    // Can't fail, we've just read all of it.
+    bool checked = rsChecksum(stream, f->offset, &f->checksum);
+    assert(checked);
+    (void) checked;
+
+    ok = ok && publish(f, stream, errMsg);
+
+    PROFILER_END();
+
+    // Each round is a new run of the computation scopes: keep the JSON file of the profiler up to date.
+    // Not being able to write it isn't a reason to stop following the file.
+    profilerWriteJson();
+
+    return ok;
+}
+
+// Reads the entire file with new workers, starting from the saved states when there's a state folder.
+static bool firstRound(Follower* f, RouteStream* stream, char errMsg[ERR_MAX])
+{
+    // Only whole lines are read: the last one is most likely still being written, it'll be read next time.
+    rsIgnoreUnfinishedLine(stream);
+
+    FILE* statesIn[MAX_COMPUTATIONS] = {NULL};
+    for (uint32_t c = 0; f->statePaths != NULL && c < f->numComputations; ++c)
+    {
+        statesIn[c] = fopen(f->statePaths[c], "rb");
+    }
+
+    bool ok = computationsStart(f->run, stream, f->computations, f->statePaths != NULL ? statesIn : NULL,
+                                f->numComputations, f->numThreads, errMsg);
+
+    for (uint32_t c = 0; c < f->numComputations; ++c)
+    {
+        if (statesIn[c] != NULL)
+        {
+            fclose(statesIn[c]);
+        }
+    }
+
+    return ok && readRound(f, stream, errMsg);
+}
+
+// Frees the workers, when the file has to be read from the start. Only finish knows how to free them,
+// so it's given a temporary file for the results, which is thrown away.
+static bool discardWorkers(Follower* f, const RouteStream* stream, char errMsg[ERR_MAX])
+{
+    if (f->run->numWorkers == 0)
+    {
+        return true;
+    }
+
+    FILE* trash = createTempFile(errMsg);
+    if (trash == NULL)
+    {
+        return false;
+    }
+
+    FILE* outputs[MAX_COMPUTATIONS];
+    for (uint32_t c = 0; c < f->numComputations; ++c)
+    {
+        outputs[c] = trash;
+    }
+    computationsFinish(f->run, stream, outputs, NULL);
+
+    fclose(trash);
+    return true;
+}
+
+void followComputations(RouteStream* stream, const char* path,
+                        const Computation* const* computations, const char* const* outPaths,
+                        const char* const* statePaths, uint32_t numComputations, uint32_t numThreads,
+                        uint32_t intervalMs, char errMsg[ERR_MAX])
+{
+    Follower f = {computations, outPaths, statePaths, numComputations, numThreads};
+    // Way too big for the stack.
+    f.run = calloc(1, sizeof(ComputationRun));
+    assert(f.run);
+
+    // We don't know what the file looked like when the stream was opened, so the first check always
+    // maps it again. It's cheap, and won't print anything new if nothing has changed.
+    struct stat last;
+    bool known = false;
+
+    bool ok = firstRound(&f, stream, errMsg);
+    while (ok)
+    {
+        sleepMs(intervalMs);
+
+        // The file may be missing or empty for a moment while it's being replaced, just wait for it.
+        struct stat now;
+        if (stat(path, &now) != 0 || now.st_size == 0)
+        {
+            continue;
+        }
+        if (known && now.st_size == last.st_size && now.st_mtime == last.st_mtime)
+        {
+            continue;
+        }
+        last = now;
+        known = true;
+
+        // Map the file again, to see the lines added since the last time.
+        RouteStream next = rsOpenMapped(path);
+        if (!rsCheck(&next, errMsg))
+        {
+            ok = false;
+            break;
+        }
+        rsIgnoreUnfinishedLine(&next);
+
+        uint64_t checksum;
+        if (rsChecksum(&next, f.offset, &checksum) && checksum == f.checksum)
+        {
+            // Same file, with (maybe) a few more lines: the strings keep their ids, and we carry on from there.
+            rsTakeStrings(&next, stream);
+            rsClose(stream);
+            *stream = next;
+
+            // Can't fail: the file hasn't changed until there.
+            bool seeked = rsSeek(stream, f.offset);
+            assert(seeked);
+            (void) seeked;
+
+            if (stream->readBufChars != f.offset)
+            {
+                ok = readRound(&f, stream, errMsg);
+            }
+        }
+        else
+        {
+            // Cut short, or replaced by another file: read it again from the start.
+            ok = discardWorkers(&f, stream, errMsg);
+            rsClose(stream);
+            *stream = next;
+            ok = ok && firstRound(&f, stream, errMsg);
+        }
+    }
+
+    char ignored[ERR_MAX];
+    discardWorkers(&f, stream, ignored);
+    rsClose(stream);
+    free(f.run);
+    for (uint32_t c = 0; c < numComputations; ++c)
+    {
+        free(f.results[c]);
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef FOLLOW_H
+#define FOLLOW_H
+
+/*
+ * follow.h
+ * ---------------
+ * The --follow mode: keeps watching the file once it has been read, a bit like "tail -f".
+ * Every time lines are added, only those are read, and the results are printed again if they've changed.
+ *
+ * The workers of the computations stay alive from one round to the next (see ComputationRun): a round maps
+ * the file again, and only gives them the lines after the ones already read. The results are then printed
+ * by a copy of the workers (see finishCopy in follow.c), as finish merges and frees them.
+ * Just like with --state (see state.h), the beginning of the file is checked with a checksum:
+ * if the file is replaced by another one, or cut short, it's read again from the start.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "route.h"
+#include "computations/computations.h"
+
+// Runs the computations on the stream (which must be in RS_MAPPED mode), then keeps watching the file at path,
+// checking every intervalMs milliseconds whether it has changed.
+// Results are written in outPaths (replaced at once, so they're always complete), or printed to stdout
+// followed by an empty line when outPaths is NULL.
+// When statePaths isn't NULL, the first round starts from the states saved there, and they're saved again
+// after each round.
+// Only returns when something goes wrong, with an error message. The stream is closed.
+void followComputations(RouteStream* stream, const char* path,
+                        const Computation* const* computations, const char* const* outPaths,
+                        const char* const* statePaths, uint32_t numComputations, uint32_t numThreads,
+                        uint32_t intervalMs, char errMsg[ERR_MAX]);
+
+#endif //FOLLOW_H
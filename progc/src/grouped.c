@@ -0,0 +1,238 @@
+#include "compile_settings.h"
+
+#if EXPERIMENTAL_ALGO
+
+#include "grouped.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+bool groupedInputAllowed = true;
+
+void groupedInit(GroupedReader* reader, uint32_t itemSize, GroupedRunFunc runFunc, void* runData)
+{
+    assert(itemSize > 0);
+
+    *reader = (GroupedReader) {
+        .mode = GROUPED_UNDECIDED,
+        .itemSize = itemSize,
+        .runFunc = runFunc,
+        .runData = runData
+    };
+}
+
+void groupedFree(GroupedReader* reader)
+{
+    free(reader->current.items);
+    free(reader->first.items);
+    free(reader->finished);
+    reader->current = (GroupedRun) {0};
+    reader->first = (GroupedRun) {0};
+    reader->finished = NULL;
+    reader->finishedWords = 0;
+}
+
+bool groupedStart(GroupedReader* reader, RouteStream* part)
+{
+    // Already using the partitioner? (When a saved state has been loaded, for example.)
+    if (reader->mode == GROUPED_PARTITIONED)
+    {
+        return false;
+    }
+    assert(reader->mode == GROUPED_UNDECIDED);
+
+    if (groupedInputAllowed && rsMark(part, &reader->partMark))
+    {
+        reader->mode = GROUPED_STREAMING;
+        reader->part = part;
+        return true;
+    }
+    else
+    {
+        reader->mode = GROUPED_PARTITIONED;
+        return false;
+    }
+}
+
+static inline bool isFinished(const uint64_t* bits, uint32_t numWords, uint32_t routeId)
+{
+    return routeId / 64 < numWords && (bits[routeId / 64] >> (routeId % 64) & 1);
+}
+
+static void markFinished(GroupedReader* reader, uint32_t routeId)
+{
+    if (routeId / 64 >= reader->finishedWords)
+    {
+        uint32_t newWords = reader->finishedWords == 0 ? 1024 : reader->finishedWords;
+        while (newWords <= routeId / 64)
+        {
+            newWords *= 2;
+        }
+
+        reader->finished = realloc(reader->finished, sizeof(uint64_t) * newWords);
+        assert(reader->finished);
+        memset(reader->finished + reader->finishedWords, 0, sizeof(uint64_t) * (newWords - reader->finishedWords));
+        reader->finishedWords = newWords;
+    }
+
+    reader->finished[routeId / 64] |= (uint64_t) 1 << (routeId % 64);
+}
+
+static void runPush(GroupedRun* run, const void* item, uint32_t itemSize)
+{
+    if (run->size == run->capacity)
+    {
+        run->capacity = run->capacity == 0 ? 64 : run->capacity * 2;
+        run->items = realloc(run->items, (size_t) run->capacity * itemSize);
+        assert(run->items);
+    }
+
+    memcpy(run->items + (size_t) run->size * itemSize, item, itemSize);
+    run->size++;
+}
+
+bool groupedNextRun(GroupedReader* reader, uint32_t routeId, const void* item)
+{
+    assert(reader->mode == GROUPED_STREAMING);
+
+    GroupedRun* run = &reader->current;
+    if (run->size != 0 && run->routeId == routeId)
+    {
+        // Same route, the run just needs more room.
+        runPush(run, item, reader->itemSize);
+        return true;
+    }
+
+    if (run->size != 0)
+    {
+        if (!reader->hasFirst)
+        {
+            // The first run may be the end of a route of the previous part: keep it for groupedFinish.
+            // Swapping the runs lets us reuse the memory of the (empty) first run.
+            GroupedRun empty = reader->first;
+            reader->first = *run;
+            *run = empty;
+            reader->hasFirst = true;
+        }
+        else
+        {
+            markFinished(reader, run->routeId);
+            reader->runFunc(reader->runData, run->routeId, run->items, run->size);
+        }
+        run->size = 0;
+    }
+
+    // Have we already seen this route? Then it's not grouped.
+    if (routeId >= GROUPED_MAX_ROUTE_ID
+        || isFinished(reader->finished, reader->finishedWords, routeId)
+        || (reader->hasFirst && reader->first.routeId == routeId))
+    {
+        return false;
+    }
+
+    run->routeId = routeId;
+    runPush(run, item, reader->itemSize);
+    return true;
+}
+
+void groupedRewind(GroupedReader* reader)
+{
+    assert(reader->mode == GROUPED_STREAMING);
+
+    rsRewind(reader->part, reader->partMark);
+    groupedFree(reader);
+    reader->hasFirst = false;
+    reader->mode = GROUPED_PARTITIONED;
+}
+
+bool groupedFinish(GroupedReader* const* readers, uint32_t numReaders, GroupedRunFunc runFunc, void* runData)
+{
+    // Check that all parts have been read route by route.
+    // (A reader that hasn't read anything is fine too: its part is empty.)
+    for (uint32_t r = 0; r < numReaders; ++r)
+    {
+        if (readers[r]->mode == GROUPED_PARTITIONED)
+        {
+            return false;
+        }
+    }
+
+    // The first and last runs of all parts, in the order of the file.
+    const GroupedRun** edges = malloc(sizeof(GroupedRun*) * 2 * (numReaders > 0 ? numReaders : 1));
+    assert(edges);
+    uint32_t numEdges = 0;
+    uint32_t numWords = 0;
+    for (uint32_t r = 0; r < numReaders; ++r)
+    {
+        const GroupedReader* reader = readers[r];
+        if (reader->hasFirst)
+        {
+            edges[numEdges++] = &reader->first;
+        }
+        if (reader->current.size != 0)
+        {
+            edges[numEdges++] = &reader->current;
+        }
+        numWords = reader->finishedWords > numWords ? reader->finishedWords : numWords;
+    }
+    for (uint32_t e = 0; e < numEdges; ++e)
+    {
+        numWords = edges[e]->routeId / 64 + 1 > numWords ? edges[e]->routeId / 64 + 1 : numWords;
+    }
+
+    // All the routes read so far, by any part.
+    uint64_t* seen = calloc(numWords > 0 ? numWords : 1, sizeof(uint64_t));
+    assert(seen);
+
+    // First, no route can be finished by two parts.
+    bool grouped = true;
+    for (uint32_t r = 0; r < numReaders && grouped; ++r)
+    {
+        const GroupedReader* reader = readers[r];
+        for (uint32_t i = 0; i < reader->finishedWords; ++i)
+        {
+            grouped = grouped && (seen[i] & reader->finished[i]) == 0;
+            seen[i] |= reader->finished[i];
+        }
+    }
+
+    // Then, the first and last runs can only be joined with the ones right next to them.
+    for (uint32_t e = 0; e < numEdges && grouped; ++e)
+    {
+        uint32_t routeId = edges[e]->routeId;
+        if (e == 0 || edges[e - 1]->routeId != routeId)
+        {
+            grouped = !isFinished(seen, numWords, routeId);
+            seen[routeId / 64] |= (uint64_t) 1 << (routeId % 64);
+        }
+    }
+    free(seen);
+
+    if (grouped)
+    {
+        // Everything's fine: join the runs of the same route, and give them to the computation.
+        uint32_t itemSize = readers[0]->itemSize;
+        GroupedRun joined = {0};
+        for (uint32_t e = 0; e < numEdges; ++e)
+        {
+            const GroupedRun* run = edges[e];
+            joined.routeId = run->routeId;
+            for (uint32_t i = 0; i < run->size; ++i)
+            {
+                runPush(&joined, run->items + (size_t) i * itemSize, itemSize);
+            }
+
+            if (e == numEdges - 1 || edges[e + 1]->routeId != run->routeId)
+            {
+                runFunc(runData, joined.routeId, joined.items, joined.size);
+                joined.size = 0;
+            }
+        }
+        free(joined.items);
+    }
+
+    free(edges);
+    return grouped;
+}
+
+#endif
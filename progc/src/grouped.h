@@ -0,0 +1,130 @@
+#ifndef GROUPED_H
+#define GROUPED_H
+
+/*
+ * grouped.h
+ * -----------------------
+ * In most files, all the steps of a route are written one after the other: the file is "grouped" by route.
+ * Then, we don't need to copy every step into a partitioner (see partition.h) to find all the steps of a route:
+ * we can read the file route by route, and aggregate each route as soon as its last step has been read.
+ * Only the steps of the current route are kept in memory, and there's no second pass over all the steps!
+ *
+ * The GroupedReader does just that for a worker. Steps are added one by one, and each time the route changes,
+ * the finished route (a "run" of steps) is given to the computation.
+ * To make sure the file really is grouped, the reader remembers every route it has finished, with a bit per route id.
+ * If one of them shows up again, the worker forgets everything and reads its part again from the start,
+ * with the partitioner this time (see groupedRewind).
+ *
+ * When the file is split in multiple parts, a route can be cut in two by the end of a part. So the first run
+ * and the last run of each part are kept aside, and given to the computation by groupedFinish once all parts
+ * have been read, joined with the runs of the same route in the neighbouring parts.
+ * groupedFinish also checks that no other route has been read by two parts; if one has, the parts
+ * have to be read again with the partitioner.
+ *
+ * Only available with EXPERIMENTAL_ALGO, just like the partitioner.
+ */
+
+#include "compile_settings.h"
+#if EXPERIMENTAL_ALGO
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "route.h"
+
+// Past that route id, the bits of the finished routes would take too much memory (32 MB), use the partitioner.
+#define GROUPED_MAX_ROUTE_ID (1u << 28)
+
+// Whether workers can read their part route by route. Set by runComputations before creating the workers:
+// saved states (see state.h) need all the routes of the file, so they're only made with the partitioner.
+extern bool groupedInputAllowed;
+
+// Aggregates a finished run: all the steps of a route, in the order of the file.
+typedef void (*GroupedRunFunc)(void* data, uint32_t routeId, const void* items, uint32_t numItems);
+
+typedef enum GroupedMode
+{
+    // Nothing has been read yet.
+    GROUPED_UNDECIDED,
+    // The part is read route by route.
+    GROUPED_STREAMING,
+    // The steps go to the partitioner, as usual.
+    GROUPED_PARTITIONED
+} GroupedMode;
+
+// The steps of a route, copied from the file.
+typedef struct GroupedRun
+{
+    uint32_t routeId;
+    uint32_t size; // In items, 0 when the run is empty.
+    uint32_t capacity;
+    uint8_t* items;
+} GroupedRun;
+
+typedef struct GroupedReader
+{
+    GroupedMode mode;
+    uint32_t itemSize;
+    GroupedRunFunc runFunc;
+    void* runData;
+
+    // The part being read, and where it begins, to read it again if the file isn't grouped after all.
+    // The part must still be there when calling groupedRewind from finish (it is, see runComputations).
+    RouteStream* part;
+    RsMark partMark;
+
+    // The route being read. Once the part is over, it's the last run.
+    GroupedRun current;
+    // The first run of the part, once it's finished.
+    GroupedRun first;
+    bool hasFirst;
+
+    // One bit per route id, set once the route has been given to runFunc.
+    uint64_t* finished;
+    uint32_t finishedWords;
+} GroupedReader;
+
+// Creates a reader giving the runs to runFunc(runData, ...), with items of itemSize bytes.
+void groupedInit(GroupedReader* reader, uint32_t itemSize, GroupedRunFunc runFunc, void* runData);
+
+void groupedFree(GroupedReader* reader);
+
+// Starts reading the part route by route, if allowed, if the reader isn't already using the partitioner,
+// and if the part can be read again later (see rsMark).
+// Returns false when the part must be read with the partitioner instead: the mode is then GROUPED_PARTITIONED.
+bool groupedStart(GroupedReader* reader, RouteStream* part);
+
+// Used by groupedAdd when the route changes. Returns false when the new route has already been read.
+bool groupedNextRun(GroupedReader* reader, uint32_t routeId, const void* item);
+
+// Adds the next step of the part, given as an item of itemSize bytes.
+// Returns false when its route has already been read before: the file isn't grouped. Call groupedRewind then.
+static inline bool groupedAdd(GroupedReader* reader, uint32_t routeId, const void* item)
+{
+    GroupedRun* run = &reader->current;
+    if (run->routeId == routeId && run->size != 0 && run->size < run->capacity)
+    {
+        memcpy(run->items + (size_t) run->size * reader->itemSize, item, reader->itemSize);
+        run->size++;
+        return true;
+    }
+
+    return groupedNextRun(reader, routeId, item);
+}
+
+// Goes back to the beginning of the part, which must now be read with the partitioner (GROUPED_PARTITIONED).
+// Everything aggregated by runFunc must be forgotten as well, that's up to the computation.
+void groupedRewind(GroupedReader* reader);
+
+// Once all parts have been read, checks that every route has been read by a single part.
+// Then, the first and last runs of all parts are given to runFunc(runData, ...), joined together when they're
+// the same route, and returns true.
+// Returns false when a reader used the partitioner, or when the file isn't grouped:
+// all parts must then be read with the partitioner, and the readers still in GROUPED_STREAMING mode rewound.
+bool groupedFinish(GroupedReader* const* readers, uint32_t numReaders, GroupedRunFunc runFunc, void* runData);
+
+#else
+#warning "grouped.h can only be used if EXPERIMENTAL_ALGO is on!"
+#endif
+#endif //GROUPED_H
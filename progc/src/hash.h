@@ -0,0 +1,132 @@
+#ifndef HASH_H
+#define HASH_H
+
+/*
+ * hash.h
+ * -----------------------
+ * The hash functions used by all hash tables of the program: pick the one that fits the keys!
+ * - hashFibonacci: for dense integer keys, like route ids. Just a multiplication by 2^32 / golden ratio,
+ *   but consecutive keys land as far as possible from each other (see the three-distance theorem),
+ *   so there are even less collisions than with a "random" hash. Only the highest bits are good!
+ * - hashMix64: for other integer keys. Every bit of the key changes about half the bits of the hash,
+ *   so any pattern in the keys disappears.
+ * - hashString: for strings (driver and town names...). Reads 8 bytes at a time instead of one,
+ *   in the style of wyhash, and all the 64 bits of the hash are good.
+ *
+ * The maps of map.h take the highest bits of the hash with hashTopBits.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+// The finalizer of SplitMix64.
+static inline uint64_t hashMix64(uint64_t value)
+{
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31);
+}
+
+// Use the highest bits only, with hashTopBits.
+static inline uint32_t hashFibonacci(uint32_t value)
+{
+    return value * 2654435769U;
+}
+
+// The highest bits of a 32-bit hash (bits must be between 1 and 32).
+static inline uint32_t hashTopBits(uint32_t hash, uint32_t bits)
+{
+    return (uint32_t) ((uint64_t) hash >> (32 - bits));
+}
+
+// Multiplies a and b, giving the low and high 64 bits of the 128-bit result.
+static inline void hashMul128(uint64_t a, uint64_t b, uint64_t* outLow, uint64_t* outHigh)
+{
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t) a * b;
+    *outLow = (uint64_t) r;
+    *outHigh = (uint64_t) (r >> 64);
+#else
+    // No 128-bit integers (MSVC): multiply the 32-bit halves, like at school.
+    uint64_t aLow = (uint32_t) a, aHigh = a >> 32;
+    uint64_t bLow = (uint32_t) b, bHigh = b >> 32;
+    uint64_t ll = aLow * bLow, lh = aLow * bHigh, hl = aHigh * bLow, hh = aHigh * bHigh;
+    uint64_t middle = (ll >> 32) + (uint32_t) lh + (uint32_t) hl;
+    *outLow = (middle << 32) | (uint32_t) ll;
+    *outHigh = hh + (lh >> 32) + (hl >> 32) + (middle >> 32);
+#endif
+}
+
+// Multiplies a and b, and folds the 128-bit result into 64 bits.
+static inline uint64_t hashMum(uint64_t a, uint64_t b)
+{
+    uint64_t low, high;
+    hashMul128(a, b, &low, &high);
+    return low ^ high;
+}
+
+static inline uint64_t hashRead64(const char* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hashRead32(const char* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// The constants of wyhash.
+#define HASH_SECRET0 0x2D358DCCAA6C78A5ULL
+#define HASH_SECRET1 0x8BB84B93962EACC9ULL
+#define HASH_SECRET2 0x4B33A62ED433D4A3ULL
+
+// Only reads the len characters of str, which doesn't need a null terminator.
+static inline uint64_t hashString(const char* str, uint32_t len)
+{
+    uint64_t seed = HASH_SECRET0;
+    uint64_t a, b;
+    if (len <= 16)
+    {
+        // Short strings (most names!) are read with at most 4 reads that may overlap, without any loop.
+        if (len >= 4)
+        {
+            uint32_t middle = (len >> 3) << 2;
+            a = (hashRead32(str) << 32) | hashRead32(str + middle);
+            b = (hashRead32(str + len - 4) << 32) | hashRead32(str + len - 4 - middle);
+        }
+        else if (len > 0)
+        {
+            a = ((uint64_t) (uint8_t) str[0] << 16) | ((uint64_t) (uint8_t) str[len >> 1] << 8)
+                | (uint8_t) str[len - 1];
+            b = 0;
+        }
+        else
+        {
+            a = 0;
+            b = 0;
+        }
+    }
+    else
+    {
+        uint32_t i = len;
+        const char* p = str;
+        while (i > 16)
+        {
+            seed = hashMum(hashRead64(p) ^ HASH_SECRET1, hashRead64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        // The last 16 characters, which may overlap with the ones read in the loop.
+        a = hashRead64(p + i - 16);
+        b = hashRead64(p + i - 8);
+    }
+
+    hashMul128(a ^ HASH_SECRET1, b ^ seed, &a, &b);
+    return hashMum(a ^ HASH_SECRET0 ^ len, b ^ HASH_SECRET2);
+}
+
+#endif //HASH_H
@@ -0,0 +1,395 @@
+#include "interner.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdbool.h>
+
+#include "hash.h"
+#include "profile.h"
+#include "portable.h"
+
+#define LOAD_ACQUIRE(ptr) ATOMIC_LOAD(ptr, ATOMIC_ACQUIRE)
+#define STORE_RELEASE(ptr, val) ATOMIC_STORE(ptr, val, ATOMIC_RELEASE)
+// Sequentially consistent, so the table can't be frozen while a thread starts writing in it (see startWriting).
+#define LOAD_SEQ(ptr) ATOMIC_LOAD(ptr, ATOMIC_SEQ_CST)
+#define FETCH_ADD(ptr, val) ATOMIC_FETCH_ADD(ptr, val, ATOMIC_SEQ_CST)
+#define FETCH_SUB(ptr, val) ATOMIC_FETCH_SUB(ptr, val, ATOMIC_SEQ_CST)
+#define CAS(ptr, expected, desired) ATOMIC_CAS(ptr, expected, desired)
+
+#if defined(__unix__) || defined(__APPLE__)
+#define INTERNER_THREADS 1
+#include <sched.h>
+#define YIELD() sched_yield()
+#define THREAD_LOCAL _Thread_local
+#else
+// No threads, no problem.
+#define INTERNER_THREADS 0
+#define YIELD() ((void) 0)
+#define THREAD_LOCAL
+#endif
+
+// The size of the blocks containing the copied strings. Each thread has its own block.
+#define STRING_BLOCK_SIZE (64 * 1024)
+
+// idPlusOne of a slot taken by a thread that is still writing the string in it.
+#define SLOT_BUSY UINT32_MAX
+
+// A slot of the hash table, empty when idPlusOne is 0.
+// All other fields are written before idPlusOne, so a thread seeing a valid idPlusOne can read them safely.
+typedef struct InternSlot
+{
+    uint32_t idPlusOne;
+    uint32_t hash;
+    uint32_t len;
+    const char* str;
+} InternSlot;
+
+typedef struct InternTable
+{
+    // The previous (smaller) table. Other threads might still be reading it, so it's freed with the interner.
+    struct InternTable* previous;
+    uint32_t capacity; // Power of two
+    // The number of slots taken.
+    uint32_t used;
+    // The number of threads adding strings to this table right now.
+    uint32_t writers;
+    // Set when the table is about to be replaced by a bigger one: no more strings can be added.
+    bool frozen;
+    InternSlot slots[];
+} InternTable;
+
+typedef struct StringBlock
+{
+    struct StringBlock* previous;
+    size_t used;
+    size_t size;
+    char data[];
+} StringBlock;
+
+typedef struct InternedString
+{
+    const char* str;
+    uint32_t len;
+} InternedString;
+
+// The strings are stored by id in segments that never move: segment s has FIRST_SEGMENT_SIZE * 2^s strings.
+// So there's no realloc while other threads are writing in there.
+#define FIRST_SEGMENT_BITS 12
+#define FIRST_SEGMENT_SIZE (1u << FIRST_SEGMENT_BITS)
+#define NUM_SEGMENTS 20
+
+struct Interner
+{
+    // The current hash table, read by all threads without locking.
+    InternTable* table;
+    // The number of strings, and the id of the next one.
+    uint32_t size;
+    // All strings, by their id. Segments are allocated when needed.
+    InternedString* segments[NUM_SEGMENTS];
+    // The blocks of all threads, containing all the copied strings.
+    StringBlock* blocks;
+    // Tells apart the interners, for the blocks of each thread.
+    uint64_t serial;
+};
+
+static uint64_t nextSerial = 1;
+
+// The block where this thread copies the strings of the interner with this serial number.
+// A thread only keeps the block of one interner, which is fine: a thread works with one stream at a time.
+static THREAD_LOCAL struct
+{
+    uint64_t serial;
+    StringBlock* block;
+} threadBlock;
+
+static InternTable* createTable(uint32_t capacity)
+{
+    InternTable* table = calloc(1, sizeof(InternTable) + sizeof(InternSlot) * capacity);
+    assert(table);
+    PROFILER_COUNT(PROFILE_ALLOCS, 1);
+
+    table->capacity = capacity;
+    return table;
+}
+
+// Finds the string in the table, without waiting for anyone. Returns its id + 1,
+// or 0 when it's not there (or when another thread is still adding a string in its way).
+static uint32_t findInTable(const InternTable* table, uint32_t hash, const char* str, uint32_t len)
+{
+    uint32_t mask = table->capacity - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        const InternSlot* slot = &table->slots[i];
+        uint32_t idPlusOne = LOAD_ACQUIRE(&slot->idPlusOne);
+        if (idPlusOne == 0 || idPlusOne == SLOT_BUSY)
+        {
+            return 0;
+        }
+        if (slot->hash == hash && slot->len == len && memcmp(slot->str, str, len) == 0)
+        {
+            return idPlusOne;
+        }
+    }
+}
+
+// Copies the string in the block of this thread, with a null terminator.
+static const char* copyString(Interner* interner, const char* str, uint32_t len)
+{
+    StringBlock* block = threadBlock.serial == interner->serial ? threadBlock.block : NULL;
+    if (block == NULL || block->used + len + 1 > block->size)
+    {
+        size_t size = len + 1 > STRING_BLOCK_SIZE ? len + 1 : STRING_BLOCK_SIZE;
+        block = malloc(sizeof(StringBlock) + size);
+        assert(block);
+        PROFILER_COUNT(PROFILE_ALLOCS, 1);
+        block->used = 0;
+        block->size = size;
+
+        // Add it to the list of all blocks, so it's freed with the interner.
+        block->previous = LOAD_ACQUIRE(&interner->blocks);
+        while (!CAS(&interner->blocks, &block->previous, block)) {}
+
+        threadBlock.serial = interner->serial;
+        threadBlock.block = block;
+    }
+
+    char* copy = block->data + block->used;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    block->used += len + 1;
+
+    return copy;
+}
+
+// Finds the segment of the string with this id, and its index in the segment.
+static inline uint32_t findSegment(uint32_t id, uint32_t* outIndex)
+{
+    // Segment s has the ids from FIRST_SEGMENT_SIZE * (2^s - 1) to FIRST_SEGMENT_SIZE * (2^(s+1) - 1).
+    uint32_t n = (id >> FIRST_SEGMENT_BITS) + 1;
+    uint32_t segment = 0;
+    while (n >>= 1)
+    {
+        segment++;
+    }
+    assert(segment < NUM_SEGMENTS);
+
+    *outIndex = id - FIRST_SEGMENT_SIZE * ((1u << segment) - 1);
+    return segment;
+}
+
+static void setString(Interner* interner, uint32_t id, const char* str, uint32_t len)
+{
+    uint32_t index;
+    uint32_t s = findSegment(id, &index);
+
+    InternedString* segment = LOAD_ACQUIRE(&interner->segments[s]);
+    if (segment == NULL)
+    {
+        // Many threads might need the segment at the same time: only the first one gets to put its own.
+        InternedString* newSegment = malloc(sizeof(InternedString) * (FIRST_SEGMENT_SIZE << s));
+        assert(newSegment);
+        PROFILER_COUNT(PROFILE_ALLOCS, 1);
+        if (CAS(&interner->segments[s], &segment, newSegment))
+        {
+            segment = newSegment;
+        }
+        else
+        {
+            free(newSegment);
+        }
+    }
+
+    segment[index] = (InternedString) {str, len};
+}
+
+// Registers the thread as a writer of the table. Returns false if the table is being replaced,
+// in which case the thread must wait for the new table.
+static bool startWriting(InternTable* table)
+{
+    (void) FETCH_ADD(&table->writers, 1);
+    if (LOAD_SEQ(&table->frozen))
+    {
+        (void) FETCH_SUB(&table->writers, 1);
+        return false;
+    }
+    return true;
+}
+
+static void stopWriting(InternTable* table)
+{
+    (void) FETCH_SUB(&table->writers, 1);
+}
+
+// Returns the id of the string, adding it to the table if needed (outAdded is then true).
+// The thread must be a writer of the table.
+static uint32_t addToTable(Interner* interner, InternTable* table, uint32_t hash, const char* str, uint32_t len,
+                           bool* outAdded)
+{
+    uint32_t mask = table->capacity - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        InternSlot* slot = &table->slots[i];
+        uint32_t idPlusOne = LOAD_ACQUIRE(&slot->idPlusOne);
+        if (idPlusOne == 0)
+        {
+            if (CAS(&slot->idPlusOne, &idPlusOne, SLOT_BUSY))
+            {
+                // The slot is ours! Only now can we take an id, so ids stay dense.
+                uint32_t id = FETCH_ADD(&interner->size, 1);
+                const char* copy = copyString(interner, str, len);
+                setString(interner, id, copy, len);
+
+                slot->hash = hash;
+                slot->len = len;
+                slot->str = copy;
+                STORE_RELEASE(&slot->idPlusOne, id + 1);
+
+                *outAdded = true;
+                return id;
+            }
+            // Another thread took it just before us. idPlusOne now has its value.
+        }
+
+        // The string in there might be ours, wait until it's written.
+        while (idPlusOne == SLOT_BUSY)
+        {
+            YIELD();
+            idPlusOne = LOAD_ACQUIRE(&slot->idPlusOne);
+        }
+
+        if (slot->hash == hash && slot->len == len && memcmp(slot->str, str, len) == 0)
+        {
+            *outAdded = false;
+            return idPlusOne - 1;
+        }
+    }
+}
+
+// Replaces the frozen table with one twice as big, once all the other threads have stopped writing in it.
+// Threads still reading the old one will just find less strings, and go looking in the new one.
+static void growTable(Interner* interner, InternTable* oldTable)
+{
+    while (LOAD_SEQ(&oldTable->writers) != 0)
+    {
+        YIELD();
+    }
+
+    InternTable* newTable = createTable(oldTable->capacity * 2);
+    newTable->previous = oldTable;
+    newTable->used = oldTable->used;
+
+    uint32_t mask = newTable->capacity - 1;
+    for (uint32_t i = 0; i < oldTable->capacity; ++i)
+    {
+        InternSlot* slot = &oldTable->slots[i];
+        if (slot->idPlusOne != 0)
+        {
+            uint32_t j = slot->hash & mask;
+            while (newTable->slots[j].idPlusOne != 0)
+            {
+                j = (j + 1) & mask;
+            }
+            newTable->slots[j] = *slot;
+        }
+    }
+
+    STORE_RELEASE(&interner->table, newTable);
+}
+
+Interner* internerCreate()
+{
+    Interner* interner = calloc(1, sizeof(Interner));
+    assert(interner);
+
+    interner->table = createTable(4096);
+    interner->serial = FETCH_ADD(&nextSerial, 1);
+
+    return interner;
+}
+
+uint32_t internerIntern(Interner* interner, const char* str, uint32_t len)
+{
+    uint32_t hash = (uint32_t) hashString(str, len);
+
+    // Most of the time, we already know the string.
+    uint32_t idPlusOne = findInTable(LOAD_ACQUIRE(&interner->table), hash, str, len);
+    if (idPlusOne != 0)
+    {
+        return idPlusOne - 1;
+    }
+
+    while (true)
+    {
+        InternTable* table = LOAD_ACQUIRE(&interner->table);
+        if (!startWriting(table))
+        {
+            // Another thread is growing the table, wait for it.
+            while (LOAD_ACQUIRE(&interner->table) == table)
+            {
+                YIELD();
+            }
+            continue;
+        }
+
+        bool added;
+        uint32_t id = addToTable(interner, table, hash, str, len, &added);
+
+        // Keep the table at most half full, so probing stays short. The first thread to see it too full
+        // freezes it, and grows it. (The threads writing in the meantime can add a few more strings,
+        // but not nearly enough to fill the other half.)
+        bool grow = false;
+        if (added && FETCH_ADD(&table->used, 1) + 1 > table->capacity / 2)
+        {
+            bool frozen = false;
+            grow = CAS(&table->frozen, &frozen, true);
+        }
+        stopWriting(table);
+
+        if (grow)
+        {
+            growTable(interner, table);
+        }
+        return id;
+    }
+}
+
+const char* internerGet(const Interner* interner, uint32_t id, uint32_t* outLen)
+{
+    assert(id < interner->size);
+
+    uint32_t index;
+    const InternedString* string = &interner->segments[findSegment(id, &index)][index];
+    *outLen = string->len;
+    return string->str;
+}
+
+uint32_t internerSize(const Interner* interner)
+{
+    return interner->size;
+}
+
+void internerFree(Interner* interner)
+{
+    InternTable* table = interner->table;
+    while (table)
+    {
+        InternTable* previous = table->previous;
+        free(table);
+        table = previous;
+    }
+
+    StringBlock* block = interner->blocks;
+    while (block)
+    {
+        StringBlock* previous = block->previous;
+        free(block);
+        block = previous;
+    }
+
+    for (uint32_t i = 0; i < NUM_SEGMENTS; ++i)
+    {
+        free(interner->segments[i]);
+    }
+    free(interner);
+}
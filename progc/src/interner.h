@@ -0,0 +1,38 @@
+#ifndef INTERNER_H
+#define INTERNER_H
+
+/*
+ * interner.h
+ * ---------------
+ * Gives a unique id to each string, so computations can work with integers instead of strings.
+ * Ids are dense: they go from 0 to the number of strings - 1, in the order strings are first seen.
+ *
+ * Used by RouteStream to give ids to towns and drivers while parsing the file (see STRING_IDS).
+ * The interner can be shared by all the threads reading the file, and never takes a lock:
+ * - looking up a string we already know is just a search in the hash table;
+ * - adding a new string takes its slot in the table with a compare-and-swap, and copies the string
+ *   in a block owned by the thread.
+ * Only when the table gets too full do the threads adding strings wait for a bigger one.
+ */
+
+#include <stdint.h>
+
+typedef struct Interner Interner;
+
+// Creates an empty interner. Exits the program when there's not enough memory.
+Interner* internerCreate();
+
+// Returns the id of the string, adding it to the interner if it's not there yet.
+// The string is copied. Can be called by multiple threads at once.
+uint32_t internerIntern(Interner* interner, const char* str, uint32_t len);
+
+// Returns the string with the given id, which is null-terminated.
+// Must not be called while other threads are adding strings.
+const char* internerGet(const Interner* interner, uint32_t id, uint32_t* outLen);
+
+// Returns the number of strings in the interner.
+uint32_t internerSize(const Interner* interner);
+
+void internerFree(Interner* interner);
+
+#endif //INTERNER_H
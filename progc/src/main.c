@@ -1,10 +1,17 @@
 #include <stdio.h>
 #include <locale.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
 
 #include "profile.h"
 #include "route.h"
 #include "options.h"
+#include "pcb.h"
+#include "delimiter_search.h"
+#include "follow.h"
+#include "state.h"
 #include "computations/computations.h"
 #ifdef WIN32
 #include <windows.h>
@@ -34,37 +41,92 @@ int main(int argv, char** argc)
         fprintf(stderr, "Erreur d'argument : %s\n", optionsErrMsg);
         return 2;
     }
+    profilerSetJsonPath(options.profileJson);
 
-    RouteStream stream = rsOpen(options.file);
+    // Choose the fastest way to parse the file this CPU can do, unless we're told otherwise.
+    if (!delimSearchInit(options.simd))
+    {
+        fprintf(stderr, "Erreur d'argument : les instructions « %s » ne sont pas supportées par ce processeur\n",
+                simdLevelName(options.simd));
+        return 2;
+    }
 
+    // First, check if it's a columnar binary file (.pcb): then there's nothing to parse!
+    // Else, map the file in memory when possible, it avoids copying the file to a buffer.
+    // Else, read the file in the background while parsing it, and if even that fails,
+    // fall back to the good old buffered reading.
+    // Compressed files (gzip, zstd) are always read in the background, since they need to be decompressed.
+    // When asked, use io_uring before mapping, it's the best for huge files that don't fit in the page cache.
     char streamErrMsg[ERR_MAX];
-    if (!rsCheck(&stream, streamErrMsg))
+    // Saved states need the file to be mapped (and so does --follow), so io_uring is out of the question.
+    bool needsMapping = options.stateDir != NULL || options.follow;
+    RouteStream stream = rsOpenColumnar(options.file);
+    bool opened = rsCheck(&stream, streamErrMsg);
+    // A broken .pcb file isn't going to make a better CSV file.
+    if (!opened && stream.sysError == EBADMSG)
     {
         fprintf(stderr, "Erreur lors de l'ouverture du fichier : %s\n", streamErrMsg);
         return 1;
     }
-
-    if (options.computation == COMPUTATION_S)
+    if (!opened && options.ioUring && !needsMapping)
     {
-        computationS(&stream);
+        stream = rsOpenUring(options.file, options.ioDepth, options.ioChunkKB * 1024);
+        opened = rsCheck(&stream, streamErrMsg);
+        if (!opened)
+        {
+            fprintf(stderr, "io_uring indisponible (%s), lecture classique du fichier.\n", streamErrMsg);
+        }
     }
-    else if (options.computation == COMPUTATION_T)
+    if (!opened)
     {
-        computationT(&stream);
+        stream = rsOpenMapped(options.file);
     }
-    else if (options.computation == COMPUTATION_D1)
+    if (!rsCheck(&stream, streamErrMsg))
     {
-        computationD1(&stream);
+        stream = rsOpenPrefetched(options.file);
     }
-    else if (options.computation == COMPUTATION_D2)
+    // Compressed files can only be read in the background, no need to try again.
+    if (!rsCheck(&stream, streamErrMsg) && stream.compression == COMPRESSION_NONE)
     {
-        computationD2(&stream);
+        stream = rsOpen(options.file);
     }
-    else if (options.computation == COMPUTATION_L)
+
+    if (!rsCheck(&stream, streamErrMsg))
     {
-        computationL(&stream);
+        fprintf(stderr, "Erreur lors de l'ouverture du fichier : %s\n", streamErrMsg);
+        return 1;
     }
-    else
+
+    if (options.convertOutput != NULL)
+    {
+        char convertErrMsg[ERR_MAX];
+        bool converted;
+        {
+            PROFILER_START("Convert");
+            converted = pcbConvert(&stream, options.convertOutput, convertErrMsg);
+            PROFILER_COUNT(PROFILE_ROWS, stream.rowsRead);
+            PROFILER_COUNT(PROFILE_BYTES, stream.bytesRead);
+            PROFILER_END();
+        }
+        bool profiled = profilerWriteJson();
+        bool readOk = rsCheck(&stream, streamErrMsg);
+        rsClose(&stream);
+
+        if (!readOk)
+        {
+            fprintf(stderr, "Erreur lors de la lecture du fichier : %s\n", streamErrMsg);
+            return 1;
+        }
+
+        if (!converted)
+        {
+            fprintf(stderr, "Erreur lors de la conversion : %s\n", convertErrMsg);
+            return 1;
+        }
+        return profiled ? 0 : 1;
+    }
+
+    if (options.numComputations == 0)
     {
         fprintf(stderr, "Pas de traitement donné !\n");
 
@@ -73,7 +135,160 @@ int main(int argv, char** argc)
         return 1;
     }
 
+    // States are saved at a position in the file, which only makes sense with a mapped CSV file.
+    if (needsMapping && stream.mode != RS_MAPPED)
+    {
+        fprintf(stderr, "Erreur d'argument : l'option « %s » ne fonctionne qu'avec un fichier CSV "
+                        "non compressé (pas de fichier .pcb, .gz, .zst, ni d'entrée standard)\n",
+                options.follow ? "--follow" : "--state");
+        return 2;
+    }
+
+    // With --max-memory, partitions that don't fit are written to the disk.
+    computationsSetMemoryBudget((uint64_t) options.maxMemoryMB * 1024 * 1024);
+
+    // With --approx, D1, D2 and T only keep a fixed number of names in memory.
+    approxConfigure(options.approxSize, options.countMin);
+    // With --hll, T only keeps a HyperLogLog of the routes of each town.
+    tHllConfigure(options.hllPrecision);
+
+    const Computation* computations[MAX_COMPUTATIONS];
+    FILE* outputs[MAX_COMPUTATIONS];
+    char outPaths[MAX_COMPUTATIONS][4096];
+    const char* outPathPtrs[MAX_COMPUTATIONS];
+    char statePaths[MAX_COMPUTATIONS][4096];
+    const char* statePathPtrs[MAX_COMPUTATIONS];
+    for (uint32_t i = 0; i < options.numComputations; ++i)
+    {
+        const char* name;
+        switch (options.computations[i])
+        {
+            case COMPUTATION_S:
+                computations[i] = &computationS;
+                name = "s";
+                break;
+            case COMPUTATION_T:
+                computations[i] = options.approx ? &computationTApprox
+                                  : options.hll  ? &computationTHll
+                                                 : &computationT;
+                name = "t";
+                break;
+            case COMPUTATION_D1:
+                computations[i] = options.approx ? &computationD1Approx : &computationD1;
+                name = "d1";
+                break;
+            case COMPUTATION_D2:
+                computations[i] = options.approx ? &computationD2Approx : &computationD2;
+                name = "d2";
+                break;
+            case COMPUTATION_L:
+                computations[i] = &computationL;
+                name = "l";
+                break;
+            default:
+                assert(false);
+                return 1;
+        }
+
+        if (options.stateDir != NULL)
+        {
+            snprintf(statePaths[i], sizeof(statePaths[i]), "%s/state_%s.bin", options.stateDir, name);
+            statePathPtrs[i] = statePaths[i];
+        }
+        if (options.outDir != NULL)
+        {
+            snprintf(outPaths[i], sizeof(outPaths[i]), "%s/result_%s.out", options.outDir, name);
+            outPathPtrs[i] = outPaths[i];
+        }
+
+        // Results are written again and again when following the file, it's up to followComputations.
+        if (options.outDir == NULL || options.follow)
+        {
+            outputs[i] = stdout;
+        }
+        else
+        {
+            outputs[i] = fopen(outPaths[i], "w");
+            if (outputs[i] == NULL)
+            {
+                fprintf(stderr, "Impossible de créer le fichier « %s » : %s\n", outPaths[i], strerror(errno));
+                return 1;
+            }
+        }
+    }
+
+    if (options.follow)
+    {
+        char followErrMsg[ERR_MAX];
+        followComputations(&stream, options.file, computations, options.outDir != NULL ? outPathPtrs : NULL,
+                           options.stateDir != NULL ? statePathPtrs : NULL, options.numComputations,
+                           options.threads, options.followIntervalMs, followErrMsg);
+        fprintf(stderr, "Erreur en suivant le fichier : %s\n", followErrMsg);
+        return 1;
+    }
+
+    // With --state, start from the saved states, and save the new ones.
+    char stateErrMsg[ERR_MAX];
+    FILE* statesIn[MAX_COMPUTATIONS] = {NULL};
+    FILE* statesOut[MAX_COMPUTATIONS] = {NULL};
+    for (uint32_t i = 0; options.stateDir != NULL && i < options.numComputations; ++i)
+    {
+        statesIn[i] = fopen(statePaths[i], "rb");
+        statesOut[i] = stateCreate(statePaths[i], stateErrMsg);
+        if (statesOut[i] == NULL)
+        {
+            fprintf(stderr, "Erreur avec l'état sauvegardé : %s\n", stateErrMsg);
+            return 1;
+        }
+    }
+
+    int exitCode = 0;
+    bool ran = runComputations(&stream, computations, outputs, options.stateDir != NULL ? statesIn : NULL,
+                               options.stateDir != NULL ? statesOut : NULL, options.numComputations,
+                               options.threads, stateErrMsg);
+    if (!ran)
+    {
+        fprintf(stderr, "Erreur avec l'état sauvegardé dans « %s » : %s\n", options.stateDir, stateErrMsg);
+        exitCode = 1;
+    }
+
+    // The file can also fail while it's being read (like a truncated .gz file), the results are then incomplete.
+    bool readOk = rsCheck(&stream, streamErrMsg);
+    if (!readOk)
+    {
+        fprintf(stderr, "Erreur lors de la lecture du fichier : %s\n", streamErrMsg);
+        exitCode = 1;
+    }
+
+    // Only keep the new states when everything went fine.
+    for (uint32_t i = 0; options.stateDir != NULL && i < options.numComputations; ++i)
+    {
+        if (statesIn[i] != NULL)
+        {
+            fclose(statesIn[i]);
+        }
+        if (!stateCommit(statesOut[i], statePaths[i], ran && readOk, stateErrMsg) && ran && readOk)
+        {
+            fprintf(stderr, "Erreur avec l'état sauvegardé : %s\n", stateErrMsg);
+            exitCode = 1;
+        }
+    }
+
+    for (uint32_t i = 0; i < options.numComputations; ++i)
+    {
+        if (outputs[i] != stdout)
+        {
+            fclose(outputs[i]);
+        }
+    }
+
     rsClose(&stream);
 
-    return 0;
+    // The JSON file is written even when something went wrong, it may help to know where.
+    if (!profilerWriteJson())
+    {
+        exitCode = 1;
+    }
+
+    return exitCode;
 }
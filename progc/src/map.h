@@ -9,6 +9,16 @@
  *
  * Uses a bunch of very CURSED macros to get the generic code generated.
  * This is obviously EXPERIMENTAL and shouldn't be used in standard implementations.
+ *
+ * There are two engines, chosen with MAP_SWISS (see compile_settings.h):
+ * - The "swiss table" one (the default), like Abseil's. Next to the entries, there's an array of 1-byte tags,
+ *   one per slot: either empty, or 7 bits of the hash of the key in the slot. The tags are compared
+ *   16 slots at a time (with a single SSE2 comparison), and an entry is only looked at when its tag matches.
+ *   With big entries (128 bytes in T!), that's way less cache lines touched on each search, even with
+ *   long probe sequences: the map can be much fuller before getting slow.
+ * - The linear one, which checks the entries one by one, calling the getOccupied and keyEqual functions on each.
+ *
+ * Both engines still mark the entries as occupied, so looping over the entries works just the same.
  */
 
 #include "compile_settings.h"
@@ -22,12 +32,52 @@
 #include <stdbool.h>
 #include <stdalign.h>
 
+#include "profile.h"
+#include "portable.h"
+
+#if MAP_SWISS && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define MAP_SSE2 1
+#include <emmintrin.h>
+#else
+#define MAP_SSE2 0
+#endif
+
+#if MAP_SWISS
+#define MAP_CTRL_FIELD uint8_t* ctrl; /* The tags of the slots, followed by a copy of the first group */
+#else
+#define MAP_CTRL_FIELD
+#endif
+
+// A good load factor for the maps: probing 16 slots at once stays fast even when the map is quite full.
+#if MAP_SWISS
+#define MAP_LOAD_FACTOR 0.875f
+#else
+#define MAP_LOAD_FACTOR 0.75f
+#endif
+
+// With the profiler, each map counts the slots it looks at, and gives them to the profiler (PROFILE_MAP_PROBES)
+// when it's cleared or freed. A global counter would be shared by all threads, which is way too slow.
+#if ENABLE_PROFILER
+#define MAP_PROBES_FIELD uint64_t probes;
+#define MAP_COUNT_PROBE(map) ((map)->probes++)
+#define MAP_RESET_PROBES(map) ((map)->probes = 0)
+// Gives the probes counted so far to the profiler, and starts again from 0.
+#define MAP_REPORT_PROBES(map) (PROFILER_COUNT(PROFILE_MAP_PROBES, (map)->probes), MAP_RESET_PROBES(map))
+#else
+#define MAP_PROBES_FIELD
+#define MAP_COUNT_PROBE(map) ((void) 0)
+#define MAP_RESET_PROBES(map) ((void) 0)
+#define MAP_REPORT_PROBES(map) ((void) 0)
+#endif
+
 #define MAP_HEADER(type) type* entries; \
     uint32_t capacity; /* Must be a power of two */ \
     uint32_t capacityExponent; \
     uint32_t size; \
     float loadFactor; \
     uint32_t sizeThreshold; \
+    MAP_CTRL_FIELD \
+    MAP_PROBES_FIELD
 
 // This map works using open addressing.
 typedef struct
@@ -58,12 +108,82 @@ typedef struct
     GetKeyPtrFunc getKeyPtrFunc;
 } MapMeta;
 
+#if MAP_SWISS
+
+// The number of tags compared at once.
+#define MAP_GROUP_SIZE 16
+// The tag of an empty slot. Occupied slots have the high bit cleared.
+// (There's no "deleted" tag, since nothing can be removed from the map.)
+#define MAP_CTRL_EMPTY 0x80
+
+// Allocates the tags of a map with the given capacity, all empty.
+// The first group is copied at the end, so a group can be read from any slot without wrapping around.
+static inline uint8_t* mapCtrlAlloc(uint32_t capacity)
+{
+    uint8_t* ctrl = malloc(capacity + MAP_GROUP_SIZE);
+    assert(ctrl);
+    memset(ctrl, MAP_CTRL_EMPTY, capacity + MAP_GROUP_SIZE);
+    return ctrl;
+}
+
+static inline void mapCtrlSet(Map* map, uint32_t i, uint8_t tag)
+{
+    map->ctrl[i] = tag;
+    if (i < MAP_GROUP_SIZE)
+    {
+        map->ctrl[map->capacity + i] = tag;
+    }
+}
+
+// Bit n is set when the slot n of the group has this tag.
+static inline uint32_t mapGroupMatch(const uint8_t* group, uint8_t tag)
+{
+#if MAP_SSE2
+    __m128i tags = _mm_loadu_si128((const __m128i*) group);
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(tags, _mm_set1_epi8((char) tag)));
+#else
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < MAP_GROUP_SIZE; ++i)
+    {
+        mask |= (uint32_t) (group[i] == tag) << i;
+    }
+    return mask;
+#endif
+}
+
+// Bit n is set when the slot n of the group is empty.
+static inline uint32_t mapGroupEmpty(const uint8_t* group)
+{
+#if MAP_SSE2
+    // Only empty slots have the high bit set, which is exactly what movemask takes.
+    return (uint32_t) _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) group));
+#else
+    return mapGroupMatch(group, MAP_CTRL_EMPTY);
+#endif
+}
+
+static inline uint32_t mapLowestBit(uint32_t mask)
+{
+    return bitLowest32(mask);
+}
+
+#endif
+
 static inline void mapInit(Map* map, uint32_t initialCapacity, float loadFactor, MapMeta meta)
 {
     assert((initialCapacity & (initialCapacity-1)) == 0 && "Must be a power of 2!");
     assert(map);
     assert(loadFactor > 0.0f && loadFactor < 1.0f);
 
+#if MAP_SWISS
+    // Groups can't be larger than the map!
+    if (initialCapacity < MAP_GROUP_SIZE)
+    {
+        initialCapacity = MAP_GROUP_SIZE;
+    }
+    map->ctrl = mapCtrlAlloc(initialCapacity);
+#endif
+
     map->capacity = initialCapacity;
     map->capacityExponent = 0;
     map->size = 0;
@@ -81,6 +201,8 @@ static inline void mapInit(Map* map, uint32_t initialCapacity, float loadFactor,
 
     map->entries = calloc(initialCapacity, meta.entrySize);
     assert(map->entries);
+    PROFILER_COUNT(PROFILE_ALLOCS, 1);
+    MAP_RESET_PROBES(map);
 }
 
 #ifndef MAP_DIAG
@@ -92,6 +214,78 @@ static uint64_t findCalls = 0;
 static uint64_t findIter = 0;
 #endif
 
+#if MAP_SWISS
+
+// Finds the slot of the key, or the empty slot where it should be inserted (outFound is then false).
+// Also gives the tag of the key.
+static inline uint32_t mapFindSlot(Map* map, void* key, const MapMeta meta, uint8_t* outTag, bool* outFound)
+{
+#if MAP_DIAG
+    findCalls++;
+    findIter++;
+#endif
+
+    // Take 7 more bits from the hash function for the tag. Hash functions give the highest bits of the hash
+    // (see MAP_HASH_FUNC), so the slot is the same as with the linear engine.
+    // For giant maps (more than 2^25 slots), some bits of the tag are also in the slot, oh well.
+    uint32_t hashBits = map->capacityExponent + 7 <= 32 ? map->capacityExponent + 7 : 32;
+    uint32_t hash = meta.hashFunc(key, hashBits);
+    uint8_t tag = hash & 0x7F;
+    *outTag = tag;
+
+    uint8_t* entries = map->entries;
+    uint32_t mask = map->capacity - 1;
+    uint32_t pos = (hash >> (hashBits - map->capacityExponent)) & mask;
+    while (true)
+    {
+        const uint8_t* group = map->ctrl + pos;
+        MAP_COUNT_PROBE(map);
+
+        uint32_t matches = mapGroupMatch(group, tag);
+        while (matches != 0)
+        {
+            uint32_t i = (pos + mapLowestBit(matches)) & mask;
+            if (meta.keyEqualFunc(entries + meta.entrySize * i, key))
+            {
+                *outFound = true;
+                return i;
+            }
+            matches &= matches - 1;
+        }
+
+        // Nothing is ever removed, so the key would have been put in the first empty slot.
+        uint32_t empty = mapGroupEmpty(group);
+        if (empty != 0)
+        {
+            *outFound = false;
+            return (pos + mapLowestBit(empty)) & mask;
+        }
+
+        pos = (pos + MAP_GROUP_SIZE) & mask;
+#if MAP_DIAG
+        findIter++;
+#endif
+    }
+}
+
+static inline void* mapFindEntry(Map* map, void* key, const MapMeta meta)
+{
+    uint8_t tag;
+    bool found;
+    uint32_t i = mapFindSlot(map, key, meta, &tag, &found);
+    return (uint8_t*) map->entries + meta.entrySize * i;
+}
+
+static inline void* mapLookup(Map* map, void* key, MapMeta meta)
+{
+    uint8_t tag;
+    bool found;
+    uint32_t i = mapFindSlot(map, key, meta, &tag, &found);
+    return found ? (uint8_t*) map->entries + meta.entrySize * i : NULL;
+}
+
+#else
+
 static inline void* mapFindEntry(Map* map, void* key, const MapMeta meta)
 {
 #if MAP_DIAG
@@ -102,11 +296,13 @@ static inline void* mapFindEntry(Map* map, void* key, const MapMeta meta)
     uint8_t* entries = map->entries;
 
     uint32_t i = meta.hashFunc(key, map->capacityExponent) & (map->capacity-1);
+    MAP_COUNT_PROBE(map);
     // Continue searching if we come across an occupied slot by some other key
     while (meta.getOccupiedFunc(entries + meta.entrySize * i) &&
         !meta.keyEqualFunc(entries + meta.entrySize * i, key))
     {
         i = (i + 1) & (map->capacity - 1);
+        MAP_COUNT_PROBE(map);
 #if MAP_DIAG
         findIter++;
 #endif
@@ -135,6 +331,8 @@ static inline void* mapLookup(Map* map, void* key, MapMeta meta)
     }
 }
 
+#endif
+
 static void mapGrow(Map* map, MapMeta meta);
 
 static inline void* mapInsert(Map* map, void* key, const MapMeta meta)
@@ -145,8 +343,18 @@ static inline void* mapInsert(Map* map, void* key, const MapMeta meta)
         mapGrow(map, meta);
     }
 
+#if MAP_SWISS
+    uint8_t tag;
+    bool found;
+    uint32_t i = mapFindSlot(map, key, meta, &tag, &found);
+    assert(!found);
+
+    void* entry = (uint8_t*) map->entries + meta.entrySize * i;
+    mapCtrlSet(map, i, tag);
+#else
     void* entry = mapFindEntry(map, key, meta);
     assert(!meta.getOccupiedFunc(entry));
+#endif
 
     meta.markOccupiedFunc(entry, key);
     map->size++;
@@ -166,12 +374,37 @@ static void mapGrow(Map* map, const MapMeta meta)
     }
     void* prevSlots = map->entries;
     void* nextSlots = calloc(nextCapacity, meta.entrySize);
+    assert(nextSlots);
+    PROFILER_COUNT(PROFILE_ALLOCS, 1);
 
     map->capacity = nextCapacity;
     map->capacityExponent = nextExponent;
     map->sizeThreshold = (int) (nextCapacity * map->loadFactor);
     map->entries = nextSlots;
 
+#if MAP_SWISS
+    uint8_t* prevCtrl = map->ctrl;
+    map->ctrl = mapCtrlAlloc(nextCapacity);
+
+    // Put all elements back in the new slots, using the tags to skip empty slots.
+    for (uint32_t i = 0; i < prevCapacity; ++i)
+    {
+        if (prevCtrl[i] != MAP_CTRL_EMPTY)
+        {
+            void* entry = ((uint8_t*) prevSlots + meta.entrySize * i);
+            struct AlignedScratch scratch;
+            void* k = meta.getKeyPtrFunc(entry, scratch.data);
+
+            uint8_t tag;
+            bool found;
+            uint32_t n = mapFindSlot(map, k, meta, &tag, &found);
+            mapCtrlSet(map, n, tag);
+            memcpy((uint8_t*) nextSlots + meta.entrySize * n, entry, meta.entrySize);
+        }
+    }
+
+    free(prevCtrl);
+#else
     // Put all elements back in the new slots.
     for (uint32_t i = 0; i < prevCapacity; ++i)
     {
@@ -186,29 +419,53 @@ static void mapGrow(Map* map, const MapMeta meta)
             memcpy(newEntry, entry, meta.entrySize);
         }
     }
+#endif
 
     free(prevSlots);
 }
 
-static void mapClear(Map* map, const int32_t newCapacity, const MapMeta meta)
+static void mapClear(Map* map, int32_t newCapacity, const MapMeta meta)
 {
     assert(map);
 
     map->size = 0;
+    MAP_REPORT_PROBES(map);
 
     if (newCapacity == -1)
     {
         // Don't change the capacity
         memset(map->entries, 0, map->capacity * meta.entrySize);
+#if MAP_SWISS
+        memset(map->ctrl, MAP_CTRL_EMPTY, map->capacity + MAP_GROUP_SIZE);
+#endif
     }
     else
     {
         assert((newCapacity & (newCapacity - 1)) == 0 && "Must be a power of 2!");
 
+#if MAP_SWISS
+        if (newCapacity < MAP_GROUP_SIZE)
+        {
+            newCapacity = MAP_GROUP_SIZE;
+        }
+        if (newCapacity > map->capacity)
+        {
+            free(map->ctrl);
+            map->ctrl = mapCtrlAlloc(newCapacity);
+        }
+        else
+        {
+            // The copy of the first group must be right after the last slot.
+            memset(map->ctrl, MAP_CTRL_EMPTY, newCapacity + MAP_GROUP_SIZE);
+        }
+#endif
+
         if (newCapacity > map->capacity)
         {
             free(map->entries);
             map->entries = calloc(newCapacity, meta.entrySize);
+            assert(map->entries);
+            PROFILER_COUNT(PROFILE_ALLOCS, 1);
         }
         else
         {
@@ -218,6 +475,7 @@ static void mapClear(Map* map, const int32_t newCapacity, const MapMeta meta)
         // Now that's maybe confusing because it won't free memory... But useless mallocs are best avoided.
 
         map->capacity = newCapacity;
+        map->sizeThreshold = (int) (newCapacity * map->loadFactor);
 
         map->capacityExponent = 0;
         uint32_t expCalc = newCapacity >> 1;
@@ -261,6 +519,12 @@ static void mapClear(Map* map, const int32_t newCapacity, const MapMeta meta)
         (GetKeyPtrFunc) MAP_GET_KEY_PTR_FUNC_NAME() \
     })
 
+#if MAP_SWISS
+#define MAP_FREE_CTRL(map) free((map)->ctrl)
+#else
+#define MAP_FREE_CTRL(map)
+#endif
+
 #define M_PASS_0(k) (void*) k
 #define M_PASS_1(k) (void*) &k
 
@@ -285,7 +549,9 @@ static void mapClear(Map* map, const int32_t newCapacity, const MapMeta meta)
     } \
     static void funcPrefix ## Free (CURRENT_MAP_TYPE()* map) \
     { \
+        MAP_REPORT_PROBES(map); \
         free(map->entries); \
+        MAP_FREE_CTRL(map); \
     }\
     static void funcPrefix ## Clear (CURRENT_MAP_TYPE()* map, int32_t newCapacity) \
     { \
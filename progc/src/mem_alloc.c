@@ -0,0 +1,60 @@
+// Needed for mmap's MAP_ANONYMOUS and madvise.
+#define _DEFAULT_SOURCE
+
+#include "compile_settings.h"
+
+#if EXPERIMENTAL_ALGO
+
+#include "mem_alloc.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define MEM_PAGES_SUPPORTED 1
+#else
+#define MEM_PAGES_SUPPORTED 0
+#endif
+
+void* memPagesAlloc(size_t size, size_t* outMappedSize)
+{
+#if MEM_PAGES_SUPPORTED
+    // Huge pages must be aligned by their size, and mmap only aligns by 4 KB:
+    // map a bit more, and unmap what's before and after the aligned part.
+    size = (size + MEM_HUGE_PAGE_SIZE - 1) & ~((size_t) MEM_HUGE_PAGE_SIZE - 1);
+    size_t extra = size + MEM_HUGE_PAGE_SIZE;
+    uint8_t* mapping = mmap(NULL, extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    uint8_t* aligned = (uint8_t*) (((uintptr_t) mapping + MEM_HUGE_PAGE_SIZE - 1)
+                                   & ~((uintptr_t) MEM_HUGE_PAGE_SIZE - 1));
+    if (aligned != mapping)
+    {
+        munmap(mapping, aligned - mapping);
+    }
+    if (aligned + size != mapping + extra)
+    {
+        munmap(aligned + size, mapping + extra - (aligned + size));
+    }
+
+#ifdef MADV_HUGEPAGE
+    // Only a hint: it's fine if transparent huge pages are disabled.
+    madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+
+    *outMappedSize = size;
+    return aligned;
+#else
+    return NULL;
+#endif
+}
+
+void memPagesFree(void* pages, size_t mappedSize)
+{
+#if MEM_PAGES_SUPPORTED
+    munmap(pages, mappedSize);
+#endif
+}
+
+#endif
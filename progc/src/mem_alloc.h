@@ -8,7 +8,18 @@
  * Allows allocation of elements in multiple contiguous memory regions, which can be
  * freed in a single function call.
  *
+ * Each new block is twice as big as the previous one (up to MEM_MAX_BLOCK_SIZE), so arenas that grow a lot
+ * don't need thousands of allocations. Blocks of at least MEM_HUGE_PAGE_SIZE are mapped directly,
+ * asking the system for huge pages: way less TLB misses when jumping around in big lists!
+ *
+ * An arena can also be reset with memReset: everything is forgotten, but the blocks are kept for
+ * the next allocations. That's great when the same arena is used over and over (for each partition,
+ * or each refresh of --follow), as almost nothing gets allocated after the first time.
+ *
+ * Arenas aren't thread-safe: each thread needs its own arena.
+ *
  * Functions are defined static for easier inlining, also because it's a small utility.
+ * Only the mapped blocks are handled in mem_alloc.c.
  *
  * By the way, this is considered experimental! So memAlloc can't be used in
  * non-experimental implementations.
@@ -20,47 +31,99 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <assert.h>
+#include <stdalign.h>
+
+#include "profile.h"
+
+// Blocks this big (or bigger) are mapped with huge pages.
+#define MEM_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+// Blocks stop growing past this size.
+#define MEM_MAX_BLOCK_SIZE (32 * 1024 * 1024)
 
 typedef struct MemBlock
 {
-    struct MemBlock* prev;
+    // The next block, used after this one (after a reset, for example).
+    struct MemBlock* next;
+    size_t size;
+    // The size of the mapping when the block is mapped (see memPagesAlloc), 0 when it's malloc'd.
+    size_t mappedSize;
 
-    uint8_t data[];
+    alignas(16) uint8_t data[];
 } MemBlock;
 
 typedef struct MemArena
 {
+    MemBlock* first;
     MemBlock* block;
 
-    size_t blockSize;
-    size_t blockPos; // 8-byte aligned
+    size_t blockSize; // The size of the current block.
+    size_t blockPos; // Aligned by alignmentMask + 1
     size_t alignmentMask;
+    // The size of the next block to allocate, including its header (so sizes stay multiples of the page size).
+    size_t nextBlockSize;
 } MemArena;
 
-// Allocates a block of memory.
+// Maps size bytes of memory (rounded up) with huge pages, if the system has them. Returns NULL on failure.
+// The size of the mapping is given in outMappedSize. Defined in mem_alloc.c.
+void* memPagesAlloc(size_t size, size_t* outMappedSize);
+
+void memPagesFree(void* pages, size_t mappedSize);
+
+// Allocates a block of memory of totalSize bytes, including the header.
 // Exits the program if the allocation fails.
-static MemBlock* memBlockAlloc(MemBlock* prev, const size_t blockSize)
+static MemBlock* memBlockAlloc(const size_t totalSize)
 {
-    MemBlock* block = malloc(sizeof(MemBlock) + blockSize);
-    assert(block);
+    MemBlock* block = NULL;
+    size_t mappedSize = 0;
+    if (totalSize >= MEM_HUGE_PAGE_SIZE)
+    {
+        block = memPagesAlloc(totalSize, &mappedSize);
+    }
+    if (block == NULL)
+    {
+        block = malloc(totalSize);
+        assert(block);
+        mappedSize = 0;
+    }
+
+    PROFILER_COUNT(PROFILE_ALLOCS, 1);
 
-    block->prev = prev;
+    block->next = NULL;
+    // Mapped blocks are rounded up to the page size: might as well use all of it.
+    block->size = (mappedSize != 0 ? mappedSize : totalSize) - sizeof(MemBlock);
+    block->mappedSize = mappedSize;
     return block;
 }
 
-// Initialize the memory arena allocator, with the given block size.
-// Smaller block sizes will lead to less memory waste, but will trigger frequent allocations.
+static void memBlockFree(MemBlock* block)
+{
+    if (block->mappedSize != 0)
+    {
+        memPagesFree(block, block->mappedSize);
+    }
+    else
+    {
+        free(block);
+    }
+}
+
+// Initialize the memory arena allocator, with the given size for the first block.
+// Smaller block sizes will lead to less memory waste, but will trigger more allocations
+// before the blocks get big.
 static void memInitEx(MemArena* arena, const size_t blockSize, const size_t alignment)
 {
     assert(arena);
     assert(blockSize >= 8);
-    assert(alignment > 0 && ((alignment & (alignment-1)) == 0));
+    assert(alignment > 0 && alignment <= 16 && ((alignment & (alignment-1)) == 0));
 
-    arena->block = memBlockAlloc(NULL, blockSize);
-    arena->blockSize = blockSize;
+    arena->first = memBlockAlloc(sizeof(MemBlock) + blockSize);
+    arena->block = arena->first;
+    arena->blockSize = arena->block->size;
     arena->blockPos = 0;
     arena->alignmentMask = alignment-1;
+    arena->nextBlockSize = blockSize * 2 < MEM_MAX_BLOCK_SIZE ? blockSize * 2 : MEM_MAX_BLOCK_SIZE;
 }
 
 static void memInit(MemArena* arena, const size_t blockSize)
@@ -68,6 +131,31 @@ static void memInit(MemArena* arena, const size_t blockSize)
     memInitEx(arena, blockSize, 8);
 }
 
+// Moves to the next block with enough room for size bytes, allocating one if there's none left.
+static void* memAllocInNextBlock(MemArena* arena, size_t size)
+{
+    MemBlock* block = arena->block;
+    while (block->next != NULL && block->next->size < size)
+    {
+        block = block->next;
+    }
+
+    if (block->next == NULL)
+    {
+        size_t minSize = sizeof(MemBlock) + size;
+        size_t newSize = arena->nextBlockSize > minSize ? arena->nextBlockSize : minSize;
+        block->next = memBlockAlloc(newSize);
+        arena->nextBlockSize = newSize * 2 < MEM_MAX_BLOCK_SIZE ? newSize * 2 : MEM_MAX_BLOCK_SIZE;
+    }
+
+    arena->block = block->next;
+    arena->blockSize = arena->block->size;
+    // Advance the position in advance as we've just allocated a new item.
+    arena->blockPos = size;
+
+    return arena->block->data;
+}
+
 // Allocate a block of memory in the arena allocator.
 // The returned pointer will be aligned by 8 bytes, and may be present
 // in another memory block if there's not enough room left.
@@ -79,10 +167,10 @@ static void* memAlloc(MemArena* arena, size_t size)
     void* fitPtr = arena->block->data + arena->blockPos;
 
     // Apply alignment
-    size = size + (size & arena->alignmentMask);
+    size = (size + arena->alignmentMask) & ~arena->alignmentMask;
     size_t newPos = arena->blockPos + size;
 
-    if (newPos < arena->blockSize)
+    if (newPos <= arena->blockSize)
     {
         arena->blockPos = newPos;
 
@@ -90,16 +178,31 @@ static void* memAlloc(MemArena* arena, size_t size)
     }
     else
     {
-        // Make sure the element isn't bigger than the block itself.
-        assert(size < arena->blockSize);
+        return memAllocInNextBlock(arena, size);
+    }
+}
 
-        arena->block = memBlockAlloc(arena->block, arena->blockSize);
-        assert(arena->block);
+// Forgets everything allocated in the arena, but keeps the blocks for the next allocations.
+static void memReset(MemArena* arena)
+{
+    assert(arena && arena->first);
 
-        // Advance the position in advance as we've just allocated a new item.
-        arena->blockPos = size;
+    arena->block = arena->first;
+    arena->blockSize = arena->block->size;
+    arena->blockPos = 0;
+}
 
-        return arena->block->data;
+// For arenas living as long as the program (static ones): initializes the arena the first time,
+// and resets it the next times.
+static void memInitOrReset(MemArena* arena, const size_t blockSize)
+{
+    if (arena->first == NULL)
+    {
+        memInit(arena, blockSize);
+    }
+    else
+    {
+        memReset(arena);
     }
 }
 
@@ -108,14 +211,15 @@ static void memFree(MemArena* arena)
 {
     assert(arena);
 
-    MemBlock* it = arena->block;
+    MemBlock* it = arena->first;
     while (it)
     {
-        MemBlock* prev = it->prev;
-        free(it);
-        it = prev;
+        MemBlock* next = it->next;
+        memBlockFree(it);
+        it = next;
     }
 
+    arena->first = NULL;
     arena->block = NULL;
     arena->blockPos = 0;
 }
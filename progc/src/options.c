@@ -3,18 +3,45 @@
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include "compile_settings.h"
+#include "parallel.h"
+#include "sketch.h"
 
-bool comptuationAlreadySet(char* arg, const Options* options, char errMsg[256])
+// Adds a computation to run, while ignoring duplicates.
+static void addComputation(Options* options, ComptuationOption computation)
 {
-    if (options->computation != COMPUTATION_NONE)
+    for (uint32_t i = 0; i < options->numComputations; ++i)
     {
-        snprintf(errMsg, 256, "Argument « %s » invalide : traitement déjà spécifié", arg);
-        return true;
+        if (options->computations[i] == computation)
+        {
+            return;
+        }
+    }
+
+    options->computations[options->numComputations++] = computation;
+}
+
+// Parses the number following the option at argv[*i], which must be between min and max.
+// Returns false if it's missing or invalid.
+static bool parseNumberArg(int argc, char** argv, int* i, long min, long max, long* outNumber)
+{
+    if (*i + 1 >= argc)
+    {
+        return false;
     }
-    else
+
+    char* str = argv[*i + 1];
+    char* end = NULL;
+    long number = strtol(str, &end, 10);
+    if (*end != '\0' || end == str || number < min || number > max)
     {
         return false;
     }
+
+    *outNumber = number;
+    (*i)++;
+    return true;
 }
 
 bool parseOptions(int argc, char** argv, Options* outOptions, char errMsg[256])
@@ -23,38 +50,190 @@ bool parseOptions(int argc, char** argv, Options* outOptions, char errMsg[256])
     assert(argv);
 
     outOptions->file = NULL;
-    outOptions->computation = COMPUTATION_NONE;
+    outOptions->convertOutput = NULL;
+    outOptions->numComputations = 0;
+    outOptions->outDir = NULL;
+    outOptions->stateDir = NULL;
+    outOptions->follow = false;
+    outOptions->followIntervalMs = 100;
+    outOptions->approx = false;
+    outOptions->approxSize = 1024;
+    outOptions->countMin = false;
+    outOptions->hll = false;
+    outOptions->hllPrecision = 10;
+    outOptions->maxMemoryMB = 0;
+    outOptions->threads = 1;
+    outOptions->ioUring = false;
+    outOptions->ioDepth = 8;
+    outOptions->ioChunkKB = 1024;
+    outOptions->simd = SIMD_AUTO;
+    outOptions->profileJson = NULL;
 
-    for (int i = 1; i < argc; ++i)
+    // "PermisC convert data.csv data.pcb": convert the CSV file to a columnar binary file.
+    bool convert = argc > 1 && strcmp(argv[1], "convert") == 0;
+
+    for (int i = convert ? 2 : 1; i < argc; ++i)
     {
         char* arg = argv[i];
 
-        if (arg[0] == '-')
+        // A lone "-" isn't an option, it's the standard input used as the file.
+        if (arg[0] == '-' && arg[1] != '\0')
         {
             if (strcmp(arg, "-t") == 0)
             {
-                if (comptuationAlreadySet(arg, outOptions, errMsg)) { return false; }
-                outOptions->computation = COMPUTATION_T;
+                addComputation(outOptions, COMPUTATION_T);
             }
             else if (strcmp(arg, "-s") == 0)
             {
-                if (comptuationAlreadySet(arg, outOptions, errMsg)) { return false; }
-                outOptions->computation = COMPUTATION_S;
+                addComputation(outOptions, COMPUTATION_S);
             }
             else if (strcmp(arg, "-d1") == 0)
             {
-                if (comptuationAlreadySet(arg, outOptions, errMsg)) { return false; }
-                outOptions->computation = COMPUTATION_D1;
+                addComputation(outOptions, COMPUTATION_D1);
             }
             else if (strcmp(arg, "-d2") == 0)
             {
-                if (comptuationAlreadySet(arg, outOptions, errMsg)) { return false; }
-                outOptions->computation = COMPUTATION_D2;
+                addComputation(outOptions, COMPUTATION_D2);
             }
             else if (strcmp(arg, "-l") == 0)
             {
-                if (comptuationAlreadySet(arg, outOptions, errMsg)) { return false; }
-                outOptions->computation = COMPUTATION_L;
+                addComputation(outOptions, COMPUTATION_L);
+            }
+            else if (strcmp(arg, "--threads") == 0)
+            {
+                // The number of threads, 0 to use all processors.
+                long threads;
+                if (!parseNumberArg(argc, argv, &i, 0, MAX_THREADS, &threads))
+                {
+                    snprintf(errMsg, 256, "L'option « %s » nécessite un nombre de threads entre 0 et %d", arg,
+                             MAX_THREADS);
+                    return false;
+                }
+                outOptions->threads = threads == 0 ? parallelNumCores() : (uint32_t) threads;
+            }
+            else if (strcmp(arg, "--io-uring") == 0)
+            {
+                outOptions->ioUring = true;
+            }
+            else if (strcmp(arg, "--io-depth") == 0)
+            {
+                long depth;
+                if (!parseNumberArg(argc, argv, &i, 2, 64, &depth))
+                {
+                    snprintf(errMsg, 256, "L'option « %s » nécessite un nombre de lectures entre 2 et 64", arg);
+                    return false;
+                }
+                outOptions->ioDepth = (uint32_t) depth;
+            }
+            else if (strcmp(arg, "--io-chunk") == 0)
+            {
+                long chunkKB;
+                if (!parseNumberArg(argc, argv, &i, 4, 256 * 1024, &chunkKB))
+                {
+                    snprintf(errMsg, 256, "L'option « %s » nécessite une taille en Ko entre 4 et %d", arg,
+                             256 * 1024);
+                    return false;
+                }
+                outOptions->ioChunkKB = (uint32_t) chunkKB;
+            }
+            else if (strncmp(arg, "--simd=", 7) == 0)
+            {
+                if (!simdLevelParse(arg + 7, &outOptions->simd))
+                {
+                    snprintf(errMsg, 256, "Instructions inconnues : « %s » (auto, scalar, swar, sse2, sse4.2 ou avx2)",
+                             arg + 7);
+                    return false;
+                }
+            }
+            else if (strcmp(arg, "--out-dir") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    snprintf(errMsg, 256, "L'option « %s » nécessite un dossier", arg);
+                    return false;
+                }
+                outOptions->outDir = argv[++i];
+            }
+            else if (strcmp(arg, "--state") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    snprintf(errMsg, 256, "L'option « %s » nécessite un dossier", arg);
+                    return false;
+                }
+                outOptions->stateDir = argv[++i];
+            }
+            else if (strcmp(arg, "--follow") == 0)
+            {
+                outOptions->follow = true;
+            }
+            else if (strcmp(arg, "--interval") == 0)
+            {
+                long interval;
+                if (!parseNumberArg(argc, argv, &i, 1, 3600 * 1000, &interval))
+                {
+                    snprintf(errMsg, 256, "L'option « %s » nécessite une durée en millisecondes entre 1 et %d", arg,
+                             3600 * 1000);
+                    return false;
+                }
+                outOptions->followIntervalMs = (uint32_t) interval;
+            }
+            else if (strcmp(arg, "--approx") == 0)
+            {
+                outOptions->approx = true;
+            }
+            else if (strcmp(arg, "--approx-size") == 0)
+            {
+                long size;
+                if (!parseNumberArg(argc, argv, &i, 10, 1 << 24, &size))
+                {
+                    snprintf(errMsg, 256, "L'option « %s » nécessite un nombre de noms entre 10 et %d", arg, 1 << 24);
+                    return false;
+                }
+                outOptions->approxSize = (uint32_t) size;
+            }
+            else if (strcmp(arg, "--count-min") == 0)
+            {
+                outOptions->countMin = true;
+            }
+            else if (strcmp(arg, "--hll") == 0)
+            {
+                outOptions->hll = true;
+            }
+            else if (strcmp(arg, "--hll-precision") == 0)
+            {
+                long precision;
+                if (!parseNumberArg(argc, argv, &i, HLL_MIN_PRECISION, HLL_MAX_PRECISION, &precision))
+                {
+                    snprintf(errMsg, 256, "L'option « %s » nécessite une précision entre %d et %d", arg,
+                             HLL_MIN_PRECISION, HLL_MAX_PRECISION);
+                    return false;
+                }
+                outOptions->hllPrecision = (uint32_t) precision;
+            }
+            else if (strcmp(arg, "--max-memory") == 0)
+            {
+                long maxMemory;
+                if (!parseNumberArg(argc, argv, &i, 16, 1 << 24, &maxMemory))
+                {
+                    snprintf(errMsg, 256, "L'option « %s » nécessite une taille en Mo entre 16 et %d", arg, 1 << 24);
+                    return false;
+                }
+                outOptions->maxMemoryMB = (uint32_t) maxMemory;
+            }
+            else if (strcmp(arg, "--profile-json") == 0)
+            {
+#if ENABLE_PROFILER
+                if (i + 1 >= argc)
+                {
+                    snprintf(errMsg, 256, "L'option « %s » nécessite un fichier", arg);
+                    return false;
+                }
+                outOptions->profileJson = argv[++i];
+#else
+                snprintf(errMsg, 256, "L'option « %s » nécessite le profilage (compiler avec ENABLE_PROFILER=1)", arg);
+                return false;
+#endif
             }
             else
             {
@@ -68,9 +247,14 @@ bool parseOptions(int argc, char** argv, Options* outOptions, char errMsg[256])
             {
                 outOptions->file = arg;
             }
+            else if (convert && outOptions->convertOutput == NULL)
+            {
+                outOptions->convertOutput = arg;
+            }
             else
             {
                 snprintf(errMsg, 256, "Argument inattendu : « %s »", arg);
+                return false;
             }
         }
     }
@@ -81,6 +265,36 @@ bool parseOptions(int argc, char** argv, Options* outOptions, char errMsg[256])
         return false;
     }
 
+    if (convert && outOptions->convertOutput == NULL)
+    {
+        snprintf(errMsg, 256, "Aucun fichier de sortie spécifié pour la conversion");
+        return false;
+    }
+
+    if (outOptions->numComputations > 1 && outOptions->outDir == NULL)
+    {
+        snprintf(errMsg, 256, "Plusieurs traitements nécessitent l'option « --out-dir »");
+        return false;
+    }
+
+    if (outOptions->approx)
+    {
+        for (uint32_t i = 0; i < outOptions->numComputations; ++i)
+        {
+            if (outOptions->computations[i] == COMPUTATION_L || outOptions->computations[i] == COMPUTATION_S)
+            {
+                snprintf(errMsg, 256, "L'option « --approx » ne fonctionne qu'avec les traitements D1, D2 et T");
+                return false;
+            }
+        }
+    }
+
+    if (outOptions->hll && outOptions->approx)
+    {
+        snprintf(errMsg, 256, "Les options « --hll » et « --approx » ne peuvent pas être utilisées ensemble");
+        return false;
+    }
+
     // The case were there's no computation specified is checked by the program later.
 
     return true;
@@ -4,10 +4,12 @@
 /*
  * options.h
  * ----------------
- * Simply parses arguments: the computation and the CSV file path.
+ * Simply parses arguments: the computation, the CSV file path, and a few settings.
  */
 
 #include <stdbool.h>
+#include <stdint.h>
+#include "delimiter_search.h"
 
 typedef enum
 {
@@ -20,8 +22,43 @@ typedef enum
 } ComptuationOption;
 
 typedef struct {
-    char* file; // Just a reference to the argv string.
-    ComptuationOption computation;
+    char* file; // Just a reference to the argv string. "-" for the standard input.
+    // The path of the .pcb file to create, when running "PermisC convert data.csv data.pcb". NULL otherwise.
+    char* convertOutput;
+    // All the computations to run, in the order given, without duplicates.
+    ComptuationOption computations[5];
+    uint32_t numComputations;
+    // The folder where the results of each computation are written, with the name result_<computation>.out.
+    // NULL when not specified: the result is then printed to stdout, with only one computation allowed.
+    char* outDir;
+    // The folder where the state of each computation is saved, with the name state_<computation>.bin,
+    // so the next run only reads the lines added to the file since then. NULL when not specified.
+    char* stateDir;
+    // Keep watching the file once it's been read, and write the results again every time they change.
+    // The file is checked every followIntervalMs milliseconds (100 by default).
+    bool follow;
+    uint32_t followIntervalMs;
+    // Use the approximate computations for D1, D2 and T, keeping only approxSize names (1024 by default),
+    // with a Count-Min sketch when countMin is true. See sketch.h.
+    bool approx;
+    uint32_t approxSize;
+    bool countMin;
+    // Use HyperLogLog for T (see computationTHll), with 2^hllPrecision bytes per town (10 by default).
+    bool hll;
+    uint32_t hllPrecision;
+    // The memory the experimental computations can use to copy the file, in MB. 0 for no limit (the default).
+    uint32_t maxMemoryMB;
+    uint32_t threads; // The number of threads used to read the file. 1 by default.
+    // Read the file using io_uring (Linux only), with ioDepth reads of ioChunkKB kilobytes in flight at once.
+    // Falls back to the other ways of reading the file when io_uring isn't available.
+    bool ioUring;
+    uint32_t ioDepth; // 8 by default
+    uint32_t ioChunkKB; // 1024 by default
+    // The instructions used to parse the file (--simd=avx2 for example). Chosen automatically by default.
+    SimdLevel simd;
+    // The JSON file where the profiler writes the durations and counters of all scopes (see profile.h).
+    // NULL when not specified. Only available when the profiler is enabled.
+    char* profileJson;
 } Options;
 
 bool parseOptions(int argc, char** argv, Options* outOptions, char errMsg[256]);
@@ -0,0 +1,114 @@
+// Needed for sysconf(_SC_NPROCESSORS_ONLN) and pthreads.
+#define _DEFAULT_SOURCE
+
+#include "parallel.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define PARALLEL_SUPPORTED 1
+#include <pthread.h>
+#include <unistd.h>
+#else
+#define PARALLEL_SUPPORTED 0
+#endif
+
+#if PARALLEL_SUPPORTED
+typedef struct
+{
+    ParallelFunc func;
+    void* data;
+    uint32_t index;
+} ThreadArgs;
+
+static void* threadMain(void* arg)
+{
+    ThreadArgs* args = arg;
+    args->func(args->index, args->data);
+    return NULL;
+}
+#endif
+
+void parallelRun(uint32_t n, ParallelFunc func, void* data)
+{
+    assert(n > 0 && n <= MAX_THREADS);
+
+#if PARALLEL_SUPPORTED
+    pthread_t threads[MAX_THREADS];
+    ThreadArgs args[MAX_THREADS];
+
+    for (uint32_t i = 1; i < n; ++i)
+    {
+        args[i] = (ThreadArgs) {func, data, i};
+        if (pthread_create(&threads[i], NULL, threadMain, &args[i]) != 0)
+        {
+            fprintf(stderr, "Impossible de créer un thread !\n");
+            exit(1);
+        }
+    }
+
+    // Make the current thread useful instead of just waiting.
+    func(0, data);
+
+    for (uint32_t i = 1; i < n; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+#else
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        func(i, data);
+    }
+#endif
+}
+
+typedef struct ForTask
+{
+    ParallelItemFunc func;
+    void* data;
+    uint32_t numItems;
+    uint32_t nextItem; // The next item to give, shared by all threads.
+} ForTask;
+
+static void forThread(uint32_t index, void* data)
+{
+    ForTask* task = data;
+
+    for (;;)
+    {
+        uint32_t item = ATOMIC_FETCH_ADD(&task->nextItem, 1, ATOMIC_RELAXED);
+        if (item >= task->numItems)
+        {
+            return;
+        }
+        task->func(index, item, task->data);
+    }
+}
+
+void parallelFor(uint32_t n, uint32_t numItems, ParallelItemFunc func, void* data)
+{
+    if (numItems == 0)
+    {
+        return;
+    }
+
+    // No need for more threads than items.
+    ForTask task = {func, data, numItems, 0};
+    parallelRun(n < numItems ? n : numItems, forThread, &task);
+}
+
+uint32_t parallelNumCores()
+{
+#if PARALLEL_SUPPORTED
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n <= 0)
+    {
+        return 1;
+    }
+    return n > MAX_THREADS ? MAX_THREADS : (uint32_t) n;
+#else
+    return 1;
+#endif
+}
@@ -0,0 +1,53 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/*
+ * parallel.h
+ * ---------------
+ * A tiny wrapper around threads, to run the same function on multiple threads at once.
+ * Uses POSIX threads when available, or runs everything on the current thread otherwise.
+ */
+
+#include <stdint.h>
+
+#include "portable.h"
+
+// The maximum number of threads that can be run at once.
+#define MAX_THREADS 256
+
+// A function run by a thread, with the index of the thread (from 0 to n-1).
+typedef void (*ParallelFunc)(uint32_t index, void* data);
+
+// Runs func(i, data) on n threads, for each i in [0; n-1]. Returns once all threads are done.
+// The first function is run on the current thread.
+void parallelRun(uint32_t n, ParallelFunc func, void* data);
+
+// A function run by parallelFor for one item, with the index of the thread running it.
+typedef void (*ParallelItemFunc)(uint32_t thread, uint32_t item, void* data);
+
+// Runs func(thread, item, data) for each item in [0; numItems-1], on up to n threads. Returns once all items are done.
+// Items are handed out one at a time to whichever thread is free, so a thread stuck on a big item doesn't
+// keep the others waiting. Give the biggest items first, so the small ones fill the gaps at the end.
+void parallelFor(uint32_t n, uint32_t numItems, ParallelItemFunc func, void* data);
+
+// A tiny lock, for very short critical sections (like writing a bit of data in a shared file).
+// Waiting threads spin, so don't keep it for long! Unlocked when zeroed.
+typedef struct ParallelLock
+{
+    char locked;
+} ParallelLock;
+
+static inline void parallelLock(ParallelLock* lock)
+{
+    while (ATOMIC_TEST_AND_SET(&lock->locked, ATOMIC_ACQUIRE)) {}
+}
+
+static inline void parallelUnlock(ParallelLock* lock)
+{
+    ATOMIC_CLEAR(&lock->locked, ATOMIC_RELEASE);
+}
+
+// Returns the number of processors available, or 1 if it's unknown.
+uint32_t parallelNumCores();
+
+#endif //PARALLEL_H
@@ -0,0 +1,211 @@
+// Needed for fseeko.
+#define _GNU_SOURCE
+
+#include "compile_settings.h"
+#include "computations/computations.h"
+
+#if EXPERIMENTAL_ALGO
+
+#include "partition.h"
+
+#include <errno.h>
+
+uint64_t partitionMemoryBudget = 0;
+uint64_t partitionMemoryUsed = 0;
+
+// Spilling stops once the memory used is under 3/4 of the budget, so we don't spill again on the next block.
+#define SPILL_TARGET(budget) ((budget) / 4 * 3)
+
+void computationsSetMemoryBudget(uint64_t bytes)
+{
+    partitionMemoryBudget = bytes;
+}
+
+static void spillFailed(const char* what)
+{
+    fprintf(stderr, "Impossible %s le fichier temporaire des partitions : %s\n", what, strerror(errno));
+    exit(1);
+}
+
+static bool spillSeek(FILE* file, uint64_t offset)
+{
+#ifdef WIN32
+    return _fseeki64(file, (long long) offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t) offset, SEEK_SET) == 0;
+#endif
+}
+
+// Writes all the blocks of the partition except the last one (which isn't full yet) to the spill file.
+static void spillPartition(Partitioner* partitioner, Partition* partition)
+{
+    if (partitioner->spillFile == NULL)
+    {
+        partitioner->spillFile = tmpfile();
+        if (partitioner->spillFile == NULL)
+        {
+            spillFailed("de créer");
+        }
+    }
+
+    // Blocks are always written at the end of the file.
+    if (!spillSeek(partitioner->spillFile, partitioner->spillFileSize))
+    {
+        spillFailed("d'écrire dans");
+    }
+
+    PartDataList* list = partition->head;
+    while (list != partition->tail)
+    {
+        if (fwrite(list->data, 1, partitioner->partitionSize, partitioner->spillFile) != partitioner->partitionSize)
+        {
+            spillFailed("d'écrire dans");
+        }
+
+        if (partition->numSpilled == partition->spilledCapacity)
+        {
+            partition->spilledCapacity = partition->spilledCapacity == 0 ? 16 : partition->spilledCapacity * 2;
+            partition->spilled = realloc(partition->spilled, sizeof(uint64_t) * partition->spilledCapacity);
+            assert(partition->spilled);
+        }
+        partition->spilled[partition->numSpilled++] = partitioner->spillFileSize;
+        partitioner->spillFileSize += partitioner->partitionSize;
+
+        PartDataList* next = list->next;
+        partFreeBlock(partitioner, list);
+        list = next;
+    }
+
+    partition->head = partition->tail;
+    partition->numBlocks = 1;
+}
+
+void partitionerSpill(Partitioner* partitioner)
+{
+    // Other threads may be spilling too, so we just spill our biggest partitions until
+    // everyone is under the target, or until we have nothing left to give.
+    while (ATOMIC_LOAD(&partitionMemoryUsed, ATOMIC_RELAXED) > SPILL_TARGET(partitionMemoryBudget))
+    {
+        Partition* biggest = NULL;
+        for (uint32_t i = 0; i < partitioner->numPartitions; ++i)
+        {
+            Partition* partition = &partitioner->partitions[i];
+            if (partition->numBlocks > 1 && (biggest == NULL || partition->numBlocks > biggest->numBlocks))
+            {
+                biggest = partition;
+            }
+        }
+
+        if (biggest == NULL)
+        {
+            break;
+        }
+        spillPartition(partitioner, biggest);
+    }
+}
+
+void partitionLoad(Partitioner* partitioner, Partition* partition)
+{
+    if (partition->numSpilled == 0)
+    {
+        return;
+    }
+
+    // Spilled blocks were written in order, so they're put back in the same order, before the ones in memory.
+    PartDataList* first = NULL;
+    PartDataList* last = NULL;
+    uint64_t position = UINT64_MAX;
+    parallelLock(&partitioner->spillLock);
+    for (uint32_t i = 0; i < partition->numSpilled; ++i)
+    {
+        uint64_t offset = partition->spilled[i];
+        if (offset != position && !spillSeek(partitioner->spillFile, offset))
+        {
+            spillFailed("de lire");
+        }
+
+        PartDataList* list = partAllocBlock(partitioner);
+        if (fread(list->data, 1, partitioner->partitionSize, partitioner->spillFile) != partitioner->partitionSize)
+        {
+            spillFailed("de lire");
+        }
+        position = offset + partitioner->partitionSize;
+
+        if (last == NULL)
+        {
+            first = list;
+        }
+        else
+        {
+            last->next = list;
+        }
+        last = list;
+    }
+    parallelUnlock(&partitioner->spillLock);
+
+    last->next = partition->head;
+    partition->head = first;
+    partition->numBlocks += partition->numSpilled;
+
+    free(partition->spilled);
+    partition->spilled = NULL;
+    partition->numSpilled = 0;
+    partition->spilledCapacity = 0;
+}
+
+void partitionRelease(Partitioner* partitioner, Partition* partition)
+{
+    PartDataList* list = partition->head;
+    while (list)
+    {
+        PartDataList* next = list->next;
+        partFreeBlock(partitioner, list);
+        list = next;
+    }
+
+    partition->head = NULL;
+    partition->tail = NULL;
+    partition->tailCursor = NULL;
+    partition->tailEnd = NULL;
+    partition->numBlocks = 0;
+}
+
+void partitionOrderBySize(Partitioner* const* partitioners, uint32_t numPartitioners, uint32_t* outOrder)
+{
+    uint32_t numPartitions = partitioners[0]->numPartitions;
+    uint64_t* sizes = calloc(numPartitions, sizeof(uint64_t));
+    assert(sizes);
+
+    for (uint32_t w = 0; w < numPartitioners; ++w)
+    {
+        for (uint32_t i = 0; i < numPartitions; ++i)
+        {
+            const Partition* partition = &partitioners[w]->partitions[i];
+            sizes[i] += partition->numBlocks + partition->numSpilled;
+        }
+    }
+
+    // There's only a few partitions, an insertion sort is plenty.
+    for (uint32_t i = 0; i < numPartitions; ++i)
+    {
+        uint32_t j = i;
+        while (j > 0 && sizes[outOrder[j - 1]] < sizes[i])
+        {
+            outOrder[j] = outOrder[j - 1];
+            j--;
+        }
+        outOrder[j] = i;
+    }
+
+    free(sizes);
+}
+
+#else
+
+void computationsSetMemoryBudget(uint64_t bytes)
+{
+    // There's no partitioner without the experimental algorithms: nothing to limit.
+    (void) bytes;
+}
+
+#endif
@@ -26,6 +26,12 @@
  * Ultimately, the partitioner works like a small hash map of huge contiguous lists.
  * Simple, but remarkably efficient!
  *
+ * When the file doesn't fit in memory, all partitioners share a memory budget (see computationsSetMemoryBudget).
+ * Once it's exceeded, the partitioner writes the full blocks of its biggest partitions to a temporary file
+ * (the "spill" file), and frees them. Then, in the second step, each partition is read back with partitionLoad
+ * right before being iterated, and freed with partitionRelease right after: only one partition at a time
+ * needs to be in memory, just like a grace hash join.
+ *
  * Only available with EXPERIMENTAL_ALGO for obvious reasons.
  */
 
@@ -34,10 +40,15 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
 
+#include "parallel.h"
+#include "profile.h"
+#include "portable.h"
+
 typedef struct PartDataList
 {
     struct PartDataList* next;
@@ -51,6 +62,12 @@ typedef struct Partition
 
     PartDataList* tail;
     PartDataList* head;
+    uint32_t numBlocks; // The number of blocks in memory, from head to tail.
+
+    // The blocks written in the spill file, by their position in the file. They come before the ones in memory.
+    uint64_t* spilled;
+    uint32_t numSpilled;
+    uint32_t spilledCapacity;
 } Partition;
 
 typedef struct Partitioner
@@ -60,8 +77,60 @@ typedef struct Partitioner
     uint32_t partitionSize;
 
     uint32_t numSteps;
+
+    // The temporary file where blocks are spilled, NULL until the memory budget is exceeded.
+    FILE* spillFile;
+    uint64_t spillFileSize;
+    // Partitions can be loaded by multiple threads at once, but there's only one file to read.
+    ParallelLock spillLock;
 } Partitioner;
 
+// The memory all partitioners can use, in bytes, 0 when there's no limit. Set by computationsSetMemoryBudget.
+extern uint64_t partitionMemoryBudget;
+// The memory used by all partitioners, only counted when there's a budget.
+extern uint64_t partitionMemoryUsed;
+
+// Writes the full blocks of the biggest partitions to the spill file, until the memory used gets well under
+// the budget (or there's nothing left to spill). Exits the program when the file can't be written.
+void partitionerSpill(Partitioner* partitioner);
+
+// Reads back all the spilled blocks of the partition, so it can be iterated.
+// Multiple partitions can be loaded at once by different threads. Exits the program when the file can't be read.
+void partitionLoad(Partitioner* partitioner, Partition* partition);
+
+// Frees all the blocks of a partition once it's been iterated. Nothing can be added to it anymore.
+void partitionRelease(Partitioner* partitioner, Partition* partition);
+
+// Gives all the partition indices, the biggest partitions first (counting all partitioners),
+// which is the best order to process them with parallelFor.
+void partitionOrderBySize(Partitioner* const* partitioners, uint32_t numPartitioners, uint32_t* outOrder);
+
+static inline PartDataList* partAllocBlock(Partitioner* partitioner)
+{
+    PartDataList* list = malloc(sizeof(PartDataList) + partitioner->partitionSize);
+    assert(list);
+    PROFILER_COUNT(PROFILE_ALLOCS, 1);
+    list->next = NULL;
+
+    if (partitionMemoryBudget != 0)
+    {
+        (void) ATOMIC_FETCH_ADD(&partitionMemoryUsed, sizeof(PartDataList) + partitioner->partitionSize,
+                                ATOMIC_RELAXED);
+    }
+    return list;
+}
+
+static inline void partFreeBlock(Partitioner* partitioner, PartDataList* list)
+{
+    free(list);
+
+    if (partitionMemoryBudget != 0)
+    {
+        (void) ATOMIC_FETCH_SUB(&partitionMemoryUsed, sizeof(PartDataList) + partitioner->partitionSize,
+                                ATOMIC_RELAXED);
+    }
+}
+
 static void partitionerInit(Partitioner* partitioner, uint32_t numPartitions, uint32_t partitionSize)
 {
     assert((numPartitions & (numPartitions - 1)) == 0 && "Num partitions must be a power of 2!");
@@ -73,14 +142,20 @@ static void partitionerInit(Partitioner* partitioner, uint32_t numPartitions, ui
     partitioner->partitionSize = partitionSize;
 
     partitioner->numSteps = 0;
+    partitioner->spillFile = NULL;
+    partitioner->spillFileSize = 0;
+    partitioner->spillLock = (ParallelLock) {0};
 
     for (uint32_t i = 0; i < numPartitions; ++i)
     {
-        PartDataList* list = malloc(sizeof(PartDataList) + partitionSize);
-        partitioner->partitions[i].head = list;
-        partitioner->partitions[i].tail = list;
-        partitioner->partitions[i].tailCursor = list->data;
-        partitioner->partitions[i].tailEnd = list->data + partitionSize;
+        PartDataList* list = partAllocBlock(partitioner);
+        partitioner->partitions[i] = (Partition) {
+            .tailCursor = list->data,
+            .tailEnd = list->data + partitionSize,
+            .tail = list,
+            .head = list,
+            .numBlocks = 1
+        };
     }
 }
 
@@ -97,15 +172,22 @@ static void partinitionerAdd(Partitioner* partitioner, uint32_t key, void* eleme
     }
     else
     {
-        PartDataList* list = malloc(sizeof(PartDataList) + partitioner->partitionSize);
-        list->next = NULL;
+        PartDataList* list = partAllocBlock(partitioner);
 
         part->tail->next = list;
         part->tail = list;
         part->tailCursor = list->data + elementSize;
         part->tailEnd = list->data + partitioner->partitionSize;
+        part->numBlocks++;
 
         memcpy(list->data, element, elementSize);
+
+        // Only check the budget when a block is allocated, it's rare enough to not slow anything down.
+        if (partitionMemoryBudget != 0
+            && ATOMIC_LOAD(&partitionMemoryUsed, ATOMIC_RELAXED) > partitionMemoryBudget)
+        {
+            partitionerSpill(partitioner);
+        }
     }
 }
 
@@ -118,14 +200,13 @@ static void partitionerFree(Partitioner* partitioner)
 
     for (int i = 0; i < partitioner->numPartitions; ++i)
     {
-        Partition* partition = &partitioner->partitions[i];
-        PartDataList* list = partition->head;
-        while (list)
-        {
-            PartDataList* temp = list;
-            list = list->next;
-            free(temp);
-        }
+        partitionRelease(partitioner, &partitioner->partitions[i]);
+        free(partitioner->partitions[i].spilled);
+    }
+
+    if (partitioner->spillFile != NULL)
+    {
+        fclose(partitioner->spillFile);
     }
 
     free(partitioner->partitions);
@@ -149,8 +230,8 @@ static void* partItNextLimit(Partitioner* partitioner, Partition* partition, Par
 }
 
 #define PARTITION_ITERATE(partitioner, part, type, var) \
-for (PartDataList* _pi_l = part->head; _pi_l != NULL; _pi_l = _pi_l->next)\
-for (type *var = (type*) _pi_l->data, *limit = partItNextLimit(partitioner, part, _pi_l, sizeof(type)); var < limit; var++)
+for (PartDataList* _pi_l = (part)->head; _pi_l != NULL; _pi_l = _pi_l->next)\
+for (type *var = (type*) _pi_l->data, *limit = partItNextLimit(partitioner, (part), _pi_l, sizeof(type)); var < limit; var++)
 
 #define PARTITIONER_ITERATE(partitioner, type, var) \
 for (Partition* _pi_p = (partitioner)->partitions; _pi_p != (partitioner)->partitions + (partitioner)->numPartitions; ++_pi_p)\
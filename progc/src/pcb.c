@@ -0,0 +1,201 @@
+#include "pcb.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+/*
+ * A growable array of 32-bit integers, used for all the columns.
+ */
+
+typedef struct
+{
+    uint32_t* data;
+    uint64_t size;
+    uint64_t capacity;
+} Column;
+
+static bool columnPush(Column* col, uint32_t value)
+{
+    if (col->size == col->capacity)
+    {
+        uint64_t newCapacity = col->capacity == 0 ? 65536 : col->capacity * 2;
+        uint32_t* newData = realloc(col->data, newCapacity * sizeof(uint32_t));
+        if (!newData)
+        {
+            return false;
+        }
+        col->data = newData;
+        col->capacity = newCapacity;
+    }
+
+    col->data[col->size++] = value;
+    return true;
+}
+
+/*
+ * Writing the file
+ */
+
+static uint64_t alignOffset(uint64_t offset)
+{
+    return (offset + PCB_ALIGNMENT - 1) / PCB_ALIGNMENT * PCB_ALIGNMENT;
+}
+
+// Writes data at the given offset, padding the file with zeroes up to it.
+static bool writeSection(FILE* file, uint64_t* fileSize, uint64_t offset, const void* data, uint64_t size)
+{
+    static const char zeroes[PCB_ALIGNMENT] = {0};
+
+    assert(offset >= *fileSize && offset - *fileSize <= PCB_ALIGNMENT);
+    if (fwrite(zeroes, 1, offset - *fileSize, file) != offset - *fileSize)
+    {
+        return false;
+    }
+    if (size > 0 && fwrite(data, 1, size, file) != size)
+    {
+        return false;
+    }
+
+    *fileSize = offset + size;
+    return true;
+}
+
+bool pcbConvert(RouteStream* stream, const char* outPath, char errMsg[ERR_MAX])
+{
+    assert(stream && outPath);
+
+    enum { ROUTE_IDS, STEP_IDS, DISTANCES, TOWNS_A, TOWNS_B, DRIVER_NAMES, NUM_COLUMNS };
+    Column columns[NUM_COLUMNS];
+    memset(columns, 0, sizeof(columns));
+
+    // The string table: the stream gives us the ids of all towns and drivers.
+    Column stringOffsets;
+    memset(&stringOffsets, 0, sizeof(stringOffsets));
+    char* strings = NULL;
+    uint64_t stringsSize = 0;
+
+    bool success = true;
+    RouteStep step;
+    uint64_t line = 1;
+    while (rsRead(stream, &step, (ALL_FIELDS & ~DISTANCE) | DISTANCE_FIXED | STRING_IDS))
+    {
+        line++;
+
+        // Only the thousandths are stored, so more decimals would be lost.
+        if (step.distanceTruncated)
+        {
+            snprintf(errMsg, ERR_MAX, "Ligne %llu : la distance a plus de 3 décimales", (unsigned long long) line);
+            success = false;
+            break;
+        }
+
+        success = columnPush(&columns[ROUTE_IDS], step.routeId)
+                  && columnPush(&columns[STEP_IDS], step.stepId)
+                  && columnPush(&columns[DISTANCES], step.distanceThousandths)
+                  && columnPush(&columns[TOWNS_A], step.townAId)
+                  && columnPush(&columns[TOWNS_B], step.townBId)
+                  && columnPush(&columns[DRIVER_NAMES], step.driverId);
+        if (!success)
+        {
+            snprintf(errMsg, ERR_MAX, "Pas assez de mémoire");
+            break;
+        }
+    }
+
+    uint32_t numStrings = rsNumStrings(stream);
+    if (success)
+    {
+        // Put all the strings one after the other.
+        for (uint32_t i = 0; i < numStrings; ++i)
+        {
+            uint32_t len;
+            rsGetString(stream, i, &len);
+            stringsSize += len;
+        }
+        strings = malloc(stringsSize > 0 ? stringsSize : 1);
+
+        success = strings != NULL && columnPush(&stringOffsets, 0);
+        uint64_t offset = 0;
+        for (uint32_t i = 0; success && i < numStrings; ++i)
+        {
+            uint32_t len;
+            const char* str = rsGetString(stream, i, &len);
+            memcpy(strings + offset, str, len);
+            offset += len;
+            success = offset <= UINT32_MAX && columnPush(&stringOffsets, (uint32_t) offset);
+        }
+
+        if (!success)
+        {
+            snprintf(errMsg, ERR_MAX, "Pas assez de mémoire");
+        }
+    }
+
+    if (success)
+    {
+        uint64_t numRows = columns[ROUTE_IDS].size;
+        uint64_t columnSize = numRows * sizeof(uint32_t);
+
+        PcbHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, PCB_MAGIC, 4);
+        header.version = PCB_VERSION;
+        header.numRows = numRows;
+        header.numStrings = numStrings;
+
+        uint64_t* columnOffsets[NUM_COLUMNS] = {
+                &header.routeIdsOffset, &header.stepIdsOffset, &header.distancesOffset,
+                &header.townsAOffset, &header.townsBOffset, &header.driverNamesOffset
+        };
+        uint64_t offset = alignOffset(sizeof(PcbHeader));
+        for (int i = 0; i < NUM_COLUMNS; ++i)
+        {
+            *columnOffsets[i] = offset;
+            offset = alignOffset(offset + columnSize);
+        }
+        header.stringOffsetsOffset = offset;
+        header.stringsOffset = alignOffset(offset + stringOffsets.size * sizeof(uint32_t));
+        header.stringsSize = stringsSize;
+
+        FILE* file = fopen(outPath, "wb");
+        if (!file)
+        {
+            snprintf(errMsg, ERR_MAX, "Impossible de créer « %s » : %s", outPath, strerror(errno));
+            success = false;
+        }
+        else
+        {
+            uint64_t fileSize = 0;
+            success = writeSection(file, &fileSize, 0, &header, sizeof(header));
+            for (int i = 0; success && i < NUM_COLUMNS; ++i)
+            {
+                success = writeSection(file, &fileSize, *columnOffsets[i], columns[i].data, columnSize);
+            }
+            success = success
+                      && writeSection(file, &fileSize, header.stringOffsetsOffset, stringOffsets.data,
+                                      stringOffsets.size * sizeof(uint32_t))
+                      && writeSection(file, &fileSize, header.stringsOffset, strings, stringsSize);
+
+            if (fclose(file) != 0)
+            {
+                success = false;
+            }
+            if (!success)
+            {
+                snprintf(errMsg, ERR_MAX, "Impossible d'écrire « %s » : %s", outPath, strerror(errno));
+            }
+        }
+    }
+
+    for (int i = 0; i < NUM_COLUMNS; ++i)
+    {
+        free(columns[i].data);
+    }
+    free(stringOffsets.data);
+    free(strings);
+
+    return success;
+}
@@ -0,0 +1,56 @@
+#ifndef PCB_H
+#define PCB_H
+
+/*
+ * pcb.h
+ * ---------------
+ * The PermisC Binary format (.pcb): a columnar copy of the CSV file, made once using
+ * "PermisC convert data.csv data.pcb". Computations can then run on the .pcb file
+ * many times, without parsing anything: the file is mapped in memory and read as is.
+ *
+ * Layout of the file (native endianness, offsets from the start of the file, sections aligned by 64 bytes):
+ *   PcbHeader
+ *   uint32_t routeIds[numRows]
+ *   uint32_t stepIds[numRows]
+ *   uint32_t distances[numRows]            (fixed-point, in thousandths: 365.109 is stored as 365109)
+ *   uint32_t townsA[numRows]               (ids of strings in the string table)
+ *   uint32_t townsB[numRows]
+ *   uint32_t driverNames[numRows]
+ *   uint32_t stringOffsets[numStrings + 1] (string i goes from strings[stringOffsets[i]] to strings[stringOffsets[i+1]])
+ *   char strings[stringsSize]              (all strings, one after the other, NOT null-terminated)
+ *
+ * Towns and drivers share the same string table.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "route.h"
+
+#define PCB_MAGIC "PCB1"
+#define PCB_VERSION 1
+#define PCB_ALIGNMENT 64
+
+typedef struct PcbHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t numRows;
+    uint32_t numStrings;
+    uint32_t reserved;
+
+    uint64_t routeIdsOffset;
+    uint64_t stepIdsOffset;
+    uint64_t distancesOffset;
+    uint64_t townsAOffset;
+    uint64_t townsBOffset;
+    uint64_t driverNamesOffset;
+    uint64_t stringOffsetsOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+} PcbHeader;
+
+// Reads all the remaining steps of the stream, and writes them in a .pcb file at outPath.
+// Returns false when something went wrong, with an error message in errMsg.
+bool pcbConvert(RouteStream* stream, const char* outPath, char errMsg[ERR_MAX]);
+
+#endif //PCB_H
@@ -0,0 +1,312 @@
+#ifndef PORTABLE_H
+#define PORTABLE_H
+
+/*
+ * portable.h
+ * ---------------
+ * The few things C11 doesn't give us in a way every compiler understands: atomics on plain variables,
+ * and finding the lowest/highest bit set of an integer.
+ * - GCC and Clang: their builtins (__atomic_*, __builtin_ctz...).
+ * - MSVC: the _Interlocked* and _BitScan* intrinsics. Interlocked operations are full barriers,
+ *   so the memory order is just ignored there.
+ * - Anything else: plain reads and writes, which is only fine without threads (see parallel.h).
+ *
+ * Atomics:
+ *   ATOMIC_LOAD(ptr, order), ATOMIC_STORE(ptr, val, order)
+ *   ATOMIC_FETCH_ADD/SUB/OR(ptr, val, order): returns the old value
+ *   ATOMIC_CAS(ptr, expected, desired): sequentially consistent, *expected gets the current value on failure
+ *   ATOMIC_TEST_AND_SET(ptr, order), ATOMIC_CLEAR(ptr, order): on a char
+ * order is one of ATOMIC_RELAXED, ATOMIC_ACQUIRE, ATOMIC_RELEASE or ATOMIC_SEQ_CST.
+ * Works with bool, char, uint32_t, uint64_t and pointers (only what the program uses).
+ *
+ * Bits: bitLowest32, bitLowest64, bitLeadingZeros64. The value must not be 0.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#if defined(__GNUC__)
+
+#define ATOMIC_RELAXED __ATOMIC_RELAXED
+#define ATOMIC_ACQUIRE __ATOMIC_ACQUIRE
+#define ATOMIC_RELEASE __ATOMIC_RELEASE
+#define ATOMIC_SEQ_CST __ATOMIC_SEQ_CST
+
+#define ATOMIC_LOAD(ptr, order) __atomic_load_n(ptr, order)
+#define ATOMIC_STORE(ptr, val, order) __atomic_store_n(ptr, val, order)
+#define ATOMIC_FETCH_ADD(ptr, val, order) __atomic_fetch_add(ptr, val, order)
+#define ATOMIC_FETCH_SUB(ptr, val, order) __atomic_fetch_sub(ptr, val, order)
+#define ATOMIC_FETCH_OR(ptr, val, order) __atomic_fetch_or(ptr, val, order)
+#define ATOMIC_CAS(ptr, expected, desired) \
+    __atomic_compare_exchange_n(ptr, expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#define ATOMIC_TEST_AND_SET(ptr, order) __atomic_test_and_set(ptr, order)
+#define ATOMIC_CLEAR(ptr, order) __atomic_clear(ptr, order)
+
+static inline uint32_t bitLowest32(uint32_t value)
+{
+    return (uint32_t) __builtin_ctz(value);
+}
+
+static inline uint32_t bitLowest64(uint64_t value)
+{
+    return (uint32_t) __builtin_ctzll(value);
+}
+
+static inline uint32_t bitLeadingZeros64(uint64_t value)
+{
+    return (uint32_t) __builtin_clzll(value);
+}
+
+#elif defined(_MSC_VER)
+
+#include <intrin.h>
+
+#define ATOMIC_RELAXED 0
+#define ATOMIC_ACQUIRE 0
+#define ATOMIC_RELEASE 0
+#define ATOMIC_SEQ_CST 0
+
+// On x86, aligned loads are atomic, and MSVC never moves volatile ones around (/volatile:ms, the default there),
+// so they're acquire loads for free. Elsewhere (ARM64), a compare-exchange that changes nothing does the job.
+#if defined(_M_IX86) || defined(_M_X64)
+#define PORTABLE_LOAD(type, ptr, intrinsic, cast) (*(const volatile type*) (ptr))
+#else
+#define PORTABLE_LOAD(type, ptr, intrinsic, cast) ((type) intrinsic((volatile cast*) (ptr), 0, 0))
+#endif
+
+static inline bool atomicLoadBool(const volatile void* ptr)
+{
+    return PORTABLE_LOAD(bool, ptr, _InterlockedCompareExchange8, char);
+}
+
+static inline char atomicLoadChar(const volatile void* ptr)
+{
+    return PORTABLE_LOAD(char, ptr, _InterlockedCompareExchange8, char);
+}
+
+static inline uint32_t atomicLoadU32(const volatile void* ptr)
+{
+    return PORTABLE_LOAD(uint32_t, ptr, _InterlockedCompareExchange, long);
+}
+
+static inline uint64_t atomicLoadU64(const volatile void* ptr)
+{
+    return PORTABLE_LOAD(uint64_t, ptr, _InterlockedCompareExchange64, long long);
+}
+
+static inline void* atomicLoadPtr(const volatile void* ptr)
+{
+#if defined(_M_IX86) || defined(_M_X64)
+    return *(void* const volatile*) ptr;
+#else
+    return _InterlockedCompareExchangePointer((void* volatile*) ptr, NULL, NULL);
+#endif
+}
+
+// Stores are rare enough: an exchange does it in any order.
+static inline void atomicStoreBool(volatile void* ptr, bool val)
+{
+    _InterlockedExchange8((volatile char*) ptr, (char) val);
+}
+
+static inline void atomicStoreU32(volatile void* ptr, uint32_t val)
+{
+    _InterlockedExchange((volatile long*) ptr, (long) val);
+}
+
+static inline void atomicStoreU64(volatile void* ptr, uint64_t val)
+{
+    _InterlockedExchange64((volatile long long*) ptr, (long long) val);
+}
+
+static inline void atomicStorePtr(volatile void* ptr, void* val)
+{
+    _InterlockedExchangePointer((void* volatile*) ptr, val);
+}
+
+static inline uint32_t atomicFetchAddU32(volatile void* ptr, uint32_t val)
+{
+    return (uint32_t) _InterlockedExchangeAdd((volatile long*) ptr, (long) val);
+}
+
+static inline uint64_t atomicFetchAddU64(volatile void* ptr, uint64_t val)
+{
+    return (uint64_t) _InterlockedExchangeAdd64((volatile long long*) ptr, (long long) val);
+}
+
+static inline uint32_t atomicFetchOrU32(volatile void* ptr, uint32_t val)
+{
+    return (uint32_t) _InterlockedOr((volatile long*) ptr, (long) val);
+}
+
+static inline uint64_t atomicFetchOrU64(volatile void* ptr, uint64_t val)
+{
+    return (uint64_t) _InterlockedOr64((volatile long long*) ptr, (long long) val);
+}
+
+static inline bool atomicCasBool(volatile void* ptr, void* expected, bool desired)
+{
+    char old = _InterlockedCompareExchange8((volatile char*) ptr, (char) desired, *(char*) expected);
+    bool success = old == *(char*) expected;
+    *(bool*) expected = (bool) old;
+    return success;
+}
+
+static inline bool atomicCasU32(volatile void* ptr, void* expected, uint32_t desired)
+{
+    long old = _InterlockedCompareExchange((volatile long*) ptr, (long) desired, *(long*) expected);
+    bool success = old == *(long*) expected;
+    *(uint32_t*) expected = (uint32_t) old;
+    return success;
+}
+
+static inline bool atomicCasU64(volatile void* ptr, void* expected, uint64_t desired)
+{
+    long long old = _InterlockedCompareExchange64((volatile long long*) ptr, (long long) desired,
+                                                  *(long long*) expected);
+    bool success = old == *(long long*) expected;
+    *(uint64_t*) expected = (uint64_t) old;
+    return success;
+}
+
+static inline bool atomicCasPtr(volatile void* ptr, void* expected, void* desired)
+{
+    void* old = _InterlockedCompareExchangePointer((void* volatile*) ptr, desired, *(void**) expected);
+    bool success = old == *(void**) expected;
+    *(void**) expected = old;
+    return success;
+}
+
+// Pick the function from the type of the variable. Anything else than the types below is a pointer.
+#define ATOMIC_LOAD(ptr, order) _Generic(*(ptr), \
+    bool: atomicLoadBool, char: atomicLoadChar, uint32_t: atomicLoadU32, uint64_t: atomicLoadU64, \
+    default: atomicLoadPtr)(ptr)
+#define ATOMIC_STORE(ptr, val, order) _Generic(*(ptr), \
+    bool: atomicStoreBool, uint32_t: atomicStoreU32, uint64_t: atomicStoreU64, default: atomicStorePtr)(ptr, val)
+#define ATOMIC_FETCH_ADD(ptr, val, order) _Generic(*(ptr), \
+    uint32_t: atomicFetchAddU32, uint64_t: atomicFetchAddU64)(ptr, val)
+#define ATOMIC_FETCH_SUB(ptr, val, order) _Generic(*(ptr), \
+    uint32_t: atomicFetchAddU32, uint64_t: atomicFetchAddU64)(ptr, 0 - (val))
+#define ATOMIC_FETCH_OR(ptr, val, order) _Generic(*(ptr), \
+    uint32_t: atomicFetchOrU32, uint64_t: atomicFetchOrU64)(ptr, val)
+#define ATOMIC_CAS(ptr, expected, desired) _Generic(*(ptr), \
+    bool: atomicCasBool, uint32_t: atomicCasU32, uint64_t: atomicCasU64, default: atomicCasPtr)(ptr, expected, desired)
+#define ATOMIC_TEST_AND_SET(ptr, order) (_InterlockedExchange8((volatile char*) (ptr), 1) != 0)
+#define ATOMIC_CLEAR(ptr, order) ((void) _InterlockedExchange8((volatile char*) (ptr), 0))
+
+static inline uint32_t bitLowest32(uint32_t value)
+{
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return (uint32_t) index;
+}
+
+static inline uint32_t bitLowest64(uint64_t value)
+{
+    unsigned long index;
+#if defined(_M_X64) || defined(_M_ARM64)
+    _BitScanForward64(&index, value);
+#else
+    // No 64-bit version on 32-bit x86: look at each half.
+    if ((uint32_t) value != 0)
+    {
+        _BitScanForward(&index, (uint32_t) value);
+    }
+    else
+    {
+        _BitScanForward(&index, (uint32_t) (value >> 32));
+        index += 32;
+    }
+#endif
+    return (uint32_t) index;
+}
+
+static inline uint32_t bitLeadingZeros64(uint64_t value)
+{
+    unsigned long index;
+#if defined(_M_X64) || defined(_M_ARM64)
+    _BitScanReverse64(&index, value);
+#else
+    if ((value >> 32) != 0)
+    {
+        _BitScanReverse(&index, (uint32_t) (value >> 32));
+        index += 32;
+    }
+    else
+    {
+        _BitScanReverse(&index, (uint32_t) value);
+    }
+#endif
+    // index is the position of the highest bit.
+    return 63 - (uint32_t) index;
+}
+
+#else
+
+// No threads, no problem.
+#define ATOMIC_RELAXED 0
+#define ATOMIC_ACQUIRE 0
+#define ATOMIC_RELEASE 0
+#define ATOMIC_SEQ_CST 0
+
+#define ATOMIC_LOAD(ptr, order) (*(ptr))
+#define ATOMIC_STORE(ptr, val, order) ((void) (*(ptr) = (val)))
+#define ATOMIC_FETCH_ADD(ptr, val, order) ((*(ptr) += (val)) - (val))
+#define ATOMIC_FETCH_SUB(ptr, val, order) ((*(ptr) -= (val)) + (val))
+// Only used on uint64_t (bitmaps).
+#define ATOMIC_FETCH_OR(ptr, val, order) portableFetchOr64((uint64_t*) (ptr), (val))
+#define ATOMIC_CAS(ptr, expected, desired) \
+    (*(ptr) == *(expected) ? (*(ptr) = (desired), true) : (*(expected) = *(ptr), false))
+#define ATOMIC_TEST_AND_SET(ptr, order) portableTestAndSet(ptr)
+#define ATOMIC_CLEAR(ptr, order) ((void) (*(ptr) = 0))
+
+static inline uint64_t portableFetchOr64(uint64_t* ptr, uint64_t val)
+{
+    uint64_t old = *ptr;
+    *ptr |= val;
+    return old;
+}
+
+static inline bool portableTestAndSet(char* ptr)
+{
+    bool old = *ptr != 0;
+    *ptr = 1;
+    return old;
+}
+
+static inline uint32_t bitLowest32(uint32_t value)
+{
+    uint32_t n = 0;
+    while ((value & 1) == 0)
+    {
+        value >>= 1;
+        n++;
+    }
+    return n;
+}
+
+static inline uint32_t bitLowest64(uint64_t value)
+{
+    uint32_t n = 0;
+    while ((value & 1) == 0)
+    {
+        value >>= 1;
+        n++;
+    }
+    return n;
+}
+
+static inline uint32_t bitLeadingZeros64(uint64_t value)
+{
+    uint32_t n = 0;
+    while ((value & (1ULL << 63)) == 0)
+    {
+        value <<= 1;
+        n++;
+    }
+    return n;
+}
+
+#endif
+
+#endif
@@ -2,13 +2,287 @@
 
 #if ENABLE_PROFILER
 
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The runs kept for the min/median/max. With --follow, only the last ones are kept: we don't want
+// the profiler to eat all the memory after a few days.
+#define PROFILE_MAX_RUNS 1024
+
+typedef struct ProfileRun
+{
+    int64_t nanos;
+    uint64_t counters[PROFILE_NUM_COUNTERS];
+} ProfileRun;
+
+typedef struct ProfileScope
+{
+    const char* name;
+    uint32_t depth; // 0 for the root
+    struct ProfileScope* parent;
+    struct ProfileScope* firstChild;
+    struct ProfileScope* lastChild;
+    struct ProfileScope* next; // The next child of the parent
+    int64_t start; // When the current run started
+
+    // The counters of the current run. Updated by any thread, see profilerCount.
+    uint64_t counters[PROFILE_NUM_COUNTERS];
+
+    // The last PROFILE_MAX_RUNS runs, in a ring: run n is at n % PROFILE_MAX_RUNS.
+    ProfileRun* runs;
+    uint64_t numRuns;
+    // The totals of all runs, including the ones that fell off the ring.
+    int64_t totalNanos;
+    uint64_t totalCounters[PROFILE_NUM_COUNTERS];
+} ProfileScope;
+
+static ProfileScope rootScope = {.name = "root"};
+
 ProfilerState profState;
 
+static const char* const counterNames[PROFILE_NUM_COUNTERS] = {"rows", "bytes", "map_probes", "allocs"};
+
 void profilerInit()
 {
 #ifdef WIN32
     QueryPerformanceFrequency(&profState.secFreq);
 #endif
+    profState.root = &rootScope;
+    profState.current = &rootScope;
+    profState.currentCounters = rootScope.counters;
+}
+
+void profilerEnter(const char* name)
+{
+    ProfileScope* parent = profState.current;
+    assert(parent && "profilerInit must be called first!");
+
+    // Same name, same parent: it's a new run of a scope we already know.
+    ProfileScope* scope = parent->firstChild;
+    while (scope != NULL && strcmp(scope->name, name) != 0)
+    {
+        scope = scope->next;
+    }
+
+    if (scope == NULL)
+    {
+        scope = calloc(1, sizeof(ProfileScope));
+        assert(scope);
+        scope->name = name;
+        scope->depth = parent->depth + 1;
+        scope->parent = parent;
+        if (parent->lastChild != NULL)
+        {
+            parent->lastChild->next = scope;
+        }
+        else
+        {
+            parent->firstChild = scope;
+        }
+        parent->lastChild = scope;
+    }
+
+    memset(scope->counters, 0, sizeof(scope->counters));
+    profState.current = scope;
+    profState.currentCounters = scope->counters;
+    scope->start = nanos();
+}
+
+// Gives the number of bytes (or rows) per second.
+static double perSecond(uint64_t count, int64_t nanos)
+{
+    return nanos > 0 ? (double) count * 1e9 / (double) nanos : 0.0;
+}
+
+static void printRun(const ProfileScope* scope, const ProfileRun* run)
+{
+    fprintf(stderr, "[PROFILER] %*s%s: %lld µs", (int) (scope->depth - 1) * 2, "", scope->name,
+            (long long) run->nanos / 1000);
+
+    const uint64_t* c = run->counters;
+    if (c[PROFILE_ROWS] != 0)
+    {
+        fprintf(stderr, " | %llu rows (%.0f rows/s)", (unsigned long long) c[PROFILE_ROWS],
+                perSecond(c[PROFILE_ROWS], run->nanos));
+    }
+    if (c[PROFILE_BYTES] != 0)
+    {
+        fprintf(stderr, " | %.1f MB (%.1f MB/s)", (double) c[PROFILE_BYTES] / 1e6,
+                perSecond(c[PROFILE_BYTES], run->nanos) / 1e6);
+    }
+    if (c[PROFILE_MAP_PROBES] != 0)
+    {
+        fprintf(stderr, " | %llu map probes", (unsigned long long) c[PROFILE_MAP_PROBES]);
+    }
+    if (c[PROFILE_ALLOCS] != 0)
+    {
+        fprintf(stderr, " | %llu allocs", (unsigned long long) c[PROFILE_ALLOCS]);
+    }
+    fputc('\n', stderr);
 }
 
-#endif
\ No newline at end of file
+void profilerExit()
+{
+    int64_t end = nanos();
+
+    ProfileScope* scope = profState.current;
+    assert(scope != &rootScope && "PROFILER_END without PROFILER_START!");
+
+    ProfileRun run = {.nanos = end - scope->start};
+    memcpy(run.counters, scope->counters, sizeof(run.counters));
+
+    if (scope->runs == NULL)
+    {
+        scope->runs = malloc(sizeof(ProfileRun) * PROFILE_MAX_RUNS);
+        assert(scope->runs);
+    }
+    scope->runs[scope->numRuns % PROFILE_MAX_RUNS] = run;
+    scope->numRuns++;
+    scope->totalNanos += run.nanos;
+
+    // The counters of the parent include the ones of its children.
+    ProfileScope* parent = scope->parent;
+    for (uint32_t i = 0; i < PROFILE_NUM_COUNTERS; ++i)
+    {
+        scope->totalCounters[i] += run.counters[i];
+        parent->counters[i] += run.counters[i];
+    }
+
+    profState.current = parent;
+    profState.currentCounters = parent->counters;
+
+    printRun(scope, &run);
+}
+
+void profilerSetJsonPath(const char* path)
+{
+    profState.jsonPath = path;
+}
+
+static int compareNanos(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*) a, y = *(const int64_t*) b;
+    return (x > y) - (x < y);
+}
+
+static void writeJsonString(FILE* file, const char* str)
+{
+    fputc('"', file);
+    for (const char* p = str; *p != '\0'; ++p)
+    {
+        if (*p == '"' || *p == '\\')
+        {
+            fprintf(file, "\\%c", *p);
+        }
+        else if ((unsigned char) *p < 0x20)
+        {
+            fprintf(file, "\\u%04x", (unsigned) *p);
+        }
+        else
+        {
+            fputc(*p, file);
+        }
+    }
+    fputc('"', file);
+}
+
+// Writes the scope and all its children, indented by its depth.
+static void writeJsonScope(FILE* file, const ProfileScope* scope)
+{
+    int indent = (int) scope->depth * 4;
+    fprintf(file, "%*s{\n", indent - 2, "");
+    fprintf(file, "%*s\"name\": ", indent, "");
+    writeJsonString(file, scope->name);
+    fprintf(file, ",\n%*s\"runs\": %llu,\n", indent, "", (unsigned long long) scope->numRuns);
+
+    // The min/median/max of the runs we still have.
+    uint32_t numKept = scope->numRuns < PROFILE_MAX_RUNS ? (uint32_t) scope->numRuns : PROFILE_MAX_RUNS;
+    int64_t sorted[PROFILE_MAX_RUNS];
+    for (uint32_t i = 0; i < numKept; ++i)
+    {
+        sorted[i] = scope->runs[i].nanos;
+    }
+    qsort(sorted, numKept, sizeof(int64_t), compareNanos);
+    double median = 0.0;
+    if (numKept != 0)
+    {
+        median = numKept % 2 == 1 ? (double) sorted[numKept / 2]
+                                  : ((double) sorted[numKept / 2 - 1] + (double) sorted[numKept / 2]) / 2.0;
+    }
+    fprintf(file, "%*s\"time_us\": {\"min\": %.3f, \"median\": %.3f, \"max\": %.3f, \"total\": %.3f},\n",
+            indent, "", numKept != 0 ? (double) sorted[0] / 1e3 : 0.0, median / 1e3,
+            numKept != 0 ? (double) sorted[numKept - 1] / 1e3 : 0.0, (double) scope->totalNanos / 1e3);
+
+    // Counters and rates are for all runs.
+    fprintf(file, "%*s\"counters\": {", indent, "");
+    for (uint32_t i = 0; i < PROFILE_NUM_COUNTERS; ++i)
+    {
+        fprintf(file, "%s\"%s\": %llu", i == 0 ? "" : ", ", counterNames[i],
+                (unsigned long long) scope->totalCounters[i]);
+    }
+    fprintf(file, "},\n");
+    fprintf(file, "%*s\"rates\": {\"rows_per_s\": %.1f, \"mb_per_s\": %.3f},\n", indent, "",
+            perSecond(scope->totalCounters[PROFILE_ROWS], scope->totalNanos),
+            perSecond(scope->totalCounters[PROFILE_BYTES], scope->totalNanos) / 1e6);
+
+    fprintf(file, "%*s\"children\": [", indent, "");
+    bool first = true;
+    for (const ProfileScope* child = scope->firstChild; child != NULL; child = child->next)
+    {
+        // Scopes that have just been started don't have any run yet.
+        if (child->numRuns != 0)
+        {
+            fputs(first ? "\n" : ",\n", file);
+            writeJsonScope(file, child);
+            first = false;
+        }
+    }
+    fprintf(file, first ? "]\n" : "\n%*s]\n", indent, "");
+    fprintf(file, "%*s}", indent - 2, "");
+}
+
+bool profilerWriteJson()
+{
+    if (profState.jsonPath == NULL)
+    {
+        return true;
+    }
+
+    char tempPath[4096];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", profState.jsonPath);
+
+    FILE* file = fopen(tempPath, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Impossible de créer le fichier « %s » : %s\n", tempPath, strerror(errno));
+        return false;
+    }
+
+    fprintf(file, "{\n  \"scopes\": [");
+    bool first = true;
+    for (const ProfileScope* scope = rootScope.firstChild; scope != NULL; scope = scope->next)
+    {
+        if (scope->numRuns != 0)
+        {
+            fputs(first ? "\n" : ",\n", file);
+            writeJsonScope(file, scope);
+            first = false;
+        }
+    }
+    fprintf(file, first ? "]\n}\n" : "\n  ]\n}\n");
+
+    bool written = !ferror(file);
+    written = fclose(file) == 0 && written;
+    if (!written || rename(tempPath, profState.jsonPath) != 0)
+    {
+        fprintf(stderr, "Impossible d'écrire le fichier « %s » : %s\n", profState.jsonPath, strerror(errno));
+        remove(tempPath);
+        return false;
+    }
+    return true;
+}
+
+#endif
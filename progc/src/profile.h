@@ -5,13 +5,42 @@
  * profile.h
  * ---------------
  * Some functions to measure nanosecond time to do really basic profiling.
+ *
+ * Scopes are opened with PROFILER_START and closed with PROFILER_END, and can be nested as much as we want:
+ * the profiler keeps a tree of all scopes, like "Computations > T > Sort towns".
+ * Each time a scope ends, its duration is printed to stderr, indented by its depth.
+ * When a scope runs again with the same parent (on each round of --follow, for example),
+ * it's the same node of the tree, with one more run: we get the min/median/max duration of all runs.
+ *
+ * Scopes also have counters (rows, bytes, map probes, allocations), incremented with PROFILER_COUNT
+ * on the innermost scope. Counters of a scope include the ones of its children, just like its duration does.
+ * Rates (MB/s, rows/s) are given when a scope has read rows or bytes.
+ *
+ * With profilerSetJsonPath (--profile-json), the whole tree is written as JSON by profilerWriteJson.
+ *
+ * Scopes can only be started and ended by the main thread. However, PROFILER_COUNT can be used by any thread,
+ * as long as the main thread stays in the same scope while the other threads run (like with parallelRun).
  */
 
 #include "compile_settings.h"
 
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "portable.h"
+
+// All the counters of a scope.
+typedef enum
+{
+    PROFILE_ROWS, // Lines of the file read
+    PROFILE_BYTES, // Characters of the file read
+    PROFILE_MAP_PROBES, // Slots (or groups of slots with swiss tables) looked at by the maps of map.h
+    PROFILE_ALLOCS, // Big allocations: arena blocks, partition blocks, map tables...
+    PROFILE_NUM_COUNTERS
+} ProfileCounter;
+
 #if ENABLE_PROFILER
 
-#include <stdint.h>
 #ifdef WIN32
 #include <windows.h>
 #elif defined(__unix__)
@@ -19,19 +48,49 @@
 #include <time.h>
 #endif
 
+// A scope of the tree, defined in profile.c.
+struct ProfileScope;
+
 typedef struct
 {
 #ifdef WIN32
     LARGE_INTEGER secFreq;
-#else
-    int dummy;
 #endif
+    // The scope containing all top-level scopes. It's never started nor ended.
+    struct ProfileScope* root;
+    // The innermost scope started and not ended yet, root if there's none.
+    struct ProfileScope* current;
+    // The counters of the current run of the current scope.
+    uint64_t* currentCounters;
+    // Where profilerWriteJson writes the tree, NULL when it's not wanted.
+    const char* jsonPath;
 } ProfilerState;
 
 extern ProfilerState profState;
 
 void profilerInit();
 
+// Starts a scope inside the current one. The name isn't copied: it must stay valid until the program exits.
+void profilerEnter(const char* name);
+
+// Ends the current scope and prints its duration and counters.
+void profilerExit();
+
+// Adds n to a counter of the current scope. Can be used by any thread.
+static inline void profilerCount(ProfileCounter counter, uint64_t n)
+{
+    (void) ATOMIC_FETCH_ADD(&profState.currentCounters[counter], n, ATOMIC_RELAXED);
+}
+
+// Sets the file where profilerWriteJson writes the tree.
+void profilerSetJsonPath(const char* path);
+
+// Writes all the scopes started so far to the JSON file given by profilerSetJsonPath, if there's one.
+// Ended scopes have all their runs, while the ones still running only have their previous runs.
+// The file is written under another name and then renamed, so it's always complete.
+// Prints an error and returns false when the file can't be written.
+bool profilerWriteJson();
+
 static int64_t nanos()
 {
 #ifdef WIN32
@@ -50,14 +109,18 @@ static int64_t nanos()
 #endif
 }
 
-#define PROFILER_START(name) int64_t pstart_ = nanos(); const char* pname_ = name;
-#define PROFILER_END() int64_t pend_ = nanos(); fprintf(stderr, "[PROFILER] %s: %lld µs\n", pname_, (long long)(pend_ - pstart_)/1000);
+#define PROFILER_START(name) profilerEnter(name)
+#define PROFILER_END() profilerExit()
+#define PROFILER_COUNT(counter, n) profilerCount(counter, n)
 
 #else
 
-#define PROFILER_START(name)
-#define PROFILER_END()
+#define PROFILER_START(name) ((void) 0)
+#define PROFILER_END() ((void) 0)
+#define PROFILER_COUNT(counter, n) ((void) 0)
 static void profilerInit() {}
+static inline void profilerSetJsonPath(const char* path) { (void) path; }
+static inline bool profilerWriteJson() { return true; }
 
 #endif
 
@@ -1,10 +1,31 @@
+// Needed for MADV_HUGEPAGE, MAP_ANONYMOUS and O_DIRECT.
+#define _GNU_SOURCE
+
 #include "route.h"
+#include "compile_settings.h"
 
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
 #include <stdlib.h>
 #include "delimiter_search.h"
+#include "uring.h"
+#include "pcb.h"
+#include "interner.h"
+#include "portable.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RS_MMAP_SUPPORTED 1
+#define RS_PREFETCH_SUPPORTED 1
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#else
+#define RS_MMAP_SUPPORTED 0
+#define RS_PREFETCH_SUPPORTED 0
+#endif
 
 // 128 KB
 // After some profiling, it empirically works fast on my computer...
@@ -13,16 +34,123 @@
 // The slack needed for the delimiter search to work properly.
 #define READ_BUFFER_SLACK 64
 
-RouteStream rsOpen(const char* path)
+// The number of characters in each window of the structural index (see RsDelimIndex).
+// Small enough for the window (and its bitmap) to still be in the L1 cache when we walk it.
+#define DELIM_INDEX_WINDOW (16 * 1024)
+#define DELIM_INDEX_WORDS (DELIM_INDEX_WINDOW / 64)
+
+// The number of chunks used in RS_PREFETCHED mode: one being parsed, the other being filled.
+#define PREFETCH_CHUNKS 2
+
+// The alignment of buffers, offsets and sizes required by O_DIRECT reads. 4 KB is fine on pretty much any disk.
+#define URING_ALIGNMENT 4096
+#define URING_MAX_DEPTH 64
+#define RS_URING_SUPPORTED URING_SUPPORTED
+
+#if RS_PREFETCH_SUPPORTED
+// A chunk of the file, filled by the prefetch thread, and then parsed by the stream.
+typedef struct
+{
+    // READ_BUFFER_SIZE + READ_BUFFER_SLACK bytes. Always contains complete lines only.
+    char* data;
+    size_t chars;
+    // True when the chunk is ready to be parsed, false when it can be filled.
+    bool full;
+} PrefetchChunk;
+
+typedef struct RsPrefetcher
+{
+    FILE* file;
+    // Decompresses the file when it's compressed, NULL otherwise.
+    Decompressor* decompressor;
+    pthread_t thread;
+
+    // Protects the full flags of the chunks, and the done/stop/error fields.
+    pthread_mutex_t lock;
+    // Signaled when a chunk has been filled, or when the thread is done.
+    pthread_cond_t chunkFilled;
+    // Signaled when a chunk has been parsed, or when the stream is closed.
+    pthread_cond_t chunkEmptied;
+
+    PrefetchChunk chunks[PREFETCH_CHUNKS];
+    // The index of the chunk being parsed by the stream.
+    uint32_t readIndex;
+    // True when the stream currently holds chunks[readIndex], and has to give it back.
+    bool holdingChunk;
+
+    // True when the thread has read the entire file (or failed).
+    bool done;
+    // True when the stream is closed, and the thread should stop as soon as possible.
+    bool stop;
+    // The errno of a failed read, 0 if everything's fine.
+    int error;
+
+    // The partial line at the end of the last chunk, which is put at the start of the next one.
+    // Only used by the thread.
+    char* carry;
+    size_t carryChars;
+} RsPrefetcher;
+#endif
+
+// Counts the lines read, for the profiler. It's cheap, but there's no point doing it without the profiler.
+#if ENABLE_PROFILER
+#define COUNT_READ(stream, rows, bytes) ((stream)->rowsRead += (rows), (stream)->bytesRead += (bytes))
+#else
+#define COUNT_READ(stream, rows, bytes) ((void) 0)
+#endif
+
+// Returns an invalid stream of the given mode, with everything set to zero/NULL.
+static RouteStream emptyStream(RouteStreamMode mode)
 {
     RouteStream s;
-    s.file = NULL;
-    s.readBuf = NULL;
-    s.readBufChars = 0;
-    s.closed = false;
+    memset(&s, 0, sizeof(RouteStream));
+    s.mode = mode;
+    return s;
+}
+
+// True when the path means "read the standard input".
+static bool isStdinPath(const char* path)
+{
+    return strcmp(path, RS_STDIN_PATH) == 0;
+}
+
+// Opens the file for reading, or gives the standard input when the path is RS_STDIN_PATH.
+// Returns NULL on failure, with errno set.
+static FILE* openFile(const char* path)
+{
+    return isStdinPath(path) ? stdin : fopen(path, "rb");
+}
+
+// Reads the first characters of the file (stopping after a newline) to find out if it's compressed.
+// The characters read are put in magic, and outLineEnded is set when the last one is a newline.
+static Compression peekCompression(FILE* file, unsigned char magic[COMPRESSION_MAGIC_SIZE],
+                                   size_t* outLen, bool* outLineEnded)
+{
+    size_t len = 0;
+    bool lineEnded = false;
+    while (len < COMPRESSION_MAGIC_SIZE && !lineEnded)
+    {
+        int ch = fgetc(file);
+        if (ch == EOF)
+        {
+            break;
+        }
+        magic[len++] = (unsigned char) ch;
+        lineEnded = ch == '\n';
+    }
+
+    *outLen = len;
+    *outLineEnded = lineEnded;
+    return compressionDetect(magic, len);
+}
+
+RouteStream rsOpen(const char* path)
+{
+    RouteStream s = emptyStream(RS_BUFFERED);
 
-    FILE* file = fopen(path, "rb");
+    FILE* file = openFile(path);
     s.file = file;
+    s.sysError = file ? 0 : errno;
 
     // Leave 64 bytes of slack for delimiter searching to work properly.
     // Make sure the buffer is zeroed out, for extra safety
@@ -36,15 +164,30 @@ RouteStream rsOpen(const char* path)
     {
         // Disable buffering, it's useless since we use fread with our own buffer.
         setvbuf(file, NULL, _IONBF, 0);
+
+        // Compressed files need the prefetch thread, we can only parse plain text here.
+        unsigned char magic[COMPRESSION_MAGIC_SIZE];
+        size_t magicLen;
+        bool lineEnded;
+        s.compression = peekCompression(file, magic, &magicLen, &lineEnded);
+        if (s.compression != COMPRESSION_NONE)
+        {
+            s.sysError = ENOTSUP;
+            fclose(file);
+            free(s.readBuf);
+            s.file = NULL;
+            s.readBuf = NULL;
+            s.readBufEnd = NULL;
+            s.readBufCursor = NULL;
+            return s;
+        }
+
         // Skip the first line (header with column names)
-        while (true)
+        while (!lineEnded)
         {
             // continue until we get to a new line :D
             int ch = fgetc(file);
-            if (ch == EOF || ch == '\n')
-            {
-                break;
-            }
+            lineEnded = ch == EOF || ch == '\n';
         }
     }
 
@@ -53,234 +196,1963 @@ RouteStream rsOpen(const char* path)
     return s;
 }
 
-bool rsCheck(const RouteStream* stream, char errMsg[ERR_MAX])
+RouteStream rsOpenMapped(const char* path)
 {
-    assert(stream && !stream->closed);
+    RouteStream s = emptyStream(RS_MAPPED);
 
-    if (!stream->file || ferror(stream->file))
+#if RS_MMAP_SUPPORTED
+    if (isStdinPath(path))
     {
-        char* fileError = strerror(errno);
-        snprintf(errMsg,ERR_MAX, "%s", fileError);
-        errMsg[ERR_MAX - 1] = '\0';
-        return false;
+        // The standard input is most likely a pipe, which can't be mapped.
+        s.sysError = EINVAL;
+        return s;
     }
-    else if (!stream->readBuf)
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
     {
-        snprintf(errMsg, ERR_MAX, "Pas assez de mémoire pour allouer le buffer de lecture");
-        return false;
+        s.sysError = errno;
+        return s;
     }
-    else
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
     {
-        return true;
+        s.sysError = errno;
+        close(fd);
+        return s;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        // Pipes, empty files and other weird stuff can't be mapped.
+        s.sysError = EINVAL;
+        close(fd);
+        return s;
     }
-}
 
-// Fill the buffer with the next chunk of data.
-//
-// If the buffer doesn't have enough room to fit the last line entirely,
-// the buffer will be truncated to the line preceding it,
-// and the file cursor will be rolled back to the beginning of the line.
-static bool continueBufferRead(RouteStream* stream)
-{
-    assert(stream);
+    size_t fileSize = (size_t) st.st_size;
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
 
-    // Reset the position cursor and end.
-    stream->readBufCursor = stream->readBuf;
+    // Reserve enough room for the entire file, rounded up to the page size, plus one extra zeroed page.
+    // That guard page (and the zeroed end of the last file page) gives us:
+    //  - the room to add a newline character when the file doesn't end with one
+    //  - the 64 bytes of zeroed slack needed for delimiter searching
+    // The reservation can't be accessed (PROT_NONE), and the file is mapped read-only: neither of them counts
+    // as committed memory, so files bigger than the RAM and the swap can still be mapped.
+    size_t fileSpan = (fileSize + pageSize - 1) / pageSize * pageSize;
+    size_t mapSize = fileSpan + pageSize;
+    char* base = mmap(NULL, mapSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        s.sysError = errno;
+        close(fd);
+        return s;
+    }
 
-    uint32_t bytesRead = (uint32_t) fread(stream->readBuf, 1, READ_BUFFER_SIZE, stream->file);
-    if (bytesRead == READ_BUFFER_SIZE)
+    // Map the file on top of the reserved region, and a zeroed page after it: the only writable page,
+    // along with the last page of the file when the newline has to go there (see below).
+    if (mmap(base, fileSize, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED
+        || mmap(base + fileSpan, pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0)
+           == MAP_FAILED)
     {
-        // Check if the last line has been truncated, unless we're at the very end.
-        // If it is the case, roll back the file cursor until the last newline character.
-        //
-        // NOTE: There's a very special case where we've reached the end of the file, and the last character
-        // is not a newline character (because we're at the end). It shouldn't be much of a problem though,
-        // we're just going to rollback the cursor and the next call will have only one line.
-        if (stream->readBuf[READ_BUFFER_SIZE - 1] != '\n')
-        {
-            int offset = 0;
-            while (stream->readBuf[READ_BUFFER_SIZE - 1 - offset] != '\n')
-            {
-                offset++;
-
-                // Make sure we don't go out of bounds if we ever have a buffer that
-                // doesn't have the '\n' character AT ALL.
-                // RBS - 1 - offset >= 0
-                // <==> -offset >= 1 - RBS
-                // <==> offset <= RBS - 1
-                assert(offset <= READ_BUFFER_SIZE-1);
-            }
+        s.sysError = errno;
+        munmap(base, mapSize);
+        close(fd);
+        return s;
+    }
+    // The mapping stays alive even when the file is closed.
+    close(fd);
+
+    // We're going to read the file once, from start to end.
+    madvise(base, fileSize, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    // Less TLB misses when the file system supports huge pages in the page cache.
+    madvise(base, mapSize, MADV_HUGEPAGE);
+#endif
+
+    s.mapBase = base;
+    s.mapSize = mapSize;
+    s.readBuf = base;
+    s.readBufChars = fileSize;
+
+    // We can't parse compressed files directly, they need to be decompressed by the prefetch thread.
+    s.compression = compressionDetect((const unsigned char*) base, fileSize);
+    if (s.compression != COMPRESSION_NONE)
+    {
+        munmap(base, mapSize);
+        s.mapBase = NULL;
+        s.readBuf = NULL;
+        s.sysError = ENOTSUP;
+        return s;
+    }
 
-            fseek(stream->file, -offset, SEEK_CUR);
-            stream->readBufChars = READ_BUFFER_SIZE - offset;
+    // Make sure the last line ends with a newline, just like in buffered mode.
+    if (base[fileSize - 1] != '\n')
+    {
+        // It's a private mapping, so only that page gets copied, and the file stays intact.
+        if (fileSize < fileSpan
+            && mprotect(base + fileSpan - pageSize, pageSize, PROT_READ | PROT_WRITE) != 0)
+        {
+            s.sysError = errno;
+            munmap(base, mapSize);
+            s.mapBase = NULL;
+            s.readBuf = NULL;
+            return s;
         }
-        else
+        base[fileSize] = '\n';
+        s.readBufChars++;
+        s.newlineAdded = true;
+    }
+    s.readBufEnd = base + s.readBufChars;
+
+    // Skip the first line (header with column names)
+    char* headerEnd = memchr(base, '\n', s.readBufChars);
+    s.readBufCursor = headerEnd + 1;
+
+    s.valid = true;
+#else
+    s.sysError = ENOSYS;
+#endif
+
+    return s;
+}
+
+// Checks that a section of a .pcb file is within the file.
+static bool pcbSectionValid(uint64_t offset, uint64_t size, uint64_t fileSize)
+{
+    return offset % sizeof(uint32_t) == 0 && offset <= fileSize && size <= fileSize - offset;
+}
+
+// Gives the biggest value of the column, 0 when it's empty. Simple enough for the compiler to vectorize it.
+static uint32_t pcbColumnMax(const uint32_t* column, uint64_t numRows)
+{
+    uint32_t max = 0;
+    for (uint64_t i = 0; i < numRows; ++i)
+    {
+        max = column[i] > max ? column[i] : max;
+    }
+    return max;
+}
+
+// Checks that all strings are inside the string table, and that all the ids of the columns are strings.
+// The rows use them as they are, so a corrupt file would make us read anywhere in memory.
+static bool pcbStringsValid(const char* base, const PcbHeader* header)
+{
+    const uint32_t* offsets = (const uint32_t*) (base + header->stringOffsetsOffset);
+    if (offsets[0] != 0 || offsets[header->numStrings] > header->stringsSize)
+    {
+        return false;
+    }
+    for (uint32_t i = 0; i < header->numStrings; ++i)
+    {
+        if (offsets[i] > offsets[i + 1])
         {
-            stream->readBufChars = READ_BUFFER_SIZE;
+            return false;
         }
-        stream->readBufEnd = stream->readBuf + stream->readBufChars;
+    }
 
+    if (header->numRows == 0)
+    {
         return true;
     }
-    else if (bytesRead == 0)
+    uint32_t maxId = pcbColumnMax((const uint32_t*) (base + header->townsAOffset), header->numRows);
+    uint32_t maxIdB = pcbColumnMax((const uint32_t*) (base + header->townsBOffset), header->numRows);
+    uint32_t maxIdDriver = pcbColumnMax((const uint32_t*) (base + header->driverNamesOffset), header->numRows);
+    maxId = maxIdB > maxId ? maxIdB : maxId;
+    maxId = maxIdDriver > maxId ? maxIdDriver : maxId;
+    return maxId < header->numStrings;
+}
+
+RouteStream rsOpenColumnar(const char* path)
+{
+    RouteStream s = emptyStream(RS_COLUMNAR);
+
+#if RS_MMAP_SUPPORTED
+    if (isStdinPath(path))
     {
-        // No more characters, EOF! (Or error)
-        stream->readBufChars = 0;
-        stream->readBufEnd = stream->readBuf;
+        // The standard input is most likely a pipe, which can't be mapped.
+        s.sysError = EINVAL;
+        return s;
+    }
 
-        return false;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        s.sysError = errno;
+        return s;
     }
-    else // if (bytesRead < READ_BUFFER_SIZE)
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
     {
-        // The buffer is not full, so we reached the end of the file.
+        s.sysError = errno;
+        close(fd);
+        return s;
+    }
 
-        // Zero out the rest of the buffer to avoid overflow.
-        memset(stream->readBuf + bytesRead, 0, READ_BUFFER_SIZE - bytesRead);
+    // Check the header first, without mapping anything: most of the time, it's just a CSV file.
+    PcbHeader header;
+    if (!S_ISREG(st.st_mode) || st.st_size < (off_t) sizeof(PcbHeader)
+        || read(fd, &header, sizeof(header)) != sizeof(header)
+        || memcmp(header.magic, PCB_MAGIC, 4) != 0)
+    {
+        s.sysError = EINVAL;
+        close(fd);
+        return s;
+    }
+    // From now on, it's a .pcb file for sure: don't let it be read as a CSV file, give an error (see rsCheck).
+    if (header.version != PCB_VERSION)
+    {
+        s.sysError = EBADMSG;
+        close(fd);
+        return s;
+    }
 
-        if (stream->readBuf[bytesRead - 1] == '\n')
-        {
-            // There's already a newline character at the end, so we're good.
-            stream->readBufChars = bytesRead;
-            stream->readBufEnd = stream->readBuf + stream->readBufChars;
-        }
-        else
-        {
-            // There's no newline character before EOF, so we need to add one.
-            // We have the room to add a newline character at the end, so let's do it.
-            stream->readBuf[bytesRead] = '\n';
+    uint64_t fileSize = (uint64_t) st.st_size;
+    uint64_t columnSize = header.numRows * sizeof(uint32_t);
+    bool valid = header.numRows <= UINT64_MAX / sizeof(uint32_t)
+                 && pcbSectionValid(header.routeIdsOffset, columnSize, fileSize)
+                 && pcbSectionValid(header.stepIdsOffset, columnSize, fileSize)
+                 && pcbSectionValid(header.distancesOffset, columnSize, fileSize)
+                 && pcbSectionValid(header.townsAOffset, columnSize, fileSize)
+                 && pcbSectionValid(header.townsBOffset, columnSize, fileSize)
+                 && pcbSectionValid(header.driverNamesOffset, columnSize, fileSize)
+                 && pcbSectionValid(header.stringOffsetsOffset,
+                                    ((uint64_t) header.numStrings + 1) * sizeof(uint32_t), fileSize)
+                 && header.stringsOffset <= fileSize && header.stringsSize <= fileSize - header.stringsOffset;
+    if (!valid)
+    {
+        s.sysError = EBADMSG;
+        close(fd);
+        return s;
+    }
 
-            stream->readBufChars = bytesRead + 1;
-            stream->readBufEnd = stream->readBuf + stream->readBufChars;
-        }
+    char* base = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        s.sysError = errno;
+        return s;
+    }
+    madvise(base, fileSize, MADV_SEQUENTIAL);
 
-        return true;
+    if (!pcbStringsValid(base, &header))
+    {
+        s.sysError = EBADMSG;
+        munmap(base, fileSize);
+        return s;
     }
-}
 
-/*
- * READ FUNCTIONS: readUInt, readStr, readFloat
- * --------------------------------------------
- * These functions exist to parse the three different types of data in the file.
- * Unsigned integers, strings and unsigned floats.
- *
- * The reasoning behind making those functions by hand instead of using stuff
- * like atoi, atof, etc. is simple: they are slow and annoying to use in sequential read.
- * atoi and atof require a null-terminated string, and that would induce really wack stuff involving
- * either copying strings or temporary null terminations...
- *
- * Since we know the exact format of integers and floats, writing them is really easy.
- */
+    s.mapBase = base;
+    s.mapSize = fileSize;
+    // Not really used, but rsCheck wants a buffer.
+    s.readBuf = base;
+    s.readBufCursor = base;
+    s.readBufEnd = base;
+
+    s.columns.routeIds = (const uint32_t*) (base + header.routeIdsOffset);
+    s.columns.stepIds = (const uint32_t*) (base + header.stepIdsOffset);
+    s.columns.distances = (const uint32_t*) (base + header.distancesOffset);
+    s.columns.townsA = (const uint32_t*) (base + header.townsAOffset);
+    s.columns.townsB = (const uint32_t*) (base + header.townsBOffset);
+    s.columns.driverNames = (const uint32_t*) (base + header.driverNamesOffset);
+    s.columns.stringOffsets = (const uint32_t*) (base + header.stringOffsetsOffset);
+    s.columns.strings = base + header.stringsOffset;
+    s.columns.numStrings = header.numStrings;
+    s.columns.rowCursor = 0;
+    s.columns.rowEnd = header.numRows;
+
+    s.valid = true;
+#else
+    s.sysError = ENOSYS;
+#endif
+
+    return s;
+}
 
-static float readUnsignedFloat(char* const start, char* const end)
+#if RS_PREFETCH_SUPPORTED
+// Reads up to size characters of the file, decompressing them if needed.
+// Returns less than size only at the end of the file, or when something went wrong (then outError is set).
+static size_t prefetchRead(RsPrefetcher* p, char* buf, size_t size, int* outError)
 {
-    uint32_t intPart = 0, decPart = 0;
-    uint32_t decSize = 1;
+    if (p->decompressor)
+    {
+        return decompRead(p->decompressor, buf, size, outError);
+    }
 
-    bool dec = false;
+    size_t bytesRead = fread(buf, 1, size, p->file);
+    if (bytesRead < size && ferror(p->file))
+    {
+        *outError = errno != 0 ? errno : EIO;
+    }
+    return bytesRead;
+}
 
-    char* cursor = start;
-    while (cursor != end)
+// The prefetch thread: fills the chunks one after the other, as soon as the stream is done parsing them.
+//
+// Each chunk is cut after its last newline character, and the partial line left
+// is carried over to the start of the next chunk. This way, the stream only ever sees complete lines,
+// and we never have to go back in the file (which pipes don't like at all).
+static void* prefetchMain(void* arg)
+{
+    RsPrefetcher* p = arg;
+    uint32_t writeIndex = 0;
+    bool eof = false;
+
+    while (!eof)
     {
-        if (*cursor != '.')
+        PrefetchChunk* chunk = &p->chunks[writeIndex];
+
+        // Wait until the stream is done with this chunk.
+        pthread_mutex_lock(&p->lock);
+        while (chunk->full && !p->stop)
+        {
+            pthread_cond_wait(&p->chunkEmptied, &p->lock);
+        }
+        bool stop = p->stop;
+        pthread_mutex_unlock(&p->lock);
+
+        if (stop)
+        {
+            break;
+        }
+
+        // Begin with the end of the line we've cut in the previous chunk, then fill the rest.
+        memcpy(chunk->data, p->carry, p->carryChars);
+        // With a compressed file, that's where the decompression happens, in parallel with the parsing.
+        int error = 0;
+        size_t toRead = READ_BUFFER_SIZE - p->carryChars;
+        size_t bytesRead = prefetchRead(p, chunk->data + p->carryChars, toRead, &error);
+        size_t chars = p->carryChars + bytesRead;
+        p->carryChars = 0;
+
+        if (bytesRead < toRead)
         {
-            // Make sure it is a digit
-            assert(*cursor >= '0' && *cursor <= '9');
+            // Either we reached the end of the file, or something went wrong.
+            eof = true;
 
-            uint32_t digit = *cursor - '0';
-            if (!dec)
+            if (error != 0)
             {
-                intPart *= 10;
-                intPart += digit;
+                // The last line has been cut by the error (like a truncated .gz file), it's most likely garbage.
+                while (chars > 0 && chunk->data[chars - 1] != '\n')
+                {
+                    chars--;
+                }
             }
-            else
+            // Make sure the last line ends with a newline. There's always room for it thanks to the slack.
+            else if (chars > 0 && chunk->data[chars - 1] != '\n')
             {
-                decPart *= 10;
-                decPart += digit;
-                decSize *= 10;
+                chunk->data[chars++] = '\n';
             }
         }
         else
         {
-            assert(!dec);
-            dec = true;
+            // Cut the chunk after the last complete line.
+            size_t lineEnd = chars;
+            while (lineEnd > 0 && chunk->data[lineEnd - 1] != '\n')
+            {
+                lineEnd--;
+            }
+            // A line can't be longer than the buffer.
+            assert(lineEnd > 0);
+
+            p->carryChars = chars - lineEnd;
+            memcpy(p->carry, chunk->data + lineEnd, p->carryChars);
+            chars = lineEnd;
         }
 
-        cursor++;
+        // The slack NEEDS to be zeroed for the delimiter search.
+        memset(chunk->data + chars, 0, READ_BUFFER_SLACK);
+
+        pthread_mutex_lock(&p->lock);
+        if (chars > 0)
+        {
+            chunk->chars = chars;
+            chunk->full = true;
+            writeIndex = (writeIndex + 1) % PREFETCH_CHUNKS;
+        }
+        p->error = error;
+        p->done = eof;
+        pthread_cond_signal(&p->chunkFilled);
+        pthread_mutex_unlock(&p->lock);
     }
 
-    return (float) intPart + (float) decPart / decSize;
+    return NULL;
 }
 
-static char* readStr(char* start, char* end, uint32_t* outLen)
+static void freePrefetcher(RsPrefetcher* p)
 {
-    *end = '\0';
-    *outLen = (uint32_t)(end - start);
-
-    return start;
+    decompFree(p->decompressor);
+    for (int i = 0; i < PREFETCH_CHUNKS; ++i)
+    {
+        free(p->chunks[i].data);
+    }
+    free(p->carry);
+    free(p);
 }
+#endif
 
-static uint32_t readUnsignedInt(char* const start, char* const end)
+#if RS_URING_SUPPORTED
+// A chunk of the file read using io_uring.
+typedef struct
 {
-    uint32_t number = 0;
+    // The allocation, with room for the carried line before the data.
+    char* alloc;
+    // The aligned area where the file is read, chunkSize bytes long (plus some slack).
+    // The partial line carried from the previous chunk is written just before it.
+    char* data;
+    // The offset of data in the file.
+    uint64_t offset;
+    // The number of bytes we should get, and the number of bytes read so far.
+    uint32_t expected;
+    uint32_t got;
+    // The length of the line carried from the previous chunk.
+    uint32_t carryChars;
+    // The errno of a failed read, 0 if everything's fine.
+    int error;
+    // True when a read is in flight for this chunk.
+    bool inFlight;
+    // True when the chunk has been assigned a part of the file (false once we're past the end of the file).
+    bool used;
+} UringChunk;
 
-    char* cursor = start;
+typedef struct RsUringReader
+{
+    Uring* ring;
+    int fd;
+    uint64_t fileSize;
+    // The file offset of the next chunk to read.
+    uint64_t nextOffset;
+    uint32_t chunkSize;
 
-    while (cursor != end)
-    {
-        // Make sure it is a digit
-        assert(*cursor >= '0' && *cursor <= '9');
+    // The chunks are read in a round-robin fashion, so chunk i+1 always comes right after chunk i in the file.
+    UringChunk chunks[URING_MAX_DEPTH];
+    uint32_t numChunks;
+    // The index of the chunk being parsed by the stream.
+    uint32_t current;
+    // True when the stream currently holds chunks[current], and has to reuse it.
+    bool holdingChunk;
+} RsUringReader;
 
-        uint32_t digit = *cursor - '0';
-        number *= 10;
-        number += digit;
-        cursor++;
+// Assigns the next part of the file to the chunk, and queues its read.
+static void queueUringChunk(RsUringReader* r, uint32_t index)
+{
+    UringChunk* chunk = &r->chunks[index];
+    chunk->carryChars = 0;
+    chunk->got = 0;
+    chunk->error = 0;
+
+    if (r->nextOffset >= r->fileSize)
+    {
+        chunk->used = false;
+        return;
     }
 
-    return number;
+    chunk->used = true;
+    chunk->inFlight = true;
+    chunk->offset = r->nextOffset;
+    uint64_t remaining = r->fileSize - r->nextOffset;
+    chunk->expected = remaining < r->chunkSize ? (uint32_t) remaining : r->chunkSize;
+    r->nextOffset += r->chunkSize;
+
+    // Always read an entire chunk, O_DIRECT reads must have an aligned size. We'll just get less bytes at the end.
+    // We never have more reads in flight than chunks, so it should always fit.
+    bool queued = uringQueueRead(r->ring, r->fd, chunk->data, r->chunkSize, chunk->offset, index);
+    assert(queued);
+    (void) queued;
 }
 
-bool rsRead(RouteStream* stream, RouteStep* outRouteStep, RouteFields fieldsToRead)
+// Sends the queued reads, waits for at least one of them to complete, and handles all completions.
+static int reapUringCompletions(RsUringReader* r)
 {
-    assert(outRouteStep);
-    assert(stream && stream->valid);
+    int err = uringSubmit(r->ring, true);
+    if (err != 0)
+    {
+        return err;
+    }
 
-    if (stream->readBufCursor >= stream->readBufEnd)
+    uint64_t index;
+    int32_t result;
+    while (uringPopCompletion(r->ring, &index, &result))
     {
-        bool bufferSuccess = continueBufferRead(stream);
-        if (!bufferSuccess)
+        UringChunk* chunk = &r->chunks[index];
+        chunk->inFlight = false;
+
+        if (result < 0)
         {
-            return false;
+            chunk->error = -result;
+        }
+        else if (result == 0)
+        {
+            // The file got shorter while we were reading it!
+            if (chunk->got < chunk->expected)
+            {
+                chunk->error = EIO;
+            }
+        }
+        else
+        {
+            chunk->got += (uint32_t) result;
+            if (chunk->got < chunk->expected)
+            {
+                // Short read, ask for the rest.
+                chunk->inFlight = uringQueueRead(r->ring, r->fd, chunk->data + chunk->got,
+                                                 r->chunkSize - chunk->got, chunk->offset + chunk->got, index);
+                assert(chunk->inFlight);
+            }
         }
     }
 
-    char* lineBegin = stream->readBufCursor;
+    return 0;
+}
 
-    // Find all the delimiters (the 5 semicolons and the new line character)
-    // searchDelimiters makes sure that the delimiters are in the right place
-    // (e.g. no newline as second delimiter), and that we aren't overflowing the buffer (zero/newline checks).
-    char* delimiters[6];
-    searchDelimiters(lineBegin, delimiters);
+// Gives back the chunk we've just parsed (by reading the next part of the file in it),
+// and waits for the next chunk. Returns false when there are no more chunks, or when something went wrong.
+static bool nextUringChunk(RouteStream* stream)
+{
+    RsUringReader* r = stream->uring;
+    assert(r);
 
-    if (fieldsToRead & ROUTE_ID)
-        outRouteStep->routeId = readUnsignedInt(lineBegin, delimiters[0]);
+    while (true)
+    {
+        if (r->holdingChunk)
+        {
+            queueUringChunk(r, r->current);
+            r->current = (r->current + 1) % r->numChunks;
+            r->holdingChunk = false;
+        }
 
-    if (fieldsToRead & STEP_ID)
-        outRouteStep->stepId = readUnsignedInt(delimiters[0] + 1, delimiters[1]);
+        UringChunk* chunk = &r->chunks[r->current];
+        if (!chunk->used)
+        {
+            // We're done reading the file.
+            stream->readBufChars = 0;
+            stream->readBufCursor = stream->readBufEnd;
+            return false;
+        }
 
-    if (fieldsToRead & TOWN_A)
-        outRouteStep->townA = readStr(delimiters[1] + 1, delimiters[2], &outRouteStep->townALen);
+        while (chunk->inFlight && chunk->error == 0)
+        {
+            int err = reapUringCompletions(r);
+            if (err != 0)
+            {
+                chunk->error = err;
+            }
+        }
+        if (chunk->error != 0)
+        {
+            stream->sysError = chunk->error;
+            stream->readBufChars = 0;
+            stream->readBufCursor = stream->readBufEnd;
+            return false;
+        }
+        r->holdingChunk = true;
 
-    if (fieldsToRead & TOWN_B)
-        outRouteStep->townB = readStr(delimiters[2] + 1, delimiters[3], &outRouteStep->townBLen);
+        char* start = chunk->data - chunk->carryChars;
+        char* end = chunk->data + chunk->expected;
 
-    if (fieldsToRead & DISTANCE)
-        outRouteStep->distance = readUnsignedFloat(delimiters[3] + 1, delimiters[4]);
+        // Skip the first line (header with column names)
+        if (chunk->offset == 0)
+        {
+            char* headerEnd = memchr(start, '\n', end - start);
+            start = headerEnd ? headerEnd + 1 : end;
+        }
 
-    if (fieldsToRead & DRIVER_NAME)
-        outRouteStep->driverName = readStr(delimiters[4] + 1, delimiters[5], &outRouteStep->driverNameLen);
+        if (chunk->offset + chunk->expected >= r->fileSize)
+        {
+            // Last chunk: make sure the last line ends with a newline. There's room for it thanks to the slack.
+            if (end > start && end[-1] != '\n')
+            {
+                *end++ = '\n';
+            }
+        }
+        else
+        {
+            // Cut the chunk after the last complete line, and carry the rest to the next chunk,
+            // which comes right after this one in the file.
+            char* lineEnd = end;
+            while (lineEnd > start && lineEnd[-1] != '\n')
+            {
+                lineEnd--;
+            }
+
+            // There's only room for one chunk before the next one: a longer line can't be read.
+            if (end - lineEnd > r->chunkSize)
+            {
+                stream->sysError = EMSGSIZE;
+                stream->readBufChars = 0;
+                stream->readBufCursor = stream->readBufEnd;
+                return false;
+            }
+
+            UringChunk* next = &r->chunks[(r->current + 1) % r->numChunks];
+            next->carryChars = (uint32_t) (end - lineEnd);
+            memcpy(next->data - next->carryChars, lineEnd, next->carryChars);
+            end = lineEnd;
+        }
+
+        // The slack NEEDS to be zeroed for the delimiter search.
+        memset(end, 0, READ_BUFFER_SLACK);
+
+        // Chunks with no complete lines (or only the header) are just skipped.
+        if (start != end)
+        {
+            stream->readBuf = start;
+            stream->readBufChars = end - start;
+            stream->readBufCursor = start;
+            stream->readBufEnd = end;
+            return true;
+        }
+    }
+}
+
+static void freeUringReader(RsUringReader* r)
+{
+    if (r->ring)
+    {
+        // The kernel might still be writing to our chunks, wait for all reads to finish.
+        for (uint32_t i = 0; i < r->numChunks; ++i)
+        {
+            while (r->chunks[i].inFlight && reapUringCompletions(r) == 0);
+        }
+        uringFree(r->ring);
+    }
+    for (uint32_t i = 0; i < r->numChunks; ++i)
+    {
+        free(r->chunks[i].alloc);
+    }
+    if (r->fd != -1)
+    {
+        close(r->fd);
+    }
+    free(r);
+}
+#endif
+
+RouteStream rsOpenUring(const char* path, uint32_t queueDepth, uint32_t chunkSize)
+{
+    RouteStream s = emptyStream(RS_URING);
+
+#if RS_URING_SUPPORTED
+    assert(chunkSize > 0);
+    chunkSize = (chunkSize + URING_ALIGNMENT - 1) / URING_ALIGNMENT * URING_ALIGNMENT;
+    if (queueDepth < 2)
+    {
+        // We need at least two chunks to carry lines from one chunk to the next.
+        queueDepth = 2;
+    }
+    else if (queueDepth > URING_MAX_DEPTH)
+    {
+        queueDepth = URING_MAX_DEPTH;
+    }
+
+    if (isStdinPath(path))
+    {
+        // We read at given offsets, pipes can't do that.
+        s.sysError = EINVAL;
+        return s;
+    }
+
+    // Skip the page cache when possible. Some file systems (like tmpfs) don't support it.
+    int fd = open(path, O_RDONLY | O_DIRECT);
+    if (fd == -1 && errno == EINVAL)
+    {
+        fd = open(path, O_RDONLY);
+    }
+    if (fd == -1)
+    {
+        s.sysError = errno;
+        return s;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        s.sysError = errno;
+        close(fd);
+        return s;
+    }
+    if (!S_ISREG(st.st_mode))
+    {
+        // We read at given offsets, so only regular files work.
+        s.sysError = EINVAL;
+        close(fd);
+        return s;
+    }
+
+    // Compressed files can't be read at given offsets either. Check the first bytes without O_DIRECT,
+    // since it only likes aligned reads.
+    FILE* peekFile = fopen(path, "rb");
+    if (peekFile)
+    {
+        unsigned char magic[COMPRESSION_MAGIC_SIZE];
+        size_t magicLen;
+        bool lineEnded;
+        s.compression = peekCompression(peekFile, magic, &magicLen, &lineEnded);
+        fclose(peekFile);
+    }
+    if (s.compression != COMPRESSION_NONE)
+    {
+        s.sysError = ENOTSUP;
+        close(fd);
+        return s;
+    }
+
+    RsUringReader* r = calloc(1, sizeof(RsUringReader));
+    if (!r)
+    {
+        s.sysError = ENOMEM;
+        close(fd);
+        return s;
+    }
+    r->fd = fd;
+    r->fileSize = (uint64_t) st.st_size;
+    r->chunkSize = chunkSize;
+    r->numChunks = queueDepth;
+
+    int err = 0;
+    r->ring = uringCreate(queueDepth, &err);
+    if (!r->ring)
+    {
+        s.sysError = err;
+        freeUringReader(r);
+        return s;
+    }
+
+    for (uint32_t i = 0; i < queueDepth; ++i)
+    {
+        // Room for the carried line (at most one chunk), the chunk itself, the final newline and the slack.
+        r->chunks[i].alloc = aligned_alloc(URING_ALIGNMENT, 2 * (size_t) chunkSize + URING_ALIGNMENT);
+        if (!r->chunks[i].alloc)
+        {
+            s.sysError = ENOMEM;
+            freeUringReader(r);
+            return s;
+        }
+        r->chunks[i].data = r->chunks[i].alloc + chunkSize;
+    }
+
+    // Start reading the first chunks right away.
+    for (uint32_t i = 0; i < queueDepth; ++i)
+    {
+        queueUringChunk(r, i);
+    }
+    err = uringSubmit(r->ring, false);
+    if (err != 0)
+    {
+        s.sysError = err;
+        freeUringReader(r);
+        return s;
+    }
+
+    s.uring = r;
+    // No chunk yet, the first call to rsRead is going to wait for the first one.
+    s.readBuf = r->chunks[0].data;
+    s.readBufCursor = s.readBuf;
+    s.readBufEnd = s.readBuf;
+    s.valid = true;
+#else
+    s.sysError = ENOSYS;
+#endif
+
+    return s;
+}
+
+RouteStream rsOpenPrefetched(const char* path)
+{
+    RouteStream s = emptyStream(RS_PREFETCHED);
+
+#if RS_PREFETCH_SUPPORTED
+    FILE* file = openFile(path);
+    if (!file)
+    {
+        s.sysError = errno;
+        return s;
+    }
+
+    // We're keeping the stdio buffer here, so reading the first line doesn't do a read call for each character.
+    // Big freads skip that buffer anyway.
+    unsigned char magic[COMPRESSION_MAGIC_SIZE];
+    size_t magicLen;
+    bool lineEnded;
+    s.compression = peekCompression(file, magic, &magicLen, &lineEnded);
+
+    Decompressor* decompressor = NULL;
+    if (s.compression != COMPRESSION_NONE)
+    {
+        // The bytes we've just read are the start of the compressed data, give them to the decompressor.
+        int err = 0;
+        decompressor = decompOpen(s.compression, file, magic, magicLen, &err);
+        if (!decompressor)
+        {
+            s.sysError = err;
+            fclose(file);
+            return s;
+        }
+
+        // Skip the first line (header with column names), once decompressed.
+        // It's only done once, so decompressing one character at a time is fine.
+        char ch;
+        do
+        {
+            if (decompRead(decompressor, &ch, 1, &err) != 1)
+            {
+                break;
+            }
+        } while (ch != '\n');
+
+        if (err != 0)
+        {
+            s.sysError = err;
+            decompFree(decompressor);
+            fclose(file);
+            return s;
+        }
+    }
+    else
+    {
+        // Skip the first line (header with column names)
+        while (!lineEnded)
+        {
+            int ch = fgetc(file);
+            lineEnded = ch == EOF || ch == '\n';
+        }
+    }
+
+    RsPrefetcher* p = calloc(1, sizeof(RsPrefetcher));
+    bool allocated = p != NULL;
+    for (int i = 0; allocated && i < PREFETCH_CHUNKS; ++i)
+    {
+        p->chunks[i].data = malloc(READ_BUFFER_SIZE + READ_BUFFER_SLACK);
+        allocated = p->chunks[i].data != NULL;
+    }
+    if (allocated)
+    {
+        p->carry = malloc(READ_BUFFER_SIZE);
+        allocated = p->carry != NULL;
+    }
+    if (!allocated)
+    {
+        if (p)
+        {
+            freePrefetcher(p);
+        }
+        decompFree(decompressor);
+        s.sysError = ENOMEM;
+        fclose(file);
+        return s;
+    }
+
+    p->file = file;
+    p->decompressor = decompressor;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->chunkFilled, NULL);
+    pthread_cond_init(&p->chunkEmptied, NULL);
+
+    int err = pthread_create(&p->thread, NULL, prefetchMain, p);
+    if (err != 0)
+    {
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->chunkFilled);
+        pthread_cond_destroy(&p->chunkEmptied);
+        freePrefetcher(p);
+        fclose(file);
+        s.sysError = err;
+        return s;
+    }
+
+    s.file = file;
+    s.prefetcher = p;
+    // No chunk yet, the first call to rsRead is going to wait for the first one.
+    s.readBuf = p->chunks[0].data;
+    s.readBufCursor = s.readBuf;
+    s.readBufEnd = s.readBuf;
+    s.valid = true;
+#else
+    s.sysError = ENOSYS;
+#endif
+
+    return s;
+}
+
+bool rsCheck(const RouteStream* stream, char errMsg[ERR_MAX])
+{
+    assert(stream && !stream->closed);
+
+    if (stream->compression != COMPRESSION_NONE && stream->sysError == ENOTSUP)
+    {
+        if (!compressionSupported(stream->compression))
+        {
+            snprintf(errMsg, ERR_MAX, "Fichier compressé en %s, mais PermisC a été compilé sans %s",
+                     compressionName(stream->compression), compressionLibrary(stream->compression));
+        }
+        else
+        {
+            snprintf(errMsg, ERR_MAX, "Fichier compressé en %s, impossible à lire dans ce mode",
+                     compressionName(stream->compression));
+        }
+        return false;
+    }
+    else if (stream->compression != COMPRESSION_NONE && stream->sysError == EILSEQ)
+    {
+        snprintf(errMsg, ERR_MAX, "Fichier compressé en %s corrompu ou incomplet", compressionName(stream->compression));
+        return false;
+    }
+    else if (stream->mode == RS_COLUMNAR && stream->sysError == EBADMSG)
+    {
+        snprintf(errMsg, ERR_MAX, "Fichier .pcb corrompu, incomplet ou d'une autre version");
+        return false;
+    }
+    else if (stream->mode == RS_URING && stream->sysError == EMSGSIZE)
+    {
+        snprintf(errMsg, ERR_MAX, "Une ligne est plus longue que les lectures io_uring, augmentez « --io-chunk »");
+        return false;
+    }
+    else if (stream->sysError != 0 || (stream->mode == RS_BUFFERED && (!stream->file || ferror(stream->file))))
+    {
+        char* fileError = strerror(stream->sysError != 0 ? stream->sysError : errno);
+        snprintf(errMsg,ERR_MAX, "%s", fileError);
+        errMsg[ERR_MAX - 1] = '\0';
+        return false;
+    }
+    else if (!stream->readBuf)
+    {
+        snprintf(errMsg, ERR_MAX, "Pas assez de mémoire pour allouer le buffer de lecture");
+        return false;
+    }
+    else
+    {
+        return true;
+    }
+}
+
+// Fill the buffer with the next chunk of data.
+//
+// If the buffer doesn't have enough room to fit the last line entirely,
+// the buffer will be truncated to the line preceding it,
+// and the rest of the line is moved to the start of the buffer on the next call.
+// We never go back in the file, so it works with pipes too.
+static bool continueBufferRead(RouteStream* stream)
+{
+    assert(stream);
+
+    // Put the partial line we've cut last time at the start of the buffer, then fill the rest.
+    size_t carryChars = stream->carryChars;
+    memmove(stream->readBuf, stream->readBufEnd, carryChars);
+    stream->carryChars = 0;
+
+    // Reset the position cursor and end.
+    stream->readBufCursor = stream->readBuf;
+
+    size_t toRead = READ_BUFFER_SIZE - carryChars;
+    size_t bytesRead = fread(stream->readBuf + carryChars, 1, toRead, stream->file);
+    size_t chars = carryChars + bytesRead;
+    if (bytesRead == toRead)
+    {
+        // Check if the last line has been truncated, unless we're at the very end.
+        // If it is the case, cut the buffer after the last newline character, and keep the rest for later.
+        //
+        // NOTE: There's a very special case where we've reached the end of the file, and the last character
+        // is not a newline character (because we're at the end). It shouldn't be much of a problem though,
+        // the next call will just have only one line.
+        size_t lineEnd = chars;
+        while (stream->readBuf[lineEnd - 1] != '\n')
+        {
+            lineEnd--;
+
+            // Make sure we don't go out of bounds if we ever have a buffer that
+            // doesn't have the '\n' character AT ALL.
+            assert(lineEnd > 0);
+        }
+
+        stream->carryChars = chars - lineEnd;
+        stream->readBufChars = lineEnd;
+        stream->readBufEnd = stream->readBuf + stream->readBufChars;
+
+        return true;
+    }
+    else if (chars == 0)
+    {
+        // No more characters, EOF! (Or error)
+        stream->readBufChars = 0;
+        stream->readBufEnd = stream->readBuf;
+
+        return false;
+    }
+    else // if (bytesRead < toRead)
+    {
+        // The buffer is not full, so we reached the end of the file.
+
+        // Zero out the rest of the buffer to avoid overflow.
+        memset(stream->readBuf + chars, 0, READ_BUFFER_SIZE - chars);
+
+        if (stream->readBuf[chars - 1] == '\n')
+        {
+            // There's already a newline character at the end, so we're good.
+            stream->readBufChars = chars;
+            stream->readBufEnd = stream->readBuf + stream->readBufChars;
+        }
+        else
+        {
+            // There's no newline character before EOF, so we need to add one.
+            // We have the room to add a newline character at the end, so let's do it.
+            stream->readBuf[chars] = '\n';
+
+            stream->readBufChars = chars + 1;
+            stream->readBufEnd = stream->readBuf + stream->readBufChars;
+        }
+
+        return true;
+    }
+}
+
+#if RS_PREFETCH_SUPPORTED
+// Gives back the chunk we've just parsed to the prefetch thread, and waits for the next one.
+// Returns false when there are no more chunks.
+static bool nextPrefetchedChunk(RouteStream* stream)
+{
+    RsPrefetcher* p = stream->prefetcher;
+    assert(p);
+
+    pthread_mutex_lock(&p->lock);
+
+    if (p->holdingChunk)
+    {
+        p->chunks[p->readIndex].full = false;
+        p->readIndex = (p->readIndex + 1) % PREFETCH_CHUNKS;
+        p->holdingChunk = false;
+        pthread_cond_signal(&p->chunkEmptied);
+    }
+
+    PrefetchChunk* chunk = &p->chunks[p->readIndex];
+    while (!chunk->full && !p->done)
+    {
+        pthread_cond_wait(&p->chunkFilled, &p->lock);
+    }
+    p->holdingChunk = chunk->full;
+    if (!chunk->full)
+    {
+        stream->sysError = p->error;
+    }
+
+    pthread_mutex_unlock(&p->lock);
+
+    if (!p->holdingChunk)
+    {
+        stream->readBufChars = 0;
+        stream->readBufCursor = stream->readBufEnd;
+        return false;
+    }
+
+    stream->readBuf = chunk->data;
+    stream->readBufChars = chunk->chars;
+    stream->readBufCursor = chunk->data;
+    stream->readBufEnd = chunk->data + chunk->chars;
+    return true;
+}
+#endif
+
+/*
+ * READ FUNCTIONS: readUInt, readStr, readFloat
+ * --------------------------------------------
+ * These functions exist to parse the three different types of data in the file.
+ * Unsigned integers, strings and unsigned floats.
+ *
+ * The reasoning behind making those functions by hand instead of using stuff
+ * like atoi, atof, etc. is simple: they are slow and annoying to use in sequential read.
+ * atoi and atof require a null-terminated string, and that would induce really wack stuff involving
+ * either copying strings or temporary null terminations...
+ *
+ * Since we know the exact format of integers and floats, writing them is really easy.
+ */
+
+// Strings aren't null-terminated, as we can't write to the buffer in RS_MAPPED mode without
+// copying the entire page. Their length is given instead.
+static char* readStr(char* start, char* end, uint32_t* outLen)
+{
+    *outLen = (uint32_t)(end - start);
+
+    return start;
+}
+
+// The slow (but simple) versions, one digit at a time.
+// Used when the number is too long for SWAR, or too close to the end of the line.
+
+static uint32_t readUnsignedIntSlow(const char* const start, const char* const end)
+{
+    uint32_t number = 0;
+
+    const char* cursor = start;
+
+    while (cursor != end)
+    {
+        // Make sure it is a digit
+        assert(*cursor >= '0' && *cursor <= '9');
+
+        uint32_t digit = *cursor - '0';
+        number *= 10;
+        number += digit;
+        cursor++;
+    }
+
+    return number;
+}
+
+static const uint32_t powers10[10] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+                                      1000000000};
+
+// Reads the integer part, the first three decimals (in thousandths), the first nine decimals,
+// and the number of decimals of an unsigned decimal number.
+static void readUnsignedDecimalSlow(const char* const start, const char* const end,
+                                    uint32_t* outInt, uint32_t* outThousandths, uint32_t* outDec, uint32_t* outDecDigits)
+{
+    uint32_t intPart = 0, decPart = 0, thousandths = 0;
+    uint32_t decDigits = 0;
+
+    bool dec = false;
+
+    for (const char* cursor = start; cursor != end; cursor++)
+    {
+        if (*cursor == '.')
+        {
+            assert(!dec);
+            dec = true;
+            continue;
+        }
+
+        // Make sure it is a digit
+        assert(*cursor >= '0' && *cursor <= '9');
+
+        uint32_t digit = *cursor - '0';
+        if (!dec)
+        {
+            intPart = intPart * 10 + digit;
+        }
+        else
+        {
+            // Stop at nine decimals so decPart doesn't overflow, but keep counting them.
+            if (decDigits < 9)
+            {
+                decPart = decPart * 10 + digit;
+            }
+            if (decDigits < 3)
+            {
+                thousandths = thousandths * 10 + digit;
+            }
+            decDigits++;
+        }
+    }
+
+    for (uint32_t i = decDigits; i < 3; i++)
+    {
+        thousandths *= 10;
+    }
+
+    *outInt = intPart;
+    *outThousandths = thousandths;
+    *outDec = decPart;
+    *outDecDigits = decDigits;
+}
+
+/*
+ * SWAR (SIMD Within A Register): 8 characters are loaded in a 64-bit integer, and parsed all at once
+ * with a few multiplications, instead of looping over each digit.
+ * Numbers in the file are short (route ids, step ids, distances like 365.109), so they almost always
+ * fit in 8 characters.
+ *
+ * Reading 8 characters at once means we can read past the end of the number, which is fine as long
+ * as we stay in the line: the caller gives the end of the line as limit.
+ * Only works on little-endian CPUs (the first character must be in the lowest byte).
+ */
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define RS_SWAR_SUPPORTED 1
+#else
+#define RS_SWAR_SUPPORTED 0
+#endif
+
+#if RS_SWAR_SUPPORTED
+#define SWAR_ONES 0x0101010101010101ULL
+
+static inline uint64_t swarLoad(const char* start)
+{
+    uint64_t chunk;
+    memcpy(&chunk, start, sizeof(chunk));
+    return chunk;
+}
+
+// Parses the first len characters (1 to 8) of the chunk, which must all be digits.
+static inline uint32_t swarDigits(uint64_t chunk, uint32_t len)
+{
+    assert(len >= 1 && len <= 8);
+
+    // Move the digits to the highest bytes, and fill the lowest ones with '0', so we get
+    // 8 digits with leading zeroes. Everything after the number is shifted out.
+    uint32_t empty = 8 * (8 - len);
+    chunk <<= empty;
+    if (len != 8)
+    {
+        chunk |= (SWAR_ONES * '0') >> (64 - empty);
+    }
+    chunk -= SWAR_ONES * '0';
+
+    // Make sure they're all digits (no byte went over 9, or below 0).
+    assert(((chunk + SWAR_ONES * (0x80 - 10)) & (SWAR_ONES * 0x80)) == 0);
+
+    // Merge pairs of digits, then pairs of 2-digit numbers, then the two 4-digit numbers.
+    // See "Faster Integer Parsing" by Daniel Lemire.
+    chunk = (chunk * 10) + (chunk >> 8);
+    chunk = (((chunk & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32)))
+             + (((chunk >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+
+    return (uint32_t) chunk;
+}
+
+// Returns the index of the first dot in the chunk, or 8 if there's none.
+static inline uint32_t swarFindDot(uint64_t chunk)
+{
+    uint64_t x = chunk ^ (SWAR_ONES * '.');
+    // The lowest byte set in found is the first zero byte of x. (Higher ones can be wrong.)
+    uint64_t found = (x - SWAR_ONES) & ~x & (SWAR_ONES * 0x80);
+    return found == 0 ? 8 : bitLowest64(found) / 8;
+}
+#endif
+
+static inline uint32_t readUnsignedInt(const char* const start, const char* const end, const char* const limit)
+{
+#if RS_SWAR_SUPPORTED
+    uint32_t len = (uint32_t) (end - start);
+    if (len - 1 < 8 && limit - start >= 8)
+    {
+        return swarDigits(swarLoad(start), len);
+    }
+#else
+    (void) limit;
+#endif
+    return readUnsignedIntSlow(start, end);
+}
+
+// Same as readUnsignedDecimalSlow, with SWAR when possible.
+static inline void readUnsignedDecimal(const char* const start, const char* const end, const char* const limit,
+                                       uint32_t* outInt, uint32_t* outThousandths,
+                                       uint32_t* outDec, uint32_t* outDecDigits)
+{
+#if RS_SWAR_SUPPORTED
+    uint32_t len = (uint32_t) (end - start);
+    if (len - 1 < 8 && limit - start >= 8)
+    {
+        uint64_t chunk = swarLoad(start);
+        uint32_t dot = swarFindDot(chunk);
+        if (dot >= len)
+        {
+            // No decimals, it's just an integer.
+            *outInt = swarDigits(chunk, len);
+            *outThousandths = 0;
+            *outDec = 0;
+            *outDecDigits = 0;
+            return;
+        }
+
+        uint32_t decLen = len - dot - 1;
+        *outInt = dot > 0 ? swarDigits(chunk, dot) : 0;
+        *outDecDigits = decLen;
+        if (decLen > 0)
+        {
+            // dot < 7 here, so the shift is fine.
+            uint64_t decChunk = chunk >> (8 * (dot + 1));
+            *outDec = swarDigits(decChunk, decLen);
+            *outThousandths = decLen <= 3
+                              ? *outDec * powers10[3 - decLen]
+                              : swarDigits(decChunk, 3);
+        }
+        else
+        {
+            *outDec = 0;
+            *outThousandths = 0;
+        }
+        return;
+    }
+#else
+    (void) limit;
+#endif
+    readUnsignedDecimalSlow(start, end, outInt, outThousandths, outDec, outDecDigits);
+}
+
+static inline float readUnsignedFloat(const char* const start, const char* const end, const char* const limit)
+{
+    uint32_t intPart, thousandths, decPart, decDigits;
+    readUnsignedDecimal(start, end, limit, &intPart, &thousandths, &decPart, &decDigits);
+
+    // Almost all distances have at most three decimals: build the float from the thousandths, like
+    // the .pcb reader does, so both give the same float. Longer (or huge) ones keep all their decimals.
+    if (decDigits <= 3 && intPart <= UINT32_MAX / 1000 - 1)
+    {
+        return rsDistanceFromThousandths(intPart * 1000 + thousandths);
+    }
+
+    return (float) intPart + (float) decPart / powers10[decDigits < 9 ? decDigits : 9];
+}
+
+// Reads an unsigned decimal number as a fixed-point number, in thousandths.
+// Decimals after the third one are ignored, and outTruncated (when not NULL) tells if there were any.
+static inline uint32_t readUnsignedFixed(const char* const start, const char* const end, const char* const limit,
+                                         bool* outTruncated)
+{
+    uint32_t intPart, thousandths, decPart, decDigits;
+    readUnsignedDecimal(start, end, limit, &intPart, &thousandths, &decPart, &decDigits);
+
+    if (outTruncated)
+    {
+        *outTruncated = decDigits > 3;
+    }
+
+    return intPart * 1000 + thousandths;
+}
+
+// Returns the interner of the stream, creating it if needed.
+static inline Interner* streamInterner(RouteStream* stream)
+{
+    if (stream->interner == NULL)
+    {
+        stream->interner = internerCreate();
+    }
+    return stream->interner;
+}
+
+// Gets a string of the string table of a .pcb file.
+static inline char* columnarStr(const RouteColumns* columns, uint32_t id, uint32_t* outLen)
+{
+    uint32_t begin = columns->stringOffsets[id];
+    *outLen = columns->stringOffsets[id + 1] - begin;
+    // The mapping is read-only, but RouteStep strings aren't const... Just don't write to them!
+    return (char*) columns->strings + begin;
+}
+
+static bool readColumnarRow(RouteStream* stream, RouteStep* outRouteStep, RouteFields fieldsToRead)
+{
+    RouteColumns* columns = &stream->columns;
+    if (columns->rowCursor >= columns->rowEnd)
+    {
+        return false;
+    }
+
+    uint64_t row = columns->rowCursor++;
+    COUNT_READ(stream, 1, 0);
+
+    if (fieldsToRead & ROUTE_ID)
+        outRouteStep->routeId = columns->routeIds[row];
+
+    if (fieldsToRead & STEP_ID)
+        outRouteStep->stepId = columns->stepIds[row];
+
+    if (fieldsToRead & TOWN_A)
+        outRouteStep->townA = columnarStr(columns, columns->townsA[row], &outRouteStep->townALen);
+
+    if (fieldsToRead & TOWN_B)
+        outRouteStep->townB = columnarStr(columns, columns->townsB[row], &outRouteStep->townBLen);
+
+    if (fieldsToRead & DISTANCE)
+        outRouteStep->distance = rsDistanceFromThousandths(columns->distances[row]);
+
+    if (fieldsToRead & DISTANCE_FIXED)
+    {
+        outRouteStep->distanceThousandths = columns->distances[row];
+        outRouteStep->distanceTruncated = false;
+    }
+
+    if (fieldsToRead & DRIVER_NAME)
+        outRouteStep->driverName = columnarStr(columns, columns->driverNames[row], &outRouteStep->driverNameLen);
+
+    // The file already has ids for every string!
+    if (fieldsToRead & STRING_IDS)
+    {
+        outRouteStep->townAId = columns->townsA[row];
+        outRouteStep->townBId = columns->townsB[row];
+        outRouteStep->driverId = columns->driverNames[row];
+    }
+
+    return true;
+}
+
+// With columns, batches are just copies (or conversions) of contiguous parts of the columns.
+static uint32_t readColumnarBatch(RouteStream* stream, RouteBatch* batch, RouteFields fieldsToRead)
+{
+    RouteColumns* columns = &stream->columns;
+    uint64_t remaining = columns->rowEnd - columns->rowCursor;
+    uint32_t n = remaining < batch->capacity ? (uint32_t) remaining : batch->capacity;
+    uint64_t first = columns->rowCursor;
+
+    if (fieldsToRead & ROUTE_ID)
+        memcpy(batch->routeIds, columns->routeIds + first, n * sizeof(uint32_t));
+
+    if (fieldsToRead & STEP_ID)
+        memcpy(batch->stepIds, columns->stepIds + first, n * sizeof(uint32_t));
+
+    if (fieldsToRead & DISTANCE)
+    {
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            batch->distances[i] = rsDistanceFromThousandths(columns->distances[first + i]);
+        }
+    }
+
+    if (fieldsToRead & DISTANCE_FIXED)
+        memcpy(batch->distancesThousandths, columns->distances + first, n * sizeof(uint32_t));
+
+    if (fieldsToRead & TOWN_A)
+    {
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            batch->townsA[i].id = columns->townsA[first + i];
+            batch->townsA[i].str = columnarStr(columns, batch->townsA[i].id, &batch->townsA[i].len);
+        }
+    }
+
+    if (fieldsToRead & TOWN_B)
+    {
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            batch->townsB[i].id = columns->townsB[first + i];
+            batch->townsB[i].str = columnarStr(columns, batch->townsB[i].id, &batch->townsB[i].len);
+        }
+    }
+
+    if (fieldsToRead & DRIVER_NAME)
+    {
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            batch->driverNames[i].id = columns->driverNames[first + i];
+            batch->driverNames[i].str = columnarStr(columns, batch->driverNames[i].id,
+                                                    &batch->driverNames[i].len);
+        }
+    }
+
+    columns->rowCursor += n;
+    COUNT_READ(stream, n, 0);
+    return n;
+}
+
+/*
+ * STRUCTURAL INDEX
+ * --------------------------------------------
+ * Instead of searching the delimiters of each line, a whole window of the buffer is scanned at once,
+ * giving a bitmap of all the delimiters (see delimiter_search.h). Lines are read in order, so
+ * the delimiters of a line are simply the 6 next bits set in the bitmap.
+ */
+
+// Forgets the current window, when the buffer has changed.
+static inline void resetDelimIndex(RsDelimIndex* index)
+{
+    index->base = NULL;
+    index->numWords = 0;
+    index->word = 0;
+    index->remaining = 0;
+}
+
+// Builds the index of the next window: right after the current one, or at the cursor when there's none.
+static void nextDelimWindow(RouteStream* stream)
+{
+    RsDelimIndex* index = &stream->delimIndex;
+    if (index->bits == NULL)
+    {
+        index->bits = malloc(DELIM_INDEX_WORDS * sizeof(uint64_t));
+        assert(index->bits);
+    }
+
+    char* start = index->base ? index->base + (size_t) index->numWords * 64 : stream->readBufCursor;
+    // Every line ends with a '\n' before readBufEnd, so we can't run out of delimiters in a valid file.
+    assert(start < stream->readBufEnd);
+
+    // The last block can go past readBufEnd, that's what the slack (or the guard page) is for.
+    size_t chars = stream->readBufEnd - start;
+    if (chars > DELIM_INDEX_WINDOW)
+    {
+        chars = DELIM_INDEX_WINDOW;
+    }
+    uint32_t numWords = (uint32_t) ((chars + 63) / 64);
+    buildDelimIndex(start, numWords, index->bits);
+
+    index->base = start;
+    index->numWords = numWords;
+    index->word = 0;
+    index->remaining = index->bits[0];
+}
+
+// Finds the 5 semicolons and the newline of the line beginning at lineBegin, which must be the next line to read.
+static inline void findDelimiters(RouteStream* stream, const char* lineBegin, char* delimiters[6])
+{
+    // Work on a copy of the index, so it stays in registers: the compiler can't assume
+    // the stream isn't modified when writing to delimiters.
+    RsDelimIndex index = stream->delimIndex;
+    for (int i = 0; i < 6; ++i)
+    {
+        while (index.remaining == 0)
+        {
+            if (index.word + 1 < index.numWords)
+            {
+                index.word++;
+                index.remaining = index.bits[index.word];
+            }
+            else
+            {
+                stream->delimIndex = index;
+                nextDelimWindow(stream);
+                index = stream->delimIndex;
+            }
+        }
+
+        delimiters[i] = index.base + (size_t) index.word * 64 + lowestBitIndex(index.remaining);
+        // Clear the lowest bit to find the next delimiter.
+        index.remaining &= index.remaining - 1;
+    }
+    stream->delimIndex = index;
+
+    // Make sure the line has the right number of delimiters, and that the index didn't lose track of the cursor.
+    assert(delimiters[0] >= lineBegin);
+    assert(*delimiters[0] == ';' && *delimiters[1] == ';' && *delimiters[2] == ';'
+           && *delimiters[3] == ';' && *delimiters[4] == ';');
+    assert(*delimiters[5] == '\n' && delimiters[5] < stream->readBufEnd);
+}
+
+// Makes sure there's at least one line left in the buffer, by reading the next chunk of the file if needed.
+// Returns false when there are no more lines.
+static inline bool ensureLineAvailable(RouteStream* stream)
+{
+    if (stream->readBufCursor < stream->readBufEnd)
+    {
+        return true;
+    }
+
+    // The mapping contains the entire file, there's nothing else to read.
+    if (stream->mode == RS_MAPPED)
+    {
+        return false;
+    }
+
+    // The buffer is going to change, the index isn't valid anymore.
+    resetDelimIndex(&stream->delimIndex);
+
+#if RS_PREFETCH_SUPPORTED
+    if (stream->mode == RS_PREFETCHED)
+    {
+        return nextPrefetchedChunk(stream);
+    }
+#endif
+#if RS_URING_SUPPORTED
+    if (stream->mode == RS_URING)
+    {
+        return nextUringChunk(stream);
+    }
+#endif
+    return continueBufferRead(stream);
+}
+
+bool rsRead(RouteStream* stream, RouteStep* outRouteStep, RouteFields fieldsToRead)
+{
+    assert(outRouteStep);
+    assert(stream && stream->valid);
+
+    if (stream->mode == RS_COLUMNAR)
+    {
+        return readColumnarRow(stream, outRouteStep, fieldsToRead);
+    }
+
+    if (!ensureLineAvailable(stream))
+    {
+        return false;
+    }
+
+    char* lineBegin = stream->readBufCursor;
+
+    // Find all the delimiters (the 5 semicolons and the new line character)
+    // findDelimiters makes sure that the delimiters are in the right place
+    // (e.g. no newline as second delimiter), and that we aren't overflowing the buffer.
+    char* delimiters[6];
+    findDelimiters(stream, lineBegin, delimiters);
+    // The numbers can be read 8 characters at once, as long as we don't go past the line.
+    const char* lineEnd = delimiters[5] + 1;
+
+    if (fieldsToRead & ROUTE_ID)
+        outRouteStep->routeId = readUnsignedInt(lineBegin, delimiters[0], lineEnd);
+
+    if (fieldsToRead & STEP_ID)
+        outRouteStep->stepId = readUnsignedInt(delimiters[0] + 1, delimiters[1], lineEnd);
+
+    if (fieldsToRead & TOWN_A)
+        outRouteStep->townA = readStr(delimiters[1] + 1, delimiters[2], &outRouteStep->townALen);
+
+    if (fieldsToRead & TOWN_B)
+        outRouteStep->townB = readStr(delimiters[2] + 1, delimiters[3], &outRouteStep->townBLen);
+
+    if (fieldsToRead & DISTANCE)
+        outRouteStep->distance = readUnsignedFloat(delimiters[3] + 1, delimiters[4], lineEnd);
+
+    if (fieldsToRead & DISTANCE_FIXED)
+        outRouteStep->distanceThousandths = readUnsignedFixed(delimiters[3] + 1, delimiters[4], lineEnd,
+                                                              &outRouteStep->distanceTruncated);
+
+    if (fieldsToRead & DRIVER_NAME)
+        outRouteStep->driverName = readStr(delimiters[4] + 1, delimiters[5], &outRouteStep->driverNameLen);
+
+    if (fieldsToRead & STRING_IDS)
+    {
+        Interner* interner = streamInterner(stream);
+
+        if (fieldsToRead & TOWN_A)
+            outRouteStep->townAId = internerIntern(interner, outRouteStep->townA, outRouteStep->townALen);
+
+        if (fieldsToRead & TOWN_B)
+            outRouteStep->townBId = internerIntern(interner, outRouteStep->townB, outRouteStep->townBLen);
+
+        if (fieldsToRead & DRIVER_NAME)
+            outRouteStep->driverId = internerIntern(interner, outRouteStep->driverName,
+                                                    outRouteStep->driverNameLen);
+    }
 
     stream->readBufCursor = delimiters[5] + 1;
+    COUNT_READ(stream, 1, (uint64_t) (stream->readBufCursor - lineBegin));
+
+    return true;
+}
+
+uint32_t rsReadBatch(RouteStream* stream, RouteBatch* batch, RouteFields fieldsToRead)
+{
+    assert(batch && batch->capacity > 0);
+    assert(stream && stream->valid);
+    assert(!(fieldsToRead & ROUTE_ID) || batch->routeIds);
+    assert(!(fieldsToRead & STEP_ID) || batch->stepIds);
+    assert(!(fieldsToRead & TOWN_A) || batch->townsA);
+    assert(!(fieldsToRead & TOWN_B) || batch->townsB);
+    assert(!(fieldsToRead & DISTANCE) || batch->distances);
+    assert(!(fieldsToRead & DISTANCE_FIXED) || batch->distancesThousandths);
+    assert(!(fieldsToRead & DRIVER_NAME) || batch->driverNames);
+
+    if (stream->mode == RS_COLUMNAR)
+    {
+        return readColumnarBatch(stream, batch, fieldsToRead);
+    }
+
+    if (!ensureLineAvailable(stream))
+    {
+        return 0;
+    }
+
+    // Only read lines from the current buffer: in buffered modes, the next chunk would overwrite
+    // the strings of the previous rows.
+    // The fieldsToRead conditions don't change during the loop, so they're easy to predict (or unswitch).
+    char* cursor = stream->readBufCursor;
+    char* const end = stream->readBufEnd;
+    Interner* interner = (fieldsToRead & STRING_IDS) ? streamInterner(stream) : NULL;
+    uint32_t n = 0;
+    while (n < batch->capacity && cursor < end)
+    {
+        char* delimiters[6];
+        findDelimiters(stream, cursor, delimiters);
+        const char* lineEnd = delimiters[5] + 1;
+
+        if (fieldsToRead & ROUTE_ID)
+            batch->routeIds[n] = readUnsignedInt(cursor, delimiters[0], lineEnd);
+
+        if (fieldsToRead & STEP_ID)
+            batch->stepIds[n] = readUnsignedInt(delimiters[0] + 1, delimiters[1], lineEnd);
+
+        if (fieldsToRead & TOWN_A)
+            batch->townsA[n].str = readStr(delimiters[1] + 1, delimiters[2], &batch->townsA[n].len);
+
+        if (fieldsToRead & TOWN_B)
+            batch->townsB[n].str = readStr(delimiters[2] + 1, delimiters[3], &batch->townsB[n].len);
+
+        if (fieldsToRead & DISTANCE)
+            batch->distances[n] = readUnsignedFloat(delimiters[3] + 1, delimiters[4], lineEnd);
+
+        if (fieldsToRead & DISTANCE_FIXED)
+            batch->distancesThousandths[n] = readUnsignedFixed(delimiters[3] + 1, delimiters[4], lineEnd, NULL);
+
+        if (fieldsToRead & DRIVER_NAME)
+            batch->driverNames[n].str = readStr(delimiters[4] + 1, delimiters[5], &batch->driverNames[n].len);
+
+        if (fieldsToRead & STRING_IDS)
+        {
+            if (fieldsToRead & TOWN_A)
+                batch->townsA[n].id = internerIntern(interner, batch->townsA[n].str, batch->townsA[n].len);
+
+            if (fieldsToRead & TOWN_B)
+                batch->townsB[n].id = internerIntern(interner, batch->townsB[n].str, batch->townsB[n].len);
+
+            if (fieldsToRead & DRIVER_NAME)
+                batch->driverNames[n].id = internerIntern(interner, batch->driverNames[n].str,
+                                                          batch->driverNames[n].len);
+        }
+
+        cursor = delimiters[5] + 1;
+        n++;
+    }
+    COUNT_READ(stream, n, (uint64_t) (cursor - stream->readBufCursor));
+    stream->readBufCursor = cursor;
+
+    return n;
+}
+
+uint32_t rsSplit(RouteStream* stream, uint32_t maxParts, RouteStream* outParts)
+{
+    assert(stream && stream->valid);
+    assert(maxParts > 0);
+
+    // All parts must share the same interner, so strings get the same ids in every part.
+    if (stream->mode != RS_COLUMNAR)
+    {
+        streamInterner(stream);
+    }
+
+    if (stream->mode == RS_COLUMNAR)
+    {
+        // Just split the rows evenly.
+        uint64_t first = stream->columns.rowCursor;
+        uint64_t numRows = stream->columns.rowEnd - first;
+        uint32_t numParts = numRows < maxParts ? (uint32_t) numRows : maxParts;
+        for (uint32_t i = 0; i < numParts; ++i)
+        {
+            RouteStream* part = &outParts[i];
+            *part = *stream;
+            part->mapBase = NULL;
+            part->mapSize = 0;
+            part->delimIndex.bits = NULL;
+            part->partIndexBits = NULL;
+            part->columns.rowCursor = first + numRows * i / numParts;
+            part->columns.rowEnd = first + numRows * (i + 1) / numParts;
+        }
+
+        stream->columns.rowCursor = stream->columns.rowEnd;
+        return numParts;
+    }
+
+    if (stream->mode != RS_MAPPED)
+    {
+        return 0;
+    }
 
+    char* const end = stream->readBufEnd;
+    const size_t remaining = end - stream->readBufCursor;
+
+    // Parts can't be closed, so the stream owns the bits of their index.
+    free(stream->partIndexBits);
+    stream->partIndexBits = malloc((size_t) maxParts * DELIM_INDEX_WORDS * sizeof(uint64_t));
+    assert(stream->partIndexBits);
+
+    uint32_t numParts = 0;
+    char* partBegin = stream->readBufCursor;
+    for (uint32_t i = 1; i <= maxParts && partBegin < end; ++i)
+    {
+        char* partEnd;
+        if (i == maxParts)
+        {
+            partEnd = end;
+        }
+        else
+        {
+            // Cut the stream at the next line after the ideal boundary.
+            char* target = stream->readBufCursor + remaining / maxParts * i;
+            if (target < partBegin)
+            {
+                continue;
+            }
+            // There's always a newline at the end of the mapping, so this can't fail.
+            partEnd = (char*) memchr(target, '\n', end - target) + 1;
+        }
+
+        RouteStream* part = &outParts[numParts++];
+        *part = *stream;
+        // Parts don't own the mapping, only the original stream does.
+        part->mapBase = NULL;
+        part->mapSize = 0;
+        // Same for the bits of their index.
+        resetDelimIndex(&part->delimIndex);
+        part->delimIndex.bits = stream->partIndexBits + (size_t) (numParts - 1) * DELIM_INDEX_WORDS;
+        part->partIndexBits = NULL;
+        part->readBuf = partBegin;
+        part->readBufCursor = partBegin;
+        part->readBufEnd = partEnd;
+        part->readBufChars = partEnd - partBegin;
+
+        partBegin = partEnd;
+    }
+
+    // The stream has been entirely given to its parts.
+    stream->readBufCursor = end;
+
+    return numParts;
+}
+
+const char* rsGetString(const RouteStream* stream, uint32_t id, uint32_t* outLen)
+{
+    assert(stream);
+
+    if (stream->mode == RS_COLUMNAR)
+    {
+        assert(id < stream->columns.numStrings);
+        return columnarStr(&stream->columns, id, outLen);
+    }
+    else
+    {
+        assert(stream->interner);
+        return internerGet(stream->interner, id, outLen);
+    }
+}
+
+uint32_t rsNumStrings(const RouteStream* stream)
+{
+    assert(stream);
+
+    if (stream->mode == RS_COLUMNAR)
+    {
+        return stream->columns.numStrings;
+    }
+    else
+    {
+        return stream->interner ? internerSize(stream->interner) : 0;
+    }
+}
+
+uint32_t rsInternString(RouteStream* stream, const char* str, uint32_t len)
+{
+    assert(stream && stream->mode != RS_COLUMNAR);
+
+    return internerIntern(streamInterner(stream), str, len);
+}
+
+void rsTakeStrings(RouteStream* stream, RouteStream* from)
+{
+    assert(stream && from && stream->mode != RS_COLUMNAR && from->mode != RS_COLUMNAR);
+    assert(stream->interner == NULL && "The stream already has strings!");
+
+    stream->interner = from->interner;
+    from->interner = NULL;
+}
+
+uint64_t rsTell(const RouteStream* stream)
+{
+    assert(stream && stream->mode == RS_MAPPED);
+
+    return (uint64_t) (stream->readBufCursor - stream->readBuf);
+}
+
+bool rsSeek(RouteStream* stream, uint64_t offset)
+{
+    assert(stream);
+
+    // The offset must be right after a newline, and after the header.
+    if (stream->mode != RS_MAPPED || offset > stream->readBufChars
+        || offset < (uint64_t) (stream->readBufCursor - stream->readBuf) || stream->readBuf[offset - 1] != '\n')
+    {
+        return false;
+    }
+
+    stream->readBufCursor = stream->readBuf + offset;
+    return true;
+}
+
+bool rsMark(const RouteStream* stream, RsMark* outMark)
+{
+    assert(stream && outMark);
+
+    outMark->rowsRead = stream->rowsRead;
+    outMark->bytesRead = stream->bytesRead;
+    if (stream->mode == RS_COLUMNAR)
+    {
+        outMark->position = stream->columns.rowCursor;
+        return true;
+    }
+    else if (stream->mode == RS_MAPPED)
+    {
+        outMark->position = (uint64_t) (stream->readBufCursor - stream->readBuf);
+        return true;
+    }
+    else
+    {
+        return false;
+    }
+}
+
+void rsRewind(RouteStream* stream, RsMark mark)
+{
+    assert(stream);
+
+    if (stream->mode == RS_COLUMNAR)
+    {
+        assert(mark.position <= stream->columns.rowEnd);
+        stream->columns.rowCursor = mark.position;
+    }
+    else
+    {
+        assert(stream->mode == RS_MAPPED && mark.position <= stream->readBufChars);
+        stream->readBufCursor = stream->readBuf + mark.position;
+        // The delimiters found so far are further in the file, find them again from there.
+        resetDelimIndex(&stream->delimIndex);
+    }
+
+    // The lines after the mark will be read again: forget we've read them.
+    stream->rowsRead = mark.rowsRead;
+    stream->bytesRead = mark.bytesRead;
+}
+
+void rsIgnoreUnfinishedLine(RouteStream* stream)
+{
+    assert(stream);
+
+    if (stream->mode != RS_MAPPED || !stream->newlineAdded)
+    {
+        return;
+    }
+
+    // Go back to the end of the previous line, without going before the cursor (the header).
+    char* end = stream->readBufEnd - 1;
+    while (end > stream->readBufCursor && end[-1] != '\n')
+    {
+        end--;
+    }
+    stream->readBufEnd = end;
+    stream->readBufChars = end - stream->readBuf;
+    stream->newlineAdded = false;
+}
+
+// The number of bytes checked at the beginning and at the end by rsChecksum.
+#define CHECKSUM_SAMPLE (64 * 1024)
+
+// FNV-1a: simple, and good enough to notice changes.
+static uint64_t fnv1a(uint64_t hash, const char* data, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= (unsigned char) data[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+bool rsChecksum(const RouteStream* stream, uint64_t end, uint64_t* outChecksum)
+{
+    assert(stream);
+
+    // Don't count the newline we've added, it's not in the file.
+    uint64_t fileSize = stream->readBufChars - (stream->newlineAdded ? 1 : 0);
+    if (stream->mode != RS_MAPPED || end > fileSize)
+    {
+        return false;
+    }
+
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    hash = fnv1a(hash, (const char*) &end, sizeof(end));
+    if (end <= 2 * CHECKSUM_SAMPLE)
+    {
+        hash = fnv1a(hash, stream->readBuf, end);
+    }
+    else
+    {
+        hash = fnv1a(hash, stream->readBuf, CHECKSUM_SAMPLE);
+        hash = fnv1a(hash, stream->readBuf + end - CHECKSUM_SAMPLE, CHECKSUM_SAMPLE);
+    }
+
+    *outChecksum = hash;
     return true;
 }
 
@@ -293,17 +2165,65 @@ void rsClose(RouteStream* stream)
         return;
     }
 
+#if RS_PREFETCH_SUPPORTED
+    RsPrefetcher* p = stream->prefetcher;
+    if (p)
+    {
+        // Wake up the thread if it's waiting for a chunk, and wait for it to finish.
+        pthread_mutex_lock(&p->lock);
+        p->stop = true;
+        pthread_cond_signal(&p->chunkEmptied);
+        pthread_mutex_unlock(&p->lock);
+        pthread_join(p->thread, NULL);
+
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->chunkFilled);
+        pthread_cond_destroy(&p->chunkEmptied);
+        freePrefetcher(p);
+        stream->prefetcher = NULL;
+        // The buffer was one of the chunks.
+        stream->readBuf = NULL;
+    }
+#endif
+#if RS_URING_SUPPORTED
+    if (stream->uring)
+    {
+        freeUringReader(stream->uring);
+        stream->uring = NULL;
+        // The buffer was in one of the chunks.
+        stream->readBuf = NULL;
+    }
+#endif
     if (stream->file)
     {
         fclose(stream->file);
         stream->file = NULL;
     }
+#if RS_MMAP_SUPPORTED
+    if (stream->mapBase)
+    {
+        munmap(stream->mapBase, stream->mapSize);
+        stream->mapBase = NULL;
+        stream->readBuf = NULL;
+    }
+#endif
     if (stream->readBuf)
     {
         free(stream->readBuf);
         stream->readBuf = NULL;
     }
 
+    if (stream->interner)
+    {
+        internerFree(stream->interner);
+        stream->interner = NULL;
+    }
+
+    free(stream->delimIndex.bits);
+    stream->delimIndex.bits = NULL;
+    free(stream->partIndexBits);
+    stream->partIndexBits = NULL;
+
     stream->closed = true;
     stream->valid = false;
 }
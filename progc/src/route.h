@@ -10,28 +10,114 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include "decompress.h"
 
 #define ERR_MAX 256
 
+// Give this path to any rsOpen function to read the standard input instead of a file.
+// Only rsOpen and rsOpenPrefetched can do it, since it's most likely a pipe.
+#define RS_STDIN_PATH "-"
+
 typedef struct RouteStep
 {
     uint32_t routeId;
     uint32_t stepId;
+    // Strings are NOT null-terminated, use their length!
     char* townA; // Invalidated on the next call to rsRead
     uint32_t townALen;
     char* townB; // Invalidated on the next call to rsRead
     uint32_t townBLen;
     float distance;
+    uint32_t distanceThousandths; // The distance in fixed-point, only read with DISTANCE_FIXED.
+    bool distanceTruncated; // True when the distance had more than three decimals, only read with DISTANCE_FIXED.
     char* driverName; // Invalidated on the next call to rsRead
     uint32_t driverNameLen;
+    // The ids of the strings, only read with STRING_IDS. Unlike the strings, they're valid until
+    // the stream is closed, and the same string always has the same id. Use rsGetString to get the string back.
+    uint32_t townAId;
+    uint32_t townBId;
+    uint32_t driverId;
 } RouteStep;
 
+typedef enum
+{
+    // The file is read chunk by chunk using fread, into a buffer of our own.
+    RS_BUFFERED,
+    // The entire file is mapped in memory (using mmap), and read directly from the page cache.
+    RS_MAPPED,
+    // The file is read chunk by chunk by a background thread, while the previous chunk is being parsed.
+    RS_PREFETCHED,
+    // The file is read with io_uring, with several direct (O_DIRECT) reads in flight at once.
+    RS_URING,
+    // The file is a columnar binary file (.pcb, see pcb.h), mapped in memory. No parsing needed!
+    RS_COLUMNAR
+} RouteStreamMode;
+
+// The columns of a .pcb file, pointing to the mapped file. Only used in RS_COLUMNAR mode.
+typedef struct RouteColumns
+{
+    const uint32_t* routeIds;
+    const uint32_t* stepIds;
+    const uint32_t* distances; // In thousandths
+    const uint32_t* townsA; // Ids of strings
+    const uint32_t* townsB;
+    const uint32_t* driverNames;
+    const uint32_t* stringOffsets;
+    const char* strings;
+    uint32_t numStrings;
+
+    // The next row to read, and the (exclusive) end of the rows to read.
+    uint64_t rowCursor;
+    uint64_t rowEnd;
+} RouteColumns;
+
+// The structural index of the buffer: a bitmap of all the delimiters (';' and '\n') of the next characters,
+// built a window at a time (see delimiter_search.h), and walked line by line. Not used in RS_COLUMNAR mode.
+typedef struct RsDelimIndex
+{
+    uint64_t* bits; // Bit n of bits[i] is set when base[i * 64 + n] is a delimiter.
+    char* base; // The first character of the window, NULL when there's no window yet.
+    uint32_t numWords; // The number of words in the window.
+    uint32_t word; // The word we're currently walking.
+    uint64_t remaining; // The bits of the current word we haven't walked yet.
+} RsDelimIndex;
+
+// The state of the background thread reading chunks in RS_PREFETCHED mode. Defined in route.c.
+struct RsPrefetcher;
+// The ring and the chunks being read in RS_URING mode. Defined in route.c.
+struct RsUringReader;
+
 typedef struct RouteStream
 {
-    FILE* file;
+    RouteStreamMode mode;
+
+    FILE* file; // Only used in RS_BUFFERED and RS_PREFETCHED modes.
+    // The compression of the file, found when opening it. Only RS_PREFETCHED streams can read compressed files,
+    // the other modes fail with ENOTSUP.
+    Compression compression;
+    struct RsPrefetcher* prefetcher; // Only used in RS_PREFETCHED mode.
+    struct RsUringReader* uring; // Only used in RS_URING mode.
+    RouteColumns columns; // Only used in RS_COLUMNAR mode.
+    // Gives ids to the strings read with STRING_IDS. Created on first use, and shared with the parts
+    // of the stream (see rsSplit). Not used in RS_COLUMNAR mode, as the file already has ids.
+    struct Interner* interner;
+    // Where the delimiters are, see RsDelimIndex. The bits are allocated on first use.
+    RsDelimIndex delimIndex;
+    // The bits of the indexes of the parts of the stream (see rsSplit), as parts aren't closed.
+    uint64_t* partIndexBits;
+
+    // The memory region reserved for the file mapping, including the zeroed guard page at the end.
+    // Only used in RS_MAPPED mode.
+    void* mapBase;
+    size_t mapSize;
+    // True when the file doesn't end with a newline, and we've added one. Only used in RS_MAPPED mode.
+    bool newlineAdded;
+    // The error number (errno) of the last failed system call, 0 if there's none.
+    int sysError;
 
     // The buffer contains multiple lines of the CSV file.
     // Each line is guaranteed to end with a '\n' character.
+    // In RS_MAPPED mode, the buffer is the entire file mapping.
     char* readBuf;
     // The current read position in the buffer.
     // Set to readBufEnd when the buffer is empty OR when reaching the end of the buffer.
@@ -39,7 +125,16 @@ typedef struct RouteStream
     // The exclusive end of the buffer.
     // Points to the character just after the last character of the buffer.
     char* readBufEnd;
-    uint32_t readBufChars; // The total number of characters in the buffer.
+    size_t readBufChars; // The total number of characters in the buffer.
+    // RS_BUFFERED mode only: the number of characters right after readBufEnd that belong to a line cut in half.
+    // They're moved to the start of the buffer on the next read.
+    size_t carryChars;
+
+    // The lines and characters read so far, only counted when the profiler is enabled.
+    // Parts of the stream (see rsSplit) start from the counts of the stream when they're made.
+    // Columnar files have no characters: only the lines are counted.
+    uint64_t rowsRead;
+    uint64_t bytesRead;
 
     // True when the stream has a file open, and a buffer ready.
     bool valid;
@@ -47,6 +142,29 @@ typedef struct RouteStream
     bool closed;
 } RouteStream;
 
+// A string in the file. NOT null-terminated, use its length!
+typedef struct RouteStr
+{
+    char* str;
+    uint32_t len;
+    uint32_t id; // Only read with STRING_IDS, see RouteStep.
+} RouteStr;
+
+// Many route steps, stored column by column (one array per field) instead of row by row.
+// The arrays are given by the caller, and must have room for capacity rows.
+// Only the arrays of the fields read are needed, others can be NULL.
+typedef struct RouteBatch
+{
+    uint32_t* routeIds;
+    uint32_t* stepIds;
+    RouteStr* townsA; // Invalidated on the next call to rsRead/rsReadBatch
+    RouteStr* townsB; // Invalidated on the next call to rsRead/rsReadBatch
+    float* distances;
+    uint32_t* distancesThousandths; // Read with DISTANCE_FIXED
+    RouteStr* driverNames; // Invalidated on the next call to rsRead/rsReadBatch
+    uint32_t capacity;
+} RouteBatch;
+
 typedef enum
 {
     ROUTE_ID = 1 << 0,
@@ -55,14 +173,58 @@ typedef enum
     TOWN_B = 1 << 3,
     DISTANCE = 1 << 4,
     DRIVER_NAME = 1 << 5,
-    ALL_FIELDS = ROUTE_ID | STEP_ID | TOWN_A | TOWN_B | DISTANCE | DRIVER_NAME
+    ALL_FIELDS = ROUTE_ID | STEP_ID | TOWN_A | TOWN_B | DISTANCE | DRIVER_NAME,
+    // The distance as a fixed-point number (thousandths), in distanceThousandths.
+    // Decimals after the third one are ignored. Not part of ALL_FIELDS.
+    // Unlike floats, adding up those gives the exact same result in any order.
+    DISTANCE_FIXED = 1 << 6,
+    // Give an id to each string read (TOWN_A, TOWN_B, DRIVER_NAME), so they can be compared as integers.
+    // Towns and drivers share the same ids: a town and a driver with the same name have the same id.
+    // Not part of ALL_FIELDS.
+    STRING_IDS = 1 << 7
 } RouteFields;
 
+// Converts a fixed-point distance (in thousandths) to a float. Every distance with at most three decimals
+// goes through this one, from the CSV or from a .pcb file, so they always give the exact same float.
+// The division is done with doubles: even with -Ofast, turning it into a multiplication gives the same result,
+// while the float version (integer part + thousandths / 1000) can change depending on how it was optimized.
+static inline float rsDistanceFromThousandths(uint32_t thousandths)
+{
+    return (float) ((double) thousandths / 1000);
+}
+
 // Opens a CSV file of all routes using the given path.
+// Works with any kind of file (including pipes), as we never go back in the file.
 // Use rsCheck to check if the stream has been created successfully,
 // and get an error message if it didn't.
 RouteStream rsOpen(const char* path);
 
+// Opens a CSV file of all routes using the given path, by mapping the entire file in memory.
+// Lines are read straight from the mapping, without copying the file to a buffer.
+// Only available on POSIX systems, and for regular non-empty files.
+// When it fails, rsCheck returns false, and rsOpen can be used instead.
+RouteStream rsOpenMapped(const char* path);
+
+// Opens a CSV file of all routes using the given path, with a background thread reading
+// the next chunks of the file while the current one is being parsed.
+// Works with any kind of file (including pipes), but only on POSIX systems.
+// Compressed files (gzip or zstd, see decompress.h) are decompressed by the background thread.
+// When it fails, rsCheck returns false, and rsOpen can be used instead.
+RouteStream rsOpenPrefetched(const char* path);
+
+// Opens a CSV file of all routes using the given path, and reads it using io_uring, with up to
+// queueDepth reads of chunkSize bytes in flight at once.
+// The file is opened with O_DIRECT when the file system supports it, so the page cache
+// is left alone: that's great for huge files that wouldn't fit in memory anyway.
+// Only available on Linux, for regular files. chunkSize is rounded up to 4 KB, and queueDepth is at least 2.
+// When it fails, rsCheck returns false, and another function can be used instead.
+RouteStream rsOpenUring(const char* path, uint32_t queueDepth, uint32_t chunkSize);
+
+// Opens a columnar binary file (.pcb) made with pcbConvert, by mapping it in memory.
+// Fails when the file isn't a valid .pcb file (or mmap isn't available),
+// so it can be used to check if a file is a .pcb file.
+RouteStream rsOpenColumnar(const char* path);
+
 // Checks the validity of a stream, and outputs an error message if it is not valid.
 bool rsCheck(const RouteStream* stream, char errMsg[ERR_MAX]);
 
@@ -70,17 +232,102 @@ bool rsCheck(const RouteStream* stream, char errMsg[ERR_MAX]);
 // Use the fieldsToRead parameter to control which fields should be read and ignored.
 //
 // IMPORTANT: All strings (townA, townB, driverName) are only valid during the call to rsRead.
-// The next call to rsRead make them invalid.
+// The next call to rsRead make them invalid. They aren't null-terminated either.
 //
 // Example:
 // void func(RouteStream* stream) {
 //     RouteStep step;
 //     while (rsRead(&stream, &step, DRIVER_NAME | DISTANCE)) {
-//         printf("Looks like %s just traveled %f meters!\n", step.driverName, step.distance);
+//         printf("Looks like %.*s just traveled %f meters!\n", step.driverNameLen, step.driverName, step.distance);
 //    }
 // }
 bool rsRead(RouteStream* stream, RouteStep* outRouteStep, RouteFields fieldsToRead);
 
+// Reads up to batch->capacity route steps from the stream, and stores their fields in the batch arrays.
+// Returns the number of steps read, which can be less than the capacity even when there are more lines left.
+// When there are no more lines, returns 0.
+//
+// Works just like rsRead, but avoids the cost of a call per line, and gives arrays that can be
+// processed with tight loops. Strings have the same lifetime as with rsRead.
+//
+// Example:
+// uint32_t ids[256]; float distances[256];
+// RouteBatch batch = {.routeIds = ids, .distances = distances, .capacity = 256};
+// uint32_t n;
+// while ((n = rsReadBatch(&stream, &batch, ROUTE_ID | DISTANCE)) > 0) {
+//     for (uint32_t i = 0; i < n; i++) { total += distances[i]; }
+// }
+uint32_t rsReadBatch(RouteStream* stream, RouteBatch* batch, RouteFields fieldsToRead);
+
+// Splits the remaining lines of a RS_MAPPED stream into at most maxParts streams of similar size,
+// so they can be read by different threads. Each part begins and ends at a line boundary.
+//
+// The parts share the mapping of the stream: they must NOT be closed, and they're invalid
+// once the stream is closed.
+// Also works with RS_COLUMNAR streams.
+// Returns the number of parts, or 0 when the stream can't be split (other modes).
+uint32_t rsSplit(RouteStream* stream, uint32_t maxParts, RouteStream* outParts);
+
+// Returns the string with the given id (see STRING_IDS). It's valid until the stream is closed,
+// and is NOT always null-terminated.
+// Must not be called while the stream (or one of its parts) is being read.
+const char* rsGetString(const RouteStream* stream, uint32_t id, uint32_t* outLen);
+
+// Returns the number of string ids given so far: all ids are lower than this number.
+uint32_t rsNumStrings(const RouteStream* stream);
+
+// Gives an id to the string, just like the ones read with STRING_IDS. The string is copied.
+// Used to get back strings saved by a previous run (see state.h). Doesn't work in RS_COLUMNAR mode.
+uint32_t rsInternString(RouteStream* stream, const char* str, uint32_t len);
+
+// Moves all the string ids of from to the stream, which must not have read any string id yet.
+// Used to map the file again once lines have been added (see follow.h), so the strings keep their ids.
+// Doesn't work in RS_COLUMNAR mode.
+void rsTakeStrings(RouteStream* stream, RouteStream* from);
+
+/*
+ * Incremental reading (see state.h): only read the lines added to the file since the last time.
+ * Only works in RS_MAPPED mode, where we know where we are in the file.
+ */
+
+// Returns the position in the file of the next line to read (or the end of the file when everything's read).
+uint64_t rsTell(const RouteStream* stream);
+
+// Starts reading at the given position of the file, which must be the start of a line (given by rsTell).
+// Returns false when the stream isn't in RS_MAPPED mode, or when the position isn't valid.
+bool rsSeek(RouteStream* stream, uint64_t offset);
+
+// Ignores the last line of the file if it doesn't end with a newline: it's most likely still being written,
+// and will be read next time, once complete. Must be called before reading.
+void rsIgnoreUnfinishedLine(RouteStream* stream);
+
+// Gives a checksum of the first `end` bytes of the file, to check later that they haven't changed.
+// Only the beginning and the end of that part of the file are checked (64 KB each), so it stays quick
+// even with huge files: good enough to catch a file that has been replaced or rewritten.
+// Returns false when the stream isn't in RS_MAPPED mode, or when the file is smaller than `end` bytes.
+bool rsChecksum(const RouteStream* stream, uint64_t end, uint64_t* outChecksum);
+
+/*
+ * Reading the same lines again
+ */
+
+// A position in the stream, given by rsMark.
+typedef struct RsMark
+{
+    uint64_t position; // The offset in the mapping (RS_MAPPED), or the row (RS_COLUMNAR).
+    // The counts of the stream at that position: the lines read again mustn't be counted twice.
+    uint64_t rowsRead;
+    uint64_t bytesRead;
+} RsMark;
+
+// Gives the position of the next line to read, to come back to it later with rsRewind.
+// Only works when the entire file is in memory: in RS_MAPPED and RS_COLUMNAR modes, and with their parts.
+// Returns false in other modes, where lines are gone once they've been read.
+bool rsMark(const RouteStream* stream, RsMark* outMark);
+
+// Goes back to a position given by rsMark on the same stream, to read the same lines again.
+void rsRewind(RouteStream* stream, RsMark mark);
+
 // Closes the file and frees any resources allocated by the stream. Marks the stream as invalid.
 void rsClose(RouteStream* stream);
 
@@ -0,0 +1,576 @@
+#include "sketch.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "hash.h"
+#include "portable.h"
+#include "state.h"
+
+// The size of the Count-Min sketch: 4 rows of 4096 counters, 128 KB in total.
+// With n the total of all counts, an estimate is off by more than 2n/4096 with a probability of 1/2^4 at most.
+#define CM_WIDTH 4096
+#define CM_DEPTH 4
+
+#define NOT_FOUND UINT32_MAX
+
+uint64_t sketchHash(const char* name, uint32_t len)
+{
+    // Both halves of the hash are good, so they can be used as different hashes.
+    return hashString(name, len);
+}
+
+/*
+ * Count-Min sketch
+ */
+
+// Adds weight to the counters of the hash, and returns its new estimate: the lowest of its counters.
+static uint64_t cmAdd(TopK* topk, uint64_t hash, uint64_t weight)
+{
+    uint32_t h1 = (uint32_t) (hash >> 32);
+    uint32_t h2 = (uint32_t) hash | 1;
+
+    uint64_t estimate = UINT64_MAX;
+    for (uint32_t row = 0; row < topk->cmDepth; ++row)
+    {
+        uint64_t* counter = &topk->countMin[row * topk->cmWidth + ((h1 + row * h2) & (topk->cmWidth - 1))];
+        *counter += weight;
+        if (*counter < estimate)
+        {
+            estimate = *counter;
+        }
+    }
+    return estimate;
+}
+
+/*
+ * Hash table: finds the item of a name
+ */
+
+static void setSlot(TopK* topk, uint32_t slot, uint32_t index)
+{
+    topk->slots[slot] = index + 1;
+    topk->items[index].slot = slot;
+}
+
+// Returns the slot of the name, or NOT_FOUND.
+static uint32_t findSlot(const TopK* topk, const char* name, uint32_t len, uint64_t hash)
+{
+    for (uint32_t s = (uint32_t) hash & topk->slotMask;; s = (s + 1) & topk->slotMask)
+    {
+        uint32_t indexPlusOne = topk->slots[s];
+        if (indexPlusOne == 0)
+        {
+            return NOT_FOUND;
+        }
+
+        const TopKItem* item = &topk->items[indexPlusOne - 1];
+        if (item->hash == hash && item->length == len && memcmp(item->name, name, len) == 0)
+        {
+            return s;
+        }
+    }
+}
+
+// Returns the first empty slot for the hash. There's always one, as the table is twice as big as the TopK.
+static uint32_t findEmptySlot(const TopK* topk, uint64_t hash)
+{
+    uint32_t s = (uint32_t) hash & topk->slotMask;
+    while (topk->slots[s] != 0)
+    {
+        s = (s + 1) & topk->slotMask;
+    }
+    return s;
+}
+
+// Empties the slot, and moves the next items back so they can still be found. (No tombstones!)
+static void removeSlot(TopK* topk, uint32_t slot)
+{
+    uint32_t i = slot;
+    uint32_t j = slot;
+    for (;;)
+    {
+        j = (j + 1) & topk->slotMask;
+        if (topk->slots[j] == 0)
+        {
+            break;
+        }
+
+        // Where the item of slot j would like to be. If it's between i (excluded) and j, it can stay.
+        uint32_t home = (uint32_t) topk->items[topk->slots[j] - 1].hash & topk->slotMask;
+        bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (!stays)
+        {
+            setSlot(topk, i, topk->slots[j] - 1);
+            i = j;
+        }
+    }
+    topk->slots[i] = 0;
+}
+
+/*
+ * Min-heap of items, by count
+ */
+
+static void swapItems(TopK* topk, uint32_t a, uint32_t b)
+{
+    TopKItem temp = topk->items[a];
+    topk->items[a] = topk->items[b];
+    topk->items[b] = temp;
+
+    topk->slots[topk->items[a].slot] = a + 1;
+    topk->slots[topk->items[b].slot] = b + 1;
+}
+
+static void siftDown(TopK* topk, uint32_t i)
+{
+    for (;;)
+    {
+        uint32_t left = 2 * i + 1, right = left + 1, smallest = i;
+        if (left < topk->size && topk->items[left].count < topk->items[smallest].count)
+        {
+            smallest = left;
+        }
+        if (right < topk->size && topk->items[right].count < topk->items[smallest].count)
+        {
+            smallest = right;
+        }
+        if (smallest == i)
+        {
+            return;
+        }
+
+        swapItems(topk, i, smallest);
+        i = smallest;
+    }
+}
+
+static void siftUp(TopK* topk, uint32_t i)
+{
+    while (i > 0)
+    {
+        uint32_t parent = (i - 1) / 2;
+        if (topk->items[parent].count <= topk->items[i].count)
+        {
+            return;
+        }
+
+        swapItems(topk, i, parent);
+        i = parent;
+    }
+}
+
+// Puts all the items back in the hash table, and in heap order.
+static void rebuild(TopK* topk)
+{
+    memset(topk->slots, 0, (topk->slotMask + 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < topk->size; ++i)
+    {
+        setSlot(topk, findEmptySlot(topk, topk->items[i].hash), i);
+    }
+    for (uint32_t i = topk->size / 2; i-- > 0;)
+    {
+        siftDown(topk, i);
+    }
+}
+
+static void setName(TopKItem* item, const char* name, uint32_t len, uint64_t hash)
+{
+    if (len > item->nameCapacity)
+    {
+        item->nameCapacity = len < 16 ? 16 : len;
+        item->name = realloc(item->name, item->nameCapacity);
+        assert(item->name);
+    }
+
+    memcpy(item->name, name, len);
+    item->length = len;
+    item->hash = hash;
+}
+
+/*
+ * TopK
+ */
+
+void topkInit(TopK* topk, uint32_t capacity, bool countMin)
+{
+    assert(capacity > 0);
+
+    topk->size = 0;
+    topk->capacity = capacity;
+    topk->maxEvicted = 0;
+    topk->items = calloc(capacity, sizeof(TopKItem));
+    assert(topk->items);
+
+    uint32_t numSlots = 2;
+    while (numSlots < capacity * 2)
+    {
+        numSlots *= 2;
+    }
+    topk->slots = calloc(numSlots, sizeof(uint32_t));
+    assert(topk->slots);
+    topk->slotMask = numSlots - 1;
+
+    topk->countMin = NULL;
+    topk->cmWidth = 0;
+    topk->cmDepth = 0;
+    if (countMin)
+    {
+        topk->cmWidth = CM_WIDTH;
+        topk->cmDepth = CM_DEPTH;
+        topk->countMin = calloc((size_t) CM_WIDTH * CM_DEPTH, sizeof(uint64_t));
+        assert(topk->countMin);
+    }
+}
+
+void topkFree(TopK* topk)
+{
+    for (uint32_t i = 0; i < topk->size; ++i)
+    {
+        free(topk->items[i].name);
+    }
+    free(topk->items);
+    free(topk->slots);
+    free(topk->countMin);
+}
+
+TopKItem* topkAdd(TopK* topk, const char* name, uint32_t len, uint64_t hash, uint64_t weight)
+{
+    uint64_t estimate = topk->countMin != NULL ? cmAdd(topk, hash, weight) : UINT64_MAX;
+
+    uint32_t slot = findSlot(topk, name, len, hash);
+    if (slot != NOT_FOUND)
+    {
+        // We know this one: the count goes up, so it goes down the heap.
+        uint32_t index = topk->slots[slot] - 1;
+        topk->items[index].count += weight;
+        siftDown(topk, index);
+        return &topk->items[topk->slots[slot] - 1];
+    }
+
+    TopKItem* item;
+    uint32_t index;
+    if (topk->size < topk->capacity)
+    {
+        // There's still room.
+        index = topk->size++;
+        item = &topk->items[index];
+    }
+    else
+    {
+        // Take the place of the item with the lowest count.
+        index = 0;
+        item = &topk->items[0];
+        removeSlot(topk, item->slot);
+        if (item->count > topk->maxEvicted)
+        {
+            topk->maxEvicted = item->count;
+        }
+    }
+
+    // The name could have been kicked out before, so it inherits the highest count kicked out.
+    // (Without a Count-Min sketch, that's the count of the item replaced. And it's 0 when nothing has been
+    // kicked out yet: the count is then exact.) The Count-Min sketch is also an upper bound: take the best one.
+    item->count = topk->maxEvicted + weight;
+    item->error = topk->maxEvicted;
+    if (estimate < item->count)
+    {
+        item->count = estimate;
+        item->error = estimate - weight;
+    }
+    item->extra = 0;
+    setName(item, name, len, hash);
+
+    slot = findEmptySlot(topk, hash);
+    setSlot(topk, slot, index);
+    if (index == 0)
+    {
+        siftDown(topk, 0);
+    }
+    else
+    {
+        siftUp(topk, index);
+    }
+
+    return &topk->items[topk->slots[slot] - 1];
+}
+
+TopKItem* topkFind(TopK* topk, const char* name, uint32_t len, uint64_t hash)
+{
+    uint32_t slot = findSlot(topk, name, len, hash);
+    return slot != NOT_FOUND ? &topk->items[topk->slots[slot] - 1] : NULL;
+}
+
+static int compareCountDesc(const void* a, const void* b)
+{
+    const TopKItem* itemA = a;
+    const TopKItem* itemB = b;
+    return itemA->count < itemB->count ? 1 : itemA->count > itemB->count ? -1 : 0;
+}
+
+void topkMerge(TopK* topk, const TopK* other)
+{
+    assert(topk->cmWidth == other->cmWidth && topk->cmDepth == other->cmDepth);
+
+    // A name missing from a TopK could have a count up to its maxEvicted count.
+    // When nothing has been kicked out, missing names really have a count of 0.
+    uint64_t maxEvicted = topk->maxEvicted;
+    uint64_t otherMaxEvicted = other->maxEvicted;
+
+    TopKItem* merged = malloc(((size_t) topk->size + other->size) * sizeof(TopKItem));
+    assert(merged);
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < topk->size; ++i)
+    {
+        TopKItem item = topk->items[i];
+        uint32_t slot = findSlot(other, item.name, item.length, item.hash);
+        if (slot != NOT_FOUND)
+        {
+            const TopKItem* otherItem = &other->items[other->slots[slot] - 1];
+            item.count += otherItem->count;
+            item.error += otherItem->error;
+            item.extra += otherItem->extra;
+        }
+        else
+        {
+            item.count += otherMaxEvicted;
+            item.error += otherMaxEvicted;
+        }
+        merged[n++] = item;
+    }
+
+    for (uint32_t i = 0; i < other->size; ++i)
+    {
+        const TopKItem* otherItem = &other->items[i];
+        if (findSlot(topk, otherItem->name, otherItem->length, otherItem->hash) != NOT_FOUND)
+        {
+            continue; // Already merged above.
+        }
+
+        TopKItem item = *otherItem;
+        item.name = NULL;
+        item.nameCapacity = 0;
+        setName(&item, otherItem->name, otherItem->length, otherItem->hash);
+        item.count += maxEvicted;
+        item.error += maxEvicted;
+        merged[n++] = item;
+    }
+
+    // Only keep the highest counts.
+    qsort(merged, n, sizeof(TopKItem), compareCountDesc);
+    uint32_t kept = n < topk->capacity ? n : topk->capacity;
+    topk->maxEvicted = maxEvicted + otherMaxEvicted;
+    for (uint32_t i = kept; i < n; ++i)
+    {
+        if (merged[i].count > topk->maxEvicted)
+        {
+            topk->maxEvicted = merged[i].count;
+        }
+        free(merged[i].name);
+    }
+
+    memcpy(topk->items, merged, kept * sizeof(TopKItem));
+    // The names of the items after them have been moved or freed, so they're not theirs anymore.
+    memset(topk->items + kept, 0, (topk->capacity - kept) * sizeof(TopKItem));
+    topk->size = kept;
+    free(merged);
+    rebuild(topk);
+
+    if (topk->countMin != NULL)
+    {
+        for (size_t i = 0; i < (size_t) topk->cmWidth * topk->cmDepth; ++i)
+        {
+            topk->countMin[i] += other->countMin[i];
+        }
+    }
+}
+
+void topkWriteState(FILE* file, const TopK* topk)
+{
+    stateWriteU32(file, topk->capacity);
+    stateWriteU32(file, topk->cmWidth);
+    stateWriteU32(file, topk->cmDepth);
+
+    stateWriteU32(file, topk->size);
+    stateWriteU64(file, topk->maxEvicted);
+    for (uint32_t i = 0; i < topk->size; ++i)
+    {
+        const TopKItem* item = &topk->items[i];
+        stateWriteStr(file, item->name, item->length);
+        stateWriteU64(file, item->count);
+        stateWriteU64(file, item->error);
+        stateWriteU64(file, item->extra);
+    }
+
+    if (topk->countMin != NULL)
+    {
+        fwrite(topk->countMin, sizeof(uint64_t), (size_t) topk->cmWidth * topk->cmDepth, file);
+    }
+}
+
+bool topkReadState(FILE* file, TopK* outTopk)
+{
+    uint32_t capacity, cmWidth, cmDepth, size;
+    if (!stateReadU32(file, &capacity) || !stateReadU32(file, &cmWidth) || !stateReadU32(file, &cmDepth)
+        || !stateReadU32(file, &size))
+    {
+        return false;
+    }
+
+    bool countMin = cmWidth != 0;
+    if (capacity == 0 || size > capacity || capacity > 1U << 24
+        || (countMin && (cmWidth != CM_WIDTH || cmDepth != CM_DEPTH)))
+    {
+        return false;
+    }
+
+    topkInit(outTopk, capacity, countMin);
+    if (!stateReadU64(file, &outTopk->maxEvicted))
+    {
+        topkFree(outTopk);
+        return false;
+    }
+
+    char* name = malloc(STATE_MAX_STR);
+    assert(name);
+
+    bool ok = true;
+    for (uint32_t i = 0; i < size && ok; ++i)
+    {
+        uint32_t len;
+        TopKItem* item = &outTopk->items[i];
+        ok = stateReadStr(file, name, STATE_MAX_STR, &len)
+             && stateReadU64(file, &item->count) && stateReadU64(file, &item->error)
+             && stateReadU64(file, &item->extra);
+        if (ok)
+        {
+            setName(item, name, len, sketchHash(name, len));
+            outTopk->size++;
+        }
+    }
+    free(name);
+
+    if (ok && countMin)
+    {
+        size_t numCounters = (size_t) cmWidth * cmDepth;
+        ok = fread(outTopk->countMin, sizeof(uint64_t), numCounters, file) == numCounters;
+    }
+
+    if (!ok)
+    {
+        topkFree(outTopk);
+        return false;
+    }
+
+    rebuild(outTopk);
+    return true;
+}
+
+/*
+ * HyperLogLog
+ */
+
+uint64_t hllHashU32(uint32_t value)
+{
+    // The finalizer of SplitMix64: close ids give completely different hashes.
+    return hashMix64(value + 0x9E3779B97F4A7C15ULL);
+}
+
+bool hllAdd(uint8_t* registers, uint32_t precision, uint64_t hash)
+{
+    // The first bits choose the register, which keeps the longest run of zeros seen in the other bits (plus one).
+    uint32_t index = (uint32_t) (hash >> (64 - precision));
+    uint64_t rest = hash << precision;
+    uint8_t rank = rest == 0 ? (uint8_t) (64 - precision + 1) : (uint8_t) (bitLeadingZeros64(rest) + 1);
+
+    if (rank > registers[index])
+    {
+        registers[index] = rank;
+        return true;
+    }
+    return false;
+}
+
+void hllMerge(uint8_t* registers, const uint8_t* other, uint32_t precision)
+{
+    uint32_t numRegisters = 1U << precision;
+    for (uint32_t i = 0; i < numRegisters; ++i)
+    {
+        if (other[i] > registers[i])
+        {
+            registers[i] = other[i];
+        }
+    }
+}
+
+double hllEstimate(const uint8_t* registers, uint32_t precision)
+{
+    uint32_t numRegisters = 1U << precision;
+    double m = numRegisters;
+
+    // 2^-rank for every possible rank, way faster than dividing for each register.
+    double inversePowers[64 - HLL_MIN_PRECISION + 2];
+    for (uint32_t rank = 0; rank <= 64 - precision + 1; ++rank)
+    {
+        inversePowers[rank] = 1.0 / (double) (1ULL << rank);
+    }
+
+    double sum = 0;
+    uint32_t zeros = 0;
+    for (uint32_t i = 0; i < numRegisters; ++i)
+    {
+        sum += inversePowers[registers[i]];
+        zeros += registers[i] == 0;
+    }
+
+    double alpha = numRegisters == 16 ? 0.673 : numRegisters == 32 ? 0.697 : numRegisters == 64 ? 0.709
+                 : 0.7213 / (1 + 1.079 / m);
+    double estimate = alpha * m * m / sum;
+
+    // With few values, lots of registers are still empty: counting them is way more precise.
+    if (estimate <= 2.5 * m && zeros != 0)
+    {
+        estimate = m * log(m / zeros);
+    }
+    return estimate;
+}
+
+/*
+ * Recent pairs
+ */
+
+// Never a real pair... unless route 4294967295 comes with a very unlucky name.
+#define EMPTY_PAIR UINT64_MAX
+
+void recentPairsInit(RecentPairs* recent, uint32_t capacity)
+{
+    assert((capacity & (capacity - 1)) == 0 && "Capacity must be a power of 2!");
+
+    recent->pairs = malloc(capacity * sizeof(uint64_t));
+    assert(recent->pairs);
+    memset(recent->pairs, 0xFF, capacity * sizeof(uint64_t)); // All EMPTY_PAIR
+    recent->mask = capacity - 1;
+}
+
+void recentPairsFree(RecentPairs* recent)
+{
+    free(recent->pairs);
+}
+
+bool recentPairsSeen(RecentPairs* recent, uint32_t routeId, uint64_t nameHash)
+{
+    // Each slot keeps only one pair: the last one that landed there.
+    uint64_t pair = (uint64_t) routeId << 32 | (nameHash >> 32);
+    uint32_t slot = (uint32_t) ((pair * 0x9E3779B97F4A7C15ULL) >> 32) & recent->mask;
+
+    if (recent->pairs[slot] == pair)
+    {
+        return true;
+    }
+
+    recent->pairs[slot] = pair;
+    return false;
+}
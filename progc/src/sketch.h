@@ -0,0 +1,125 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+/*
+ * sketch.h
+ * ---------------
+ * Approximate counting in a fixed amount of memory, used by the --approx mode.
+ * No matter how many drivers or towns there are in the file, the memory used stays the same.
+ *
+ * TopK uses the Space-Saving algorithm (Metwally et al., 2005): it only keeps `capacity` names with their counts.
+ * When a new name comes in and there's no room left, it takes the place of the name with the lowest count,
+ * and inherits its count. So a count can only be overestimated, and never by more than the count it inherited,
+ * which is kept as the "error" of the item: the real count is between count - error and count.
+ * Any name whose count is more than total / capacity is guaranteed to be in the TopK.
+ *
+ * A TopK can also be backed by a Count-Min sketch (Cormode & Muthukrishnan, 2005), a small table of counters
+ * giving an upper bound of the count of any name, even ones that have been kicked out.
+ * A name coming in then takes the lowest of the two estimates, which gives a much smaller error
+ * when there are lots of names with small counts. Since a name can then come in with a lower count than the
+ * others, the highest count ever kicked out is kept aside (maxEvicted): that's what a name coming in inherits.
+ *
+ * HyperLogLog (Flajolet et al., 2007) counts distinct values, like the number of routes going through a town,
+ * with 2^precision registers of one byte. The error is about 1.04 / sqrt(2^precision): 3% with 1 KB.
+ * Adding the same value twice changes nothing, and merging two of them is just keeping the highest registers,
+ * so threads and previous runs (see state.h) can be merged without counting anything twice.
+ *
+ * RecentPairs is a small cache used to count a (route, name) pair only once, since routes are usually
+ * written in blocks of consecutive lines. It's not exact: a pair seen again after being pushed out of
+ * the cache is counted twice.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct TopKItem
+{
+    char* name; // Not null-terminated, owned by the TopK.
+    uint32_t length;
+    uint32_t nameCapacity;
+    uint64_t hash; // See sketchHash.
+    // The estimated count, never lower than the real one.
+    uint64_t count;
+    // How much the count can be overestimated.
+    uint64_t error;
+    // A second counter, for the computation to use with topkFind. Reset to 0 when the name is kicked out,
+    // so it's never higher than the real value.
+    uint64_t extra;
+    // Where the item is in the hash table of the TopK.
+    uint32_t slot;
+} TopKItem;
+
+typedef struct TopK
+{
+    // A min-heap of all items, by count: items[0] is the one with the lowest count.
+    TopKItem* items;
+    uint32_t size;
+    uint32_t capacity;
+    // The highest count of all the names kicked out so far: no name outside the TopK can have a higher count.
+    uint64_t maxEvicted;
+
+    // Finds the item of a name: an open-addressing table with the index of each item (plus one, 0 when empty).
+    uint32_t* slots;
+    uint32_t slotMask;
+
+    // The Count-Min sketch: depth rows of width counters. NULL when not used.
+    uint64_t* countMin;
+    uint32_t cmWidth; // A power of 2
+    uint32_t cmDepth;
+} TopK;
+
+// Hashes a name for the TopK and RecentPairs functions.
+uint64_t sketchHash(const char* name, uint32_t len);
+
+// Creates an empty TopK keeping at most capacity names, with a Count-Min sketch when countMin is true.
+// Exits the program when there's not enough memory.
+void topkInit(TopK* topk, uint32_t capacity, bool countMin);
+void topkFree(TopK* topk);
+
+// Adds weight to the count of the name, with its hash given by sketchHash.
+// Returns the item of the name, valid until the next change to the TopK.
+TopKItem* topkAdd(TopK* topk, const char* name, uint32_t len, uint64_t hash, uint64_t weight);
+
+// Returns the item of the name, or NULL when it's not in the TopK.
+TopKItem* topkFind(TopK* topk, const char* name, uint32_t len, uint64_t hash);
+
+// Adds all the counts of other to topk, as if topk had seen all the names of other (other isn't changed).
+// Names missing in one of the two get the maxEvicted count of that one, as they could have been kicked out.
+// Both must have the same Count-Min sketch size (or no sketch at all).
+void topkMerge(TopK* topk, const TopK* other);
+
+// Saves the TopK into a state file (see state.h), and reads it back into an uninitialized TopK.
+// The TopK read has the same capacity and Count-Min sketch as the one saved.
+void topkWriteState(FILE* file, const TopK* topk);
+bool topkReadState(FILE* file, TopK* outTopk);
+
+// The precisions allowed for HyperLogLog: from 16 registers to 65536.
+#define HLL_MIN_PRECISION 4
+#define HLL_MAX_PRECISION 16
+
+// Hashes a number (like a route id) for hllAdd.
+uint64_t hllHashU32(uint32_t value);
+
+// Adds the value with the given hash to the 2^precision registers. Registers start at 0.
+// Returns true when a register changed: the value was never added before (false doesn't mean it was, though).
+bool hllAdd(uint8_t* registers, uint32_t precision, uint64_t hash);
+// Adds all the values of other to registers.
+void hllMerge(uint8_t* registers, const uint8_t* other, uint32_t precision);
+// Returns the estimated number of distinct values added to the registers.
+double hllEstimate(const uint8_t* registers, uint32_t precision);
+
+typedef struct RecentPairs
+{
+    uint64_t* pairs;
+    uint32_t mask;
+} RecentPairs;
+
+// Creates a cache remembering at most capacity pairs (a power of 2).
+void recentPairsInit(RecentPairs* recent, uint32_t capacity);
+void recentPairsFree(RecentPairs* recent);
+
+// Returns true when the pair has been seen recently, and remembers it otherwise.
+bool recentPairsSeen(RecentPairs* recent, uint32_t routeId, uint64_t nameHash);
+
+#endif //SKETCH_H
@@ -0,0 +1,168 @@
+#include "state.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// Written at the start of every state file.
+static const char stateMagic[4] = {'P', 'C', 'S', 'T'};
+
+// The path of the temporary file written by stateCreate.
+static void tempPath(const char* path, char out[4096])
+{
+    snprintf(out, 4096, "%s.tmp", path);
+}
+
+FILE* stateCreate(const char* path, char errMsg[ERR_MAX])
+{
+    char temp[4096];
+    tempPath(path, temp);
+
+    FILE* file = fopen(temp, "wb");
+    if (file == NULL)
+    {
+        snprintf(errMsg, ERR_MAX, "Impossible de créer le fichier « %s.tmp » : %s", path, strerror(errno));
+        return NULL;
+    }
+
+    // States are written with lots of tiny writes, a bigger buffer helps a bit.
+    setvbuf(file, NULL, _IOFBF, 1024 * 1024);
+    return file;
+}
+
+bool stateCommit(FILE* file, const char* path, bool ok, char errMsg[ERR_MAX])
+{
+    char temp[4096];
+    tempPath(path, temp);
+
+    bool written = !ferror(file);
+    written = fclose(file) == 0 && written;
+    if (!ok || !written || rename(temp, path) != 0)
+    {
+        if (ok)
+        {
+            snprintf(errMsg, ERR_MAX, "Impossible d'écrire l'état dans « %s » : %s", path, strerror(errno));
+        }
+        remove(temp);
+        return false;
+    }
+    return true;
+}
+
+void stateWriteHeader(FILE* file, const StateHeader* header)
+{
+    fwrite(stateMagic, 1, sizeof(stateMagic), file);
+    stateWriteU32(file, STATE_VERSION);
+    stateWriteStr(file, header->computation, (uint32_t) strlen(header->computation));
+    stateWriteU64(file, header->offset);
+    stateWriteU64(file, header->checksum);
+}
+
+bool stateReadHeader(FILE* file, StateHeader* outHeader)
+{
+    char magic[4];
+    uint32_t version, nameLen;
+    return fread(magic, 1, sizeof(magic), file) == sizeof(magic)
+           && memcmp(magic, stateMagic, sizeof(magic)) == 0
+           && stateReadU32(file, &version) && version == STATE_VERSION
+           && stateReadStr(file, outHeader->computation, sizeof(outHeader->computation), &nameLen)
+           && stateReadU64(file, &outHeader->offset)
+           && stateReadU64(file, &outHeader->checksum);
+}
+
+void stateWriteU32(FILE* file, uint32_t value)
+{
+    fwrite(&value, sizeof(value), 1, file);
+}
+
+bool stateReadU32(FILE* file, uint32_t* outValue)
+{
+    return fread(outValue, sizeof(*outValue), 1, file) == 1;
+}
+
+void stateWriteU32s(FILE* file, const uint32_t* values, uint32_t count)
+{
+    fwrite(values, sizeof(*values), count, file);
+}
+
+void stateWriteU64(FILE* file, uint64_t value)
+{
+    fwrite(&value, sizeof(value), 1, file);
+}
+
+bool stateReadU64(FILE* file, uint64_t* outValue)
+{
+    return fread(outValue, sizeof(*outValue), 1, file) == 1;
+}
+
+void stateWriteFloat(FILE* file, float value)
+{
+    fwrite(&value, sizeof(value), 1, file);
+}
+
+bool stateReadFloat(FILE* file, float* outValue)
+{
+    return fread(outValue, sizeof(*outValue), 1, file) == 1;
+}
+
+void stateWriteStr(FILE* file, const char* str, uint32_t len)
+{
+    stateWriteU32(file, len);
+    fwrite(str, 1, len, file);
+}
+
+bool stateReadStr(FILE* file, char* buf, uint32_t bufSize, uint32_t* outLen)
+{
+    if (!stateReadU32(file, outLen) || *outLen >= bufSize)
+    {
+        return false;
+    }
+
+    buf[*outLen] = '\0';
+    return fread(buf, 1, *outLen, file) == *outLen;
+}
+
+void stateWriteStrings(FILE* file, const RouteStream* stream)
+{
+    uint32_t numStrings = rsNumStrings(stream);
+    stateWriteU32(file, numStrings);
+    for (uint32_t i = 0; i < numStrings; ++i)
+    {
+        uint32_t len;
+        const char* str = rsGetString(stream, i, &len);
+        stateWriteStr(file, str, len);
+    }
+}
+
+uint32_t* stateReadStrings(FILE* file, RouteStream* stream, uint32_t* outNumIds)
+{
+    uint32_t numStrings;
+    if (!stateReadU32(file, &numStrings))
+    {
+        return NULL;
+    }
+
+    uint32_t* newIds = malloc((numStrings > 0 ? numStrings : 1) * sizeof(uint32_t));
+    char* buf = malloc(STATE_MAX_STR);
+    bool ok = newIds != NULL && buf != NULL;
+
+    for (uint32_t i = 0; ok && i < numStrings; ++i)
+    {
+        uint32_t len;
+        ok = stateReadStr(file, buf, STATE_MAX_STR, &len);
+        if (ok)
+        {
+            newIds[i] = rsInternString(stream, buf, len);
+        }
+    }
+
+    free(buf);
+    if (!ok)
+    {
+        free(newIds);
+        return NULL;
+    }
+
+    *outNumIds = numStrings;
+    return newIds;
+}
@@ -0,0 +1,84 @@
+#ifndef STATE_H
+#define STATE_H
+
+/*
+ * state.h
+ * ---------------
+ * Saves what computations have aggregated so far (with the --state option), so the next run on the same file
+ * only has to read the lines added since then. Perfect for a log that only ever grows!
+ *
+ * Each computation has its own state file, beginning with a header telling which part of the CSV file it covers:
+ * the offset of the first line that hasn't been read yet, and a checksum of the lines before it
+ * (see rsChecksum), so we can tell when the file has been changed or replaced.
+ * Then comes whatever the computation wants to save (see loadState and finish in computations.h).
+ *
+ * Numbers are written as they are in memory: state files are meant to be read by the same program
+ * on the same computer, not shared.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "route.h"
+
+// Increase this when the format of any state file changes, so old files are ignored.
+#define STATE_VERSION 6
+
+typedef struct StateHeader
+{
+    // The name of the computation, to make sure we're not reading the state of another one.
+    // (The experimental algorithms don't save the same things, for instance.)
+    char computation[64];
+    // The position in the CSV file of the first line that hasn't been read.
+    uint64_t offset;
+    // The checksum of the file until offset, see rsChecksum.
+    uint64_t checksum;
+} StateHeader;
+
+// Creates a new state file, which replaces the one at path once stateCommit is called.
+// It's written in "<path>.tmp" first, so a failure doesn't leave a broken state behind.
+// Returns NULL when the file can't be created, with an error message.
+FILE* stateCreate(const char* path, char errMsg[ERR_MAX]);
+// Closes the file given by stateCreate, and puts it in place of the old state at path (when ok is true),
+// or deletes it (when ok is false, or when something went wrong while writing).
+// Returns false when the state hasn't been replaced. The error message is only given when ok is true.
+bool stateCommit(FILE* file, const char* path, bool ok, char errMsg[ERR_MAX]);
+
+// Writes the header of a state file. Errors can be checked later with ferror.
+void stateWriteHeader(FILE* file, const StateHeader* header);
+// Reads the header of a state file. Returns false when it's not a valid state file, or an old version.
+bool stateReadHeader(FILE* file, StateHeader* outHeader);
+
+// Write functions: errors can be checked later with ferror.
+// Read functions: return false when the end of the file is reached, or when something went wrong.
+
+void stateWriteU32(FILE* file, uint32_t value);
+bool stateReadU32(FILE* file, uint32_t* outValue);
+// Writes count numbers at once, way faster than one by one. Read them back with stateReadU32.
+void stateWriteU32s(FILE* file, const uint32_t* values, uint32_t count);
+
+void stateWriteU64(FILE* file, uint64_t value);
+bool stateReadU64(FILE* file, uint64_t* outValue);
+
+void stateWriteFloat(FILE* file, float value);
+bool stateReadFloat(FILE* file, float* outValue);
+
+// Strings can't be longer than a line, which can't be longer than the read buffer of the stream.
+// A buffer of this size can read any string of a state file.
+#define STATE_MAX_STR (128 * 1024)
+
+// Strings are written with their length first, and read into the given buffer of bufSize bytes,
+// with a null character at the end. Returns false when the string doesn't fit.
+void stateWriteStr(FILE* file, const char* str, uint32_t len);
+bool stateReadStr(FILE* file, char* buf, uint32_t bufSize, uint32_t* outLen);
+
+// Writes all the strings of the stream (see STRING_IDS), so the state can store ids instead of strings.
+void stateWriteStrings(FILE* file, const RouteStream* stream);
+
+// Reads the strings written by stateWriteStrings, and gives them an id in the stream (see rsInternString).
+// Returns an array giving the new id of each saved id, to be freed with free.
+// Returns NULL when the file isn't valid.
+uint32_t* stateReadStrings(FILE* file, RouteStream* stream, uint32_t* outNumIds);
+
+#endif //STATE_H
@@ -0,0 +1,250 @@
+// Needed for syscall() and MAP_POPULATE.
+#define _DEFAULT_SOURCE
+
+#include "uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#if URING_SUPPORTED
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct Uring
+{
+    int fd;
+    uint32_t entries;
+    // The number of requests queued, but not yet sent to the kernel.
+    uint32_t toSubmit;
+
+    // Submission queue: we write the tail, the kernel writes the head.
+    void* sqRing;
+    size_t sqRingSize;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    // One iovec per submission entry, they need to live until the request is submitted.
+    struct iovec* iovecs;
+
+    // Completion queue: the kernel writes the tail, we write the head.
+    void* cqRing;
+    size_t cqRingSize;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+};
+
+Uring* uringCreate(uint32_t entries, int* outError)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+    {
+        *outError = errno;
+        return NULL;
+    }
+
+    Uring* ring = calloc(1, sizeof(Uring));
+    if (!ring)
+    {
+        close(fd);
+        *outError = ENOMEM;
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    ring->sqRing = MAP_FAILED;
+    ring->cqRing = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // Recent kernels (5.4+) put both rings in the same mapping.
+    bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMap && ring->cqRingSize > ring->sqRingSize)
+    {
+        ring->sqRingSize = ring->cqRingSize;
+    }
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED)
+    {
+        goto fail;
+    }
+
+    if (singleMap)
+    {
+        ring->cqRing = ring->sqRing;
+    }
+    else
+    {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            fd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED)
+        {
+            goto fail;
+        }
+    }
+
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        goto fail;
+    }
+
+    ring->iovecs = calloc(params.sq_entries, sizeof(struct iovec));
+    if (!ring->iovecs)
+    {
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    char* sq = ring->sqRing;
+    ring->sqHead = (unsigned*) (sq + params.sq_off.head);
+    ring->sqTail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sqMask = (unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*) (sq + params.sq_off.array);
+
+    char* cq = ring->cqRing;
+    ring->cqHead = (unsigned*) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cqMask = (unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+    return ring;
+
+fail:
+    *outError = errno;
+    uringFree(ring);
+    return NULL;
+}
+
+bool uringQueueRead(Uring* ring, int fd, void* buf, uint32_t len, uint64_t offset, uint64_t userData)
+{
+    // Only we write to the tail, so no need for an atomic load there.
+    unsigned tail = *ring->sqTail;
+    unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    if (tail - head >= ring->entries)
+    {
+        return false;
+    }
+
+    unsigned index = tail & *ring->sqMask;
+    struct iovec* iov = &ring->iovecs[index];
+    iov->iov_base = buf;
+    iov->iov_len = len;
+
+    // READV is used instead of READ, since it's been there since the very first version of io_uring.
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) iov;
+    sqe->len = 1;
+    sqe->off = offset;
+    sqe->user_data = userData;
+
+    ring->sqArray[index] = index;
+    // Make sure the kernel sees the entry before the new tail.
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->toSubmit++;
+
+    return true;
+}
+
+int uringSubmit(Uring* ring, bool wait)
+{
+    int ret;
+    do
+    {
+        ret = (int) syscall(__NR_io_uring_enter, ring->fd, ring->toSubmit, wait ? 1 : 0,
+                            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+    {
+        return errno;
+    }
+
+    ring->toSubmit -= (uint32_t) ret;
+    return 0;
+}
+
+bool uringPopCompletion(Uring* ring, uint64_t* outUserData, int32_t* outResult)
+{
+    unsigned head = *ring->cqHead;
+    unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+    {
+        return false;
+    }
+
+    struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cqMask];
+    *outUserData = cqe->user_data;
+    *outResult = cqe->res;
+
+    // Give the entry back to the kernel.
+    __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void uringFree(Uring* ring)
+{
+    if (ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (ring->cqRing != MAP_FAILED && ring->cqRing != ring->sqRing)
+    {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    if (ring->sqRing != MAP_FAILED)
+    {
+        munmap(ring->sqRing, ring->sqRingSize);
+    }
+    free(ring->iovecs);
+    close(ring->fd);
+    free(ring);
+}
+
+#else
+
+Uring* uringCreate(uint32_t entries, int* outError)
+{
+    *outError = ENOSYS;
+    return NULL;
+}
+
+bool uringQueueRead(Uring* ring, int fd, void* buf, uint32_t len, uint64_t offset, uint64_t userData)
+{
+    return false;
+}
+
+int uringSubmit(Uring* ring, bool wait)
+{
+    return ENOSYS;
+}
+
+bool uringPopCompletion(Uring* ring, uint64_t* outUserData, int32_t* outResult)
+{
+    return false;
+}
+
+void uringFree(Uring* ring)
+{
+}
+
+#endif
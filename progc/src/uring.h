@@ -0,0 +1,49 @@
+#ifndef URING_H
+#define URING_H
+
+/*
+ * uring.h
+ * ---------------
+ * A tiny wrapper around Linux's io_uring, using the raw system calls (no liburing needed).
+ * Only does what we need: queue reads, submit them, and get their results back.
+ *
+ * When io_uring isn't available at compile time, URING_SUPPORTED is 0 and uringCreate always fails.
+ * It can also fail at run time on old kernels, or when io_uring is disabled (like in some containers).
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define URING_SUPPORTED 1
+#endif
+#endif
+
+#ifndef URING_SUPPORTED
+#define URING_SUPPORTED 0
+#endif
+
+typedef struct Uring Uring;
+
+// Creates a ring that can have at least `entries` requests in flight at once.
+// Returns NULL on failure, with the error number in outError.
+Uring* uringCreate(uint32_t entries, int* outError);
+
+// Queues a read of len bytes at the given offset of the file. The request is only sent with uringSubmit.
+// The userData value is given back with the completion of the request.
+// Returns false when the queue is full.
+bool uringQueueRead(Uring* ring, int fd, void* buf, uint32_t len, uint64_t offset, uint64_t userData);
+
+// Sends all queued requests to the kernel. When wait is true, waits until at least one request completes.
+// Returns 0 on success, or the error number.
+int uringSubmit(Uring* ring, bool wait);
+
+// Takes the next completed request, if there's any. The result is the number of bytes read,
+// or a negative error number.
+bool uringPopCompletion(Uring* ring, uint64_t* outUserData, int32_t* outResult);
+
+// Closes the ring. Requests still in flight are cancelled.
+void uringFree(Uring* ring);
+
+#endif //URING_H